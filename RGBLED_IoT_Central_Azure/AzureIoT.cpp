@@ -3,6 +3,8 @@
 
 #include "AzureIoT.h"
 #include <stdarg.h>
+#include <string.h>
+#include <time.h>
 
 #include <az_precondition_internal.h>
 
@@ -24,16 +26,36 @@ log_function_t default_logging_function = NULL;
 
 #define MQTT_CLIENT_ID_BUFFER_SIZE 256
 #define MQTT_USERNAME_BUFFER_SIZE 350
-#define DECODED_SAS_KEY_BUFFER_SIZE 64
 #define PLAIN_SAS_SIGNATURE_BUFFER_SIZE 256
 #define SAS_HMAC256_ENCRYPTED_SIGNATURE_BUFFER_SIZE 32
 #define SAS_SIGNATURE_BUFFER_SIZE 64
 #define MQTT_PASSWORD_BUFFER_SIZE 512
+#define PROVISIONED_IOT_HUB_FQDN_BUFFER_SIZE 128
+#define PROVISIONED_DEVICE_ID_BUFFER_SIZE 128
+#define DATA_BUFFER_SCRATCH_PAINT_BYTE 0xA5
+#define REPORTED_PROPERTIES_TOPIC_PLACEHOLDER_REQUEST_ID "0"
+// Not numeric, so it is never mistaken for a reported properties update request id.
+#define PROPERTIES_DOCUMENT_GET_REQUEST_ID "get"
+#define OFFLINE_TELEMETRY_RECORD_HEADER_SIZE 2
+#define OFFLINE_TELEMETRY_RECORD_MAX_SIZE UINT16_MAX
+#define IOT_HUB_COMMANDS_TOPIC_PREFIX "$iothub/methods/"
+#define IOT_HUB_COMMANDS_RESPONSE_TOPIC_PREFIX "$iothub/methods/res/"
+#define IOT_HUB_COMMANDS_RESPONSE_TOPIC_REQUEST_ID "/?$rid="
+// Digits of the largest uint32_t.
+#define UINT32_DECIMAL_MAX_SIZE 10
+#define IOT_HUB_PROPERTIES_RESPONSE_TOPIC_PREFIX "$iothub/twin/res/"
+#define IOT_HUB_PROPERTIES_WRITABLE_UPDATE_TOPIC_PREFIX "$iothub/twin/PATCH/"
 
 #define DPS_REGISTER_CUSTOM_PAYLOAD_BEGIN "{\"modelId\":\""
 #define DPS_REGISTER_CUSTOM_PAYLOAD_END "\"}"
 
 #define NUMBER_OF_SECONDS_IN_A_MINUTE 60
+#define NUMBER_OF_MILLISECONDS_IN_A_SECOND 1000
+#define NUMBER_OF_NANOSECONDS_IN_A_MILLISECOND 1000000
+
+// Rate limiter tokens are kept in thousandths of a message, so a rate of N messages per second
+// refills N tokens per millisecond.
+#define RATE_LIMIT_TOKEN 1000
 
 #define EXIT_IF_TRUE(condition, retcode, message, ...) \
   do                                                   \
@@ -49,25 +71,33 @@ log_function_t default_logging_function = NULL;
   EXIT_IF_TRUE(az_result_failed(azresult), retcode, message, ##__VA_ARGS__)
 
 /* --- Internal function prototypes --- */
-static uint32_t get_current_unix_time();
+static uint32_t get_current_unix_time(azure_iot_t* azure_iot);
+
+static uint64_t get_current_time_in_ms(azure_iot_t* azure_iot);
+
+static uint64_t get_sas_token_expiration_time_in_ms(azure_iot_t* azure_iot);
 
 static int generate_sas_token_for_dps(
     az_iot_provisioning_client* provisioning_client,
-    az_span device_key,
+    az_span decoded_device_key,
+    uint32_t current_unix_time,
     unsigned int duration_in_minutes,
     az_span data_buffer_span,
+    uint32_t* scratch_overflow_count,
     data_manipulation_functions_t data_manipulation_functions,
-    az_span sas_token,
-    uint32_t* expiration_time);
+    az_span sas_token);
 
 static int generate_sas_token_for_iot_hub(
     az_iot_hub_client* iot_hub_client,
-    az_span device_key,
+    az_span decoded_device_key,
+    uint32_t current_unix_time,
     unsigned int duration_in_minutes,
     az_span data_buffer_span,
+    uint32_t* scratch_overflow_count,
     data_manipulation_functions_t data_manipulation_functions,
-    az_span sas_token,
-    uint32_t* expiration_time);
+    az_span sas_token);
+
+static az_span get_decoded_device_key(azure_iot_t* azure_iot);
 
 static int get_mqtt_client_config_for_dps(
     azure_iot_t* azure_iot,
@@ -80,17 +110,140 @@ static int get_mqtt_client_config_for_iot_hub(
 static az_span generate_dps_register_custom_property(
     az_span model_id,
     az_span data_buffer,
-    az_span* remainder);
+    az_span* remainder,
+    uint32_t* scratch_overflow_count);
+
+static az_span get_tls_session_to_resume(azure_iot_t* azure_iot);
+
+static int load_cached_provisioning(azure_iot_t* azure_iot);
+
+static int connect_to_iot_hub(azure_iot_t* azure_iot);
+
+static int prepare_next_sas_token(azure_iot_t* azure_iot);
+
+static int publish_mqtt_message(azure_iot_t* azure_iot, mqtt_message_t* mqtt_message);
+
+static int hold_mqtt_message(azure_iot_t* azure_iot, mqtt_message_t* mqtt_message);
+
+static int publish_mqtt_message_fragments(
+    azure_iot_t* azure_iot,
+    mqtt_message_fragments_t* mqtt_message);
+
+static int join_mqtt_message_fragments(
+    azure_iot_t* azure_iot,
+    mqtt_message_fragments_t* fragments,
+    mqtt_message_t* mqtt_message);
+
+static int publish_held_messages(azure_iot_t* azure_iot);
+
+static void clear_cached_provisioning(azure_iot_t* azure_iot);
+
+static az_span copy_into_data_buffer_region(data_buffer_region_t* region, az_span source);
+
+static az_span split_scratch_buffer(
+    az_span span,
+    int32_t size,
+    az_span* remainder,
+    uint32_t* overflow_count);
+
+static void count_scratch_overflow(azure_iot_t* azure_iot, az_result azr);
+
+static void reset_data_buffer_region(data_buffer_region_t* region);
+
+static void post_event(azure_iot_t* azure_iot, azure_iot_event_t event);
+
+static void set_state(azure_iot_t* azure_iot, azure_iot_client_state_t state);
+
+static uint32_t get_time_until_next_work_in_ms(azure_iot_t* azure_iot);
+
+static int subscribe_to_pnp_topics(azure_iot_t* azure_iot);
+
+static int build_iot_hub_topics(azure_iot_t* azure_iot);
+
+static int request_properties_document(azure_iot_t* azure_iot);
+
+static void set_reconnect_policy_defaults(
+    reconnect_policy_t* policy,
+    uint32_t min_delay_in_ms,
+    uint32_t max_delay_in_ms,
+    uint32_t max_attempts_per_window);
+
+static void schedule_reconnect(azure_iot_t* azure_iot);
+
+static bool are_pnp_subscriptions_completed(azure_iot_t* azure_iot);
+
+static int store_offline_telemetry(azure_iot_t* azure_iot, az_span payload);
+
+static bool is_offline_telemetry_pending(azure_iot_t* azure_iot);
+
+static int publish_offline_telemetry(azure_iot_t* azure_iot);
+
+static int publish_telemetry(azure_iot_t* azure_iot, az_span payload);
+
+static bool can_publish_telemetry(azure_iot_t* azure_iot);
+
+static void process_in_flight_telemetry(azure_iot_t* azure_iot);
+
+static void reset_in_flight_telemetry(azure_iot_t* azure_iot);
+
+static int find_reported_property(azure_iot_t* azure_iot, az_span name);
+
+static bool has_space_for_reported_property(azure_iot_t* azure_iot, int index, int32_t size);
+
+static void remove_reported_property(azure_iot_t* azure_iot, int index);
+
+static int flush_reported_properties(azure_iot_t* azure_iot);
+
+static uint32_t get_time_until_rate_limit_token_in_ms(
+    azure_iot_t* azure_iot,
+    outbound_message_class_t message_class);
+
+static bool take_rate_limit_token(azure_iot_t* azure_iot, outbound_message_class_t message_class);
+
+static void throttle_rate_limit(azure_iot_t* azure_iot, outbound_message_class_t message_class);
+
+static int enqueue_outbound_message(
+    azure_iot_t* azure_iot,
+    outbound_message_class_t message_class,
+    mqtt_message_t* mqtt_message);
+
+static void drain_outbound_queues(azure_iot_t* azure_iot);
+
+static bool is_outbound_queue_drainable(azure_iot_t* azure_iot);
+
+/*
+ * @brief    Kinds of messages received from the Azure IoT Hub, as told by their topic prefix.
+ */
+typedef enum iot_hub_topic_type_t_enum
+{
+  iot_hub_topic_type_unknown,
+  iot_hub_topic_type_properties,
+  iot_hub_topic_type_command
+} iot_hub_topic_type_t;
+
+static iot_hub_topic_type_t classify_iot_hub_topic(az_span topic);
+
+static int handle_properties_message(azure_iot_t* azure_iot, mqtt_message_t* mqtt_message);
+
+static void schedule_properties_document_retry(azure_iot_t* azure_iot, az_iot_status status);
+
+static int handle_command_request(azure_iot_t* azure_iot, mqtt_message_t* mqtt_message);
 
 #define is_device_provisioned(azure_iot)                                     \
   (!az_span_is_content_equal(azure_iot->config->iot_hub_fqdn, AZ_SPAN_EMPTY) \
    && !az_span_is_content_equal(azure_iot->config->device_id, AZ_SPAN_EMPTY))
 
+#define is_outbound_queue_enabled(azure_iot, message_class) \
+  (az_span_size(azure_iot->config->outbound_queue_buffers[message_class]) > 0)
+
 /* --- Public API --- */
 void azure_iot_init(azure_iot_t* azure_iot, azure_iot_config_t* azure_iot_config)
 {
   _az_PRECONDITION_NOT_NULL(azure_iot);
   _az_PRECONDITION_NOT_NULL(azure_iot_config);
+
+  az_span data_buffer;
+
   if (azure_iot_config->use_device_provisioning)
   {
     _az_PRECONDITION(az_span_is_content_equal(azure_iot_config->iot_hub_fqdn, AZ_SPAN_EMPTY));
@@ -129,17 +282,117 @@ void azure_iot_init(azure_iot_t* azure_iot, azure_iot_config_t* azure_iot_config
   _az_PRECONDITION_NOT_NULL(azure_iot_config->on_properties_update_completed);
   _az_PRECONDITION_NOT_NULL(azure_iot_config->on_properties_received);
   _az_PRECONDITION_NOT_NULL(azure_iot_config->on_command_request_received);
+  if (azure_iot_config->offline_telemetry_storage.push != NULL)
+  {
+    _az_PRECONDITION_NOT_NULL(azure_iot_config->offline_telemetry_storage.peek);
+    _az_PRECONDITION_NOT_NULL(azure_iot_config->offline_telemetry_storage.pop);
+  }
+  if (azure_iot_config->telemetry_qos == mqtt_qos_at_least_once)
+  {
+    _az_PRECONDITION_VALID_SPAN(azure_iot_config->telemetry_in_flight_buffer, 1, false);
+    _az_PRECONDITION(
+        azure_iot_config->telemetry_in_flight_window_size <= TELEMETRY_IN_FLIGHT_MAX_COUNT);
+  }
+
+  if (azure_iot_config->data_buffer_persistent_region_size == 0)
+  {
+    azure_iot_config->data_buffer_persistent_region_size
+        = DEFAULT_DATA_BUFFER_PERSISTENT_REGION_SIZE;
+  }
+
+  if (azure_iot_config->data_buffer_connection_region_size == 0)
+  {
+    azure_iot_config->data_buffer_connection_region_size
+        = DEFAULT_DATA_BUFFER_CONNECTION_REGION_SIZE;
+  }
+
+  _az_PRECONDITION(
+      (azure_iot_config->data_buffer_persistent_region_size
+       + azure_iot_config->data_buffer_connection_region_size)
+      < az_span_size(azure_iot_config->data_buffer));
+
+  // Command responses and properties over their rate limits wait in their outbound queues.
+  _az_PRECONDITION(
+      azure_iot_config->rate_limits[outbound_message_class_command_response].rate_per_sec == 0
+      || az_span_size(
+             azure_iot_config->outbound_queue_buffers[outbound_message_class_command_response])
+          > 0);
+  _az_PRECONDITION(
+      azure_iot_config->rate_limits[outbound_message_class_properties].rate_per_sec == 0
+      || az_span_size(azure_iot_config->outbound_queue_buffers[outbound_message_class_properties])
+          > 0);
 
   (void)memset(azure_iot, 0, sizeof(azure_iot_t));
   azure_iot->config = azure_iot_config;
-  azure_iot->data_buffer = azure_iot->config->data_buffer;
-  azure_iot->state = azure_iot_state_initialized;
+
+  data_buffer = azure_iot->config->data_buffer;
+  azure_iot->persistent_region.buffer = split_az_span(
+      data_buffer, azure_iot->config->data_buffer_persistent_region_size, &data_buffer);
+  azure_iot->connection_region.buffer = split_az_span(
+      data_buffer, azure_iot->config->data_buffer_connection_region_size, &data_buffer);
+  azure_iot->scratch_buffer = data_buffer;
+  // Painting the scratch region, so its high-water mark can be found later.
+  az_span_fill(azure_iot->scratch_buffer, DATA_BUFFER_SCRATCH_PAINT_BYTE);
+  set_state(azure_iot, azure_iot_state_initialized);
   azure_iot->dps_operation_id = AZ_SPAN_EMPTY;
+  azure_iot->next_sas_token = AZ_SPAN_EMPTY;
+  azure_iot->offline_telemetry.buffer = azure_iot->config->offline_telemetry_buffer;
+  // Records spilled before a reboot are still in the storage.
+  azure_iot->has_spilled_telemetry = (azure_iot->config->offline_telemetry_storage.peek != NULL);
 
   if (azure_iot->config->sas_token_lifetime_in_minutes == 0)
   {
     azure_iot->config->sas_token_lifetime_in_minutes = DEFAULT_SAS_TOKEN_LIFETIME_IN_MINUTES;
   }
+
+  if (azure_iot->config->offline_telemetry_drain_rate_per_sec == 0)
+  {
+    azure_iot->config->offline_telemetry_drain_rate_per_sec
+        = DEFAULT_OFFLINE_TELEMETRY_DRAIN_RATE_PER_SEC;
+  }
+
+  if (azure_iot->config->telemetry_in_flight_window_size == 0)
+  {
+    azure_iot->config->telemetry_in_flight_window_size = TELEMETRY_IN_FLIGHT_MAX_COUNT;
+  }
+
+  if (azure_iot->config->telemetry_ack_timeout_in_ms == 0)
+  {
+    azure_iot->config->telemetry_ack_timeout_in_ms = DEFAULT_TELEMETRY_ACK_TIMEOUT_IN_MS;
+  }
+
+  if (azure_iot->config->telemetry_max_retransmit_count == 0)
+  {
+    azure_iot->config->telemetry_max_retransmit_count = DEFAULT_TELEMETRY_MAX_RETRANSMIT_COUNT;
+  }
+
+  if (azure_iot->config->reported_properties_flush_interval_in_ms == 0)
+  {
+    azure_iot->config->reported_properties_flush_interval_in_ms
+        = DEFAULT_REPORTED_PROPERTIES_FLUSH_INTERVAL_IN_MS;
+  }
+
+  if (azure_iot->config->reported_properties_flush_threshold == 0)
+  {
+    azure_iot->config->reported_properties_flush_threshold
+        = (uint32_t)az_span_size(azure_iot->config->reported_properties_buffer) / 4 * 3;
+  }
+
+  if (azure_iot->config->tls_session_lifetime_in_secs == 0)
+  {
+    azure_iot->config->tls_session_lifetime_in_secs = DEFAULT_TLS_SESSION_LIFETIME_IN_SECS;
+  }
+
+  set_reconnect_policy_defaults(
+      &azure_iot->config->dps_reconnect_policy,
+      DEFAULT_DPS_RECONNECT_MIN_DELAY_IN_MS,
+      DEFAULT_DPS_RECONNECT_MAX_DELAY_IN_MS,
+      DEFAULT_DPS_RECONNECT_MAX_ATTEMPTS_PER_WINDOW);
+  set_reconnect_policy_defaults(
+      &azure_iot->config->iot_hub_reconnect_policy,
+      DEFAULT_IOT_HUB_RECONNECT_MIN_DELAY_IN_MS,
+      DEFAULT_IOT_HUB_RECONNECT_MAX_DELAY_IN_MS,
+      DEFAULT_IOT_HUB_RECONNECT_MAX_ATTEMPTS_PER_WINDOW);
 }
 
 int azure_iot_start(azure_iot_t* azure_iot)
@@ -161,7 +414,20 @@ int azure_iot_start(azure_iot_t* azure_iot)
   else
   {
     // TODO: should only go to started if stopped or in error?
-    azure_iot->state = azure_iot_state_started;
+    if (azure_iot->held_messages_count > 0)
+    {
+      LogError(
+          "Discarding %d messages held during SAS token refresh.",
+          azure_iot->held_messages_count);
+      azure_iot->sas_token_refresh_statistics.dropped_messages_count
+          += azure_iot->held_messages_count;
+    }
+
+    azure_iot->held_messages_count = 0;
+    azure_iot->held_messages_buffer = azure_iot->config->sas_refresh_held_messages_buffer;
+    azure_iot->is_refreshing_sas = false;
+    azure_iot->is_connecting_to_dps = false;
+    set_state(azure_iot, azure_iot_state_started);
     result = RESULT_OK;
   }
 
@@ -183,16 +449,20 @@ int azure_iot_stop(azure_iot_t* azure_iot)
   {
     if (azure_iot->mqtt_client_handle != NULL)
     {
+      // Moving out of the connecting states first, so the disconnection caused by the stop
+      // is not mistaken by a connection refused by the Azure IoT Hub.
+      set_state(azure_iot, azure_iot_state_initialized);
+
       if (azure_iot->config->mqtt_client_interface.mqtt_client_deinit(azure_iot->mqtt_client_handle)
           != 0)
       {
-        azure_iot->state = azure_iot_state_error;
+        set_state(azure_iot, azure_iot_state_error);
         LogError("Failed deinitializing MQTT client.");
         result = RESULT_ERROR;
       }
       else
       {
-        azure_iot->state = azure_iot_state_initialized;
+        set_state(azure_iot, azure_iot_state_initialized);
         result = RESULT_OK;
       }
 
@@ -200,7 +470,7 @@ int azure_iot_stop(azure_iot_t* azure_iot)
     }
     else
     {
-      azure_iot->state = azure_iot_state_initialized;
+      set_state(azure_iot, azure_iot_state_initialized);
       result = RESULT_OK;
     }
   }
@@ -230,12 +500,9 @@ azure_iot_status_t azure_iot_get_status(azure_iot_t* azure_iot)
     case azure_iot_state_provisioned:
     case azure_iot_state_connecting_to_hub:
     case azure_iot_state_connected_to_hub:
-    case azure_iot_state_subscribing_to_pnp_cmds:
-    case azure_iot_state_subscribed_to_pnp_cmds:
-    case azure_iot_state_subscribing_to_pnp_props:
-    case azure_iot_state_subscribed_to_pnp_props:
-    case azure_iot_state_subscribing_to_pnp_writable_props:
+    case azure_iot_state_subscribing_to_pnp_topics:
     case azure_iot_state_refreshing_sas:
+    case azure_iot_state_reconnect_scheduled:
       status = azure_iot_connecting;
       break;
     case azure_iot_state_ready:
@@ -255,7 +522,7 @@ void azure_iot_do_work(azure_iot_t* azure_iot)
   _az_PRECONDITION_NOT_NULL(azure_iot);
 
   int result;
-  int64_t now;
+  uint64_t now_in_ms;
   int packet_id;
   az_result azrc;
   size_t length;
@@ -272,31 +539,31 @@ void azure_iot_do_work(azure_iot_t* azure_iot)
     case azure_iot_state_started:
       if (azure_iot->config->use_device_provisioning && !is_device_provisioned(azure_iot))
       {
-        // This seems harmless, but...
-        // azure_iot->config->data_buffer always points to the original buffer provided by the user.
-        // azure_iot->data_buffer is an intermediate pointer. It starts by pointing to
-        // azure_iot->config->data_buffer. In the steps below the code might need to retain part of
-        // azure_iot->data_buffer for saving some critical information, namely the DPS operation id,
-        // the provisioned IoT Hub FQDN and provisioned Device ID (if provisioning is being used).
-        // In these cases, azure_iot->data_buffer will then point to `the remaining available space`
-        // of azure_iot->config->data_buffer after deducting the spaces for the data mentioned above
-        // (DPS operation id, IoT Hub FQDN and Device ID). Not all these data exist at the same time
-        // though. Memory (from azure_iot->data_buffer) is taken/reserved for the `Operation ID`
-        // while provisioning is in progress, but as soon as it is succesfully completed the
-        // `Operation ID` is no longer needed, so its memory is released back into
-        // azure_iot->data_buffer, but then space is reserved again for the provisioned IoT Hub FQDN
-        // and Device ID. Finally, when the client is stopped and started again, it does not do
-        // provisioning again if done already. In such case, the logic needs to preserve the spaces
-        // reserved for IoT Hub FQDN and Device ID previously provisioned.
-        azure_iot->data_buffer = azure_iot->config->data_buffer;
-
-        result = get_mqtt_client_config_for_dps(azure_iot, &mqtt_client_config);
-        azure_iot->state = azure_iot_state_connecting_to_dps;
+        // The IoT Hub FQDN and Device ID (previously provisioned or loaded from the provisioning
+        // cache) are kept in the persistent region of the data buffer, so they survive the client
+        // being stopped and started again. Without them, the region is released for the ones
+        // about to be provisioned (or loaded).
+        // The DPS operation id and the SAS token prepared ahead of time live in the connection
+        // region, released whenever a new MQTT client configuration is generated.
+        reset_data_buffer_region(&azure_iot->persistent_region);
+        azure_iot->next_sas_token = AZ_SPAN_EMPTY;
+
+        if (load_cached_provisioning(azure_iot) == RESULT_OK)
+        {
+          result = get_mqtt_client_config_for_iot_hub(azure_iot, &mqtt_client_config);
+          set_state(azure_iot, azure_iot_state_connecting_to_hub);
+        }
+        else
+        {
+          result = get_mqtt_client_config_for_dps(azure_iot, &mqtt_client_config);
+          set_state(azure_iot, azure_iot_state_connecting_to_dps);
+          azure_iot->is_connecting_to_dps = true;
+        }
       }
       else
       {
         result = get_mqtt_client_config_for_iot_hub(azure_iot, &mqtt_client_config);
-        azure_iot->state = azure_iot_state_connecting_to_hub;
+        set_state(azure_iot, azure_iot_state_connecting_to_hub);
       }
 
       if (result != 0
@@ -304,7 +571,7 @@ void azure_iot_do_work(azure_iot_t* azure_iot)
                  &mqtt_client_config, &azure_iot->mqtt_client_handle)
               != 0)
       {
-        azure_iot->state = azure_iot_state_error;
+        set_state(azure_iot, azure_iot_state_error);
         LogError("Failed initializing MQTT client.");
         return;
       }
@@ -314,7 +581,7 @@ void azure_iot_do_work(azure_iot_t* azure_iot)
       break;
     case azure_iot_state_connected_to_dps:
       // Subscribe to DPS topic.
-      azure_iot->state = azure_iot_state_subscribing_to_dps;
+      set_state(azure_iot, azure_iot_state_subscribing_to_dps);
 
       packet_id = azure_iot->config->mqtt_client_interface.mqtt_client_subscribe(
           azure_iot->mqtt_client_handle,
@@ -323,7 +590,7 @@ void azure_iot_do_work(azure_iot_t* azure_iot)
 
       if (packet_id < 0)
       {
-        azure_iot->state = azure_iot_state_error;
+        set_state(azure_iot, azure_iot_state_error);
         LogError("Failed subscribing to Azure Device Provisioning respose topic.");
         return;
       }
@@ -332,7 +599,7 @@ void azure_iot_do_work(azure_iot_t* azure_iot)
     case azure_iot_state_subscribing_to_dps:
       break;
     case azure_iot_state_subscribed_to_dps:
-      data_buffer = azure_iot->data_buffer;
+      data_buffer = azure_iot->scratch_buffer;
 
       azrc = az_iot_provisioning_client_register_get_publish_topic(
           &azure_iot->dps_client,
@@ -342,27 +609,32 @@ void azure_iot_do_work(azure_iot_t* azure_iot)
 
       if (az_result_failed(azrc))
       {
-        azure_iot->state = azure_iot_state_error;
+        count_scratch_overflow(azure_iot, azrc);
+        set_state(azure_iot, azure_iot_state_error);
         LogError("Failed getting the DPS register topic: az_result return code 0x%08x.", azrc);
         return;
       }
 
-      mqtt_message.topic = split_az_span(data_buffer, length + 1, &data_buffer);
+      mqtt_message.topic = split_scratch_buffer(
+          data_buffer, length + 1, &data_buffer, &azure_iot->scratch_overflow_count);
 
       if (az_span_is_content_equal(mqtt_message.topic, AZ_SPAN_EMPTY)
           || az_span_is_content_equal(data_buffer, AZ_SPAN_EMPTY))
       {
-        azure_iot->state = azure_iot_state_error;
+        set_state(azure_iot, azure_iot_state_error);
         LogError("Failed reserving memory for DPS register payload.");
         return;
       }
 
       dps_register_custom_property = generate_dps_register_custom_property(
-          azure_iot->config->model_id, data_buffer, &mqtt_message.payload);
+          azure_iot->config->model_id,
+          data_buffer,
+          &mqtt_message.payload,
+          &azure_iot->scratch_overflow_count);
 
       if (az_span_is_content_equal(dps_register_custom_property, AZ_SPAN_EMPTY))
       {
-        azure_iot->state = azure_iot_state_error;
+        set_state(azure_iot, azure_iot_state_error);
         LogError("Failed generating DPS register custom property payload.");
         return;
       }
@@ -377,7 +649,8 @@ void azure_iot_do_work(azure_iot_t* azure_iot)
 
       if (az_result_failed(azrc))
       {
-        azure_iot->state = azure_iot_state_error;
+        count_scratch_overflow(azure_iot, azrc);
+        set_state(azure_iot, azure_iot_state_error);
         LogError("az_iot_provisioning_client_get_request_payload failed (0x%08x).", azrc);
         return;
       }
@@ -385,30 +658,24 @@ void azure_iot_do_work(azure_iot_t* azure_iot)
       mqtt_message.payload = az_span_slice(mqtt_message.payload, 0, length);
       mqtt_message.qos = mqtt_qos_at_most_once;
 
-      azure_iot->state = azure_iot_state_provisioning_waiting;
+      set_state(azure_iot, azure_iot_state_provisioning_waiting);
 
       packet_id = azure_iot->config->mqtt_client_interface.mqtt_client_publish(
           azure_iot->mqtt_client_handle, &mqtt_message);
 
       if (packet_id < 0)
       {
-        azure_iot->state = azure_iot_state_error;
+        set_state(azure_iot, azure_iot_state_error);
         LogError("Failed publishing to DPS registration topic");
         return;
       }
 
       break;
     case azure_iot_state_provisioning_querying:
-      now = get_current_unix_time();
+      now_in_ms = get_current_time_in_ms(azure_iot);
 
-      if (now == 0)
-      {
-        azure_iot->state = azure_iot_state_error;
-        LogError("Failed getting current time for DPS query throttling");
-        return;
-      }
-
-      if ((now - azure_iot->dps_last_query_time) < azure_iot->dps_retry_after_seconds)
+      if ((now_in_ms - azure_iot->dps_last_query_time_in_ms)
+          < (uint64_t)azure_iot->dps_retry_after_seconds * NUMBER_OF_MILLISECONDS_IN_A_SECOND)
       {
         // Throttling query...
         return;
@@ -417,32 +684,33 @@ void azure_iot_do_work(azure_iot_t* azure_iot)
       azrc = az_iot_provisioning_client_query_status_get_publish_topic(
           &azure_iot->dps_client,
           azure_iot->dps_operation_id, // register_response->operation_id,
-          (char*)az_span_ptr(azure_iot->data_buffer),
-          (size_t)az_span_size(azure_iot->data_buffer),
+          (char*)az_span_ptr(azure_iot->scratch_buffer),
+          (size_t)az_span_size(azure_iot->scratch_buffer),
           &length);
 
       if (az_result_failed(azrc))
       {
-        azure_iot->state = azure_iot_state_error;
+        count_scratch_overflow(azure_iot, azrc);
+        set_state(azure_iot, azure_iot_state_error);
         LogError(
             "Unable to get provisioning query status publish topic: az_result return code 0x%08x.",
             azrc);
         return;
       }
 
-      mqtt_message.topic = az_span_slice(azure_iot->data_buffer, 0, length + 1);
+      mqtt_message.topic = az_span_slice(azure_iot->scratch_buffer, 0, length + 1);
       mqtt_message.payload = AZ_SPAN_EMPTY;
       mqtt_message.qos = mqtt_qos_at_most_once;
 
-      azure_iot->state = azure_iot_state_provisioning_waiting;
-      azure_iot->dps_last_query_time = now;
+      set_state(azure_iot, azure_iot_state_provisioning_waiting);
+      azure_iot->dps_last_query_time_in_ms = now_in_ms;
 
       packet_id = azure_iot->config->mqtt_client_interface.mqtt_client_publish(
           azure_iot->mqtt_client_handle, &mqtt_message);
 
       if (packet_id < 0)
       {
-        azure_iot->state = azure_iot_state_error;
+        set_state(azure_iot, azure_iot_state_error);
         LogError("Failed publishing to DPS status query topic");
         return;
       }
@@ -457,150 +725,288 @@ void azure_iot_do_work(azure_iot_t* azure_iot)
                  azure_iot->mqtt_client_handle)
               != 0)
       {
-        azure_iot->state = azure_iot_state_error;
+        set_state(azure_iot, azure_iot_state_error);
         LogError("Failed de-initializing MQTT client.");
         return;
       }
 
       azure_iot->mqtt_client_handle = NULL;
+      azure_iot->dps_reconnect_backoff.consecutive_failures_count = 0;
 
       // Connect to Hub
-      result = get_mqtt_client_config_for_iot_hub(azure_iot, &mqtt_client_config);
-
-      if (result != 0)
-      {
-        azure_iot->state = azure_iot_state_error;
-        LogError("Failed getting MQTT client configuration for connecting to IoT Hub.");
-        return;
-      }
-
-      azure_iot->state = azure_iot_state_connecting_to_hub;
-
-      if (azure_iot->config->mqtt_client_interface.mqtt_client_init(
-              &mqtt_client_config, &azure_iot->mqtt_client_handle)
-          != 0)
-      {
-        azure_iot->state = azure_iot_state_error;
-        LogError("Failed initializing MQTT client for IoT Hub connection.");
-        return;
-      }
-
+      (void)connect_to_iot_hub(azure_iot);
       break;
     case azure_iot_state_connecting_to_hub:
       break;
     case azure_iot_state_connected_to_hub:
-      azure_iot->state = azure_iot_state_subscribing_to_pnp_cmds;
-
-      packet_id = azure_iot->config->mqtt_client_interface.mqtt_client_subscribe(
-          azure_iot->mqtt_client_handle,
-          AZ_SPAN_FROM_STR(AZ_IOT_HUB_CLIENT_COMMANDS_SUBSCRIBE_TOPIC),
-          mqtt_qos_at_least_once);
-
-      if (packet_id < 0)
+      if (build_iot_hub_topics(azure_iot) != RESULT_OK)
       {
-        azure_iot->state = azure_iot_state_error;
-        LogError("Failed subscribing to IoT Plug and Play commands topic.");
+        set_state(azure_iot, azure_iot_state_error);
+        LogError("Failed building the Azure IoT Hub topics.");
         return;
       }
 
+      // PUBACKs for packets sent over a previous connection will not arrive anymore.
+      reset_in_flight_telemetry(azure_iot);
+      // Writable properties updated while disconnected are only learned from the full document.
+      azure_iot->is_properties_document_requested = false;
+      azure_iot->properties_document_retry_time_in_ms = 0;
+      azure_iot->properties_document_failures_count = 0;
+      (void)subscribe_to_pnp_topics(azure_iot);
       break;
-    case azure_iot_state_subscribing_to_pnp_cmds:
+    case azure_iot_state_subscribing_to_pnp_topics:
       break;
-    case azure_iot_state_subscribed_to_pnp_cmds:
-      azure_iot->state = azure_iot_state_subscribing_to_pnp_props;
-
-      packet_id = azure_iot->config->mqtt_client_interface.mqtt_client_subscribe(
-          azure_iot->mqtt_client_handle,
-          AZ_SPAN_FROM_STR(AZ_IOT_HUB_CLIENT_PROPERTIES_MESSAGE_SUBSCRIBE_TOPIC),
-          mqtt_qos_at_least_once);
-
-      if (packet_id < 0)
+    case azure_iot_state_ready:
+      if (azure_iot->disconnected_since_in_ms != 0)
       {
-        azure_iot->state = azure_iot_state_error;
-        LogError("Failed subscribing to IoT Plug and Play properties topic.");
-        return;
+        azure_iot->reconnect_statistics.disconnected_time_in_ms
+            += get_current_time_in_ms(azure_iot) - azure_iot->disconnected_since_in_ms;
+        azure_iot->disconnected_since_in_ms = 0;
+        azure_iot->iot_hub_reconnect_backoff.consecutive_failures_count = 0;
+        LogInfo("Azure IoT client reconnected.");
       }
 
-      break;
-    case azure_iot_state_subscribing_to_pnp_props:
-      break;
-    case azure_iot_state_subscribed_to_pnp_props:
-      azure_iot->state = azure_iot_state_subscribing_to_pnp_writable_props;
+      if (azure_iot->is_refreshing_sas)
+      {
+        uint32_t blackout_in_ms = (uint32_t)(get_current_time_in_ms(azure_iot)
+                                             - azure_iot->sas_refresh_start_time_in_ms);
 
-      packet_id = azure_iot->config->mqtt_client_interface.mqtt_client_subscribe(
-          azure_iot->mqtt_client_handle,
-          AZ_SPAN_FROM_STR(AZ_IOT_HUB_CLIENT_PROPERTIES_WRITABLE_UPDATES_SUBSCRIBE_TOPIC),
-          mqtt_qos_at_least_once);
+        azure_iot->is_refreshing_sas = false;
+        azure_iot->sas_token_refresh_statistics.last_blackout_in_ms = blackout_in_ms;
 
-      if (packet_id < 0)
+        if (blackout_in_ms > azure_iot->sas_token_refresh_statistics.max_blackout_in_ms)
+        {
+          azure_iot->sas_token_refresh_statistics.max_blackout_in_ms = blackout_in_ms;
+        }
+
+        LogInfo("SAS token refreshed (blackout=%u ms).", blackout_in_ms);
+
+        if (publish_held_messages(azure_iot) != RESULT_OK)
+        {
+          LogError("Failed publishing messages held during SAS token refresh.");
+        }
+      }
+
+      if (!azure_iot->is_properties_document_requested
+          && get_current_time_in_ms(azure_iot) >= azure_iot->properties_document_retry_time_in_ms
+          && get_time_until_rate_limit_token_in_ms(azure_iot, outbound_message_class_properties)
+              == 0)
       {
-        azure_iot->state = azure_iot_state_error;
-        LogError("Failed subscribing to IoT Plug and Play writable properties topic.");
-        return;
+        if (request_properties_document(azure_iot) == RESULT_OK)
+        {
+          azure_iot->is_properties_document_requested = true;
+        }
+        else
+        {
+          LogError("Failed requesting the properties document.");
+        }
       }
 
-      break;
-    case azure_iot_state_subscribing_to_pnp_writable_props:
-      break;
-    case azure_iot_state_ready:
-      // Checking for SAS token expiration.
-      now = get_current_unix_time();
+      drain_outbound_queues(azure_iot);
+      process_in_flight_telemetry(azure_iot);
 
-      if (now == 0)
+      if (azure_iot->reported_properties_count > 0
+          && get_current_time_in_ms(azure_iot) >= azure_iot->reported_properties_flush_time_in_ms
+          && flush_reported_properties(azure_iot) != RESULT_OK)
       {
-        azure_iot->state = azure_iot_state_error;
-        LogError("Failed getting current time for checking SAS token expiration.");
-        return;
+        // Not critical, the properties are kept and sent later.
+        azure_iot->reported_properties_flush_time_in_ms = get_current_time_in_ms(azure_iot)
+            + azure_iot->config->reported_properties_flush_interval_in_ms;
+        LogError("Failed sending reported properties.");
+      }
+
+      // Stored telemetry is newer than the one queued.
+      if (is_offline_telemetry_pending(azure_iot) && can_publish_telemetry(azure_iot)
+          && azure_iot->outbound_queues[outbound_message_class_telemetry].count == 0
+          && get_current_time_in_ms(azure_iot)
+              >= azure_iot->offline_telemetry_next_drain_time_in_ms
+          && take_rate_limit_token(azure_iot, outbound_message_class_telemetry))
+      {
+        azure_iot->offline_telemetry_next_drain_time_in_ms = get_current_time_in_ms(azure_iot)
+            + NUMBER_OF_MILLISECONDS_IN_A_SECOND
+                / azure_iot->config->offline_telemetry_drain_rate_per_sec;
+
+        if (publish_offline_telemetry(azure_iot) != RESULT_OK)
+        {
+          // Not critical, the record is kept and retried next time.
+          LogError("Failed publishing stored telemetry.");
+        }
       }
-      else if ((azure_iot->sas_token_expiration_time - now) < SAS_TOKEN_REFRESH_THRESHOLD_IN_SECS)
+
+      // Checking for SAS token expiration, against the monotonic clock so setting the wall
+      // clock does not cause spurious refreshes.
+      now_in_ms = get_current_time_in_ms(azure_iot);
+
+      if (now_in_ms + SAS_TOKEN_REFRESH_THRESHOLD_IN_SECS * NUMBER_OF_MILLISECONDS_IN_A_SECOND
+          > azure_iot->sas_token_expiration_time_in_ms)
       {
-        azure_iot->state = azure_iot_state_refreshing_sas;
+        azure_iot->is_refreshing_sas = true;
+        azure_iot->sas_refresh_start_time_in_ms = get_current_time_in_ms(azure_iot);
+        azure_iot->sas_token_refresh_statistics.refresh_count++;
+
+        set_state(azure_iot, azure_iot_state_refreshing_sas);
         if (azure_iot->config->mqtt_client_interface.mqtt_client_deinit(
                 azure_iot->mqtt_client_handle)
             != 0)
         {
-          azure_iot->state = azure_iot_state_error;
+          set_state(azure_iot, azure_iot_state_error);
           LogError("Failed de-initializing MQTT client.");
           return;
         }
 
         azure_iot->mqtt_client_handle = NULL;
+
+        if (azure_iot->config->sas_token_refresh_mode == sas_token_refresh_mode_make_before_break)
+        {
+          // The next SAS token is ready, so there is no need to wait for another pass.
+          set_state(azure_iot, azure_iot_state_provisioned);
+          (void)connect_to_iot_hub(azure_iot);
+        }
+      }
+      else if (
+          azure_iot->config->sas_token_refresh_mode == sas_token_refresh_mode_make_before_break
+          && az_span_size(azure_iot->next_sas_token) == 0
+          && now_in_ms + SAS_TOKEN_PREPARE_THRESHOLD_IN_SECS * NUMBER_OF_MILLISECONDS_IN_A_SECOND
+              > azure_iot->sas_token_expiration_time_in_ms)
+      {
+        if (prepare_next_sas_token(azure_iot) != RESULT_OK)
+        {
+          // Not critical, the SAS token is generated when reconnecting instead.
+          LogError("Failed generating next SAS token ahead of time.");
+        }
       }
       break;
     case azure_iot_state_refreshing_sas:
       break;
+    case azure_iot_state_reconnect_scheduled:
+      if (get_current_time_in_ms(azure_iot) >= azure_iot->reconnect_time_in_ms)
+      {
+        azure_iot->reconnect_statistics.attempts_count++;
+        set_state(azure_iot, azure_iot_state_initialized);
+        (void)azure_iot_start(azure_iot);
+      }
+      break;
     case azure_iot_state_error:
+      if (azure_iot->config->automatic_reconnect)
+      {
+        schedule_reconnect(azure_iot);
+      }
+      break;
     default:
       break;
   }
 }
 
+void azure_iot_wait_for_work(azure_iot_t* azure_iot, uint32_t max_wait_in_ms)
+{
+  _az_PRECONDITION_NOT_NULL(azure_iot);
+
+  uint64_t wait_start_time_in_ms;
+  uint32_t timeout_in_ms = get_time_until_next_work_in_ms(azure_iot);
+
+  if (timeout_in_ms > max_wait_in_ms)
+  {
+    timeout_in_ms = max_wait_in_ms;
+  }
+
+  if (azure_iot->config->event_interface.wait == NULL || timeout_in_ms == 0)
+  {
+    return;
+  }
+
+  wait_start_time_in_ms = get_current_time_in_ms(azure_iot);
+
+  if (azure_iot->idle_statistics_start_time_in_ms == 0)
+  {
+    azure_iot->idle_statistics_start_time_in_ms = wait_start_time_in_ms;
+  }
+
+  azure_iot->config->event_interface.wait(timeout_in_ms);
+
+  azure_iot->idle_statistics.idle_time_in_ms
+      += get_current_time_in_ms(azure_iot) - wait_start_time_in_ms;
+  azure_iot->idle_statistics.wait_count++;
+}
+
+void azure_iot_get_idle_statistics(azure_iot_t* azure_iot, idle_statistics_t* statistics)
+{
+  _az_PRECONDITION_NOT_NULL(azure_iot);
+  _az_PRECONDITION_NOT_NULL(statistics);
+
+  *statistics = azure_iot->idle_statistics;
+  statistics->total_time_in_ms = azure_iot->idle_statistics_start_time_in_ms == 0
+      ? 0
+      : get_current_time_in_ms(azure_iot) - azure_iot->idle_statistics_start_time_in_ms;
+}
+
 int azure_iot_send_telemetry(azure_iot_t* azure_iot, az_span message)
 {
   _az_PRECONDITION_NOT_NULL(azure_iot);
   _az_PRECONDITION_VALID_SPAN(message, 1, false);
 
-  az_result azr;
-  size_t topic_length;
+  bool can_publish = can_publish_telemetry(azure_iot);
+  bool is_queued = is_outbound_queue_enabled(azure_iot, outbound_message_class_telemetry);
   mqtt_message_t mqtt_message;
 
-  azr = az_iot_hub_client_telemetry_get_publish_topic(
-      &azure_iot->iot_hub_client,
-      NULL,
-      (char*)az_span_ptr(azure_iot->data_buffer),
-      az_span_size(azure_iot->data_buffer),
-      &topic_length);
-  EXIT_IF_AZ_FAILED(azr, RESULT_ERROR, "Failed to get the telemetry topic");
+  if (!can_publish)
+  {
+    azure_iot->telemetry_delivery_statistics.window_full_count++;
+  }
 
-  mqtt_message.topic = az_span_slice(azure_iot->data_buffer, 0, topic_length + 1);
-  mqtt_message.payload = message;
-  mqtt_message.qos = mqtt_qos_at_most_once;
+  // Once there is stored telemetry, new telemetry must go behind it to keep the order.
+  // Queued telemetry waits for an in-flight slot in the queue instead.
+  if (az_span_size(azure_iot->offline_telemetry.buffer) > 0
+      && (azure_iot->state != azure_iot_state_ready || is_offline_telemetry_pending(azure_iot)
+          || (!can_publish && !is_queued)))
+  {
+    return store_offline_telemetry(azure_iot, message);
+  }
 
-  int packet_id = azure_iot->config->mqtt_client_interface.mqtt_client_publish(
-      azure_iot->mqtt_client_handle, &mqtt_message);
-  EXIT_IF_TRUE(packet_id < 0, RESULT_ERROR, "Failed publishing to telemetry topic");
+  EXIT_IF_TRUE(
+      !can_publish && !is_queued, RESULT_ERROR, "No in-flight slot available for telemetry.");
 
-  return RESULT_OK;
+  // The token is only taken once the message is queued or published below, so telemetry
+  // stored for later does not spend it twice (it takes another one when drained).
+  if (get_time_until_rate_limit_token_in_ms(azure_iot, outbound_message_class_telemetry) > 0)
+  {
+    // Stored telemetry is drained within the rate limit.
+    if (az_span_size(azure_iot->offline_telemetry.buffer) > 0
+        && store_offline_telemetry(azure_iot, message) == RESULT_OK)
+    {
+      azure_iot->rate_limit_statistics.deferred_count[outbound_message_class_telemetry]++;
+      return RESULT_OK;
+    }
+
+    azure_iot->rate_limit_statistics.dropped_count[outbound_message_class_telemetry]++;
+    LogError("Telemetry over its rate limit, dropped.");
+    return RESULT_ERROR;
+  }
+
+  if (is_queued)
+  {
+    // The telemetry topic is only known once connected, so it is not queued.
+    mqtt_message.topic = AZ_SPAN_EMPTY;
+    mqtt_message.payload = message;
+    mqtt_message.qos = azure_iot->config->telemetry_qos;
+
+    if (enqueue_outbound_message(azure_iot, outbound_message_class_telemetry, &mqtt_message)
+        == RESULT_OK)
+    {
+      (void)take_rate_limit_token(azure_iot, outbound_message_class_telemetry);
+      return RESULT_OK;
+    }
+
+    EXIT_IF_TRUE(
+        az_span_size(azure_iot->offline_telemetry.buffer) == 0,
+        RESULT_ERROR,
+        "No space for queueing telemetry.");
+
+    return store_offline_telemetry(azure_iot, message);
+  }
+
+  (void)take_rate_limit_token(azure_iot, outbound_message_class_telemetry);
+
+  return publish_telemetry(azure_iot, message);
 }
 
 int azure_iot_send_properties_update(azure_iot_t* azure_iot, uint32_t request_id, az_span message)
@@ -609,90 +1015,355 @@ int azure_iot_send_properties_update(azure_iot_t* azure_iot, uint32_t request_id
   _az_PRECONDITION_VALID_SPAN(message, 1, false);
 
   az_result azr;
-  size_t topic_length;
+  mqtt_message_fragments_t fragments;
   mqtt_message_t mqtt_message;
-  az_span data_buffer = azure_iot->data_buffer;
-  az_span request_id_span = data_buffer;
+  uint8_t request_id_buffer[UINT32_DECIMAL_MAX_SIZE];
+  az_span remainder;
+  bool is_deferred;
 
-  azr = az_span_u32toa(request_id_span, request_id, &data_buffer);
-  EXIT_IF_TRUE(az_result_failed(azr), RESULT_ERROR, "Failed generating Twin request id.");
-  request_id_span = az_span_slice(
-      request_id_span, 0, az_span_size(request_id_span) - az_span_size(data_buffer));
+  // Built once connected to the Azure IoT Hub, so nothing gets queued under a bare request id.
+  EXIT_IF_TRUE(
+      az_span_size(azure_iot->reported_properties_topic_prefix) == 0,
+      RESULT_ERROR,
+      "Properties update not sent, Azure IoT Hub topics not built yet (not connected).");
 
-  azr = az_iot_hub_client_properties_get_reported_publish_topic(
-      &azure_iot->iot_hub_client,
-      request_id_span,
-      (char*)az_span_ptr(data_buffer),
-      az_span_size(data_buffer),
-      &topic_length);
-  EXIT_IF_AZ_FAILED(azr, RESULT_ERROR, "Failed to get the reported properties publish topic");
+  azr = az_span_u32toa(AZ_SPAN_FROM_BUFFER(request_id_buffer), request_id, &remainder);
+  EXIT_IF_AZ_FAILED(azr, RESULT_ERROR, "Failed generating Twin request id.");
 
-  mqtt_message.topic = az_span_slice(data_buffer, 0, topic_length);
-  mqtt_message.payload = message;
-  mqtt_message.qos = mqtt_qos_at_most_once;
+  // The topic is the prefix built once per connection followed by the request id.
+  fragments.topic[0] = azure_iot->reported_properties_topic_prefix;
+  fragments.topic[1] = az_span_slice(
+      AZ_SPAN_FROM_BUFFER(request_id_buffer),
+      0,
+      (int32_t)sizeof(request_id_buffer) - az_span_size(remainder));
+  fragments.topic_count = 2;
+  fragments.payload[0] = message;
+  fragments.payload_count = 1;
+  fragments.qos = mqtt_qos_at_most_once;
 
-  int packet_id = azure_iot->config->mqtt_client_interface.mqtt_client_publish(
-      azure_iot->mqtt_client_handle, &mqtt_message);
+  if (is_outbound_queue_enabled(azure_iot, outbound_message_class_properties))
+  {
+    // Over the rate limit, it waits in the queue; `drain_outbound_queues` takes the token.
+    is_deferred
+        = get_time_until_rate_limit_token_in_ms(azure_iot, outbound_message_class_properties) > 0;
+
+    EXIT_IF_TRUE(
+        join_mqtt_message_fragments(azure_iot, &fragments, &mqtt_message) != RESULT_OK
+            || enqueue_outbound_message(
+                   azure_iot, outbound_message_class_properties, &mqtt_message)
+                != RESULT_OK,
+        RESULT_ERROR,
+        "No space for queueing properties update.");
+
+    if (is_deferred)
+    {
+      azure_iot->rate_limit_statistics.deferred_count[outbound_message_class_properties]++;
+    }
+
+    return RESULT_OK;
+  }
+
+  // Without a queue to wait in, it is not held back (see `rate_limits`).
+  (void)take_rate_limit_token(azure_iot, outbound_message_class_properties);
+
+  int packet_id = publish_mqtt_message_fragments(azure_iot, &fragments);
   EXIT_IF_TRUE(packet_id < 0, RESULT_ERROR, "Failed publishing to reported properties topic.");
 
   return RESULT_OK;
 }
 
-int azure_iot_mqtt_client_connected(azure_iot_t* azure_iot)
+int azure_iot_set_reported_property(azure_iot_t* azure_iot, az_span name, az_span value)
 {
   _az_PRECONDITION_NOT_NULL(azure_iot);
+  _az_PRECONDITION_VALID_SPAN(name, 1, false);
+  _az_PRECONDITION_VALID_SPAN(value, 1, false);
 
-  int result;
+  az_span buffer = azure_iot->config->reported_properties_buffer;
+  // Comma, quotes and colon around the name.
+  int32_t size = az_span_size(name) + az_span_size(value) + 4;
+  int index;
 
-  if (azure_iot->state == azure_iot_state_connecting_to_dps)
+  EXIT_IF_TRUE(
+      az_span_size(buffer) == 0, RESULT_ERROR, "Reported properties buffer not configured.");
+
+  index = find_reported_property(azure_iot, name);
+
+  if (!has_space_for_reported_property(azure_iot, index, size)
+      && azure_iot->state == azure_iot_state_ready)
+  {
+    (void)flush_reported_properties(azure_iot);
+
+    // Gone if the patch was sent, still there if the flush was deferred or failed.
+    index = find_reported_property(azure_iot, name);
+  }
+
+  if (!has_space_for_reported_property(azure_iot, index, size))
+  {
+    // The value set before, if any, is kept.
+    azure_iot->reported_properties_statistics.overflow_count++;
+    LogError("No space for reported property %.*s.", az_span_size(name), az_span_ptr(name));
+    return RESULT_ERROR;
+  }
+
+  if (index >= 0)
+  {
+    // The last value set wins.
+    remove_reported_property(azure_iot, index);
+    azure_iot->reported_properties_statistics.coalesced_count++;
+  }
+
+  if (azure_iot->reported_properties_count == 0)
+  {
+    azure_iot->reported_properties_flush_time_in_ms = get_current_time_in_ms(azure_iot)
+        + azure_iot->config->reported_properties_flush_interval_in_ms;
+  }
+
+  azure_iot->reported_properties[azure_iot->reported_properties_count].offset
+      = azure_iot->reported_properties_used;
+  azure_iot->reported_properties[azure_iot->reported_properties_count].name_size
+      = az_span_size(name);
+  azure_iot->reported_properties[azure_iot->reported_properties_count].size = size;
+  azure_iot->reported_properties_count++;
+
+  buffer = az_span_slice_to_end(buffer, azure_iot->reported_properties_used);
+  buffer = az_span_copy_u8(buffer, ',');
+  buffer = az_span_copy_u8(buffer, '"');
+  buffer = az_span_copy(buffer, name);
+  buffer = az_span_copy_u8(buffer, '"');
+  buffer = az_span_copy_u8(buffer, ':');
+  (void)az_span_copy(buffer, value);
+  azure_iot->reported_properties_used += size;
+  azure_iot->reported_properties_statistics.set_count++;
+
+  if ((uint32_t)azure_iot->reported_properties_used
+      >= azure_iot->config->reported_properties_flush_threshold)
+  {
+    azure_iot->reported_properties_flush_time_in_ms = get_current_time_in_ms(azure_iot);
+  }
+
+  return RESULT_OK;
+}
+
+int azure_iot_set_reported_properties(azure_iot_t* azure_iot, az_span properties)
+{
+  _az_PRECONDITION_NOT_NULL(azure_iot);
+  _az_PRECONDITION_VALID_SPAN(properties, 1, false);
+
+  az_result azr;
+  az_json_reader jr;
+  az_span name;
+  uint8_t* value_start;
+  uint8_t* value_end;
+
+  if (az_span_size(azure_iot->config->reported_properties_buffer) == 0)
+  {
+    // Checked here too, so no request id is used up by an update that cannot be sent.
+    EXIT_IF_TRUE(
+        az_span_size(azure_iot->reported_properties_topic_prefix) == 0,
+        RESULT_ERROR,
+        "Reported properties not sent, Azure IoT Hub topics not built yet (not connected).");
+
+    return azure_iot_send_properties_update(
+        azure_iot, azure_iot->reported_properties_request_id++, properties);
+  }
+
+  azr = az_json_reader_init(&jr, properties, NULL);
+  EXIT_IF_AZ_FAILED(azr, RESULT_ERROR, "Failed initializing json reader for reported properties.");
+
+  azr = az_json_reader_next_token(&jr);
+  EXIT_IF_TRUE(
+      az_result_failed(azr) || jr.token.kind != AZ_JSON_TOKEN_BEGIN_OBJECT,
+      RESULT_ERROR,
+      "Reported properties are not a JSON object.");
+
+  while (az_result_succeeded(azr = az_json_reader_next_token(&jr))
+         && jr.token.kind == AZ_JSON_TOKEN_PROPERTY_NAME)
+  {
+    name = jr.token.slice;
+
+    azr = az_json_reader_next_token(&jr);
+    EXIT_IF_AZ_FAILED(azr, RESULT_ERROR, "Failed reading reported property value.");
+
+    // The slice of a string token does not include its quotes.
+    value_start = az_span_ptr(jr.token.slice) - (jr.token.kind == AZ_JSON_TOKEN_STRING ? 1 : 0);
+
+    azr = az_json_reader_skip_children(&jr);
+    EXIT_IF_AZ_FAILED(azr, RESULT_ERROR, "Failed skipping reported property value.");
+
+    value_end = az_span_ptr(jr.token.slice) + az_span_size(jr.token.slice)
+        + (jr.token.kind == AZ_JSON_TOKEN_STRING ? 1 : 0);
+
+    EXIT_IF_TRUE(
+        azure_iot_set_reported_property(
+            azure_iot, name, az_span_create(value_start, (int32_t)(value_end - value_start)))
+            != RESULT_OK,
+        RESULT_ERROR,
+        "Failed setting reported property.");
+  }
+
+  EXIT_IF_AZ_FAILED(azr, RESULT_ERROR, "Failed reading reported properties.");
+
+  return RESULT_OK;
+}
+
+int azure_iot_mqtt_client_connected(azure_iot_t* azure_iot)
+{
+  _az_PRECONDITION_NOT_NULL(azure_iot);
+
+  int result;
+
+  if (azure_iot->state == azure_iot_state_connecting_to_dps)
   {
     if (!azure_iot->config->use_device_provisioning)
     {
-      azure_iot->state = azure_iot_state_error;
+      set_state(azure_iot, azure_iot_state_error);
       LogError("Invalid state, provisioning disabled in config.");
       result = RESULT_ERROR;
     }
     else
     {
-      azure_iot->state = azure_iot_state_connected_to_dps;
+      set_state(azure_iot, azure_iot_state_connected_to_dps);
       result = RESULT_OK;
     }
   }
   else if (azure_iot->state == azure_iot_state_connecting_to_hub)
   {
-    azure_iot->state = azure_iot_state_connected_to_hub;
+    // The provisioning result saved is still valid, no need to fall back to DPS anymore.
+    azure_iot->is_provisioning_cached = false;
+    set_state(azure_iot, azure_iot_state_connected_to_hub);
     result = RESULT_OK;
   }
   else
   {
     LogError("Unexpected mqtt client connection (%d).", azure_iot->state);
-    azure_iot->state = azure_iot_state_error;
+    set_state(azure_iot, azure_iot_state_error);
     result = RESULT_ERROR;
   }
 
+  post_event(azure_iot, azure_iot_event_mqtt_connected);
+
   return result;
 }
 
+int azure_iot_mqtt_client_tls_session_established(
+    azure_iot_t* azure_iot,
+    az_span tls_session,
+    bool is_resumed)
+{
+  _az_PRECONDITION_NOT_NULL(azure_iot);
+
+  // Sessions with DPS are not worth saving, as it is only connected to once per provisioning.
+  if (azure_iot->state != azure_iot_state_connecting_to_hub)
+  {
+    return RESULT_OK;
+  }
+
+  if (is_resumed)
+  {
+    // The session saved is still the one in use, so it keeps its original age.
+    azure_iot->tls_session_statistics.resumed_count++;
+    return RESULT_OK;
+  }
+
+  azure_iot->tls_session_statistics.handshake_count++;
+  azure_iot->tls_session = AZ_SPAN_EMPTY;
+
+  if (az_span_size(tls_session) == 0)
+  {
+    return RESULT_OK;
+  }
+
+  EXIT_IF_TRUE(
+      az_span_size(tls_session) > az_span_size(azure_iot->config->tls_session_buffer),
+      RESULT_ERROR,
+      "TLS session does not fit in tls_session_buffer (%d bytes).",
+      az_span_size(tls_session));
+
+  azure_iot->tls_session = az_span_slice(
+      azure_iot->config->tls_session_buffer, 0, az_span_size(tls_session));
+  (void)az_span_copy(azure_iot->tls_session, tls_session);
+  azure_iot->tls_session_saved_time_in_ms = get_current_time_in_ms(azure_iot);
+
+  return RESULT_OK;
+}
+
+int azure_iot_mqtt_client_connection_refused(
+    azure_iot_t* azure_iot,
+    mqtt_connect_return_code_t return_code)
+{
+  _az_PRECONDITION_NOT_NULL(azure_iot);
+
+  // Only refusals of the device itself tell the saved provisioning result is outdated; others
+  // (e.g., server unavailable) are transient.
+  if (azure_iot->state == azure_iot_state_connecting_to_hub
+      && (return_code == mqtt_connect_return_code_id_rejected
+          || return_code == mqtt_connect_return_code_bad_username
+          || return_code == mqtt_connect_return_code_not_authorized))
+  {
+    azure_iot->is_iot_hub_connection_rejected = true;
+  }
+
+  // The Azure IoT Hub refuses connections over its throttling limits as "server unavailable".
+  // MQTT 3.1.1 disconnections carry no reason, so they are not taken as throttling.
+  if (azure_iot->state == azure_iot_state_connecting_to_hub
+      && return_code == mqtt_connect_return_code_server_unavailable)
+  {
+    for (int i = 0; i < OUTBOUND_MESSAGE_CLASS_COUNT; i++)
+    {
+      throttle_rate_limit(azure_iot, (outbound_message_class_t)i);
+    }
+  }
+
+  return RESULT_OK;
+}
+
 int azure_iot_mqtt_client_disconnected(azure_iot_t* azure_iot)
 {
   _az_PRECONDITION_NOT_NULL(azure_iot);
 
   int result;
 
-  if (azure_iot->state == azure_iot_state_refreshing_sas)
+  if (azure_iot->state == azure_iot_state_refreshing_sas
+      || azure_iot->state == azure_iot_state_provisioned)
   {
     // Moving the state to azure_iot_state_provisioned will cause this client to move
     // on to trying to connect to the Azure IoT Hub again.
-    azure_iot->state = azure_iot_state_provisioned;
+    set_state(azure_iot, azure_iot_state_provisioned);
+    result = RESULT_OK;
+  }
+  else if (
+      azure_iot->state == azure_iot_state_connecting_to_hub && azure_iot->is_provisioning_cached
+      && azure_iot->is_iot_hub_connection_rejected)
+  {
+    // The Azure IoT Hub saved rejected the device (e.g., the device got re-assigned).
+    // Device-provisioning is performed again once the client is restarted, and the MQTT client
+    // still initialized is de-initialized by `schedule_reconnect` or `azure_iot_stop`.
+    LogError("Azure IoT Hub rejected the device, discarding saved provisioning result.");
+    azure_iot->is_iot_hub_connection_rejected = false;
+    clear_cached_provisioning(azure_iot);
+    set_state(azure_iot, azure_iot_state_error);
+    result = RESULT_OK;
+  }
+  else if (
+      azure_iot->config->automatic_reconnect && azure_iot->state != azure_iot_state_not_initialized
+      && azure_iot->state != azure_iot_state_initialized
+      && azure_iot->state != azure_iot_state_reconnect_scheduled)
+  {
+    // The MQTT client cannot be de-initialized from within its own callbacks,
+    // so the reconnection is scheduled by `azure_iot_do_work`.
+    LogError("MQTT client disconnected unexpectedly (%d).", azure_iot->state);
+    set_state(azure_iot, azure_iot_state_error);
     result = RESULT_OK;
   }
   else
   {
     // MQTT client could disconnect at any time for any reason, it is an expected situation.
-    azure_iot->state = azure_iot_state_initialized;
+    set_state(azure_iot, azure_iot_state_initialized);
     result = RESULT_OK;
   }
 
+  post_event(azure_iot, azure_iot_event_mqtt_disconnected);
+
   return result;
 }
 
@@ -700,28 +1371,65 @@ int azure_iot_mqtt_client_subscribe_completed(azure_iot_t* azure_iot, int packet
 {
   _az_PRECONDITION_NOT_NULL(azure_iot);
 
-  (void)packet_id;
   int result;
+  int index;
+  int expected_packet_id;
 
   if (azure_iot->state == azure_iot_state_subscribing_to_dps)
   {
-    azure_iot->state = azure_iot_state_subscribed_to_dps;
-    result = RESULT_OK;
-  }
-  else if (azure_iot->state == azure_iot_state_subscribing_to_pnp_cmds)
-  {
-    azure_iot->state = azure_iot_state_subscribed_to_pnp_cmds;
+    set_state(azure_iot, azure_iot_state_subscribed_to_dps);
     result = RESULT_OK;
   }
-  else if (azure_iot->state == azure_iot_state_subscribing_to_pnp_props)
+  else if (azure_iot->state == azure_iot_state_subscribing_to_pnp_topics)
   {
-    azure_iot->state = azure_iot_state_subscribed_to_pnp_props;
-    result = RESULT_OK;
-  }
-  else if (azure_iot->state == azure_iot_state_subscribing_to_pnp_writable_props)
-  {
-    azure_iot->state = azure_iot_state_ready;
-    result = RESULT_OK;
+    result = RESULT_ERROR;
+    index = -1;
+
+    for (int i = 0; i < PNP_SUBSCRIPTIONS_COUNT; i++)
+    {
+      if (__atomic_load_n(&azure_iot->pnp_subscriptions_packet_ids[i], __ATOMIC_SEQ_CST)
+          == packet_id)
+      {
+        index = i;
+        break;
+      }
+    }
+
+    if (index < 0)
+    {
+      // SUBACK arrived before `mqtt_client_subscribe` returned the packet id. The ids of the
+      // subscriptions sent before are all recorded, so it can only be for the one in flight.
+      index = __atomic_load_n(&azure_iot->pnp_subscription_in_flight_index, __ATOMIC_SEQ_CST);
+      expected_packet_id = 0;
+
+      if (index >= 0
+          && !__atomic_compare_exchange_n(
+              &azure_iot->pnp_subscriptions_packet_ids[index],
+              &expected_packet_id,
+              packet_id,
+              false,
+              __ATOMIC_SEQ_CST,
+              __ATOMIC_SEQ_CST)
+          && expected_packet_id != packet_id)
+      {
+        index = -1;
+      }
+    }
+
+    if (index >= 0 && !azure_iot->pnp_subscriptions_completed[index])
+    {
+      azure_iot->pnp_subscriptions_completed[index] = true;
+      result = RESULT_OK;
+    }
+
+    if (result != RESULT_OK)
+    {
+      LogError("Unexpected SUBACK for IoT Plug and Play topics (packet id=%d)", packet_id);
+    }
+    else if (are_pnp_subscriptions_completed(azure_iot))
+    {
+      set_state(azure_iot, azure_iot_state_ready);
+    }
   }
   else
   {
@@ -729,18 +1437,35 @@ int azure_iot_mqtt_client_subscribe_completed(azure_iot_t* azure_iot, int packet
     result = RESULT_ERROR;
   }
 
+  post_event(azure_iot, azure_iot_event_mqtt_subscribe_completed);
+
   return result;
 }
 
-/*
- * Currently unused.
- */
 int azure_iot_mqtt_client_publish_completed(azure_iot_t* azure_iot, int packet_id)
 {
   _az_PRECONDITION_NOT_NULL(azure_iot);
 
-  (void)packet_id;
+  if (packet_id <= 0)
+  {
+    return RESULT_OK;
+  }
+
+  for (uint8_t i = 0; i < azure_iot->config->telemetry_in_flight_window_size; i++)
+  {
+    telemetry_in_flight_t* in_flight = &azure_iot->telemetry_in_flight[i];
+
+    if (in_flight->is_used && in_flight->packet_id == packet_id)
+    {
+      azure_iot->telemetry_delivery_statistics.acked_count++;
+      in_flight->is_used = false;
+      // A slot is free, so stored telemetry can be drained.
+      post_event(azure_iot, azure_iot_event_mqtt_publish_completed);
+      break;
+    }
+  }
 
+  // PUBACKs not found are for messages already given up on or retransmitted; not an error.
   return RESULT_OK;
 }
 
@@ -758,91 +1483,25 @@ int azure_iot_mqtt_client_message_received(azure_iot_t* azure_iot, mqtt_message_
     // This message should either be:
     // - a response to a properties update request, or
     // - a response to a "get" properties request, or
+    // - a writable properties update, or
     // - a command request.
-
-    az_iot_hub_client_properties_message property_message;
-    azrc = az_iot_hub_client_properties_parse_received_topic(
-        &azure_iot->iot_hub_client, mqtt_message->topic, &property_message);
-
-    if (az_result_succeeded(azrc))
-    {
-      switch (property_message.message_type)
-      {
-        // A response from a property GET publish message with the property document as a payload.
-        case AZ_IOT_HUB_CLIENT_PROPERTIES_MESSAGE_TYPE_GET_RESPONSE:
-          result = RESULT_ERROR; // TODO: change to RESULT_OK once implemented.
-          break;
-
-        // An update to the desired properties with the properties as a payload.
-        case AZ_IOT_HUB_CLIENT_PROPERTIES_MESSAGE_TYPE_WRITABLE_UPDATED:
-          if (azure_iot->config->on_properties_received != NULL)
-          {
-            azure_iot->config->on_properties_received(mqtt_message->payload);
-          }
-          result = RESULT_OK;
-          break;
-
-        // When the device publishes a property update, this message type arrives when
-        // server acknowledges this.
-        case AZ_IOT_HUB_CLIENT_PROPERTIES_MESSAGE_TYPE_ACKNOWLEDGEMENT:
-          result = RESULT_OK;
-
-          if (azure_iot->config->on_properties_update_completed != NULL)
-          {
-            uint32_t request_id = 0;
-
-            if (az_result_failed(az_span_atou32(property_message.request_id, &request_id)))
-            {
-              LogError(
-                  "Failed parsing properties update request id (%.*s).",
-                  az_span_size(property_message.request_id),
-                  az_span_ptr(property_message.request_id));
-              result = RESULT_ERROR;
-            }
-            else
-            {
-              azure_iot->config->on_properties_update_completed(
-                  request_id, property_message.status);
-            }
-          }
-          break;
-
-        // An error has occurred
-        case AZ_IOT_HUB_CLIENT_PROPERTIES_MESSAGE_TYPE_ERROR:
-          LogError("Message Type: Request Error");
-          result = RESULT_ERROR;
-          break;
-      }
-    }
-    else
+    // Only the parser matching the topic prefix is tried, so commands do not pay for a failed
+    // properties parse.
+    switch (classify_iot_hub_topic(mqtt_message->topic))
     {
-      az_iot_hub_client_command_request az_sdk_command_request;
-      azrc = az_iot_hub_client_commands_parse_received_topic(
-          &azure_iot->iot_hub_client, mqtt_message->topic, &az_sdk_command_request);
-
-      if (az_result_succeeded(azrc))
-      {
-        if (azure_iot->config->on_command_request_received != NULL)
-        {
-          command_request_t command_request;
-          command_request.request_id = az_sdk_command_request.request_id;
-          command_request.component_name = az_sdk_command_request.component_name;
-          command_request.command_name = az_sdk_command_request.command_name;
-          command_request.payload = mqtt_message->payload;
-
-          azure_iot->config->on_command_request_received(command_request);
-        }
-
-        result = RESULT_OK;
-      }
-      else
-      {
+      case iot_hub_topic_type_properties:
+        result = handle_properties_message(azure_iot, mqtt_message);
+        break;
+      case iot_hub_topic_type_command:
+        result = handle_command_request(azure_iot, mqtt_message);
+        break;
+      default:
         LogError(
             "Could not recognize MQTT message (%.*s).",
             az_span_size(mqtt_message->topic),
             az_span_ptr(mqtt_message->topic));
         result = RESULT_ERROR;
-      }
+        break;
     }
   }
   else if (azure_iot->state == azure_iot_state_provisioning_waiting)
@@ -865,12 +1524,12 @@ int azure_iot_mqtt_client_message_received(azure_iot_t* azure_iot, mqtt_message_
 
         if (az_span_is_content_equal(azure_iot->dps_operation_id, AZ_SPAN_EMPTY))
         {
-          azure_iot->dps_operation_id = slice_and_copy_az_span(
-              azure_iot->data_buffer, register_response.operation_id, &azure_iot->data_buffer);
+          azure_iot->dps_operation_id = copy_into_data_buffer_region(
+              &azure_iot->connection_region, register_response.operation_id);
 
           if (az_span_is_content_equal(azure_iot->dps_operation_id, AZ_SPAN_EMPTY))
           {
-            azure_iot->state = azure_iot_state_error;
+            set_state(azure_iot, azure_iot_state_error);
             LogError("Failed reserving memory for DPS operation id.");
             result = RESULT_ERROR;
           }
@@ -879,45 +1538,53 @@ int azure_iot_mqtt_client_message_received(azure_iot_t* azure_iot, mqtt_message_
         if (result == RESULT_OK)
         {
           azure_iot->dps_retry_after_seconds = register_response.retry_after_seconds;
-          azure_iot->state = azure_iot_state_provisioning_querying;
+          set_state(azure_iot, azure_iot_state_provisioning_querying);
         }
       }
       else if (register_response.operation_status == AZ_IOT_PROVISIONING_STATUS_ASSIGNED)
       {
-        az_span data_buffer = azure_iot->config->data_buffer; // Operation ID is no longer needed.
-        azure_iot->data_buffer = data_buffer; // In case any step below fails.
+        reset_data_buffer_region(&azure_iot->persistent_region);
 
-        azure_iot->config->iot_hub_fqdn = slice_and_copy_az_span(
-            data_buffer, register_response.registration_state.assigned_hub_hostname, &data_buffer);
+        azure_iot->config->iot_hub_fqdn = copy_into_data_buffer_region(
+            &azure_iot->persistent_region,
+            register_response.registration_state.assigned_hub_hostname);
 
         if (az_span_is_content_equal(azure_iot->config->iot_hub_fqdn, AZ_SPAN_EMPTY))
         {
-          azure_iot->state = azure_iot_state_error;
+          set_state(azure_iot, azure_iot_state_error);
           LogError("Failed saving IoT Hub fqdn from provisioning.");
           result = RESULT_ERROR;
         }
         else
         {
-          azure_iot->config->device_id = slice_and_copy_az_span(
-              data_buffer, register_response.registration_state.device_id, &data_buffer);
+          azure_iot->config->device_id = copy_into_data_buffer_region(
+              &azure_iot->persistent_region, register_response.registration_state.device_id);
 
           if (az_span_is_content_equal(azure_iot->config->device_id, AZ_SPAN_EMPTY))
           {
-            azure_iot->state = azure_iot_state_error;
+            set_state(azure_iot, azure_iot_state_error);
             LogError("Failed saving device id from provisioning.");
             result = RESULT_ERROR;
           }
           else
           {
-            azure_iot->data_buffer = data_buffer;
-            azure_iot->state = azure_iot_state_provisioned;
+            set_state(azure_iot, azure_iot_state_provisioned);
             result = RESULT_OK;
+
+            if (azure_iot->config->provisioning_cache.save != NULL
+                && azure_iot->config->provisioning_cache.save(
+                       azure_iot->config->iot_hub_fqdn, azure_iot->config->device_id)
+                    != 0)
+            {
+              // Not critical, device-provisioning will just be performed again after a reboot.
+              LogError("Failed saving provisioning result.");
+            }
           }
         }
       }
       else
       {
-        azure_iot->state = azure_iot_state_error;
+        set_state(azure_iot, azure_iot_state_error);
         LogError("Device provisisioning failed.");
         result = RESULT_OK;
       }
@@ -929,6 +1596,8 @@ int azure_iot_mqtt_client_message_received(azure_iot_t* azure_iot, mqtt_message_
     result = RESULT_ERROR;
   }
 
+  post_event(azure_iot, azure_iot_event_mqtt_message_received);
+
   return result;
 }
 
@@ -942,31 +1611,64 @@ int azure_iot_send_command_response(
   _az_PRECONDITION_VALID_SPAN(request_id, 1, false);
 
   az_result azrc;
+  mqtt_message_fragments_t fragments;
   mqtt_message_t mqtt_message;
-  size_t topic_length;
+  uint8_t status_buffer[UINT32_DECIMAL_MAX_SIZE];
+  az_span remainder;
   int packet_id;
+  bool is_deferred;
 
-  mqtt_message.topic = azure_iot->data_buffer;
-
-  azrc = az_iot_hub_client_commands_response_get_publish_topic(
-      &azure_iot->iot_hub_client,
-      request_id,
-      response_status,
-      (char*)az_span_ptr(mqtt_message.topic),
-      az_span_size(mqtt_message.topic),
-      &topic_length);
+  azrc = az_span_u32toa(AZ_SPAN_FROM_BUFFER(status_buffer), response_status, &remainder);
   EXIT_IF_AZ_FAILED(azrc, RESULT_ERROR, "Failed to get the commands response topic.");
 
-  mqtt_message.topic = az_span_slice(mqtt_message.topic, 0, topic_length + 1);
-  mqtt_message.payload = payload;
-  mqtt_message.qos = mqtt_qos_at_most_once;
+  // Same topic as az_iot_hub_client_commands_response_get_publish_topic, without formatting it
+  // into the data buffer: $iothub/methods/res/{status}/?$rid={request id}
+  fragments.topic[0] = AZ_SPAN_FROM_STR(IOT_HUB_COMMANDS_RESPONSE_TOPIC_PREFIX);
+  fragments.topic[1] = az_span_slice(
+      AZ_SPAN_FROM_BUFFER(status_buffer),
+      0,
+      (int32_t)sizeof(status_buffer) - az_span_size(remainder));
+  fragments.topic[2] = AZ_SPAN_FROM_STR(IOT_HUB_COMMANDS_RESPONSE_TOPIC_REQUEST_ID);
+  fragments.topic[3] = request_id;
+  fragments.topic_count = 4;
+  fragments.payload[0] = payload;
+  fragments.payload_count = az_span_size(payload) > 0 ? 1 : 0;
+  fragments.qos = mqtt_qos_at_most_once;
+
+  if (is_outbound_queue_enabled(azure_iot, outbound_message_class_command_response))
+  {
+    // Over the rate limit, it waits in the queue; `drain_outbound_queues` takes the token.
+    is_deferred
+        = get_time_until_rate_limit_token_in_ms(
+              azure_iot, outbound_message_class_command_response)
+        > 0;
+
+    EXIT_IF_TRUE(
+        join_mqtt_message_fragments(azure_iot, &fragments, &mqtt_message) != RESULT_OK
+            || enqueue_outbound_message(
+                   azure_iot, outbound_message_class_command_response, &mqtt_message)
+                != RESULT_OK,
+        RESULT_ERROR,
+        "No space for queueing command response (%.*s).",
+        az_span_size(request_id),
+        az_span_ptr(request_id));
+
+    if (is_deferred)
+    {
+      azure_iot->rate_limit_statistics.deferred_count[outbound_message_class_command_response]++;
+    }
+
+    return RESULT_OK;
+  }
 
-  packet_id = azure_iot->config->mqtt_client_interface.mqtt_client_publish(
-      azure_iot->mqtt_client_handle, &mqtt_message);
+  // Without a queue to wait in, it is not held back (see `rate_limits`).
+  (void)take_rate_limit_token(azure_iot, outbound_message_class_command_response);
+
+  packet_id = publish_mqtt_message_fragments(azure_iot, &fragments);
 
   if (packet_id < 0)
   {
-    azure_iot->state = azure_iot_state_error;
+    set_state(azure_iot, azure_iot_state_error);
     LogError(
         "Failed publishing command response (%.*s).",
         az_span_size(request_id),
@@ -979,514 +1681,2928 @@ int azure_iot_send_command_response(
   }
 }
 
-/* --- Implementation of internal functions --- */
-
-/*
- * @brief           Gets the number of seconds since UNIX epoch until now.
- * @return uint32_t Number of seconds.
- */
-static uint32_t get_current_unix_time()
+void azure_iot_get_reconnect_statistics(azure_iot_t* azure_iot, reconnect_statistics_t* statistics)
 {
-  time_t now = time(NULL);
-  return (now == INDEFINITE_TIME ? 0 : (uint32_t)(now));
+  _az_PRECONDITION_NOT_NULL(azure_iot);
+  _az_PRECONDITION_NOT_NULL(statistics);
+
+  *statistics = azure_iot->reconnect_statistics;
 }
 
-/*
- * @brief           Initializes the Device Provisioning client and generates the config for an MQTT
- * client.
- * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
- * @param[in]       mqtt_client_config A pointer to a generic structure to contain the configuration
- * for creating and connecting an MQTT client to Azure Device Provisioning service.
- *
- * @return int      0 on success, non-zero if any failure occurs.
- */
-static int get_mqtt_client_config_for_dps(
+void azure_iot_get_data_buffer_statistics(
     azure_iot_t* azure_iot,
-    mqtt_client_config_t* mqtt_client_config)
+    data_buffer_statistics_t* statistics)
 {
-  az_span data_buffer_span;
-  az_span client_id_span;
-  az_span username_span;
-  az_span password_span;
-  size_t client_id_length;
-  size_t username_length;
-  size_t password_length;
-  az_result azrc;
-
-  azrc = az_iot_provisioning_client_init(
-      &azure_iot->dps_client,
-      AZ_SPAN_FROM_STR(DPS_GLOBAL_ENDPOINT_MQTT_URI_WITH_PORT),
-      azure_iot->config->dps_id_scope,
-      azure_iot->config->dps_registration_id,
-      NULL);
-  EXIT_IF_AZ_FAILED(azrc, RESULT_ERROR, "Failed to initialize provisioning client.");
-
-  data_buffer_span = azure_iot->data_buffer;
+  _az_PRECONDITION_NOT_NULL(azure_iot);
+  _az_PRECONDITION_NOT_NULL(statistics);
 
-  password_span = split_az_span(data_buffer_span, MQTT_PASSWORD_BUFFER_SIZE, &data_buffer_span);
-  EXIT_IF_TRUE(
-      az_span_is_content_equal(password_span, AZ_SPAN_EMPTY),
-      RESULT_ERROR,
-      "Failed reserving buffer for password_span.");
+  int32_t scratch_high_water_mark = az_span_size(azure_iot->scratch_buffer);
+  uint8_t* scratch = az_span_ptr(azure_iot->scratch_buffer);
 
-  if (!az_span_is_content_equal(azure_iot->config->device_key, AZ_SPAN_EMPTY))
-  {
-    password_length = generate_sas_token_for_dps(
-        &azure_iot->dps_client,
-        azure_iot->config->device_key,
-        azure_iot->config->sas_token_lifetime_in_minutes,
-        data_buffer_span,
-        azure_iot->config->data_manipulation_functions,
-        password_span,
-        &azure_iot->sas_token_expiration_time);
-    EXIT_IF_TRUE(
-        password_length == 0, RESULT_ERROR, "Failed creating mqtt password for DPS connection.");
+  statistics->persistent.size = az_span_size(azure_iot->persistent_region.buffer);
+  statistics->persistent.high_water_mark = azure_iot->persistent_region.high_water_mark;
+  statistics->persistent.overflow_count = azure_iot->persistent_region.overflow_count;
+  statistics->connection.size = az_span_size(azure_iot->connection_region.buffer);
+  statistics->connection.high_water_mark = azure_iot->connection_region.high_water_mark;
+  statistics->connection.overflow_count = azure_iot->connection_region.overflow_count;
 
-    mqtt_client_config->password = password_span;
-  }
-  else
+  // Bytes still holding the paint were never written.
+  while (scratch_high_water_mark > 0
+         && scratch[scratch_high_water_mark - 1] == DATA_BUFFER_SCRATCH_PAINT_BYTE)
   {
-    mqtt_client_config->password = AZ_SPAN_EMPTY;
+    scratch_high_water_mark--;
   }
 
-  client_id_span = split_az_span(data_buffer_span, MQTT_CLIENT_ID_BUFFER_SIZE, &data_buffer_span);
-  EXIT_IF_TRUE(
-      az_span_is_content_equal(client_id_span, AZ_SPAN_EMPTY),
-      RESULT_ERROR,
-      "Failed reserving buffer for client_id_span.");
+  statistics->scratch.size = az_span_size(azure_iot->scratch_buffer);
+  statistics->scratch.high_water_mark = scratch_high_water_mark;
+  statistics->scratch.overflow_count = azure_iot->scratch_overflow_count;
+}
 
-  azrc = az_iot_provisioning_client_get_client_id(
-      &azure_iot->dps_client,
+void azure_iot_get_telemetry_delivery_statistics(
+    azure_iot_t* azure_iot,
+    telemetry_delivery_statistics_t* statistics)
+{
+  _az_PRECONDITION_NOT_NULL(azure_iot);
+  _az_PRECONDITION_NOT_NULL(statistics);
+
+  *statistics = azure_iot->telemetry_delivery_statistics;
+}
+
+void azure_iot_get_offline_telemetry_statistics(
+    azure_iot_t* azure_iot,
+    offline_telemetry_statistics_t* statistics)
+{
+  _az_PRECONDITION_NOT_NULL(azure_iot);
+  _az_PRECONDITION_NOT_NULL(statistics);
+
+  *statistics = azure_iot->offline_telemetry_statistics;
+  statistics->buffered_count = azure_iot->offline_telemetry.count;
+}
+
+void azure_iot_get_reported_properties_statistics(
+    azure_iot_t* azure_iot,
+    reported_properties_statistics_t* statistics)
+{
+  _az_PRECONDITION_NOT_NULL(azure_iot);
+  _az_PRECONDITION_NOT_NULL(statistics);
+
+  *statistics = azure_iot->reported_properties_statistics;
+}
+
+void azure_iot_get_tls_session_statistics(
+    azure_iot_t* azure_iot,
+    tls_session_statistics_t* statistics)
+{
+  _az_PRECONDITION_NOT_NULL(azure_iot);
+  _az_PRECONDITION_NOT_NULL(statistics);
+
+  *statistics = azure_iot->tls_session_statistics;
+}
+
+void azure_iot_get_connection_phase_statistics(
+    azure_iot_t* azure_iot,
+    connection_phase_statistics_t* statistics)
+{
+  _az_PRECONDITION_NOT_NULL(azure_iot);
+  _az_PRECONDITION_NOT_NULL(statistics);
+
+  *statistics = azure_iot->connection_phase_statistics;
+}
+
+void azure_iot_get_sas_token_refresh_statistics(
+    azure_iot_t* azure_iot,
+    sas_token_refresh_statistics_t* statistics)
+{
+  _az_PRECONDITION_NOT_NULL(azure_iot);
+  _az_PRECONDITION_NOT_NULL(statistics);
+
+  *statistics = azure_iot->sas_token_refresh_statistics;
+}
+
+void azure_iot_get_rate_limit_statistics(
+    azure_iot_t* azure_iot,
+    rate_limit_statistics_t* statistics)
+{
+  _az_PRECONDITION_NOT_NULL(azure_iot);
+  _az_PRECONDITION_NOT_NULL(statistics);
+
+  *statistics = azure_iot->rate_limit_statistics;
+
+  for (int i = 0; i < OUTBOUND_MESSAGE_CLASS_COUNT; i++)
+  {
+    statistics->backoff_level[i] = azure_iot->rate_limiters[i].backoff_level;
+  }
+}
+
+void azure_iot_get_outbound_queue_statistics(
+    azure_iot_t* azure_iot,
+    outbound_queue_statistics_t* statistics)
+{
+  _az_PRECONDITION_NOT_NULL(azure_iot);
+  _az_PRECONDITION_NOT_NULL(statistics);
+
+  *statistics = azure_iot->outbound_queue_statistics;
+}
+
+/* --- Implementation of internal functions --- */
+
+/*
+ * @brief           Gets the number of seconds since UNIX epoch until now, from the wall clock.
+ * @remark          Only for what must be in wall-clock time (the expiration within SAS tokens).
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ *
+ * @return uint32_t Number of seconds, or zero if the time is not known.
+ */
+static uint32_t get_current_unix_time(azure_iot_t* azure_iot)
+{
+  if (azure_iot->config->clock_interface.get_unix_time != NULL)
+  {
+    return azure_iot->config->clock_interface.get_unix_time();
+  }
+
+  time_t now = time(NULL);
+  return (now == INDEFINITE_TIME ? 0 : (uint32_t)(now));
+}
+
+/*
+ * @brief           Gets the number of milliseconds elapsed on the monotonic clock.
+ * @remark          Used for all deadlines and intervals, as it does not move when the wall clock
+ * is set.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ *
+ * @return uint64_t Number of milliseconds since an arbitrary point in the past.
+ */
+static uint64_t get_current_time_in_ms(azure_iot_t* azure_iot)
+{
+  struct timespec now;
+
+  if (azure_iot->config->clock_interface.get_monotonic_time_in_ms != NULL)
+  {
+    return azure_iot->config->clock_interface.get_monotonic_time_in_ms();
+  }
+
+  if (clock_gettime(CLOCK_MONOTONIC, &now) != 0)
+  {
+    return 0;
+  }
+
+  return (uint64_t)now.tv_sec * NUMBER_OF_MILLISECONDS_IN_A_SECOND
+      + (uint64_t)now.tv_nsec / NUMBER_OF_NANOSECONDS_IN_A_MILLISECOND;
+}
+
+/*
+ * @brief           Gets when a SAS token generated now expires, on the monotonic clock.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ *
+ * @return uint64_t Expiration time, as returned by `get_current_time_in_ms`.
+ */
+static uint64_t get_sas_token_expiration_time_in_ms(azure_iot_t* azure_iot)
+{
+  return get_current_time_in_ms(azure_iot)
+      + (uint64_t)azure_iot->config->sas_token_lifetime_in_minutes * NUMBER_OF_SECONDS_IN_A_MINUTE
+      * NUMBER_OF_MILLISECONDS_IN_A_SECOND;
+}
+
+/*
+ * @brief           Initializes the MQTT client for connecting to the Azure IoT Hub.
+ * @remark          On failure the client is moved to the error state.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ *
+ * @return int      0 on success, non-zero if any failure occurs.
+ */
+static int connect_to_iot_hub(azure_iot_t* azure_iot)
+{
+  mqtt_client_config_t mqtt_client_config;
+
+  if (get_mqtt_client_config_for_iot_hub(azure_iot, &mqtt_client_config) != 0)
+  {
+    set_state(azure_iot, azure_iot_state_error);
+    LogError("Failed getting MQTT client configuration for connecting to IoT Hub.");
+    return RESULT_ERROR;
+  }
+
+  set_state(azure_iot, azure_iot_state_connecting_to_hub);
+  azure_iot->is_connecting_to_dps = false;
+  azure_iot->is_iot_hub_connection_rejected = false;
+
+  if (azure_iot->config->mqtt_client_interface.mqtt_client_init(
+          &mqtt_client_config, &azure_iot->mqtt_client_handle)
+      != 0)
+  {
+    set_state(azure_iot, azure_iot_state_error);
+    LogError("Failed initializing MQTT client for IoT Hub connection.");
+    return RESULT_ERROR;
+  }
+
+  return RESULT_OK;
+}
+
+/*
+ * @brief           Sets the default values of any members of a reconnect policy left as zero.
+ * @param[in]       policy                     The reconnect policy to be updated.
+ * @param[in]       min_delay_in_ms            Default value for `min_delay_in_ms`.
+ * @param[in]       max_delay_in_ms            Default value for `max_delay_in_ms`.
+ * @param[in]       max_attempts_per_window    Default value for `max_attempts_per_window`.
+ */
+static void set_reconnect_policy_defaults(
+    reconnect_policy_t* policy,
+    uint32_t min_delay_in_ms,
+    uint32_t max_delay_in_ms,
+    uint32_t max_attempts_per_window)
+{
+  if (policy->min_delay_in_ms == 0)
+  {
+    policy->min_delay_in_ms = min_delay_in_ms;
+  }
+
+  if (policy->max_delay_in_ms == 0)
+  {
+    policy->max_delay_in_ms = max_delay_in_ms;
+  }
+
+  if (policy->max_attempts_per_window == 0)
+  {
+    policy->max_attempts_per_window = max_attempts_per_window;
+  }
+
+  if (policy->window_in_secs == 0)
+  {
+    policy->window_in_secs = DEFAULT_RECONNECT_WINDOW_IN_SECS;
+  }
+}
+
+/*
+ * @brief           Disconnects the MQTT client and schedules a new connection attempt.
+ * @remark          The delay follows the reconnect policy of the service the client was working
+ * with when the failure happened (Azure Device Provisioning or Azure IoT Hub). It is an exponential
+ * backoff with full jitter, capped by the maximum attempts allowed per window.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ */
+static void schedule_reconnect(azure_iot_t* azure_iot)
+{
+  reconnect_policy_t* policy;
+  reconnect_backoff_t* backoff;
+  uint64_t now = get_current_time_in_ms(azure_iot);
+  uint64_t window_in_ms;
+  uint64_t ceiling;
+  uint32_t delay;
+
+  if (azure_iot->mqtt_client_handle != NULL)
+  {
+    // Avoids the disconnection below to be taken as another failure.
+    set_state(azure_iot, azure_iot_state_initialized);
+
+    if (azure_iot->config->mqtt_client_interface.mqtt_client_deinit(azure_iot->mqtt_client_handle)
+        != 0)
+    {
+      LogError("Failed deinitializing MQTT client.");
+    }
+
+    azure_iot->mqtt_client_handle = NULL;
+  }
+
+  if (azure_iot->is_connecting_to_dps)
+  {
+    policy = &azure_iot->config->dps_reconnect_policy;
+    backoff = &azure_iot->dps_reconnect_backoff;
+    azure_iot->reconnect_statistics.dps_failures_count++;
+  }
+  else
+  {
+    policy = &azure_iot->config->iot_hub_reconnect_policy;
+    backoff = &azure_iot->iot_hub_reconnect_backoff;
+    azure_iot->reconnect_statistics.iot_hub_failures_count++;
+  }
+
+  if (azure_iot->disconnected_since_in_ms == 0)
+  {
+    azure_iot->disconnected_since_in_ms = now;
+  }
+
+  // Exponential backoff with full jitter.
+  ceiling = policy->min_delay_in_ms;
+
+  for (uint32_t i = 0; i < backoff->consecutive_failures_count && ceiling < policy->max_delay_in_ms;
+       i++)
+  {
+    ceiling *= 2;
+  }
+
+  if (ceiling > policy->max_delay_in_ms)
+  {
+    ceiling = policy->max_delay_in_ms;
+  }
+
+  delay = (uint32_t)((azure_iot->config->get_random_number != NULL
+                          ? azure_iot->config->get_random_number()
+                          : (uint32_t)rand())
+                     % (ceiling + 1));
+
+  // Cap on the number of attempts per window.
+  window_in_ms = (uint64_t)policy->window_in_secs * NUMBER_OF_MILLISECONDS_IN_A_SECOND;
+
+  if ((now - backoff->window_start_time_in_ms) >= window_in_ms)
+  {
+    backoff->window_start_time_in_ms = now;
+    backoff->window_attempts_count = 0;
+  }
+  else if (backoff->window_attempts_count >= policy->max_attempts_per_window)
+  {
+    azure_iot->reconnect_statistics.window_limit_reached_count++;
+    delay += (uint32_t)(backoff->window_start_time_in_ms + window_in_ms - now);
+    backoff->window_start_time_in_ms += window_in_ms;
+    backoff->window_attempts_count = 0;
+  }
+
+  backoff->window_attempts_count++;
+  backoff->consecutive_failures_count++;
+
+  azure_iot->reconnect_statistics.last_delay_in_ms = delay;
+  azure_iot->reconnect_time_in_ms = now + delay;
+  set_state(azure_iot, azure_iot_state_reconnect_scheduled);
+
+  LogInfo(
+      "Reconnecting to %s in %u ms (attempt %u).",
+      azure_iot->is_connecting_to_dps ? "DPS" : "IoT Hub",
+      delay,
+      backoff->consecutive_failures_count);
+}
+
+/*
+ * @brief           Subscribes to all the IoT Plug and Play topics at once.
+ * @remark          The SUBSCRIBEs are sent back-to-back, without waiting for the SUBACKs in
+ * between. The packet ids are kept so `azure_iot_mqtt_client_subscribe_completed` can track which
+ * subscriptions are still outstanding. The client is ready once the last SUBACK is received.
+ * On failure the client is moved to the error state.
+ * The SUBACKs are handled in the task of the MQTT client, possibly before `mqtt_client_subscribe`
+ * returns, so the packet ids and the index of the subscription in flight are shared atomically.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ *
+ * @return int      0 on success, non-zero if any failure occurs.
+ */
+static int subscribe_to_pnp_topics(azure_iot_t* azure_iot)
+{
+  static const az_span pnp_topics[PNP_SUBSCRIPTIONS_COUNT]
+      = { AZ_SPAN_LITERAL_FROM_STR(AZ_IOT_HUB_CLIENT_COMMANDS_SUBSCRIBE_TOPIC),
+          AZ_SPAN_LITERAL_FROM_STR(AZ_IOT_HUB_CLIENT_PROPERTIES_MESSAGE_SUBSCRIBE_TOPIC),
+          AZ_SPAN_LITERAL_FROM_STR(AZ_IOT_HUB_CLIENT_PROPERTIES_WRITABLE_UPDATES_SUBSCRIBE_TOPIC) };
+  int packet_id;
+  int expected_packet_id;
+
+  for (int i = 0; i < PNP_SUBSCRIPTIONS_COUNT; i++)
+  {
+    __atomic_store_n(&azure_iot->pnp_subscriptions_packet_ids[i], 0, __ATOMIC_SEQ_CST);
+    azure_iot->pnp_subscriptions_completed[i] = false;
+  }
+
+  __atomic_store_n(&azure_iot->pnp_subscription_in_flight_index, -1, __ATOMIC_SEQ_CST);
+  set_state(azure_iot, azure_iot_state_subscribing_to_pnp_topics);
+
+  for (int i = 0; i < PNP_SUBSCRIPTIONS_COUNT; i++)
+  {
+    __atomic_store_n(&azure_iot->pnp_subscription_in_flight_index, i, __ATOMIC_SEQ_CST);
+
+    packet_id = azure_iot->config->mqtt_client_interface.mqtt_client_subscribe(
+        azure_iot->mqtt_client_handle, pnp_topics[i], mqtt_qos_at_least_once);
+
+    if (packet_id < 0)
+    {
+      __atomic_store_n(&azure_iot->pnp_subscription_in_flight_index, -1, __ATOMIC_SEQ_CST);
+      set_state(azure_iot, azure_iot_state_error);
+      LogError(
+          "Failed subscribing to IoT Plug and Play topic (%.*s).",
+          az_span_size(pnp_topics[i]),
+          az_span_ptr(pnp_topics[i]));
+      return RESULT_ERROR;
+    }
+
+    // Unless already recorded by its SUBACK.
+    expected_packet_id = 0;
+    (void)__atomic_compare_exchange_n(
+        &azure_iot->pnp_subscriptions_packet_ids[i],
+        &expected_packet_id,
+        packet_id,
+        false,
+        __ATOMIC_SEQ_CST,
+        __ATOMIC_SEQ_CST);
+  }
+
+  __atomic_store_n(&azure_iot->pnp_subscription_in_flight_index, -1, __ATOMIC_SEQ_CST);
+
+  return RESULT_OK;
+}
+
+/*
+ * @brief           Checks if SUBACKs have been received for all the IoT Plug and Play topics.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ *
+ * @return bool     true if all subscriptions are completed, false otherwise.
+ */
+static bool are_pnp_subscriptions_completed(azure_iot_t* azure_iot)
+{
+  for (int i = 0; i < PNP_SUBSCRIPTIONS_COUNT; i++)
+  {
+    if (!azure_iot->pnp_subscriptions_completed[i])
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/*
+ * @brief           Tells which kind of Azure IoT Hub message a topic is for by its prefix.
+ * @remark          Much cheaper than the SDK parsers, which are then only called for the kind of
+ * message they can parse.
+ * @param[in]       topic              Topic of a message received from the Azure IoT Hub.
+ *
+ * @return iot_hub_topic_type_t  The kind of message, or iot_hub_topic_type_unknown.
+ */
+static iot_hub_topic_type_t classify_iot_hub_topic(az_span topic)
+{
+  static const az_span commands_prefix = AZ_SPAN_LITERAL_FROM_STR(IOT_HUB_COMMANDS_TOPIC_PREFIX);
+  static const az_span properties_response_prefix
+      = AZ_SPAN_LITERAL_FROM_STR(IOT_HUB_PROPERTIES_RESPONSE_TOPIC_PREFIX);
+  static const az_span properties_writable_update_prefix
+      = AZ_SPAN_LITERAL_FROM_STR(IOT_HUB_PROPERTIES_WRITABLE_UPDATE_TOPIC_PREFIX);
+
+  if (az_span_size(topic) > az_span_size(commands_prefix)
+      && az_span_is_content_equal(
+          az_span_slice(topic, 0, az_span_size(commands_prefix)), commands_prefix))
+  {
+    return iot_hub_topic_type_command;
+  }
+  else if (
+      (az_span_size(topic) > az_span_size(properties_response_prefix)
+       && az_span_is_content_equal(
+           az_span_slice(topic, 0, az_span_size(properties_response_prefix)),
+           properties_response_prefix))
+      || (az_span_size(topic) > az_span_size(properties_writable_update_prefix)
+          && az_span_is_content_equal(
+              az_span_slice(topic, 0, az_span_size(properties_writable_update_prefix)),
+              properties_writable_update_prefix)))
+  {
+    return iot_hub_topic_type_properties;
+  }
+  else
+  {
+    return iot_hub_topic_type_unknown;
+  }
+}
+
+/*
+ * @brief           Handles a response to a properties request or a writable properties update.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ * @param[in]       mqtt_message       The message received, with a properties topic.
+ *
+ * @return int      0 on success, non-zero if any failure occurs.
+ */
+static int handle_properties_message(azure_iot_t* azure_iot, mqtt_message_t* mqtt_message)
+{
+  int result;
+  az_iot_hub_client_properties_message property_message;
+  az_result azrc = az_iot_hub_client_properties_parse_received_topic(
+      &azure_iot->iot_hub_client, mqtt_message->topic, &property_message);
+
+  if (az_result_failed(azrc))
+  {
+    LogError(
+        "Could not parse properties message (%.*s): az_result return code 0x%08x.",
+        az_span_size(mqtt_message->topic),
+        az_span_ptr(mqtt_message->topic),
+        azrc);
+    return RESULT_ERROR;
+  }
+
+  if (property_message.message_type != AZ_IOT_HUB_CLIENT_PROPERTIES_MESSAGE_TYPE_WRITABLE_UPDATED
+      && property_message.status == AZ_IOT_STATUS_THROTTLED)
+  {
+    throttle_rate_limit(azure_iot, outbound_message_class_properties);
+  }
+
+  switch (property_message.message_type)
+  {
+    // A response from a property GET publish message with the property document as a payload.
+    case AZ_IOT_HUB_CLIENT_PROPERTIES_MESSAGE_TYPE_GET_RESPONSE:
+      if (property_message.status != AZ_IOT_STATUS_OK)
+      {
+        LogError("Failed getting the properties document (%d).", property_message.status);
+        schedule_properties_document_retry(azure_iot, property_message.status);
+        result = RESULT_ERROR;
+      }
+      else
+      {
+        azure_iot->properties_document_failures_count = 0;
+
+        // The writable properties within the document are handled as an update.
+        if (azure_iot->config->on_properties_received != NULL)
+        {
+          azure_iot->config->on_properties_received(
+              mqtt_message->payload, property_message.message_type);
+        }
+        result = RESULT_OK;
+      }
+      break;
+
+    // An update to the desired properties with the properties as a payload.
+    case AZ_IOT_HUB_CLIENT_PROPERTIES_MESSAGE_TYPE_WRITABLE_UPDATED:
+      if (azure_iot->config->on_properties_received != NULL)
+      {
+        azure_iot->config->on_properties_received(
+            mqtt_message->payload, property_message.message_type);
+      }
+      result = RESULT_OK;
+      break;
+
+    // When the device publishes a property update, this message type arrives when
+    // server acknowledges this.
+    case AZ_IOT_HUB_CLIENT_PROPERTIES_MESSAGE_TYPE_ACKNOWLEDGEMENT:
+      result = RESULT_OK;
+
+      if (azure_iot->config->on_properties_update_completed != NULL)
+      {
+        uint32_t request_id = 0;
+
+        if (az_result_failed(az_span_atou32(property_message.request_id, &request_id)))
+        {
+          LogError(
+              "Failed parsing properties update request id (%.*s).",
+              az_span_size(property_message.request_id),
+              az_span_ptr(property_message.request_id));
+          result = RESULT_ERROR;
+        }
+        else
+        {
+          azure_iot->config->on_properties_update_completed(
+              request_id, property_message.status);
+        }
+      }
+      break;
+
+    // An error has occurred
+    case AZ_IOT_HUB_CLIENT_PROPERTIES_MESSAGE_TYPE_ERROR:
+      LogError("Message Type: Request Error");
+
+      // The SDK reports error statuses (4xx, 5xx) of the properties document request here too.
+      if (az_span_is_content_equal(
+              property_message.request_id, AZ_SPAN_FROM_STR(PROPERTIES_DOCUMENT_GET_REQUEST_ID)))
+      {
+        LogError("Failed getting the properties document (%d).", property_message.status);
+        schedule_properties_document_retry(azure_iot, property_message.status);
+      }
+
+      result = RESULT_ERROR;
+      break;
+  }
+
+  return result;
+}
+
+/*
+ * @brief           Requests the properties document again later, after it was refused.
+ * @remark          The delay doubles with each consecutive failure, from
+ * PROPERTIES_DOCUMENT_RETRY_MIN_DELAY_IN_MS up to PROPERTIES_DOCUMENT_RETRY_MAX_DELAY_IN_MS. A
+ * throttled request also waits for the properties rate limit, halved by `throttle_rate_limit`.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ * @param[in]       status             Status of the response to the request.
+ *
+ * @return          Nothing.
+ */
+static void schedule_properties_document_retry(azure_iot_t* azure_iot, az_iot_status status)
+{
+  uint32_t delay_in_ms = PROPERTIES_DOCUMENT_RETRY_MIN_DELAY_IN_MS;
+
+  for (uint32_t i = 0; i < azure_iot->properties_document_failures_count
+       && delay_in_ms < PROPERTIES_DOCUMENT_RETRY_MAX_DELAY_IN_MS;
+       i++)
+  {
+    delay_in_ms *= 2;
+  }
+
+  if (delay_in_ms > PROPERTIES_DOCUMENT_RETRY_MAX_DELAY_IN_MS)
+  {
+    delay_in_ms = PROPERTIES_DOCUMENT_RETRY_MAX_DELAY_IN_MS;
+  }
+
+  azure_iot->properties_document_failures_count++;
+  azure_iot->properties_document_retry_time_in_ms = get_current_time_in_ms(azure_iot) + delay_in_ms;
+  azure_iot->is_properties_document_requested = false;
+
+  LogInfo(
+      "Properties document requested again in %u ms (status=%d).", delay_in_ms, (int)status);
+}
+
+/*
+ * @brief           Handles a command request, passing it to `on_command_request_received`.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ * @param[in]       mqtt_message       The message received, with a commands topic.
+ *
+ * @return int      0 on success, non-zero if any failure occurs.
+ */
+static int handle_command_request(azure_iot_t* azure_iot, mqtt_message_t* mqtt_message)
+{
+  az_iot_hub_client_command_request az_sdk_command_request;
+  az_result azrc = az_iot_hub_client_commands_parse_received_topic(
+      &azure_iot->iot_hub_client, mqtt_message->topic, &az_sdk_command_request);
+
+  if (az_result_failed(azrc))
+  {
+    LogError(
+        "Could not parse command request (%.*s): az_result return code 0x%08x.",
+        az_span_size(mqtt_message->topic),
+        az_span_ptr(mqtt_message->topic),
+        azrc);
+    return RESULT_ERROR;
+  }
+
+  if (azure_iot->config->on_command_request_received != NULL)
+  {
+    command_request_t command_request;
+    command_request.request_id = az_sdk_command_request.request_id;
+    command_request.component_name = az_sdk_command_request.component_name;
+    command_request.command_name = az_sdk_command_request.command_name;
+    command_request.payload = mqtt_message->payload;
+
+    azure_iot->config->on_command_request_received(command_request);
+  }
+
+  return RESULT_OK;
+}
+
+/*
+ * @brief           Generates the SAS token for the next connection with the Azure IoT Hub.
+ * @remark          The token is kept in the connection region of the data buffer, being released
+ * by `get_mqtt_client_config_for_iot_hub` when it is used.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ *
+ * @return int      0 on success, non-zero if any failure occurs.
+ */
+static int prepare_next_sas_token(azure_iot_t* azure_iot)
+{
+  az_span data_buffer_span = azure_iot->scratch_buffer;
+  az_span sas_token;
+  size_t sas_token_length;
+
+  if (az_span_is_content_equal(azure_iot->config->device_key, AZ_SPAN_EMPTY))
+  {
+    return RESULT_OK; // No SAS token with x509 certificate authentication.
+  }
+
+  sas_token = split_scratch_buffer(
+      data_buffer_span,
+      MQTT_PASSWORD_BUFFER_SIZE,
+      &data_buffer_span,
+      &azure_iot->scratch_overflow_count);
+  EXIT_IF_TRUE(
+      az_span_is_content_equal(sas_token, AZ_SPAN_EMPTY),
+      RESULT_ERROR,
+      "Failed reserving buffer for next sas token.");
+
+  sas_token_length = generate_sas_token_for_iot_hub(
+      &azure_iot->iot_hub_client,
+      get_decoded_device_key(azure_iot),
+      get_current_unix_time(azure_iot),
+      azure_iot->config->sas_token_lifetime_in_minutes,
+      data_buffer_span,
+      &azure_iot->scratch_overflow_count,
+      azure_iot->config->data_manipulation_functions,
+      sas_token);
+  EXIT_IF_TRUE(sas_token_length == 0, RESULT_ERROR, "Failed generating next sas token.");
+  azure_iot->next_sas_token_expiration_time_in_ms = get_sas_token_expiration_time_in_ms(azure_iot);
+
+  // Keeping the null-terminator, required by the MQTT client.
+  azure_iot->next_sas_token = copy_into_data_buffer_region(
+      &azure_iot->connection_region, az_span_slice(sas_token, 0, sas_token_length + 1));
+  EXIT_IF_TRUE(
+      az_span_is_content_equal(azure_iot->next_sas_token, AZ_SPAN_EMPTY),
+      RESULT_ERROR,
+      "Failed reserving memory for next sas token.");
+
+  LogInfo("Next SAS token generated ahead of time.");
+
+  return RESULT_OK;
+}
+
+/*
+ * @brief           Publishes an MQTT message through the MQTT client of the user application.
+ * @remark          While a SAS token refresh is in progress the message is held instead, to be
+ * published once the Azure IoT client is ready again.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ * @param[in]       mqtt_message       The message to be published.
+ *
+ * @return int      The packet ID on success, or NEGATIVE if any failure occurs.
+ */
+static int publish_mqtt_message(azure_iot_t* azure_iot, mqtt_message_t* mqtt_message)
+{
+  if (azure_iot->is_refreshing_sas)
+  {
+    return hold_mqtt_message(azure_iot, mqtt_message);
+  }
+
+  return azure_iot->config->mqtt_client_interface.mqtt_client_publish(
+      azure_iot->mqtt_client_handle, mqtt_message);
+}
+
+/*
+ * @brief           Publishes an MQTT message given in fragments through the MQTT client of the user
+ * application.
+ * @remark          Uses `mqtt_client_publish_fragments` when the MQTT client provides it, so the
+ * fragments are only copied once, into the transmit buffer of the MQTT client. Otherwise, or if the
+ * message must be held during a SAS token refresh, the fragments are joined first.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ * @param[in]       mqtt_message       The message to be published.
+ *
+ * @return int      The packet ID on success, or NEGATIVE if any failure occurs.
+ */
+static int publish_mqtt_message_fragments(
+    azure_iot_t* azure_iot,
+    mqtt_message_fragments_t* mqtt_message)
+{
+  mqtt_message_t joined_message;
+
+  if (!azure_iot->is_refreshing_sas
+      && azure_iot->config->mqtt_client_interface.mqtt_client_publish_fragments != NULL)
+  {
+    return azure_iot->config->mqtt_client_interface.mqtt_client_publish_fragments(
+        azure_iot->mqtt_client_handle, mqtt_message);
+  }
+
+  if (join_mqtt_message_fragments(azure_iot, mqtt_message, &joined_message) != RESULT_OK)
+  {
+    return -1;
+  }
+
+  return publish_mqtt_message(azure_iot, &joined_message);
+}
+
+/*
+ * @brief           Joins the fragments of an MQTT message into the scratch buffer.
+ * @remark          The topic gets a null-terminator, as required by the MQTT client. A payload made
+ * of a single fragment is already contiguous, so it is used as is.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ * @param[in]       fragments          The message to be joined.
+ * @param[out]      mqtt_message       The joined message, valid until the scratch buffer is reused.
+ *
+ * @return int      0 on success, non-zero if the scratch buffer is too small.
+ */
+static int join_mqtt_message_fragments(
+    azure_iot_t* azure_iot,
+    mqtt_message_fragments_t* fragments,
+    mqtt_message_t* mqtt_message)
+{
+  az_span buffer = azure_iot->scratch_buffer;
+  az_span remainder = buffer;
+  int32_t size = 1; // Null-terminator of the topic.
+  int i;
+
+  for (i = 0; i < fragments->topic_count; i++)
+  {
+    size += az_span_size(fragments->topic[i]);
+  }
+
+  if (fragments->payload_count > 1)
+  {
+    for (i = 0; i < fragments->payload_count; i++)
+    {
+      size += az_span_size(fragments->payload[i]);
+    }
+  }
+
+  if (size > az_span_size(buffer))
+  {
+    azure_iot->scratch_overflow_count++;
+    LogError("No space for joining the MQTT message.");
+    return RESULT_ERROR;
+  }
+
+  for (i = 0; i < fragments->topic_count; i++)
+  {
+    remainder = az_span_copy(remainder, fragments->topic[i]);
+  }
+
+  remainder = az_span_copy_u8(remainder, null_terminator);
+  mqtt_message->topic = az_span_slice(buffer, 0, az_span_size(buffer) - az_span_size(remainder));
+
+  if (fragments->payload_count == 0)
+  {
+    mqtt_message->payload = AZ_SPAN_EMPTY;
+  }
+  else if (fragments->payload_count == 1)
+  {
+    mqtt_message->payload = fragments->payload[0];
+  }
+  else
+  {
+    buffer = remainder;
+
+    for (i = 0; i < fragments->payload_count; i++)
+    {
+      remainder = az_span_copy(remainder, fragments->payload[i]);
+    }
+
+    mqtt_message->payload
+        = az_span_slice(buffer, 0, az_span_size(buffer) - az_span_size(remainder));
+  }
+
+  mqtt_message->qos = fragments->qos;
+
+  return RESULT_OK;
+}
+
+/*
+ * @brief           Copies an MQTT message into the buffer for messages held during SAS refresh.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ * @param[in]       mqtt_message       The message to be held.
+ *
+ * @return int      0 on success, or NEGATIVE if there is no space left for holding the message.
+ */
+static int hold_mqtt_message(azure_iot_t* azure_iot, mqtt_message_t* mqtt_message)
+{
+  mqtt_message_t* held_message;
+  az_span buffer = azure_iot->held_messages_buffer;
+  int32_t topic_length = az_span_size(mqtt_message->topic);
+
+  // Topics might or not include the null-terminator, but it is always needed by the MQTT client.
+  if (topic_length > 0 && az_span_ptr(mqtt_message->topic)[topic_length - 1] == null_terminator)
+  {
+    topic_length--;
+  }
+
+  if (azure_iot->held_messages_count == SAS_REFRESH_HELD_MESSAGES_MAX_COUNT
+      || az_span_size(buffer) < (topic_length + 1 + az_span_size(mqtt_message->payload)))
+  {
+    azure_iot->sas_token_refresh_statistics.dropped_messages_count++;
+    LogError("No space for holding message during SAS token refresh.");
+    return -1;
+  }
+
+  held_message = &azure_iot->held_messages[azure_iot->held_messages_count];
+  held_message->topic = split_az_span(buffer, topic_length + 1, &buffer);
+  az_span_copy_u8(
+      az_span_copy(held_message->topic, az_span_slice(mqtt_message->topic, 0, topic_length)),
+      null_terminator);
+  held_message->payload = az_span_size(mqtt_message->payload) == 0
+      ? AZ_SPAN_EMPTY
+      : slice_and_copy_az_span(buffer, mqtt_message->payload, &buffer);
+  held_message->qos = mqtt_message->qos;
+
+  azure_iot->held_messages_buffer = buffer;
+  azure_iot->held_messages_count++;
+  azure_iot->sas_token_refresh_statistics.held_messages_count++;
+
+  return 0;
+}
+
+/*
+ * @brief           Publishes, in order, the messages held during the SAS token refresh.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ *
+ * @return int      0 on success, non-zero if any failure occurs.
+ */
+static int publish_held_messages(azure_iot_t* azure_iot)
+{
+  int result = RESULT_OK;
+
+  for (uint8_t i = 0; i < azure_iot->held_messages_count; i++)
+  {
+    if (azure_iot->config->mqtt_client_interface.mqtt_client_publish(
+            azure_iot->mqtt_client_handle, &azure_iot->held_messages[i])
+        < 0)
+    {
+      azure_iot->sas_token_refresh_statistics.dropped_messages_count++;
+      result = RESULT_ERROR;
+    }
+  }
+
+  azure_iot->held_messages_count = 0;
+  azure_iot->held_messages_buffer = azure_iot->config->sas_refresh_held_messages_buffer;
+
+  return result;
+}
+
+/*
+ * @brief           Copies data into the offline telemetry ring buffer, wrapping around its end.
+ * @param[in]       offline_telemetry  A pointer to the offline telemetry ring buffer.
+ * @param[in]       offset             Position (from the start of the ring buffer) where to copy
+ * to.
+ * @param[in]       data               The data to be copied.
+ *
+ * @return          Nothing.
+ */
+static void copy_into_offline_telemetry_buffer(
+    offline_telemetry_buffer_t* offline_telemetry,
+    int32_t offset,
+    az_span data)
+{
+  int32_t capacity = az_span_size(offline_telemetry->buffer);
+  int32_t length = az_span_size(data);
+  int32_t first_part_length;
+
+  offset %= capacity;
+  first_part_length = (length < (capacity - offset)) ? length : (capacity - offset);
+
+  (void)memcpy(
+      az_span_ptr(offline_telemetry->buffer) + offset, az_span_ptr(data), first_part_length);
+  (void)memcpy(
+      az_span_ptr(offline_telemetry->buffer),
+      az_span_ptr(data) + first_part_length,
+      length - first_part_length);
+}
+
+/*
+ * @brief           Copies data out of the offline telemetry ring buffer, wrapping around its end.
+ * @param[in]       offline_telemetry  A pointer to the offline telemetry ring buffer.
+ * @param[in]       offset             Position (from the start of the ring buffer) where to copy
+ * from.
+ * @param[in]       destination        Where to copy the data to. Its size is the size copied.
+ *
+ * @return          Nothing.
+ */
+static void copy_from_offline_telemetry_buffer(
+    offline_telemetry_buffer_t* offline_telemetry,
+    int32_t offset,
+    az_span destination)
+{
+  int32_t capacity = az_span_size(offline_telemetry->buffer);
+  int32_t length = az_span_size(destination);
+  int32_t first_part_length;
+
+  offset %= capacity;
+  first_part_length = (length < (capacity - offset)) ? length : (capacity - offset);
+
+  (void)memcpy(
+      az_span_ptr(destination), az_span_ptr(offline_telemetry->buffer) + offset, first_part_length);
+  (void)memcpy(
+      az_span_ptr(destination) + first_part_length,
+      az_span_ptr(offline_telemetry->buffer),
+      length - first_part_length);
+}
+
+/*
+ * @brief           Reads the oldest record in the offline telemetry ring buffer, without removing
+ * it.
+ * @param[in]       offline_telemetry  A pointer to a non-empty offline telemetry ring buffer.
+ * @param[in]       destination        Where to copy the record to.
+ * @param[out]      record_length      The length of the record.
+ * @param[out]      overflow_count     Incremented if `destination` is too small for the record.
+ *
+ * @return int      0 on success, or non-zero if `destination` is too small for the record.
+ */
+static int read_offline_telemetry_record(
+    offline_telemetry_buffer_t* offline_telemetry,
+    az_span destination,
+    int32_t* record_length,
+    uint32_t* overflow_count)
+{
+  uint8_t header[OFFLINE_TELEMETRY_RECORD_HEADER_SIZE];
+
+  copy_from_offline_telemetry_buffer(
+      offline_telemetry, offline_telemetry->head, az_span_create(header, sizeof(header)));
+  *record_length = (header[0] << 8) | header[1];
+
+  if (az_span_size(destination) < *record_length)
+  {
+    (*overflow_count)++;
+    LogError("Buffer too small for stored telemetry record (%d).", *record_length);
+    return RESULT_ERROR;
+  }
+
+  copy_from_offline_telemetry_buffer(
+      offline_telemetry,
+      offline_telemetry->head + OFFLINE_TELEMETRY_RECORD_HEADER_SIZE,
+      az_span_slice(destination, 0, *record_length));
+
+  return RESULT_OK;
+}
+
+/*
+ * @brief           Removes the oldest record from the offline telemetry ring buffer.
+ * @param[in]       offline_telemetry  A pointer to a non-empty offline telemetry ring buffer.
+ *
+ * @return          Nothing.
+ */
+static void remove_offline_telemetry_record(offline_telemetry_buffer_t* offline_telemetry)
+{
+  uint8_t header[OFFLINE_TELEMETRY_RECORD_HEADER_SIZE];
+  int32_t record_size;
+
+  copy_from_offline_telemetry_buffer(
+      offline_telemetry, offline_telemetry->head, az_span_create(header, sizeof(header)));
+  record_size = OFFLINE_TELEMETRY_RECORD_HEADER_SIZE + ((header[0] << 8) | header[1]);
+
+  offline_telemetry->head
+      = (offline_telemetry->head + record_size) % az_span_size(offline_telemetry->buffer);
+  offline_telemetry->used -= record_size;
+  offline_telemetry->count--;
+}
+
+/*
+ * @brief           Makes room in the offline telemetry ring buffer by moving its oldest record
+ * into the offline telemetry storage or, if that is not possible, dropping it.
+ * @remark          The scratch region of the data buffer is used for the record.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ *
+ * @return          Nothing.
+ */
+static void evict_offline_telemetry_record(azure_iot_t* azure_iot)
+{
+  offline_telemetry_buffer_t* offline_telemetry = &azure_iot->offline_telemetry;
+  int32_t record_length;
+
+  if (azure_iot->config->offline_telemetry_storage.push != NULL
+      && read_offline_telemetry_record(
+             offline_telemetry,
+             azure_iot->scratch_buffer,
+             &record_length,
+             &azure_iot->scratch_overflow_count)
+          == RESULT_OK
+      && azure_iot->config->offline_telemetry_storage.push(
+             az_span_slice(azure_iot->scratch_buffer, 0, record_length))
+          == 0)
+  {
+    azure_iot->has_spilled_telemetry = true;
+    azure_iot->offline_telemetry_statistics.spilled_count++;
+  }
+  else
+  {
+    azure_iot->offline_telemetry_statistics.dropped_count++;
+  }
+
+  remove_offline_telemetry_record(offline_telemetry);
+}
+
+/*
+ * @brief           Stores a telemetry payload to be published once the client is connected.
+ * @remark          If the offline telemetry buffer is full, its oldest records are moved into the
+ * offline telemetry storage or dropped to make room.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ * @param[in]       payload            The telemetry payload.
+ *
+ * @return int      0 on success, or non-zero if the payload could not be stored.
+ */
+static int store_offline_telemetry(azure_iot_t* azure_iot, az_span payload)
+{
+  offline_telemetry_buffer_t* offline_telemetry = &azure_iot->offline_telemetry;
+  int32_t capacity = az_span_size(offline_telemetry->buffer);
+  int32_t payload_length = az_span_size(payload);
+  int32_t record_size = OFFLINE_TELEMETRY_RECORD_HEADER_SIZE + payload_length;
+  uint8_t header[OFFLINE_TELEMETRY_RECORD_HEADER_SIZE];
+
+  if (payload_length > OFFLINE_TELEMETRY_RECORD_MAX_SIZE)
+  {
+    azure_iot->offline_telemetry_statistics.dropped_count++;
+    LogError("Telemetry payload too large to be stored (%d).", payload_length);
+    return RESULT_ERROR;
+  }
+
+  while (offline_telemetry->count > 0 && (capacity - offline_telemetry->used) < record_size)
+  {
+    evict_offline_telemetry_record(azure_iot);
+  }
+
+  if (record_size > capacity)
+  {
+    // Only the storage can take it, and the ring buffer is empty now so the order is kept.
+    if (azure_iot->config->offline_telemetry_storage.push == NULL
+        || azure_iot->config->offline_telemetry_storage.push(payload) != 0)
+    {
+      azure_iot->offline_telemetry_statistics.dropped_count++;
+      LogError("No space for storing telemetry payload (%d).", payload_length);
+      return RESULT_ERROR;
+    }
+
+    azure_iot->has_spilled_telemetry = true;
+    azure_iot->offline_telemetry_statistics.spilled_count++;
+  }
+  else
+  {
+    int32_t tail = offline_telemetry->head + offline_telemetry->used;
+
+    header[0] = (uint8_t)(payload_length >> 8);
+    header[1] = (uint8_t)payload_length;
+
+    copy_into_offline_telemetry_buffer(
+        offline_telemetry, tail, az_span_create(header, sizeof(header)));
+    copy_into_offline_telemetry_buffer(
+        offline_telemetry, tail + OFFLINE_TELEMETRY_RECORD_HEADER_SIZE, payload);
+
+    offline_telemetry->used += record_size;
+    offline_telemetry->count++;
+  }
+
+  azure_iot->offline_telemetry_statistics.stored_count++;
+
+  return RESULT_OK;
+}
+
+/*
+ * @brief           Tells if there is stored telemetry waiting to be published.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ *
+ * @return bool     True if there is stored telemetry, false otherwise.
+ */
+static bool is_offline_telemetry_pending(azure_iot_t* azure_iot)
+{
+  return azure_iot->offline_telemetry.count > 0 || azure_iot->has_spilled_telemetry;
+}
+
+/*
+ * @brief           Publishes the oldest stored telemetry record.
+ * @remark          Records in the offline telemetry storage are older than the ones in the
+ * offline telemetry ring buffer, so they are published first. A record is only removed once
+ * published.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ *
+ * @return int      0 on success, or non-zero if any failure occurs.
+ */
+static int publish_offline_telemetry(azure_iot_t* azure_iot)
+{
+  int32_t record_length;
+  bool is_from_storage = false;
+  az_span data_buffer = azure_iot->scratch_buffer;
+  az_span payload;
+
+  if (azure_iot->has_spilled_telemetry)
+  {
+    if (azure_iot->config->offline_telemetry_storage.peek(data_buffer, &record_length) == 0)
+    {
+      is_from_storage = true;
+    }
+    else
+    {
+      azure_iot->has_spilled_telemetry = false;
+    }
+  }
+
+  if (!is_from_storage)
+  {
+    if (azure_iot->offline_telemetry.count == 0)
+    {
+      return RESULT_OK;
+    }
+
+    if (read_offline_telemetry_record(
+            &azure_iot->offline_telemetry,
+            data_buffer,
+            &record_length,
+            &azure_iot->scratch_overflow_count)
+        != RESULT_OK)
+    {
+      // Cannot ever be published with this data buffer.
+      remove_offline_telemetry_record(&azure_iot->offline_telemetry);
+      azure_iot->offline_telemetry_statistics.dropped_count++;
+      return RESULT_ERROR;
+    }
+  }
+
+  payload = az_span_slice(data_buffer, 0, record_length);
+
+  EXIT_IF_TRUE(
+      publish_telemetry(azure_iot, payload) != RESULT_OK,
+      RESULT_ERROR,
+      "Failed publishing stored telemetry record.");
+
+  if (is_from_storage)
+  {
+    (void)azure_iot->config->offline_telemetry_storage.pop();
+  }
+  else
+  {
+    remove_offline_telemetry_record(&azure_iot->offline_telemetry);
+  }
+
+  azure_iot->offline_telemetry_statistics.replayed_count++;
+
+  return RESULT_OK;
+}
+
+/*
+ * @brief           Moves the client to a new state, accounting the time spent in the previous one.
+ * @remark          Setting the current state again is not a transition, and is not accounted.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ * @param[in]       state              The new state.
+ *
+ * @return          Nothing.
+ */
+static void set_state(azure_iot_t* azure_iot, azure_iot_client_state_t state)
+{
+  connection_phase_statistics_t* statistics = &azure_iot->connection_phase_statistics;
+  uint64_t now = get_current_time_in_ms(azure_iot);
+  uint32_t time_in_state;
+
+  if (state == azure_iot->state)
+  {
+    return;
+  }
+
+  // Nothing to account for before the client is initialized.
+  if (azure_iot->state != azure_iot_state_not_initialized)
+  {
+    time_in_state = (uint32_t)(now - azure_iot->state_entry_time_in_ms);
+    statistics->total_time_in_ms[azure_iot->state] += time_in_state;
+    statistics->last_time_in_ms[azure_iot->state] = time_in_state;
+  }
+
+  if (state == azure_iot_state_started || state == azure_iot_state_refreshing_sas)
+  {
+    azure_iot->connection_start_time_in_ms = now;
+  }
+  else if (state == azure_iot_state_ready)
+  {
+    statistics->last_time_to_ready_in_ms = (uint32_t)(now - azure_iot->connection_start_time_in_ms);
+  }
+
+  statistics->entry_count[state]++;
+  azure_iot->state_entry_time_in_ms = now;
+  azure_iot->state = state;
+}
+
+/*
+ * @brief           Posts an event into the event queue of the user application, if any.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ * @param[in]       event              The event to be posted.
+ *
+ * @return          Nothing.
+ */
+static void post_event(azure_iot_t* azure_iot, azure_iot_event_t event)
+{
+  azure_iot->idle_statistics.events_count++;
+
+  if (azure_iot->config->event_interface.post != NULL)
+  {
+    azure_iot->config->event_interface.post(event);
+  }
+}
+
+/*
+ * @brief           Gets how long until `azure_iot_do_work` has something to do, if no event is
+ * posted in the meantime.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ *
+ * @return uint32_t Time in milliseconds, zero if there is work to do right away, or
+ * EVENT_WAIT_MAX_TIMEOUT_IN_MS if only an event can move the state machine forward.
+ */
+static uint32_t get_time_until_next_work_in_ms(azure_iot_t* azure_iot)
+{
+  uint64_t now_in_ms = get_current_time_in_ms(azure_iot);
+  uint64_t deadline_in_ms = now_in_ms + EVENT_WAIT_MAX_TIMEOUT_IN_MS;
+  uint64_t candidate_in_ms;
+
+  switch (azure_iot->state)
+  {
+    case azure_iot_state_started:
+    case azure_iot_state_connected_to_dps:
+    case azure_iot_state_subscribed_to_dps:
+    case azure_iot_state_provisioned:
+    case azure_iot_state_connected_to_hub:
+      return 0;
+    case azure_iot_state_error:
+      return azure_iot->config->automatic_reconnect ? 0 : EVENT_WAIT_MAX_TIMEOUT_IN_MS;
+    case azure_iot_state_provisioning_querying:
+      deadline_in_ms = azure_iot->dps_last_query_time_in_ms
+          + (uint64_t)azure_iot->dps_retry_after_seconds * NUMBER_OF_MILLISECONDS_IN_A_SECOND;
+      break;
+    case azure_iot_state_reconnect_scheduled:
+      deadline_in_ms = azure_iot->reconnect_time_in_ms;
+      break;
+    case azure_iot_state_ready:
+      if (azure_iot->disconnected_since_in_ms != 0 || azure_iot->is_refreshing_sas
+          || is_outbound_queue_drainable(azure_iot))
+      {
+        return 0;
+      }
+
+      candidate_in_ms = azure_iot->sas_token_expiration_time_in_ms
+          - SAS_TOKEN_REFRESH_THRESHOLD_IN_SECS * NUMBER_OF_MILLISECONDS_IN_A_SECOND;
+      deadline_in_ms = (candidate_in_ms < deadline_in_ms) ? candidate_in_ms : deadline_in_ms;
+
+      if (azure_iot->config->sas_token_refresh_mode == sas_token_refresh_mode_make_before_break
+          && az_span_size(azure_iot->next_sas_token) == 0)
+      {
+        candidate_in_ms = azure_iot->sas_token_expiration_time_in_ms
+            - SAS_TOKEN_PREPARE_THRESHOLD_IN_SECS * NUMBER_OF_MILLISECONDS_IN_A_SECOND;
+        deadline_in_ms = (candidate_in_ms < deadline_in_ms) ? candidate_in_ms : deadline_in_ms;
+      }
+
+      for (uint8_t i = 0; i < azure_iot->config->telemetry_in_flight_window_size; i++)
+      {
+        telemetry_in_flight_t* in_flight = &azure_iot->telemetry_in_flight[i];
+
+        if (in_flight->is_used)
+        {
+          candidate_in_ms = in_flight->sent_time_in_ms == 0
+              ? now_in_ms
+              : in_flight->sent_time_in_ms + azure_iot->config->telemetry_ack_timeout_in_ms;
+          deadline_in_ms = (candidate_in_ms < deadline_in_ms) ? candidate_in_ms : deadline_in_ms;
+        }
+      }
+
+      if (is_offline_telemetry_pending(azure_iot) && can_publish_telemetry(azure_iot))
+      {
+        candidate_in_ms = now_in_ms
+            + get_time_until_rate_limit_token_in_ms(azure_iot, outbound_message_class_telemetry);
+        candidate_in_ms = (candidate_in_ms > azure_iot->offline_telemetry_next_drain_time_in_ms)
+            ? candidate_in_ms
+            : azure_iot->offline_telemetry_next_drain_time_in_ms;
+        deadline_in_ms = (candidate_in_ms < deadline_in_ms) ? candidate_in_ms : deadline_in_ms;
+      }
+
+      // Queued command responses and properties waiting for their rate limits.
+      for (int i = 0; i < OUTBOUND_MESSAGE_CLASS_COUNT; i++)
+      {
+        if (i != outbound_message_class_telemetry && azure_iot->outbound_queues[i].count > 0)
+        {
+          candidate_in_ms = now_in_ms
+              + get_time_until_rate_limit_token_in_ms(azure_iot, (outbound_message_class_t)i);
+          deadline_in_ms = (candidate_in_ms < deadline_in_ms) ? candidate_in_ms : deadline_in_ms;
+        }
+      }
+
+      if (!azure_iot->is_properties_document_requested)
+      {
+        candidate_in_ms = now_in_ms
+            + get_time_until_rate_limit_token_in_ms(azure_iot, outbound_message_class_properties);
+        candidate_in_ms = (candidate_in_ms > azure_iot->properties_document_retry_time_in_ms)
+            ? candidate_in_ms
+            : azure_iot->properties_document_retry_time_in_ms;
+        deadline_in_ms = (candidate_in_ms < deadline_in_ms) ? candidate_in_ms : deadline_in_ms;
+      }
+
+      if (azure_iot->reported_properties_count > 0)
+      {
+        candidate_in_ms = azure_iot->reported_properties_flush_time_in_ms;
+        deadline_in_ms = (candidate_in_ms < deadline_in_ms) ? candidate_in_ms : deadline_in_ms;
+      }
+      break;
+    default:
+      // Waiting for the MQTT client.
+      break;
+  }
+
+  // All the deadlines above (SAS token expiration and DPS query time included) are on the
+  // monotonic clock of `get_current_time_in_ms`, in milliseconds.
+  return (deadline_in_ms <= now_in_ms) ? 0 : (uint32_t)(deadline_in_ms - now_in_ms);
+}
+
+/*
+ * @brief           Builds the topics that do not change during an Azure IoT Hub connection.
+ * @remark          These are the telemetry topic (with the content type and encoding properties, if
+ * set) and the reported properties topic up to (and not including) the request id. They are kept
+ * in buffers of their own within azure_iot_t, so the publish path does not regenerate them on
+ * every message.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ *
+ * @return int      0 on success, non-zero if any failure occurs.
+ */
+static int build_iot_hub_topics(azure_iot_t* azure_iot)
+{
+  az_result azr;
+  size_t topic_length;
+  az_span placeholder_request_id
+      = AZ_SPAN_FROM_STR(REPORTED_PROPERTIES_TOPIC_PLACEHOLDER_REQUEST_ID);
+  uint8_t properties_buffer[TELEMETRY_PROPERTIES_BUFFER_SIZE];
+  az_iot_message_properties properties;
+  bool has_properties = false;
+
+  azr = az_iot_message_properties_init(&properties, AZ_SPAN_FROM_BUFFER(properties_buffer), 0);
+  EXIT_IF_AZ_FAILED(azr, RESULT_ERROR, "Failed to initialize the telemetry properties");
+
+  if (az_span_size(azure_iot->config->telemetry_content_type) > 0)
+  {
+    azr = az_iot_message_properties_append(
+        &properties,
+        AZ_SPAN_FROM_STR(AZ_IOT_MESSAGE_PROPERTIES_CONTENT_TYPE),
+        azure_iot->config->telemetry_content_type);
+    EXIT_IF_AZ_FAILED(azr, RESULT_ERROR, "Failed to append the telemetry content type");
+    has_properties = true;
+  }
+
+  if (az_span_size(azure_iot->config->telemetry_content_encoding) > 0)
+  {
+    azr = az_iot_message_properties_append(
+        &properties,
+        AZ_SPAN_FROM_STR(AZ_IOT_MESSAGE_PROPERTIES_CONTENT_ENCODING),
+        azure_iot->config->telemetry_content_encoding);
+    EXIT_IF_AZ_FAILED(azr, RESULT_ERROR, "Failed to append the telemetry content encoding");
+    has_properties = true;
+  }
+
+  azr = az_iot_hub_client_telemetry_get_publish_topic(
+      &azure_iot->iot_hub_client,
+      has_properties ? &properties : NULL,
+      (char*)azure_iot->telemetry_topic_buffer,
+      sizeof(azure_iot->telemetry_topic_buffer),
+      &topic_length);
+  EXIT_IF_AZ_FAILED(azr, RESULT_ERROR, "Failed to get the telemetry topic");
+
+  // Keeping the null-terminator, required by the MQTT client.
+  azure_iot->telemetry_topic = az_span_create(azure_iot->telemetry_topic_buffer, topic_length + 1);
+
+  azr = az_iot_hub_client_properties_get_reported_publish_topic(
+      &azure_iot->iot_hub_client,
+      placeholder_request_id,
+      (char*)azure_iot->reported_properties_topic_prefix_buffer,
+      sizeof(azure_iot->reported_properties_topic_prefix_buffer),
+      &topic_length);
+  EXIT_IF_AZ_FAILED(azr, RESULT_ERROR, "Failed to get the reported properties publish topic");
+
+  // The request id is the last part of the topic.
+  azure_iot->reported_properties_topic_prefix = az_span_create(
+      azure_iot->reported_properties_topic_prefix_buffer,
+      (int32_t)topic_length - az_span_size(placeholder_request_id));
+
+  return RESULT_OK;
+}
+
+/*
+ * @brief           Requests the full properties document from Azure IoT Hub.
+ * @remark          The response is delivered to `on_properties_received` as a
+ * AZ_IOT_HUB_CLIENT_PROPERTIES_MESSAGE_TYPE_GET_RESPONSE, once per connection.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ *
+ * @return int      0 on success, non-zero if any failure occurs.
+ */
+static int request_properties_document(azure_iot_t* azure_iot)
+{
+  az_result azr;
+  size_t topic_length;
+  mqtt_message_t mqtt_message;
+
+  azr = az_iot_hub_client_properties_document_get_publish_topic(
+      &azure_iot->iot_hub_client,
+      AZ_SPAN_FROM_STR(PROPERTIES_DOCUMENT_GET_REQUEST_ID),
+      (char*)az_span_ptr(azure_iot->scratch_buffer),
+      (size_t)az_span_size(azure_iot->scratch_buffer),
+      &topic_length);
+  count_scratch_overflow(azure_iot, azr);
+  EXIT_IF_AZ_FAILED(azr, RESULT_ERROR, "Failed to get the properties document topic");
+
+  // Keeping the null-terminator, required by the MQTT client.
+  mqtt_message.topic = az_span_slice(azure_iot->scratch_buffer, 0, (int32_t)topic_length + 1);
+  mqtt_message.payload = AZ_SPAN_EMPTY;
+  mqtt_message.qos = mqtt_qos_at_most_once;
+
+  if (is_outbound_queue_enabled(azure_iot, outbound_message_class_properties))
+  {
+    EXIT_IF_TRUE(
+        enqueue_outbound_message(azure_iot, outbound_message_class_properties, &mqtt_message)
+            != RESULT_OK,
+        RESULT_ERROR,
+        "No space for queueing properties document request.");
+    return RESULT_OK;
+  }
+
+  (void)take_rate_limit_token(azure_iot, outbound_message_class_properties);
+
+  EXIT_IF_TRUE(
+      publish_mqtt_message(azure_iot, &mqtt_message) < 0,
+      RESULT_ERROR,
+      "Failed publishing to properties document topic.");
+
+  return RESULT_OK;
+}
+
+/*
+ * @brief           Finds an unused slot within the telemetry in-flight window.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ *
+ * @return          A pointer to the slot, or NULL if all the slots are taken.
+ */
+static telemetry_in_flight_t* get_free_telemetry_in_flight_slot(azure_iot_t* azure_iot)
+{
+  for (uint8_t i = 0; i < azure_iot->config->telemetry_in_flight_window_size; i++)
+  {
+    if (!azure_iot->telemetry_in_flight[i].is_used)
+    {
+      return &azure_iot->telemetry_in_flight[i];
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * @brief           Tells if telemetry can be published right away.
+ * @remark          That is always true with QoS 0. With QoS 1 a free in-flight slot is needed.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ *
+ * @return bool     True if telemetry can be published, false otherwise.
+ */
+static bool can_publish_telemetry(azure_iot_t* azure_iot)
+{
+  return azure_iot->config->telemetry_qos != mqtt_qos_at_least_once
+      || get_free_telemetry_in_flight_slot(azure_iot) != NULL;
+}
+
+/*
+ * @brief           Publishes (or re-publishes) a telemetry message kept in an in-flight slot.
+ * @remark          On success the slot takes the new packet ID and is timed from now.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ * @param[in]       in_flight          The in-flight slot to be published.
+ *
+ * @return int      0 on success, or non-zero if any failure occurs.
+ */
+static int send_in_flight_telemetry(azure_iot_t* azure_iot, telemetry_in_flight_t* in_flight)
+{
+  int packet_id;
+  mqtt_message_t mqtt_message;
+
+  mqtt_message.topic = azure_iot->telemetry_topic;
+  mqtt_message.payload = in_flight->payload;
+  mqtt_message.qos = mqtt_qos_at_least_once;
+
+  // A PUBACK arriving before the packet ID is saved below is missed, and the message is
+  // retransmitted once it times out (duplicates are allowed with AT LEAST ONCE).
+  in_flight->packet_id = 0;
+  packet_id = publish_mqtt_message(azure_iot, &mqtt_message);
+  EXIT_IF_TRUE(packet_id < 0, RESULT_ERROR, "Failed publishing to telemetry topic");
+
+  in_flight->packet_id = packet_id;
+  in_flight->sent_time_in_ms = get_current_time_in_ms(azure_iot);
+
+  return RESULT_OK;
+}
+
+/*
+ * @brief           Publishes a telemetry payload with the QoS configured for telemetry.
+ * @remark          With QoS 1 the payload is copied into a free in-flight slot (the caller must
+ * check one is available with `can_publish_telemetry`) and is considered accepted even if the
+ * first attempt to publish fails, since it is retried by `process_in_flight_telemetry`.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ * @param[in]       payload            The telemetry payload.
+ *
+ * @return int      0 on success, or non-zero if any failure occurs.
+ */
+static int publish_telemetry(azure_iot_t* azure_iot, az_span payload)
+{
+  mqtt_message_t mqtt_message;
+
+  if (azure_iot->config->telemetry_qos == mqtt_qos_at_least_once)
+  {
+    telemetry_in_flight_t* in_flight = get_free_telemetry_in_flight_slot(azure_iot);
+    int32_t slot_size = az_span_size(azure_iot->config->telemetry_in_flight_buffer)
+        / azure_iot->config->telemetry_in_flight_window_size;
+    int32_t slot_index;
+    uint32_t in_flight_count = 0;
+
+    EXIT_IF_TRUE(in_flight == NULL, RESULT_ERROR, "No in-flight slot available for telemetry.");
+    EXIT_IF_TRUE(
+        az_span_size(payload) > slot_size,
+        RESULT_ERROR,
+        "Telemetry payload too large for in-flight slot (%d > %d).",
+        az_span_size(payload),
+        slot_size);
+
+    slot_index = (int32_t)(in_flight - azure_iot->telemetry_in_flight);
+    in_flight->payload = az_span_slice(
+        azure_iot->config->telemetry_in_flight_buffer,
+        slot_index * slot_size,
+        slot_index * slot_size + az_span_size(payload));
+    (void)az_span_copy(in_flight->payload, payload);
+    in_flight->packet_id = 0;
+    in_flight->sent_time_in_ms = 0;
+    in_flight->retransmit_count = 0;
+    in_flight->is_used = true;
+
+    azure_iot->telemetry_delivery_statistics.sent_count++;
+
+    for (uint8_t i = 0; i < azure_iot->config->telemetry_in_flight_window_size; i++)
+    {
+      in_flight_count += azure_iot->telemetry_in_flight[i].is_used ? 1 : 0;
+    }
+
+    if (in_flight_count > azure_iot->telemetry_delivery_statistics.max_in_flight_count)
+    {
+      azure_iot->telemetry_delivery_statistics.max_in_flight_count = in_flight_count;
+    }
+
+    if (azure_iot->state == azure_iot_state_ready
+        && send_in_flight_telemetry(azure_iot, in_flight) != RESULT_OK)
+    {
+      LogError("Telemetry kept for retransmission.");
+    }
+
+    return RESULT_OK;
+  }
+
+  mqtt_message.topic = azure_iot->telemetry_topic;
+  mqtt_message.payload = payload;
+  mqtt_message.qos = mqtt_qos_at_most_once;
+
+  int packet_id = publish_mqtt_message(azure_iot, &mqtt_message);
+  EXIT_IF_TRUE(packet_id < 0, RESULT_ERROR, "Failed publishing to telemetry topic");
+
+  return RESULT_OK;
+}
+
+/*
+ * @brief           Publishes the in-flight telemetry not sent yet over the current connection and
+ * retransmits the one whose PUBACK is overdue.
+ * @remark          Messages not acknowledged after `telemetry_max_retransmit_count` retransmits are
+ * given up on.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ *
+ * @return          Nothing.
+ */
+static void process_in_flight_telemetry(azure_iot_t* azure_iot)
+{
+  uint64_t now_in_ms = get_current_time_in_ms(azure_iot);
+
+  for (uint8_t i = 0; i < azure_iot->config->telemetry_in_flight_window_size; i++)
+  {
+    telemetry_in_flight_t* in_flight = &azure_iot->telemetry_in_flight[i];
+
+    if (!in_flight->is_used)
+    {
+      continue;
+    }
+    else if (in_flight->sent_time_in_ms == 0)
+    {
+      (void)send_in_flight_telemetry(azure_iot, in_flight);
+    }
+    else if (
+        (now_in_ms - in_flight->sent_time_in_ms) >= azure_iot->config->telemetry_ack_timeout_in_ms)
+    {
+      if (in_flight->retransmit_count >= azure_iot->config->telemetry_max_retransmit_count)
+      {
+        azure_iot->telemetry_delivery_statistics.expired_count++;
+        in_flight->is_used = false;
+        LogError("No PUBACK for telemetry (packet id=%d), giving up.", in_flight->packet_id);
+      }
+      else
+      {
+        in_flight->retransmit_count++;
+        azure_iot->telemetry_delivery_statistics.retransmit_count++;
+        (void)send_in_flight_telemetry(azure_iot, in_flight);
+      }
+    }
+  }
+}
+
+/*
+ * @brief           Marks all the in-flight telemetry as not sent over the current connection, so
+ * it is published again once the client is ready.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ *
+ * @return          Nothing.
+ */
+static void reset_in_flight_telemetry(azure_iot_t* azure_iot)
+{
+  for (uint8_t i = 0; i < azure_iot->config->telemetry_in_flight_window_size; i++)
+  {
+    azure_iot->telemetry_in_flight[i].packet_id = 0;
+    azure_iot->telemetry_in_flight[i].sent_time_in_ms = 0;
+  }
+}
+
+/*
+ * @brief           Initializes the Device Provisioning client and generates the config for an MQTT
+ * client.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ * @param[in]       mqtt_client_config A pointer to a generic structure to contain the configuration
+ * for creating and connecting an MQTT client to Azure Device Provisioning service.
+ *
+ * @return int      0 on success, non-zero if any failure occurs.
+ */
+static int get_mqtt_client_config_for_dps(
+    azure_iot_t* azure_iot,
+    mqtt_client_config_t* mqtt_client_config)
+{
+  az_span data_buffer_span;
+  az_span client_id_span;
+  az_span username_span;
+  az_span password_span;
+  size_t client_id_length;
+  size_t username_length;
+  size_t password_length;
+  az_result azrc;
+
+  azrc = az_iot_provisioning_client_init(
+      &azure_iot->dps_client,
+      AZ_SPAN_FROM_STR(DPS_GLOBAL_ENDPOINT_MQTT_URI_WITH_PORT),
+      azure_iot->config->dps_id_scope,
+      azure_iot->config->dps_registration_id,
+      NULL);
+  EXIT_IF_AZ_FAILED(azrc, RESULT_ERROR, "Failed to initialize provisioning client.");
+
+  // A new registration starts, with a new operation id.
+  reset_data_buffer_region(&azure_iot->connection_region);
+  azure_iot->dps_operation_id = AZ_SPAN_EMPTY;
+  azure_iot->next_sas_token = AZ_SPAN_EMPTY;
+
+  data_buffer_span = azure_iot->scratch_buffer;
+
+  password_span = split_scratch_buffer(
+      data_buffer_span,
+      MQTT_PASSWORD_BUFFER_SIZE,
+      &data_buffer_span,
+      &azure_iot->scratch_overflow_count);
+  EXIT_IF_TRUE(
+      az_span_is_content_equal(password_span, AZ_SPAN_EMPTY),
+      RESULT_ERROR,
+      "Failed reserving buffer for password_span.");
+
+  if (!az_span_is_content_equal(azure_iot->config->device_key, AZ_SPAN_EMPTY))
+  {
+    password_length = generate_sas_token_for_dps(
+        &azure_iot->dps_client,
+        get_decoded_device_key(azure_iot),
+        get_current_unix_time(azure_iot),
+        azure_iot->config->sas_token_lifetime_in_minutes,
+        data_buffer_span,
+        &azure_iot->scratch_overflow_count,
+        azure_iot->config->data_manipulation_functions,
+        password_span);
+    EXIT_IF_TRUE(
+        password_length == 0, RESULT_ERROR, "Failed creating mqtt password for DPS connection.");
+    azure_iot->sas_token_expiration_time_in_ms = get_sas_token_expiration_time_in_ms(azure_iot);
+
+    mqtt_client_config->password = password_span;
+  }
+  else
+  {
+    mqtt_client_config->password = AZ_SPAN_EMPTY;
+  }
+
+  mqtt_client_config->tls_session = AZ_SPAN_EMPTY;
+
+  client_id_span = split_scratch_buffer(
+      data_buffer_span,
+      MQTT_CLIENT_ID_BUFFER_SIZE,
+      &data_buffer_span,
+      &azure_iot->scratch_overflow_count);
+  EXIT_IF_TRUE(
+      az_span_is_content_equal(client_id_span, AZ_SPAN_EMPTY),
+      RESULT_ERROR,
+      "Failed reserving buffer for client_id_span.");
+
+  azrc = az_iot_provisioning_client_get_client_id(
+      &azure_iot->dps_client,
+      (char*)az_span_ptr(client_id_span),
+      az_span_size(client_id_span),
+      &client_id_length);
+  EXIT_IF_AZ_FAILED(azrc, RESULT_ERROR, "Failed getting client id for DPS connection.");
+
+  username_span = split_scratch_buffer(
+      data_buffer_span,
+      MQTT_USERNAME_BUFFER_SIZE,
+      &data_buffer_span,
+      &azure_iot->scratch_overflow_count);
+
+  azrc = az_iot_provisioning_client_get_user_name(
+      &azure_iot->dps_client,
+      (char*)az_span_ptr(username_span),
+      az_span_size(username_span),
+      &username_length);
+  EXIT_IF_AZ_FAILED(azrc, RESULT_ERROR, "Failed to get MQTT client username.");
+
+  mqtt_client_config->address = AZ_SPAN_FROM_STR(DPS_GLOBAL_ENDPOINT_FQDN);
+  mqtt_client_config->port = DPS_GLOBAL_ENDPOINT_PORT;
+
+  mqtt_client_config->client_id = client_id_span;
+  mqtt_client_config->username = username_span;
+
+  return RESULT_OK;
+}
+
+/*
+ * @brief           Initializes the Azure IoT Hub client and generates the config for an MQTT
+ * client.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ * @param[in]       mqtt_client_config A pointer to a generic structure to contain the configuration
+ * for creating and connecting an MQTT client to Azure IoT Hub.
+ *
+ * @return int      0 on success, non-zero if any failure occurs.
+ */
+static int get_mqtt_client_config_for_iot_hub(
+    azure_iot_t* azure_iot,
+    mqtt_client_config_t* mqtt_client_config)
+{
+  az_span data_buffer_span;
+  az_span client_id_span;
+  az_span username_span;
+  az_span password_span;
+  size_t client_id_length;
+  size_t username_length;
+  size_t password_length;
+  az_result azrc;
+
+  azure_iot->iot_hub_client_options = az_iot_hub_client_options_default();
+  azure_iot->iot_hub_client_options.user_agent = azure_iot->config->user_agent;
+  azure_iot->iot_hub_client_options.model_id = azure_iot->config->model_id;
+
+  azrc = az_iot_hub_client_init(
+      &azure_iot->iot_hub_client,
+      azure_iot->config->iot_hub_fqdn,
+      azure_iot->config->device_id,
+      &azure_iot->iot_hub_client_options);
+  EXIT_IF_AZ_FAILED(azrc, RESULT_ERROR, "Failed to initialize Azure IoT Hub client.");
+
+  data_buffer_span = azure_iot->scratch_buffer;
+
+  if (az_span_size(azure_iot->next_sas_token) > 0
+      && azure_iot->next_sas_token_expiration_time_in_ms
+          > get_current_time_in_ms(azure_iot)
+              + SAS_TOKEN_PREPARE_THRESHOLD_IN_SECS * NUMBER_OF_MILLISECONDS_IN_A_SECOND)
+  {
+    password_span = split_scratch_buffer(
+        data_buffer_span,
+        az_span_size(azure_iot->next_sas_token),
+        &data_buffer_span,
+        &azure_iot->scratch_overflow_count);
+    EXIT_IF_TRUE(
+        az_span_is_content_equal(password_span, AZ_SPAN_EMPTY),
+        RESULT_ERROR,
+        "Failed reserving buffer for password_span.");
+
+    (void)az_span_copy(password_span, azure_iot->next_sas_token);
+    azure_iot->sas_token_expiration_time_in_ms = azure_iot->next_sas_token_expiration_time_in_ms;
+  }
+  else
+  {
+    password_span = split_scratch_buffer(
+        data_buffer_span,
+        MQTT_PASSWORD_BUFFER_SIZE,
+        &data_buffer_span,
+        &azure_iot->scratch_overflow_count);
+    EXIT_IF_TRUE(
+        az_span_is_content_equal(password_span, AZ_SPAN_EMPTY),
+        RESULT_ERROR,
+        "Failed reserving buffer for password_span.");
+
+    password_length = generate_sas_token_for_iot_hub(
+        &azure_iot->iot_hub_client,
+        get_decoded_device_key(azure_iot),
+        get_current_unix_time(azure_iot),
+        azure_iot->config->sas_token_lifetime_in_minutes,
+        data_buffer_span,
+        &azure_iot->scratch_overflow_count,
+        azure_iot->config->data_manipulation_functions,
+        password_span);
+    EXIT_IF_TRUE(
+        password_length == 0,
+        RESULT_ERROR,
+        "Failed creating mqtt password for IoT Hub connection.");
+    azure_iot->sas_token_expiration_time_in_ms = get_sas_token_expiration_time_in_ms(azure_iot);
+  }
+
+  // The SAS token prepared ahead of time (if any) and the DPS operation id are no longer needed.
+  reset_data_buffer_region(&azure_iot->connection_region);
+  azure_iot->next_sas_token = AZ_SPAN_EMPTY;
+  azure_iot->dps_operation_id = AZ_SPAN_EMPTY;
+
+  client_id_span = split_scratch_buffer(
+      data_buffer_span,
+      MQTT_CLIENT_ID_BUFFER_SIZE,
+      &data_buffer_span,
+      &azure_iot->scratch_overflow_count);
+  EXIT_IF_TRUE(
+      az_span_is_content_equal(client_id_span, AZ_SPAN_EMPTY),
+      RESULT_ERROR,
+      "Failed reserving buffer for client_id_span.");
+
+  azrc = az_iot_hub_client_get_client_id(
+      &azure_iot->iot_hub_client,
       (char*)az_span_ptr(client_id_span),
       az_span_size(client_id_span),
       &client_id_length);
-  EXIT_IF_AZ_FAILED(azrc, RESULT_ERROR, "Failed getting client id for DPS connection.");
+  EXIT_IF_AZ_FAILED(azrc, RESULT_ERROR, "Failed getting client id for IoT Hub connection.");
+
+  username_span = split_scratch_buffer(
+      data_buffer_span,
+      MQTT_USERNAME_BUFFER_SIZE,
+      &data_buffer_span,
+      &azure_iot->scratch_overflow_count);
+
+  azrc = az_iot_hub_client_get_user_name(
+      &azure_iot->iot_hub_client,
+      (char*)az_span_ptr(username_span),
+      az_span_size(username_span),
+      &username_length);
+  EXIT_IF_AZ_FAILED(azrc, RESULT_ERROR, "Failed to get MQTT client username.");
+
+  mqtt_client_config->address = azure_iot->config->iot_hub_fqdn;
+  mqtt_client_config->port = IOT_HUB_ENDPOINT_PORT;
+
+  mqtt_client_config->client_id = client_id_span;
+  mqtt_client_config->username = username_span;
+  mqtt_client_config->password = password_span;
+  mqtt_client_config->tls_session = get_tls_session_to_resume(azure_iot);
+
+  return RESULT_OK;
+}
+
+/*
+ * @brief           Gets the TLS session saved from the last connection with the Azure IoT Hub, if
+ * it is still recent enough to be resumed.
+ * @remark          A session the server no longer accepts only costs the full handshake it would
+ * have required anyway, but the lifetime avoids offering sessions that are certainly expired.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ *
+ * @return          The TLS session to be offered, or AZ_SPAN_EMPTY if there is none.
+ */
+static az_span get_tls_session_to_resume(azure_iot_t* azure_iot)
+{
+  if (az_span_size(azure_iot->tls_session) == 0)
+  {
+    return AZ_SPAN_EMPTY;
+  }
+
+  if ((get_current_time_in_ms(azure_iot) - azure_iot->tls_session_saved_time_in_ms)
+      >= (uint64_t)azure_iot->config->tls_session_lifetime_in_secs
+          * NUMBER_OF_MILLISECONDS_IN_A_SECOND)
+  {
+    LogInfo("Saved TLS session expired, performing a full handshake.");
+    azure_iot->tls_session_statistics.expired_count++;
+    azure_iot->tls_session = AZ_SPAN_EMPTY;
+    return AZ_SPAN_EMPTY;
+  }
+
+  azure_iot->tls_session_statistics.offered_count++;
+
+  return azure_iot->tls_session;
+}
+
+/*
+ * @brief           Gets the base64-decoded device key, decoding it on the first call only.
+ * @remark          The device key does not change, so decoding it again on every SAS token
+ * generation would only add latency to each (re)connection.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ *
+ * @return          The decoded device key, or AZ_SPAN_EMPTY if it could not be decoded.
+ */
+static az_span get_decoded_device_key(azure_iot_t* azure_iot)
+{
+  size_t decoded_device_key_length;
+
+  if (az_span_size(azure_iot->decoded_device_key) == 0)
+  {
+    if (azure_iot->config->data_manipulation_functions.base64_decode(
+            az_span_ptr(azure_iot->config->device_key),
+            az_span_size(azure_iot->config->device_key),
+            azure_iot->decoded_device_key_buffer,
+            sizeof(azure_iot->decoded_device_key_buffer),
+            &decoded_device_key_length)
+        != 0)
+    {
+      LogError("Failed decoding SAS key.");
+      return AZ_SPAN_EMPTY;
+    }
+
+    azure_iot->decoded_device_key
+        = az_span_create(azure_iot->decoded_device_key_buffer, (int32_t)decoded_device_key_length);
+  }
+
+  return azure_iot->decoded_device_key;
+}
+
+/*
+ * @brief           Generates a SAS token used as password for connecting with Azure Device
+ * Provisioning.
+ * @remarks         The SAS token generation depends on the following steps:
+ *                  1. Calculate the expiration time, as current unix time since epoch plus the
+ * token duration, in minutes.
+ *                  2. Generate the SAS signature;
+ *                    a. Generate the DPS-specific secret string (a.k.a., "signature");
+ *                    b. base64-decode the encryption key (device key), done once by the caller;
+ *                    c. Encrypt (HMAC-SHA256) the signature using the base64-decoded encryption
+ * key; d. base64-encode the encrypted signature, which gives the final SAS signature (sig);
+ *                  3. Compose the final SAS token with the DPS audience (sr), SAS signature (sig)
+ * and expiration time (se).
+ * @param[in]       provisioning_client         A pointer to an initialized instance of
+ * az_iot_provisioning_client.
+ * @param[in]       decoded_device_key          az_span containing the base64-decoded device key.
+ * @param[in]       current_unix_time           Current wall-clock time, as unix time.
+ * @param[in]       duration_in_minutes         Duration of the SAS token, in minutes.
+ * @param[in]       data_buffer_span            az_span with a buffer containing enough space for
+ * all the intermediate data generated by this function.
+ * @param[out]      scratch_overflow_count      Incremented if `data_buffer_span` is too small.
+ * @param[in]       data_manipulation_functions Set of user-defined functions needed for the
+ * generation of the SAS token.
+ * @param[out]      sas_token                   az_span with buffer where to write the resulting SAS
+ * token.
+ *
+ * @return int      Length of the resulting SAS token, or zero if any failure occurs.
+ */
+static int generate_sas_token_for_dps(
+    az_iot_provisioning_client* provisioning_client,
+    az_span decoded_device_key,
+    uint32_t current_unix_time,
+    unsigned int duration_in_minutes,
+    az_span data_buffer_span,
+    uint32_t* scratch_overflow_count,
+    data_manipulation_functions_t data_manipulation_functions,
+    az_span sas_token)
+{
+  int result;
+  az_result rc;
+  uint32_t expiration_time;
+  size_t mqtt_password_length, length;
+  az_span plain_sas_signature, sas_signature, sas_hmac256_signed_signature;
+
+  EXIT_IF_TRUE(az_span_size(decoded_device_key) == 0, 0, "No decoded SAS key.");
+
+  // Step 1.
+  EXIT_IF_TRUE(current_unix_time == 0, 0, "Failed getting current unix time.");
+
+  expiration_time = current_unix_time + duration_in_minutes * NUMBER_OF_SECONDS_IN_A_MINUTE;
+
+  // Step 2.a.
+  plain_sas_signature = split_scratch_buffer(
+      data_buffer_span,
+      PLAIN_SAS_SIGNATURE_BUFFER_SIZE,
+      &data_buffer_span,
+      scratch_overflow_count);
+  EXIT_IF_TRUE(
+      az_span_is_content_equal(plain_sas_signature, AZ_SPAN_EMPTY),
+      0,
+      "Failed reserving buffer for plain sas token.");
+
+  rc = az_iot_provisioning_client_sas_get_signature(
+      provisioning_client, expiration_time, plain_sas_signature, &plain_sas_signature);
+  EXIT_IF_AZ_FAILED(rc, 0, "Could not get the signature for SAS key.");
+
+  // Step 2.b.
+  sas_signature = split_scratch_buffer(
+      data_buffer_span,
+      SAS_SIGNATURE_BUFFER_SIZE,
+      &data_buffer_span,
+      scratch_overflow_count);
+  EXIT_IF_TRUE(
+      az_span_is_content_equal(sas_signature, AZ_SPAN_EMPTY),
+      0,
+      "Failed reserving buffer for sas_signature.");
+
+  // Step 2.c.
+  sas_hmac256_signed_signature = split_scratch_buffer(
+      data_buffer_span,
+      SAS_HMAC256_ENCRYPTED_SIGNATURE_BUFFER_SIZE,
+      &data_buffer_span,
+      scratch_overflow_count);
+  EXIT_IF_TRUE(
+      az_span_is_content_equal(sas_hmac256_signed_signature, AZ_SPAN_EMPTY),
+      0,
+      "Failed reserving buffer for sas_hmac256_signed_signature.");
+
+  result = data_manipulation_functions.hmac_sha256_encrypt(
+      az_span_ptr(decoded_device_key),
+      (size_t)az_span_size(decoded_device_key),
+      az_span_ptr(plain_sas_signature),
+      az_span_size(plain_sas_signature),
+      az_span_ptr(sas_hmac256_signed_signature),
+      az_span_size(sas_hmac256_signed_signature));
+  EXIT_IF_TRUE(result != 0, 0, "Failed encrypting SAS signature.");
+
+  // Step 2.d.
+  result = data_manipulation_functions.base64_encode(
+      az_span_ptr(sas_hmac256_signed_signature),
+      az_span_size(sas_hmac256_signed_signature),
+      az_span_ptr(sas_signature),
+      az_span_size(sas_signature),
+      &length);
+  EXIT_IF_TRUE(result != 0, 0, "Failed encoding SAS signature.");
+
+  sas_signature = az_span_slice(sas_signature, 0, length);
+
+  // Step 3.
+  rc = az_iot_provisioning_client_sas_get_password(
+      provisioning_client,
+      sas_signature,
+      expiration_time,
+      AZ_SPAN_EMPTY,
+      (char*)az_span_ptr(sas_token),
+      az_span_size(sas_token),
+      &mqtt_password_length);
+  EXIT_IF_AZ_FAILED(rc, 0, "Could not get the password.");
+
+  return mqtt_password_length;
+}
+
+/*
+ * @brief           Generates a SAS token used as password for connecting with Azure IoT Hub.
+ * @remarks         The SAS token generation depends on the following steps:
+ *                  1. Calculate the expiration time, as current unix time since epoch plus the
+ * token duration, in minutes.
+ *                  2. Generate the SAS signature;
+ *                    a. Generate the DPS-specific secret string (a.k.a., "signature");
+ *                    b. base64-decode the encryption key (device key), done once by the caller;
+ *                    c. Encrypt (HMAC-SHA256) the signature using the base64-decoded encryption
+ * key; d. base64-encode the encrypted signature, which gives the final SAS signature (sig);
+ *                  3. Compose the final SAS token with the DPS audience (sr), SAS signature (sig)
+ * and expiration time (se).
+ * @param[in]       iot_hub_client              A pointer to an initialized instance of
+ * az_iot_hub_client.
+ * @param[in]       decoded_device_key          az_span containing the base64-decoded device key.
+ * @param[in]       current_unix_time           Current wall-clock time, as unix time.
+ * @param[in]       duration_in_minutes         Duration of the SAS token, in minutes.
+ * @param[in]       data_buffer_span            az_span with a buffer containing enough space for
+ * all the intermediate data generated by this function.
+ * @param[out]      scratch_overflow_count      Incremented if `data_buffer_span` is too small.
+ * @param[in]       data_manipulation_functions Set of user-defined functions needed for the
+ * generation of the SAS token.
+ * @param[out]      sas_token                   az_span with buffer where to write the resulting SAS
+ * token.
+ *
+ * @return int      Length of the resulting SAS token, or zero if any failure occurs.
+ */
+static int generate_sas_token_for_iot_hub(
+    az_iot_hub_client* iot_hub_client,
+    az_span decoded_device_key,
+    uint32_t current_unix_time,
+    unsigned int duration_in_minutes,
+    az_span data_buffer_span,
+    uint32_t* scratch_overflow_count,
+    data_manipulation_functions_t data_manipulation_functions,
+    az_span sas_token)
+{
+  int result;
+  az_result rc;
+  uint32_t expiration_time;
+  size_t mqtt_password_length, length;
+  az_span plain_sas_signature, sas_signature, sas_hmac256_signed_signature;
+
+  EXIT_IF_TRUE(az_span_size(decoded_device_key) == 0, 0, "No decoded SAS key.");
+
+  // Step 1.
+  EXIT_IF_TRUE(current_unix_time == 0, 0, "Failed getting current unix time.");
+
+  expiration_time = current_unix_time + duration_in_minutes * NUMBER_OF_SECONDS_IN_A_MINUTE;
+
+  // Step 2.a.
+  plain_sas_signature = split_scratch_buffer(
+      data_buffer_span,
+      PLAIN_SAS_SIGNATURE_BUFFER_SIZE,
+      &data_buffer_span,
+      scratch_overflow_count);
+  EXIT_IF_TRUE(
+      az_span_is_content_equal(plain_sas_signature, AZ_SPAN_EMPTY),
+      0,
+      "Failed reserving buffer for plain sas token.");
+
+  rc = az_iot_hub_client_sas_get_signature(
+      iot_hub_client, expiration_time, plain_sas_signature, &plain_sas_signature);
+  EXIT_IF_AZ_FAILED(rc, 0, "Could not get the signature for SAS key.");
+
+  // Step 2.b.
+  sas_signature = split_scratch_buffer(
+      data_buffer_span,
+      SAS_SIGNATURE_BUFFER_SIZE,
+      &data_buffer_span,
+      scratch_overflow_count);
+  EXIT_IF_TRUE(
+      az_span_is_content_equal(sas_signature, AZ_SPAN_EMPTY),
+      0,
+      "Failed reserving buffer for sas_signature.");
+
+  // Step 2.c.
+  sas_hmac256_signed_signature = split_scratch_buffer(
+      data_buffer_span,
+      SAS_HMAC256_ENCRYPTED_SIGNATURE_BUFFER_SIZE,
+      &data_buffer_span,
+      scratch_overflow_count);
+  EXIT_IF_TRUE(
+      az_span_is_content_equal(sas_hmac256_signed_signature, AZ_SPAN_EMPTY),
+      0,
+      "Failed reserving buffer for sas_hmac256_signed_signature.");
+
+  result = data_manipulation_functions.hmac_sha256_encrypt(
+      az_span_ptr(decoded_device_key),
+      (size_t)az_span_size(decoded_device_key),
+      az_span_ptr(plain_sas_signature),
+      az_span_size(plain_sas_signature),
+      az_span_ptr(sas_hmac256_signed_signature),
+      az_span_size(sas_hmac256_signed_signature));
+  EXIT_IF_TRUE(result != 0, 0, "Failed encrypting SAS signature.");
+
+  // Step 2.d.
+  result = data_manipulation_functions.base64_encode(
+      az_span_ptr(sas_hmac256_signed_signature),
+      az_span_size(sas_hmac256_signed_signature),
+      az_span_ptr(sas_signature),
+      az_span_size(sas_signature),
+      &length);
+  EXIT_IF_TRUE(result != 0, 0, "Failed encoding SAS signature.");
+
+  sas_signature = az_span_slice(sas_signature, 0, length);
+
+  // Step 3.
+  rc = az_iot_hub_client_sas_get_password(
+      iot_hub_client,
+      expiration_time,
+      sas_signature,
+      AZ_SPAN_EMPTY,
+      (char*)az_span_ptr(sas_token),
+      az_span_size(sas_token),
+      &mqtt_password_length);
+  EXIT_IF_AZ_FAILED(rc, 0, "Could not get the password.");
+
+  return mqtt_password_length;
+}
+
+/**
+ * @brief        Generates a custom payload for DPS registration request containing the Azure PnP
+ * model ID.
+ * @remark       This payload with the model ID is required for Azure IoT Central to properly
+ *               assign the IoT Plug and Play template.
+ *
+ * @param[in]    mode_id        The string with the IoT Plug and Play model ID.
+ * @param[in]    data_buffer    Buffer where to write the resulting payload.
+ * @param[in]    remainder      The remainder space of `data_buffer` after enough is reserved for
+ *                              the resulting payload.
+ * @param[out]   scratch_overflow_count    Incremented if `data_buffer` is too small.
+ *
+ * @return       az_span        An az_span (reserved from `data_buffer`) containing the payload
+ *                              for the DPS registration request.
+ */
+static az_span generate_dps_register_custom_property(
+    az_span model_id,
+    az_span data_buffer,
+    az_span* remainder,
+    uint32_t* scratch_overflow_count)
+{
+  az_span custom_property;
+  size_t length = lengthof(DPS_REGISTER_CUSTOM_PAYLOAD_BEGIN) + az_span_size(model_id)
+      + lengthof(DPS_REGISTER_CUSTOM_PAYLOAD_END);
 
-  username_span = split_az_span(data_buffer_span, MQTT_USERNAME_BUFFER_SIZE, &data_buffer_span);
+  custom_property = split_scratch_buffer(data_buffer, length, remainder, scratch_overflow_count);
+  EXIT_IF_TRUE(
+      az_span_is_content_equal(custom_property, AZ_SPAN_EMPTY),
+      AZ_SPAN_EMPTY,
+      "Failed generating DPS register custom property (not enough space).");
 
-  azrc = az_iot_provisioning_client_get_user_name(
-      &azure_iot->dps_client,
-      (char*)az_span_ptr(username_span),
-      az_span_size(username_span),
-      &username_length);
-  EXIT_IF_AZ_FAILED(azrc, RESULT_ERROR, "Failed to get MQTT client username.");
+  data_buffer = az_span_copy(data_buffer, AZ_SPAN_FROM_STR(DPS_REGISTER_CUSTOM_PAYLOAD_BEGIN));
+  EXIT_IF_TRUE(
+      az_span_is_content_equal(data_buffer, AZ_SPAN_EMPTY),
+      AZ_SPAN_EMPTY,
+      "Failed generating DPS register custom property (prefix).");
 
-  mqtt_client_config->address = AZ_SPAN_FROM_STR(DPS_GLOBAL_ENDPOINT_FQDN);
-  mqtt_client_config->port = DPS_GLOBAL_ENDPOINT_PORT;
+  data_buffer = az_span_copy(data_buffer, model_id);
+  EXIT_IF_TRUE(
+      az_span_is_content_equal(data_buffer, AZ_SPAN_EMPTY),
+      AZ_SPAN_EMPTY,
+      "Failed generating DPS register custom property (model id).");
 
-  mqtt_client_config->client_id = client_id_span;
-  mqtt_client_config->username = username_span;
+  data_buffer = az_span_copy(data_buffer, AZ_SPAN_FROM_STR(DPS_REGISTER_CUSTOM_PAYLOAD_END));
+  EXIT_IF_TRUE(
+      az_span_is_content_equal(data_buffer, AZ_SPAN_EMPTY),
+      AZ_SPAN_EMPTY,
+      "Failed generating DPS register custom property (suffix).");
 
-  return RESULT_OK;
+  return custom_property;
 }
 
 /*
- * @brief           Initializes the Azure IoT Hub client and generates the config for an MQTT
- * client.
- * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
- * @param[in]       mqtt_client_config A pointer to a generic structure to contain the configuration
- * for creating and connecting an MQTT client to Azure IoT Hub.
+ * @brief        Loads the device-provisioning result saved through the provisioning cache.
+ * @remark       The Azure IoT Hub FQDN and device ID are kept in the persistent region of the
+ *               data buffer, the same way it is done when device-provisioning completes.
  *
- * @return int      0 on success, non-zero if any failure occurs.
+ * @param[in]    azure_iot    A pointer to an initialized instance of azure_iot_t.
+ *
+ * @return       int          0 if a provisioning result was loaded, non-zero otherwise.
  */
-static int get_mqtt_client_config_for_iot_hub(
-    azure_iot_t* azure_iot,
-    mqtt_client_config_t* mqtt_client_config)
+static int load_cached_provisioning(azure_iot_t* azure_iot)
 {
-  az_span data_buffer_span;
-  az_span client_id_span;
-  az_span username_span;
-  az_span password_span;
-  size_t client_id_length;
-  size_t username_length;
-  size_t password_length;
-  az_result azrc;
-
-  azure_iot->iot_hub_client_options = az_iot_hub_client_options_default();
-  azure_iot->iot_hub_client_options.user_agent = azure_iot->config->user_agent;
-  azure_iot->iot_hub_client_options.model_id = azure_iot->config->model_id;
+  int32_t iot_hub_fqdn_length;
+  int32_t device_id_length;
+  az_span data_buffer = azure_iot->scratch_buffer;
+  az_span iot_hub_fqdn;
+  az_span device_id;
 
-  azrc = az_iot_hub_client_init(
-      &azure_iot->iot_hub_client,
-      azure_iot->config->iot_hub_fqdn,
-      azure_iot->config->device_id,
-      &azure_iot->iot_hub_client_options);
-  EXIT_IF_AZ_FAILED(azrc, RESULT_ERROR, "Failed to initialize Azure IoT Hub client.");
-
-  data_buffer_span = azure_iot->data_buffer;
+  if (azure_iot->config->provisioning_cache.load == NULL)
+  {
+    return RESULT_ERROR;
+  }
 
-  password_span = split_az_span(data_buffer_span, MQTT_PASSWORD_BUFFER_SIZE, &data_buffer_span);
+  iot_hub_fqdn = split_scratch_buffer(
+      data_buffer,
+      PROVISIONED_IOT_HUB_FQDN_BUFFER_SIZE,
+      &data_buffer,
+      &azure_iot->scratch_overflow_count);
   EXIT_IF_TRUE(
-      az_span_is_content_equal(password_span, AZ_SPAN_EMPTY),
+      az_span_is_content_equal(iot_hub_fqdn, AZ_SPAN_EMPTY),
       RESULT_ERROR,
-      "Failed reserving buffer for password_span.");
+      "Failed reserving buffer for saved IoT Hub fqdn.");
 
-  password_length = generate_sas_token_for_iot_hub(
-      &azure_iot->iot_hub_client,
-      azure_iot->config->device_key,
-      azure_iot->config->sas_token_lifetime_in_minutes,
-      data_buffer_span,
-      azure_iot->config->data_manipulation_functions,
-      password_span,
-      &azure_iot->sas_token_expiration_time);
+  device_id = split_scratch_buffer(
+      data_buffer,
+      PROVISIONED_DEVICE_ID_BUFFER_SIZE,
+      &data_buffer,
+      &azure_iot->scratch_overflow_count);
   EXIT_IF_TRUE(
-      password_length == 0, RESULT_ERROR, "Failed creating mqtt password for IoT Hub connection.");
+      az_span_is_content_equal(device_id, AZ_SPAN_EMPTY),
+      RESULT_ERROR,
+      "Failed reserving buffer for saved device id.");
+
+  if (azure_iot->config->provisioning_cache.load(
+          iot_hub_fqdn, &iot_hub_fqdn_length, device_id, &device_id_length)
+          != 0
+      || iot_hub_fqdn_length <= 0 || iot_hub_fqdn_length > az_span_size(iot_hub_fqdn)
+      || device_id_length <= 0 || device_id_length > az_span_size(device_id))
+  {
+    LogInfo("No saved provisioning result found.");
+    return RESULT_ERROR;
+  }
 
-  client_id_span = split_az_span(data_buffer_span, MQTT_CLIENT_ID_BUFFER_SIZE, &data_buffer_span);
+  reset_data_buffer_region(&azure_iot->persistent_region);
+  iot_hub_fqdn = copy_into_data_buffer_region(
+      &azure_iot->persistent_region, az_span_slice(iot_hub_fqdn, 0, iot_hub_fqdn_length));
+  device_id = copy_into_data_buffer_region(
+      &azure_iot->persistent_region, az_span_slice(device_id, 0, device_id_length));
   EXIT_IF_TRUE(
-      az_span_is_content_equal(client_id_span, AZ_SPAN_EMPTY),
+      az_span_is_content_equal(iot_hub_fqdn, AZ_SPAN_EMPTY)
+          || az_span_is_content_equal(device_id, AZ_SPAN_EMPTY),
       RESULT_ERROR,
-      "Failed reserving buffer for client_id_span.");
+      "Failed reserving memory for saved provisioning result.");
 
-  azrc = az_iot_hub_client_get_client_id(
-      &azure_iot->iot_hub_client,
-      (char*)az_span_ptr(client_id_span),
-      az_span_size(client_id_span),
-      &client_id_length);
-  EXIT_IF_AZ_FAILED(azrc, RESULT_ERROR, "Failed getting client id for IoT Hub connection.");
+  azure_iot->config->iot_hub_fqdn = iot_hub_fqdn;
+  azure_iot->config->device_id = device_id;
+  azure_iot->is_provisioning_cached = true;
 
-  username_span = split_az_span(data_buffer_span, MQTT_USERNAME_BUFFER_SIZE, &data_buffer_span);
+  LogInfo(
+      "Using saved provisioning result (hub=%.*s, device id=%.*s).",
+      az_span_size(iot_hub_fqdn),
+      az_span_ptr(iot_hub_fqdn),
+      az_span_size(device_id),
+      az_span_ptr(device_id));
 
-  azrc = az_iot_hub_client_get_user_name(
-      &azure_iot->iot_hub_client,
-      (char*)az_span_ptr(username_span),
-      az_span_size(username_span),
-      &username_length);
-  EXIT_IF_AZ_FAILED(azrc, RESULT_ERROR, "Failed to get MQTT client username.");
+  return RESULT_OK;
+}
 
-  mqtt_client_config->address = azure_iot->config->iot_hub_fqdn;
-  mqtt_client_config->port = IOT_HUB_ENDPOINT_PORT;
+/*
+ * @brief        Discards the device-provisioning result loaded from the provisioning cache.
+ * @remark       Both the saved copy and the one in use are discarded, so the next time the client
+ *               is started it performs device-provisioning again.
+ *
+ * @param[in]    azure_iot    A pointer to an initialized instance of azure_iot_t.
+ */
+static void clear_cached_provisioning(azure_iot_t* azure_iot)
+{
+  if (azure_iot->config->provisioning_cache.clear != NULL
+      && azure_iot->config->provisioning_cache.clear() != 0)
+  {
+    LogError("Failed clearing saved provisioning result.");
+  }
 
-  mqtt_client_config->client_id = client_id_span;
-  mqtt_client_config->username = username_span;
-  mqtt_client_config->password = password_span;
+  azure_iot->config->iot_hub_fqdn = AZ_SPAN_EMPTY;
+  azure_iot->config->device_id = AZ_SPAN_EMPTY;
+  reset_data_buffer_region(&azure_iot->persistent_region);
+  azure_iot->is_provisioning_cached = false;
 
-  return RESULT_OK;
+  // The device may be provisioned to another IoT Hub, which would not know the session.
+  azure_iot->tls_session = AZ_SPAN_EMPTY;
 }
 
 /*
- * @brief           Generates a SAS token used as password for connecting with Azure Device
- * Provisioning.
- * @remarks         The SAS token generation depends on the following steps:
- *                  1. Calculate the expiration time, as current unix time since epoch plus the
- * token duration, in minutes.
- *                  2. Generate the SAS signature;
- *                    a. Generate the DPS-specific secret string (a.k.a., "signature");
- *                    b. base64-decode the encryption key (device key);
- *                    c. Encrypt (HMAC-SHA256) the signature using the base64-decoded encryption
- * key; d. base64-encode the encrypted signature, which gives the final SAS signature (sig);
- *                  3. Compose the final SAS token with the DPS audience (sr), SAS signature (sig)
- * and expiration time (se).
- * @param[in]       provisioning_client         A pointer to an initialized instance of
- * az_iot_provisioning_client.
- * @param[in]       device_key                  az_span containing the device key.
- * @param[in]       duration_in_minutes         Duration of the SAS token, in minutes.
- * @param[in]       data_buffer_span            az_span with a buffer containing enough space for
- * all the intermediate data generated by this function.
- * @param[in]       data_manipulation_functions Set of user-defined functions needed for the
- * generation of the SAS token.
- * @param[out]      sas_token                   az_span with buffer where to write the resulting SAS
- * token.
- * @param[out]      expiration_time             The expiration time of the resulting SAS token, as
- * unix time.
+ * @brief        Copies data into a region of the data buffer, right after what it already holds.
  *
- * @return int      Length of the resulting SAS token, or zero if any failure occurs.
+ * @param[in]    region     The region of the data buffer to copy into.
+ * @param[in]    source     The data to be copied.
+ *
+ * @return       az_span    The copy, or AZ_SPAN_EMPTY if the region has no space left for it.
  */
-static int generate_sas_token_for_dps(
-    az_iot_provisioning_client* provisioning_client,
-    az_span device_key,
-    unsigned int duration_in_minutes,
-    az_span data_buffer_span,
-    data_manipulation_functions_t data_manipulation_functions,
-    az_span sas_token,
-    uint32_t* expiration_time)
+static az_span copy_into_data_buffer_region(data_buffer_region_t* region, az_span source)
 {
-  int result;
-  az_result rc;
-  uint32_t current_unix_time;
-  size_t mqtt_password_length, decoded_sas_key_length, length;
-  az_span plain_sas_signature, sas_signature, decoded_sas_key, sas_hmac256_signed_signature;
+  az_span destination;
 
-  // Step 1.
-  current_unix_time = get_current_unix_time();
-  EXIT_IF_TRUE(current_unix_time == 0, 0, "Failed getting current unix time.");
+  if (az_span_size(source) > (az_span_size(region->buffer) - region->used))
+  {
+    region->overflow_count++;
+    LogError(
+        "Data buffer region too small (%d used of %d, %d needed).",
+        region->used,
+        az_span_size(region->buffer),
+        az_span_size(source));
+    return AZ_SPAN_EMPTY;
+  }
 
-  *expiration_time = current_unix_time + duration_in_minutes * NUMBER_OF_SECONDS_IN_A_MINUTE;
+  destination = az_span_slice(region->buffer, region->used, region->used + az_span_size(source));
+  (void)az_span_copy(destination, source);
 
-  // Step 2.a.
-  plain_sas_signature
-      = split_az_span(data_buffer_span, PLAIN_SAS_SIGNATURE_BUFFER_SIZE, &data_buffer_span);
-  EXIT_IF_TRUE(
-      az_span_is_content_equal(plain_sas_signature, AZ_SPAN_EMPTY),
-      0,
-      "Failed reserving buffer for plain sas token.");
+  region->used += az_span_size(source);
+
+  if (region->used > region->high_water_mark)
+  {
+    region->high_water_mark = region->used;
+  }
+
+  return destination;
+}
+
+/*
+ * @brief        Releases everything held in a region of the data buffer.
+ *
+ * @param[in]    region     The region of the data buffer to be released.
+ */
+static void reset_data_buffer_region(data_buffer_region_t* region) { region->used = 0; }
+
+/*
+ * @brief        Reserves `size` bytes from a part of the scratch region of the data buffer.
+ * @remark       Same as `split_az_span`, but counting the reservations that do not fit.
+ *
+ * @param[in]    span              The part of the scratch region to reserve from.
+ * @param[in]    size              Number of bytes to reserve.
+ * @param[out]   remainder         Where to store what is left of `span` after the reservation.
+ * @param[out]   overflow_count    Incremented if `span` is smaller than `size`.
+ *
+ * @return       az_span           The bytes reserved, or AZ_SPAN_EMPTY if they do not fit.
+ */
+static az_span split_scratch_buffer(
+    az_span span,
+    int32_t size,
+    az_span* remainder,
+    uint32_t* overflow_count)
+{
+  if (size > az_span_size(span))
+  {
+    (*overflow_count)++;
+    LogError(
+        "Data buffer scratch region too small (%d available, %d needed).",
+        az_span_size(span),
+        size);
+    return AZ_SPAN_EMPTY;
+  }
+
+  return split_az_span(span, size, remainder);
+}
+
+/*
+ * @brief        Counts a failure of an azure-sdk-for-c function writing into the scratch region of
+ *               the data buffer, if it ran out of space.
+ *
+ * @param[in]    azure_iot    A pointer to an initialized instance of azure_iot_t.
+ * @param[in]    azr          The result of the function.
+ */
+static void count_scratch_overflow(azure_iot_t* azure_iot, az_result azr)
+{
+  if (azr == AZ_ERROR_NOT_ENOUGH_SPACE)
+  {
+    azure_iot->scratch_overflow_count++;
+  }
+}
+
+/* --- az_core extensions --- */
+az_span split_az_span(az_span span, int32_t size, az_span* remainder)
+{
+  az_span result = az_span_slice(span, 0, size);
+
+  if (remainder != NULL && !az_span_is_content_equal(result, AZ_SPAN_EMPTY))
+  {
+    *remainder = az_span_slice(span, size, az_span_size(span));
+  }
+
+  return result;
+}
+
+az_span slice_and_copy_az_span(az_span destination, az_span source, az_span* remainder)
+{
+  az_span result = split_az_span(destination, az_span_size(source), remainder);
+
+  if (az_span_is_content_equal(*remainder, AZ_SPAN_EMPTY))
+  {
+    result = AZ_SPAN_EMPTY;
+  }
+
+  if (!az_span_is_content_equal(result, AZ_SPAN_EMPTY))
+  {
+    (void)az_span_copy(result, source);
+  }
+
+  return result;
+}
+
+/*
+ * @brief           Finds a reported property set and not sent yet.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ * @param[in]       name               Name of the property.
+ *
+ * @return          The index of the property in `azure_iot->reported_properties`, or -1 if not
+ * found.
+ */
+static int find_reported_property(azure_iot_t* azure_iot, az_span name)
+{
+  for (int i = 0; i < azure_iot->reported_properties_count; i++)
+  {
+    reported_property_t* property = &azure_iot->reported_properties[i];
+
+    // Skipping the comma and the opening quote.
+    if (property->name_size == az_span_size(name)
+        && az_span_is_content_equal(
+            az_span_slice(
+                azure_iot->config->reported_properties_buffer,
+                property->offset + 2,
+                property->offset + 2 + property->name_size),
+            name))
+    {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+/*
+ * @brief           Tells if a reported property fits in the buffer, replacing the value at `index`.
+ * @remark          Keeps space for the closing brace of the patch.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ * @param[in]       index              Index of the value replaced, or -1 if none.
+ * @param[in]       size               Size of the property, as added by
+ * `azure_iot_set_reported_property`.
+ *
+ * @return          true if the property fits, false otherwise.
+ */
+static bool has_space_for_reported_property(azure_iot_t* azure_iot, int index, int32_t size)
+{
+  int32_t used = azure_iot->reported_properties_used;
+
+  if (index >= 0)
+  {
+    used -= azure_iot->reported_properties[index].size;
+  }
+  else if (azure_iot->reported_properties_count == REPORTED_PROPERTIES_MAX_COUNT)
+  {
+    return false;
+  }
+
+  return (used + size) < az_span_size(azure_iot->config->reported_properties_buffer);
+}
+
+/*
+ * @brief           Removes a reported property, moving the ones after it over its space.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ * @param[in]       index              Index of the property in `azure_iot->reported_properties`.
+ *
+ * @return          Nothing.
+ */
+static void remove_reported_property(azure_iot_t* azure_iot, int index)
+{
+  uint8_t* buffer = az_span_ptr(azure_iot->config->reported_properties_buffer);
+  reported_property_t removed = azure_iot->reported_properties[index];
+
+  (void)memmove(
+      buffer + removed.offset,
+      buffer + removed.offset + removed.size,
+      (size_t)(azure_iot->reported_properties_used - removed.offset - removed.size));
+  azure_iot->reported_properties_used -= removed.size;
+
+  for (int i = index; i < azure_iot->reported_properties_count - 1; i++)
+  {
+    azure_iot->reported_properties[i] = azure_iot->reported_properties[i + 1];
+    azure_iot->reported_properties[i].offset -= removed.size;
+  }
+
+  azure_iot->reported_properties_count--;
+}
+
+/*
+ * @brief           Sends the reported properties set so far as a single patch.
+ * @remark          The patch is made in place: the leading comma becomes the opening brace, and
+ * the closing brace is appended.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ *
+ * @return int      0 on success, non-zero if any failure occurs (the properties are kept).
+ */
+static int flush_reported_properties(azure_iot_t* azure_iot)
+{
+  az_span buffer = azure_iot->config->reported_properties_buffer;
+  uint32_t rate_limit_wait_in_ms;
+  int result;
+
+  if (azure_iot->reported_properties_count == 0)
+  {
+    return RESULT_OK;
+  }
 
-  rc = az_iot_provisioning_client_sas_get_signature(
-      provisioning_client, *expiration_time, plain_sas_signature, &plain_sas_signature);
-  EXIT_IF_AZ_FAILED(rc, 0, "Could not get the signature for SAS key.");
+  rate_limit_wait_in_ms
+      = get_time_until_rate_limit_token_in_ms(azure_iot, outbound_message_class_properties);
 
-  // Step 2.b.
-  sas_signature = split_az_span(data_buffer_span, SAS_SIGNATURE_BUFFER_SIZE, &data_buffer_span);
-  EXIT_IF_TRUE(
-      az_span_is_content_equal(sas_signature, AZ_SPAN_EMPTY),
-      0,
-      "Failed reserving buffer for sas_signature.");
+  if (rate_limit_wait_in_ms > 0)
+  {
+    // Properties set in the meantime are merged into the same patch.
+    azure_iot->reported_properties_flush_time_in_ms
+        = get_current_time_in_ms(azure_iot) + rate_limit_wait_in_ms;
+    azure_iot->rate_limit_statistics.deferred_count[outbound_message_class_properties]++;
+    return RESULT_OK;
+  }
 
-  decoded_sas_key = split_az_span(data_buffer_span, DECODED_SAS_KEY_BUFFER_SIZE, &data_buffer_span);
-  EXIT_IF_TRUE(
-      az_span_is_content_equal(decoded_sas_key, AZ_SPAN_EMPTY),
-      0,
-      "Failed reserving buffer for decoded_sas_key.");
+  az_span_ptr(buffer)[0] = '{';
+  az_span_ptr(buffer)[azure_iot->reported_properties_used] = '}';
 
-  result = data_manipulation_functions.base64_decode(
-      az_span_ptr(device_key),
-      az_span_size(device_key),
-      az_span_ptr(decoded_sas_key),
-      az_span_size(decoded_sas_key),
-      &decoded_sas_key_length);
-  EXIT_IF_TRUE(result != 0, 0, "Failed decoding SAS key.");
+  result = azure_iot_send_properties_update(
+      azure_iot,
+      azure_iot->reported_properties_request_id,
+      az_span_slice(buffer, 0, azure_iot->reported_properties_used + 1));
 
-  // Step 2.c.
-  sas_hmac256_signed_signature = split_az_span(
-      data_buffer_span, SAS_HMAC256_ENCRYPTED_SIGNATURE_BUFFER_SIZE, &data_buffer_span);
-  EXIT_IF_TRUE(
-      az_span_is_content_equal(sas_hmac256_signed_signature, AZ_SPAN_EMPTY),
-      0,
-      "Failed reserving buffer for sas_hmac256_signed_signature.");
+  if (result != RESULT_OK)
+  {
+    az_span_ptr(buffer)[0] = ',';
+    return result;
+  }
 
-  result = data_manipulation_functions.hmac_sha256_encrypt(
-      az_span_ptr(decoded_sas_key),
-      decoded_sas_key_length,
-      az_span_ptr(plain_sas_signature),
-      az_span_size(plain_sas_signature),
-      az_span_ptr(sas_hmac256_signed_signature),
-      az_span_size(sas_hmac256_signed_signature));
-  EXIT_IF_TRUE(result != 0, 0, "Failed encrypting SAS signature.");
+  azure_iot->reported_properties_request_id++;
+  azure_iot->reported_properties_count = 0;
+  azure_iot->reported_properties_used = 0;
+  azure_iot->reported_properties_statistics.flush_count++;
 
-  // Step 2.d.
-  result = data_manipulation_functions.base64_encode(
-      az_span_ptr(sas_hmac256_signed_signature),
-      az_span_size(sas_hmac256_signed_signature),
-      az_span_ptr(sas_signature),
-      az_span_size(sas_signature),
-      &length);
-  EXIT_IF_TRUE(result != 0, 0, "Failed encoding SAS signature.");
+  return RESULT_OK;
+}
 
-  sas_signature = az_span_slice(sas_signature, 0, length);
+/*
+ * @brief           Adds the tokens earned since the last refill to the bucket of a message class.
+ * @remark          A bucket never used starts full. One backoff level is undone per
+ * RATE_LIMIT_RECOVERY_INTERVAL_IN_MS without throttling signals.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ * @param[in]       message_class      The class of outbound messages.
+ *
+ * @return          Nothing.
+ */
+static void refill_rate_limiter(azure_iot_t* azure_iot, outbound_message_class_t message_class)
+{
+  rate_limit_t* rate_limit = &azure_iot->config->rate_limits[message_class];
+  rate_limiter_t* rate_limiter = &azure_iot->rate_limiters[message_class];
+  uint64_t now = get_current_time_in_ms(azure_iot);
+  uint64_t capacity
+      = (uint64_t)(rate_limit->burst != 0 ? rate_limit->burst : rate_limit->rate_per_sec)
+      * RATE_LIMIT_TOKEN;
+  uint64_t tokens;
+
+  if (rate_limiter->last_refill_time_in_ms == 0)
+  {
+    rate_limiter->tokens = capacity;
+    rate_limiter->last_refill_time_in_ms = now;
+    return;
+  }
 
-  // Step 3.
-  rc = az_iot_provisioning_client_sas_get_password(
-      provisioning_client,
-      sas_signature,
-      *expiration_time,
-      AZ_SPAN_EMPTY,
-      (char*)az_span_ptr(sas_token),
-      az_span_size(sas_token),
-      &mqtt_password_length);
-  EXIT_IF_AZ_FAILED(rc, 0, "Could not get the password.");
+  tokens = ((now - rate_limiter->last_refill_time_in_ms) * rate_limit->rate_per_sec)
+      >> rate_limiter->backoff_level;
 
-  return mqtt_password_length;
+  // Fractions of a token are kept for the next refill by not moving the refill time.
+  if (tokens > 0)
+  {
+    rate_limiter->tokens
+        = (rate_limiter->tokens + tokens < capacity) ? rate_limiter->tokens + tokens : capacity;
+    rate_limiter->last_refill_time_in_ms = now;
+  }
+
+  while (rate_limiter->backoff_level > 0
+         && (now - rate_limiter->last_throttled_time_in_ms) >= RATE_LIMIT_RECOVERY_INTERVAL_IN_MS)
+  {
+    rate_limiter->backoff_level--;
+    rate_limiter->last_throttled_time_in_ms += RATE_LIMIT_RECOVERY_INTERVAL_IN_MS;
+    LogInfo(
+        "Rate limit of outbound class %d recovered to 1/%u.",
+        message_class,
+        1U << rate_limiter->backoff_level);
+  }
 }
 
 /*
- * @brief           Generates a SAS token used as password for connecting with Azure IoT Hub.
- * @remarks         The SAS token generation depends on the following steps:
- *                  1. Calculate the expiration time, as current unix time since epoch plus the
- * token duration, in minutes.
- *                  2. Generate the SAS signature;
- *                    a. Generate the DPS-specific secret string (a.k.a., "signature");
- *                    b. base64-decode the encryption key (device key);
- *                    c. Encrypt (HMAC-SHA256) the signature using the base64-decoded encryption
- * key; d. base64-encode the encrypted signature, which gives the final SAS signature (sig);
- *                  3. Compose the final SAS token with the DPS audience (sr), SAS signature (sig)
- * and expiration time (se).
- * @param[in]       iot_hub_client              A pointer to an initialized instance of
- * az_iot_hub_client.
- * @param[in]       device_key                  az_span containing the device key.
- * @param[in]       duration_in_minutes         Duration of the SAS token, in minutes.
- * @param[in]       data_buffer_span            az_span with a buffer containing enough space for
- * all the intermediate data generated by this function.
- * @param[in]       data_manipulation_functions Set of user-defined functions needed for the
- * generation of the SAS token.
- * @param[out]      sas_token                   az_span with buffer where to write the resulting SAS
- * token.
- * @param[out]      expiration_time             The expiration time of the resulting SAS token, as
- * unix time.
+ * @brief           Gets how long until a message of a class can be published within its rate
+ * limit.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ * @param[in]       message_class      The class of outbound messages.
  *
- * @return int      Length of the resulting SAS token, or zero if any failure occurs.
+ * @return uint32_t Time in milliseconds, zero if a message can be published right away.
  */
-static int generate_sas_token_for_iot_hub(
-    az_iot_hub_client* iot_hub_client,
-    az_span device_key,
-    unsigned int duration_in_minutes,
-    az_span data_buffer_span,
-    data_manipulation_functions_t data_manipulation_functions,
-    az_span sas_token,
-    uint32_t* expiration_time)
+static uint32_t get_time_until_rate_limit_token_in_ms(
+    azure_iot_t* azure_iot,
+    outbound_message_class_t message_class)
 {
-  int result;
-  az_result rc;
-  uint32_t current_unix_time;
-  size_t mqtt_password_length, decoded_sas_key_length, length;
-  az_span plain_sas_signature, sas_signature, decoded_sas_key, sas_hmac256_signed_signature;
+  uint32_t rate_per_sec = azure_iot->config->rate_limits[message_class].rate_per_sec;
+  rate_limiter_t* rate_limiter = &azure_iot->rate_limiters[message_class];
 
-  // Step 1.
-  current_unix_time = get_current_unix_time();
-  EXIT_IF_TRUE(current_unix_time == 0, 0, "Failed getting current unix time.");
+  if (rate_per_sec == 0)
+  {
+    return 0;
+  }
 
-  *expiration_time = current_unix_time + duration_in_minutes * NUMBER_OF_SECONDS_IN_A_MINUTE;
+  refill_rate_limiter(azure_iot, message_class);
 
-  // Step 2.a.
-  plain_sas_signature
-      = split_az_span(data_buffer_span, PLAIN_SAS_SIGNATURE_BUFFER_SIZE, &data_buffer_span);
-  EXIT_IF_TRUE(
-      az_span_is_content_equal(plain_sas_signature, AZ_SPAN_EMPTY),
-      0,
-      "Failed reserving buffer for plain sas token.");
+  if (rate_limiter->tokens >= RATE_LIMIT_TOKEN)
+  {
+    return 0;
+  }
 
-  rc = az_iot_hub_client_sas_get_signature(
-      iot_hub_client, *expiration_time, plain_sas_signature, &plain_sas_signature);
-  EXIT_IF_AZ_FAILED(rc, 0, "Could not get the signature for SAS key.");
+  return (uint32_t)(((RATE_LIMIT_TOKEN - rate_limiter->tokens) << rate_limiter->backoff_level)
+                    + rate_per_sec - 1)
+      / rate_per_sec;
+}
 
-  // Step 2.b.
-  sas_signature = split_az_span(data_buffer_span, SAS_SIGNATURE_BUFFER_SIZE, &data_buffer_span);
-  EXIT_IF_TRUE(
-      az_span_is_content_equal(sas_signature, AZ_SPAN_EMPTY),
-      0,
-      "Failed reserving buffer for sas_signature.");
+/*
+ * @brief           Takes a token from the bucket of a message class, if there is one.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ * @param[in]       message_class      The class of outbound messages.
+ *
+ * @return bool     True if a message of the class can be published now, false otherwise.
+ */
+static bool take_rate_limit_token(azure_iot_t* azure_iot, outbound_message_class_t message_class)
+{
+  if (get_time_until_rate_limit_token_in_ms(azure_iot, message_class) > 0)
+  {
+    return false;
+  }
 
-  decoded_sas_key = split_az_span(data_buffer_span, DECODED_SAS_KEY_BUFFER_SIZE, &data_buffer_span);
-  EXIT_IF_TRUE(
-      az_span_is_content_equal(decoded_sas_key, AZ_SPAN_EMPTY),
-      0,
-      "Failed reserving buffer for decoded_sas_key.");
+  if (azure_iot->config->rate_limits[message_class].rate_per_sec != 0)
+  {
+    azure_iot->rate_limiters[message_class].tokens -= RATE_LIMIT_TOKEN;
+  }
 
-  result = data_manipulation_functions.base64_decode(
-      az_span_ptr(device_key),
-      az_span_size(device_key),
-      az_span_ptr(decoded_sas_key),
-      az_span_size(decoded_sas_key),
-      &decoded_sas_key_length);
-  EXIT_IF_TRUE(result != 0, 0, "Failed decoding SAS key.");
+  return true;
+}
 
-  // Step 2.c.
-  sas_hmac256_signed_signature = split_az_span(
-      data_buffer_span, SAS_HMAC256_ENCRYPTED_SIGNATURE_BUFFER_SIZE, &data_buffer_span);
-  EXIT_IF_TRUE(
-      az_span_is_content_equal(sas_hmac256_signed_signature, AZ_SPAN_EMPTY),
-      0,
-      "Failed reserving buffer for sas_hmac256_signed_signature.");
+/*
+ * @brief           Backs off the rate limit of a message class on a throttling signal from the
+ * Azure IoT Hub.
+ * @remark          The rate is halved (up to RATE_LIMIT_MAX_BACKOFF_LEVEL times) and the bucket
+ * emptied, so no burst follows. Classes without a rate limit are left unlimited.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ * @param[in]       message_class      The class of outbound messages.
+ *
+ * @return          Nothing.
+ */
+static void throttle_rate_limit(azure_iot_t* azure_iot, outbound_message_class_t message_class)
+{
+  rate_limiter_t* rate_limiter = &azure_iot->rate_limiters[message_class];
 
-  result = data_manipulation_functions.hmac_sha256_encrypt(
-      az_span_ptr(decoded_sas_key),
-      decoded_sas_key_length,
-      az_span_ptr(plain_sas_signature),
-      az_span_size(plain_sas_signature),
-      az_span_ptr(sas_hmac256_signed_signature),
-      az_span_size(sas_hmac256_signed_signature));
-  EXIT_IF_TRUE(result != 0, 0, "Failed encrypting SAS signature.");
+  if (azure_iot->config->rate_limits[message_class].rate_per_sec == 0)
+  {
+    return;
+  }
 
-  // Step 2.d.
-  result = data_manipulation_functions.base64_encode(
-      az_span_ptr(sas_hmac256_signed_signature),
-      az_span_size(sas_hmac256_signed_signature),
-      az_span_ptr(sas_signature),
-      az_span_size(sas_signature),
-      &length);
-  EXIT_IF_TRUE(result != 0, 0, "Failed encoding SAS signature.");
+  refill_rate_limiter(azure_iot, message_class);
 
-  sas_signature = az_span_slice(sas_signature, 0, length);
+  if (rate_limiter->backoff_level < RATE_LIMIT_MAX_BACKOFF_LEVEL)
+  {
+    rate_limiter->backoff_level++;
+  }
 
-  // Step 3.
-  rc = az_iot_hub_client_sas_get_password(
-      iot_hub_client,
-      *expiration_time,
-      sas_signature,
-      AZ_SPAN_EMPTY,
-      (char*)az_span_ptr(sas_token),
-      az_span_size(sas_token),
-      &mqtt_password_length);
-  EXIT_IF_AZ_FAILED(rc, 0, "Could not get the password.");
+  rate_limiter->tokens = 0;
+  rate_limiter->last_throttled_time_in_ms = get_current_time_in_ms(azure_iot);
+  azure_iot->rate_limit_statistics.throttled_count[message_class]++;
 
-  return mqtt_password_length;
+  LogInfo(
+      "Throttled by Azure IoT Hub, rate limit of outbound class %d backed off to 1/%u.",
+      message_class,
+      1U << rate_limiter->backoff_level);
 }
 
-/**
- * @brief        Generates a custom payload for DPS registration request containing the Azure PnP
- * model ID.
- * @remark       This payload with the model ID is required for Azure IoT Central to properly
- *               assign the IoT Plug and Play template.
- *
- * @param[in]    mode_id        The string with the IoT Plug and Play model ID.
- * @param[in]    data_buffer    Buffer where to write the resulting payload.
- * @param[in]    remainder      The remainder space of `data_buffer` after enough is reserved for
- *                              the resulting payload.
+/*
+ * @brief           Copies a message into the outbound queue of its class.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ * @param[in]       message_class      The class of the message.
+ * @param[in]       mqtt_message       The message to be queued; its topic is queued as-is.
  *
- * @return       az_span        An az_span (reserved from `data_buffer`) containing the payload
- *                              for the DPS registration request.
+ * @return int      0 on success, or non-zero if the queue is full.
  */
-static az_span generate_dps_register_custom_property(
-    az_span model_id,
-    az_span data_buffer,
-    az_span* remainder)
+static int enqueue_outbound_message(
+    azure_iot_t* azure_iot,
+    outbound_message_class_t message_class,
+    mqtt_message_t* mqtt_message)
 {
-  az_span custom_property;
-  size_t length = lengthof(DPS_REGISTER_CUSTOM_PAYLOAD_BEGIN) + az_span_size(model_id)
-      + lengthof(DPS_REGISTER_CUSTOM_PAYLOAD_END);
+  outbound_queue_t* queue = &azure_iot->outbound_queues[message_class];
+  outbound_queue_statistics_t* statistics = &azure_iot->outbound_queue_statistics;
+  az_span buffer = azure_iot->config->outbound_queue_buffers[message_class];
+  int32_t size = az_span_size(mqtt_message->topic) + az_span_size(mqtt_message->payload);
+  outbound_message_t* message;
 
-  custom_property = split_az_span(data_buffer, length, remainder);
-  EXIT_IF_TRUE(
-      az_span_is_content_equal(custom_property, AZ_SPAN_EMPTY),
-      AZ_SPAN_EMPTY,
-      "Failed generating DPS register custom property (not enough space).");
+  if (queue->count == OUTBOUND_QUEUE_MAX_COUNT || (queue->used + size) > az_span_size(buffer))
+  {
+    statistics->overflow_count[message_class]++;
+    return RESULT_ERROR;
+  }
 
-  data_buffer = az_span_copy(data_buffer, AZ_SPAN_FROM_STR(DPS_REGISTER_CUSTOM_PAYLOAD_BEGIN));
-  EXIT_IF_TRUE(
-      az_span_is_content_equal(data_buffer, AZ_SPAN_EMPTY),
-      AZ_SPAN_EMPTY,
-      "Failed generating DPS register custom property (prefix).");
+  buffer = az_span_slice_to_end(buffer, queue->used);
+  buffer = az_span_copy(buffer, mqtt_message->topic);
+  (void)az_span_copy(buffer, mqtt_message->payload);
 
-  data_buffer = az_span_copy(data_buffer, model_id);
-  EXIT_IF_TRUE(
-      az_span_is_content_equal(data_buffer, AZ_SPAN_EMPTY),
-      AZ_SPAN_EMPTY,
-      "Failed generating DPS register custom property (model id).");
+  message = &queue->messages[queue->count];
+  message->topic_size = az_span_size(mqtt_message->topic);
+  message->payload_size = az_span_size(mqtt_message->payload);
+  message->qos = mqtt_message->qos;
+  message->enqueued_time_in_ms = get_current_time_in_ms(azure_iot);
 
-  data_buffer = az_span_copy(data_buffer, AZ_SPAN_FROM_STR(DPS_REGISTER_CUSTOM_PAYLOAD_END));
-  EXIT_IF_TRUE(
-      az_span_is_content_equal(data_buffer, AZ_SPAN_EMPTY),
-      AZ_SPAN_EMPTY,
-      "Failed generating DPS register custom property (suffix).");
+  queue->count++;
+  queue->used += size;
+  statistics->queued_count[message_class]++;
 
-  return custom_property;
+  if (queue->count > statistics->max_count[message_class])
+  {
+    statistics->max_count[message_class] = queue->count;
+  }
+
+  return RESULT_OK;
 }
 
-/* --- az_core extensions --- */
-az_span split_az_span(az_span span, int32_t size, az_span* remainder)
+/*
+ * @brief           Publishes the oldest message in the outbound queue of a class, and removes it.
+ * @remark          A message that fails to be published is dropped, so it cannot hold back the
+ * rest of the queue.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ * @param[in]       message_class      The class of the queue, which must not be empty.
+ *
+ * @return          Nothing.
+ */
+static void publish_queued_outbound_message(
+    azure_iot_t* azure_iot,
+    outbound_message_class_t message_class)
 {
-  az_span result = az_span_slice(span, 0, size);
+  outbound_queue_t* queue = &azure_iot->outbound_queues[message_class];
+  outbound_queue_statistics_t* statistics = &azure_iot->outbound_queue_statistics;
+  outbound_message_t* message = &queue->messages[0];
+  az_span buffer = azure_iot->config->outbound_queue_buffers[message_class];
+  int32_t size = message->topic_size + message->payload_size;
+  uint32_t delay_in_ms
+      = (uint32_t)(get_current_time_in_ms(azure_iot) - message->enqueued_time_in_ms);
+  mqtt_message_t mqtt_message;
+  int result;
 
-  if (remainder != NULL && !az_span_is_content_equal(result, AZ_SPAN_EMPTY))
+  mqtt_message.topic = az_span_slice(buffer, 0, message->topic_size);
+  mqtt_message.payload = message->payload_size == 0
+      ? AZ_SPAN_EMPTY
+      : az_span_slice(buffer, message->topic_size, size);
+  mqtt_message.qos = message->qos;
+
+  if (message_class == outbound_message_class_telemetry)
   {
-    *remainder = az_span_slice(span, size, az_span_size(span));
+    result = publish_telemetry(azure_iot, mqtt_message.payload);
+  }
+  else
+  {
+    result = publish_mqtt_message(azure_iot, &mqtt_message) < 0 ? RESULT_ERROR : RESULT_OK;
   }
 
-  return result;
+  if (result == RESULT_OK)
+  {
+    statistics->published_count[message_class]++;
+    statistics->total_delay_in_ms[message_class] += delay_in_ms;
+
+    if (delay_in_ms > statistics->max_delay_in_ms[message_class])
+    {
+      statistics->max_delay_in_ms[message_class] = delay_in_ms;
+    }
+  }
+  else
+  {
+    statistics->failed_count[message_class]++;
+    LogError("Failed publishing queued message of outbound class %d.", message_class);
+  }
+
+  // The rest of the queue is moved to the front of its buffer.
+  (void)memmove(az_span_ptr(buffer), az_span_ptr(buffer) + size, (size_t)(queue->used - size));
+  (void)memmove(
+      &queue->messages[0],
+      &queue->messages[1],
+      (queue->count - 1) * sizeof(outbound_message_t));
+  queue->used -= size;
+  queue->count--;
 }
 
-az_span slice_and_copy_az_span(az_span destination, az_span source, az_span* remainder)
+/*
+ * @brief           Publishes the messages in the outbound queues, in strict priority order.
+ * @remark          At most OUTBOUND_QUEUE_DRAIN_MAX_COUNT messages are published per call, so
+ * messages queued in between by a higher class are published ahead of the rest. Telemetry is only
+ * published while there is an in-flight slot for it (its rate limit token is taken when queued).
+ * Command responses and properties are published while their rate limits allow it, and otherwise
+ * wait in their queues.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ *
+ * @return          Nothing.
+ */
+static void drain_outbound_queues(azure_iot_t* azure_iot)
 {
-  az_span result = split_az_span(destination, az_span_size(source), remainder);
+  uint32_t published_count = 0;
 
-  if (az_span_is_content_equal(*remainder, AZ_SPAN_EMPTY))
+  for (int i = 0; i < OUTBOUND_MESSAGE_CLASS_COUNT; i++)
   {
-    result = AZ_SPAN_EMPTY;
-  }
+    outbound_message_class_t message_class = (outbound_message_class_t)i;
 
-  if (!az_span_is_content_equal(result, AZ_SPAN_EMPTY))
-  {
-    (void)az_span_copy(result, source);
+    while (azure_iot->outbound_queues[i].count > 0
+           && published_count < OUTBOUND_QUEUE_DRAIN_MAX_COUNT
+           && (message_class == outbound_message_class_telemetry
+                   ? can_publish_telemetry(azure_iot)
+                   : take_rate_limit_token(azure_iot, message_class)))
+    {
+      publish_queued_outbound_message(azure_iot, message_class);
+      published_count++;
+    }
   }
+}
 
-  return result;
+/*
+ * @brief           Tells if `drain_outbound_queues` has any message to publish right away.
+ * @param[in]       azure_iot          A pointer to an initialized instance of azure_iot_t.
+ *
+ * @return bool     True if there is a message to publish, false otherwise.
+ */
+static bool is_outbound_queue_drainable(azure_iot_t* azure_iot)
+{
+  return (azure_iot->outbound_queues[outbound_message_class_command_response].count > 0
+          && get_time_until_rate_limit_token_in_ms(
+                 azure_iot, outbound_message_class_command_response)
+              == 0)
+      || (azure_iot->outbound_queues[outbound_message_class_properties].count > 0
+          && get_time_until_rate_limit_token_in_ms(azure_iot, outbound_message_class_properties)
+              == 0)
+      || (azure_iot->outbound_queues[outbound_message_class_telemetry].count > 0
+          && can_publish_telemetry(azure_iot));
 }
@@ -64,6 +64,50 @@ extern log_function_t default_logging_function;
 
 #define DEFAULT_SAS_TOKEN_LIFETIME_IN_MINUTES 60
 #define SAS_TOKEN_REFRESH_THRESHOLD_IN_SECS 30
+#define SAS_TOKEN_PREPARE_THRESHOLD_IN_SECS 120
+
+#define SAS_REFRESH_HELD_MESSAGES_MAX_COUNT 4
+
+#define PNP_SUBSCRIPTIONS_COUNT 3
+
+#define DEFAULT_DATA_BUFFER_PERSISTENT_REGION_SIZE 256
+#define DEFAULT_DATA_BUFFER_CONNECTION_REGION_SIZE 384
+
+#define EVENT_WAIT_MAX_TIMEOUT_IN_MS 5000
+
+// Large enough for the telemetry content type and encoding message properties.
+#define TELEMETRY_TOPIC_BUFFER_SIZE 224
+#define DECODED_SAS_KEY_BUFFER_SIZE 64
+#define TELEMETRY_PROPERTIES_BUFFER_SIZE 64
+#define REPORTED_PROPERTIES_TOPIC_PREFIX_BUFFER_SIZE 64
+
+#define DEFAULT_DPS_RECONNECT_MIN_DELAY_IN_MS 5000
+#define DEFAULT_DPS_RECONNECT_MAX_DELAY_IN_MS 300000
+#define DEFAULT_DPS_RECONNECT_MAX_ATTEMPTS_PER_WINDOW 10
+#define DEFAULT_IOT_HUB_RECONNECT_MIN_DELAY_IN_MS 1000
+#define DEFAULT_IOT_HUB_RECONNECT_MAX_DELAY_IN_MS 120000
+#define DEFAULT_IOT_HUB_RECONNECT_MAX_ATTEMPTS_PER_WINDOW 30
+#define DEFAULT_RECONNECT_WINDOW_IN_SECS 3600
+
+#define DEFAULT_OFFLINE_TELEMETRY_DRAIN_RATE_PER_SEC 5
+
+#define TELEMETRY_IN_FLIGHT_MAX_COUNT 8
+#define DEFAULT_TELEMETRY_ACK_TIMEOUT_IN_MS 10000
+#define DEFAULT_TELEMETRY_MAX_RETRANSMIT_COUNT 3
+
+#define REPORTED_PROPERTIES_MAX_COUNT 8
+#define DEFAULT_REPORTED_PROPERTIES_FLUSH_INTERVAL_IN_MS 500
+
+#define DEFAULT_TLS_SESSION_LIFETIME_IN_SECS 3600
+
+#define PROPERTIES_DOCUMENT_RETRY_MIN_DELAY_IN_MS 1000
+#define PROPERTIES_DOCUMENT_RETRY_MAX_DELAY_IN_MS 60000
+
+#define RATE_LIMIT_MAX_BACKOFF_LEVEL 4
+#define RATE_LIMIT_RECOVERY_INTERVAL_IN_MS 30000
+
+#define OUTBOUND_QUEUE_MAX_COUNT 8
+#define OUTBOUND_QUEUE_DRAIN_MAX_COUNT 4
 
 /*
  * The structures below define a generic interface to abstract the interaction of this module,
@@ -81,6 +125,26 @@ typedef enum mqtt_qos_t_enum
   mqtt_qos_exactly_once = MQTT_QOS_EXACTLY_ONCE
 } mqtt_qos_t;
 
+#define MQTT_CONNECT_RETURN_CODE_ACCEPTED 0
+#define MQTT_CONNECT_RETURN_CODE_UNACCEPTABLE_PROTOCOL 1
+#define MQTT_CONNECT_RETURN_CODE_ID_REJECTED 2
+#define MQTT_CONNECT_RETURN_CODE_SERVER_UNAVAILABLE 3
+#define MQTT_CONNECT_RETURN_CODE_BAD_USERNAME 4
+#define MQTT_CONNECT_RETURN_CODE_NOT_AUTHORIZED 5
+
+/*
+ * @brief    Return codes of an MQTT 3.1.1 CONNACK.
+ */
+typedef enum mqtt_connect_return_code_t_enum
+{
+  mqtt_connect_return_code_accepted = MQTT_CONNECT_RETURN_CODE_ACCEPTED,
+  mqtt_connect_return_code_unacceptable_protocol = MQTT_CONNECT_RETURN_CODE_UNACCEPTABLE_PROTOCOL,
+  mqtt_connect_return_code_id_rejected = MQTT_CONNECT_RETURN_CODE_ID_REJECTED,
+  mqtt_connect_return_code_server_unavailable = MQTT_CONNECT_RETURN_CODE_SERVER_UNAVAILABLE,
+  mqtt_connect_return_code_bad_username = MQTT_CONNECT_RETURN_CODE_BAD_USERNAME,
+  mqtt_connect_return_code_not_authorized = MQTT_CONNECT_RETURN_CODE_NOT_AUTHORIZED
+} mqtt_connect_return_code_t;
+
 /*
  * @brief     Defines a generic MQTT message to be exchanged between the AzureIoT layer
  *            and the user application.
@@ -97,6 +161,25 @@ typedef struct mqtt_message_t_struct
   mqtt_qos_t qos;
 } mqtt_message_t;
 
+// Enough for a topic prefix, a request id and a payload split in a couple of chunks.
+#define MQTT_MESSAGE_FRAGMENTS_MAX_COUNT 4
+
+/*
+ * @brief     MQTT message whose topic and payload are each given as a list of fragments, to be
+ *            concatenated by the MQTT client as it serializes the PUBLISH.
+ * @remark    This lets the Azure IoT client pass cached topic prefixes, request ids and payload
+ *            chunks as they are, instead of first joining them into a single buffer that the MQTT
+ *            client would copy again. The topic fragments do not include a null-terminator.
+ */
+typedef struct mqtt_message_fragments_t_struct
+{
+  az_span topic[MQTT_MESSAGE_FRAGMENTS_MAX_COUNT];
+  uint8_t topic_count;
+  az_span payload[MQTT_MESSAGE_FRAGMENTS_MAX_COUNT];
+  uint8_t payload_count;
+  mqtt_qos_t qos;
+} mqtt_message_fragments_t;
+
 /*
  * @brief    Configuration structure passed by `mqtt_client_init_function_t` to the user
  *           application for initializing the actual MQTT client.
@@ -127,6 +210,16 @@ typedef struct mqtt_client_config_t_struct
    * @brief    Password to be provided in the CONNECT sent by the MQTT client.
    */
   az_span password;
+
+  /*
+   * @brief    TLS session (ticket or session id) saved from a previous connection to the same
+   *           server, to be offered by the MQTT client to resume it instead of performing a full
+   *           TLS handshake.
+   * @remark   Opaque to the Azure IoT client, as given to
+   *           `azure_iot_mqtt_client_tls_session_established`. AZ_SPAN_EMPTY if there is no
+   *           session to resume.
+   */
+  az_span tls_session;
 } mqtt_client_config_t;
 
 /*
@@ -183,7 +276,7 @@ typedef int (*mqtt_client_deinit_function_t)(mqtt_client_handle_t mqtt_client_ha
  * @return       int                   The packet ID on success, or NEGATIVE if any failure occurs.
  *                                     If the QoS in `mqtt_message` is:
  *                                     - AT LEAST ONCE, the Azure IoT client expects
- * `azure_iot_mqtt_client_connected` to be called once the MQTT client receives a PUBACK.
+ * `azure_iot_mqtt_client_publish_completed` to be called once the MQTT client receives a PUBACK.
  *                                     - AT MOST ONCE, there should be no PUBACK, so no further
  * action is needed for this PUBLISH.
  */
@@ -191,6 +284,24 @@ typedef int (*mqtt_client_publish_function_t)(
     mqtt_client_handle_t mqtt_client_handle,
     mqtt_message_t* mqtt_message);
 
+/*
+ * @brief        Function to send an MQTT PUBLISH given in fragments.
+ * @remark       Same as `mqtt_client_publish_function_t`, except that the topic and the payload are
+ * the concatenation of the fragments in `mqtt_message`, which the MQTT client is expected to
+ * serialize directly into its transmit buffer.
+ *
+ * @param[in]    mqtt_client_handle    A pointer to the instance of the MQTT client previously
+ * created with `mqtt_client_init_function_t` function.
+ * @param[in]    mqtt_message          A structure containing the topic name and payload fragments,
+ * and the QoS to be used to publish an actual MQTT message.
+ *
+ * @return       int                   The packet ID on success, or NEGATIVE if any failure occurs,
+ * as for `mqtt_client_publish_function_t`.
+ */
+typedef int (*mqtt_client_publish_fragments_function_t)(
+    mqtt_client_handle_t mqtt_client_handle,
+    mqtt_message_fragments_t* mqtt_message);
+
 /*
  * @brief        Function to send an MQTT SUBSCRIBE.
  * @remark       When this function is invoked, Azure IoT client expects the actual MQTT client
@@ -213,12 +324,16 @@ typedef int (*mqtt_client_subscribe_function_t)(
 
 /*
  * @brief    Structure that consolidates all the abstracted MQTT functions.
+ * @remark   `mqtt_client_publish_fragments` is optional. If it is NULL, the fragments of properties
+ *           updates and command responses are joined into the data buffer and published with
+ *           `mqtt_client_publish`, as are messages held or queued by the Azure IoT client.
  */
 typedef struct mqtt_client_interface_t_struct
 {
   mqtt_client_init_function_t mqtt_client_init;
   mqtt_client_deinit_function_t mqtt_client_deinit;
   mqtt_client_publish_function_t mqtt_client_publish;
+  mqtt_client_publish_fragments_function_t mqtt_client_publish_fragments;
   mqtt_client_subscribe_function_t mqtt_client_subscribe;
 } mqtt_client_interface_t;
 
@@ -294,6 +409,60 @@ typedef struct data_manipulation_functions_t_struct
   hmac_sha256_encryption_function_t hmac_sha256_encrypt;
 } data_manipulation_functions_t;
 
+/*
+ * @brief         Function to load a previously saved device-provisioning result.
+ * @remark        When this function is invoked, the user application shall copy the Azure IoT Hub
+ * FQDN and device ID last saved with `provisioning_cache_save_function_t` into the buffers provided.
+ * No null-terminators are expected.
+ *
+ * @param[in]     iot_hub_fqdn           Buffer where to write the Azure IoT Hub FQDN.
+ * @param[out]    iot_hub_fqdn_length    Length of the Azure IoT Hub FQDN written in `iot_hub_fqdn`.
+ * @param[in]     device_id              Buffer where to write the device ID.
+ * @param[out]    device_id_length       Length of the device ID written in `device_id`.
+ *
+ * @return        int                    0 on success, or non-zero if nothing is saved or any
+ * failure occurs.
+ */
+typedef int (*provisioning_cache_load_function_t)(
+    az_span iot_hub_fqdn,
+    int32_t* iot_hub_fqdn_length,
+    az_span device_id,
+    int32_t* device_id_length);
+
+/*
+ * @brief         Function to save the result of a successful device-provisioning.
+ * @remark        The content must be kept in non-volatile storage (e.g., NVS on the ESP32) so it
+ * survives a reboot of the device.
+ *
+ * @param[in]     iot_hub_fqdn    The Azure IoT Hub FQDN assigned by Azure Device Provisioning.
+ * @param[in]     device_id       The device ID assigned by Azure Device Provisioning.
+ *
+ * @return        int             0 on success, or non-zero if any failure occurs.
+ */
+typedef int (*provisioning_cache_save_function_t)(az_span iot_hub_fqdn, az_span device_id);
+
+/*
+ * @brief         Function to erase the device-provisioning result previously saved.
+ * @remark        Invoked when the Azure IoT Hub saved rejects the device (as informed through
+ * `azure_iot_mqtt_client_connection_refused`), so the next start performs device-provisioning
+ * again.
+ *
+ * @return        int             0 on success, or non-zero if any failure occurs.
+ */
+typedef int (*provisioning_cache_clear_function_t)();
+
+/*
+ * @brief    Structure that consolidates the functions for persisting device-provisioning results.
+ * @remark   This is optional. If `load` is NULL, device-provisioning is always performed when
+ *           the Azure IoT client is started for the first time.
+ */
+typedef struct provisioning_cache_interface_t_struct
+{
+  provisioning_cache_load_function_t load;
+  provisioning_cache_save_function_t save;
+  provisioning_cache_clear_function_t clear;
+} provisioning_cache_interface_t;
+
 /*
  * @brief        Defines the callback for notifying the completion of a reported properties update.
  *
@@ -307,16 +476,22 @@ typedef struct data_manipulation_functions_t_struct
 typedef void (*properties_update_completed_t)(uint32_t request_id, az_iot_status status_code);
 
 /*
- * @brief        Defines the callback for receiving a writable-properties update.
+ * @brief        Defines the callback for receiving writable properties.
+ * @remark       Writable properties are received either as an update (only the properties that
+ *               changed) or, once the client is ready after each connection, as the full
+ *               properties document (with the writable properties in its "desired" section).
+ *               In both cases the writable properties carry a "$version", which can be used to
+ *               skip the ones already applied.
  *
- * @param[in]    request_id     Request ID provided by the caller when sending the reported
- * properties update.
- * @param[in]    status_code    Result of the reported properties update (uses HTTP status code
- * semantics).
+ * @param[in]    properties     Raw payload with the writable properties received from Azure.
+ * @param[in]    message_type   Either AZ_IOT_HUB_CLIENT_PROPERTIES_MESSAGE_TYPE_WRITABLE_UPDATED
+ *                              or AZ_IOT_HUB_CLIENT_PROPERTIES_MESSAGE_TYPE_GET_RESPONSE.
  *
  * @return                      Nothing.
  */
-typedef void (*properties_received_t)(az_span properties);
+typedef void (*properties_received_t)(
+    az_span properties,
+    az_iot_hub_client_properties_message_type message_type);
 
 /*
  * @brief    Structure containing all the details of a IoT Plug and Play Command.
@@ -390,6 +565,9 @@ typedef enum azure_iot_status_t_struct
    *            Once the possible mitigations are applied stop the Azure IoT client
    *            by calling `azure_iot_stop` (which resets the client state) and restart it
    *            using `azure_iot_start`.
+   *            If `automatic_reconnect` is set in `azure_iot_config_t`, the Azure IoT client
+   *            leaves this state by itself on the next call to `azure_iot_do_work`, scheduling
+   *            a reconnection (reported as `azure_iot_connecting`).
    */
   azure_iot_error
 } azure_iot_status_t;
@@ -412,16 +590,481 @@ typedef enum azure_iot_client_state_t_struct
   azure_iot_state_provisioned,
   azure_iot_state_connecting_to_hub,
   azure_iot_state_connected_to_hub,
-  azure_iot_state_subscribing_to_pnp_cmds,
-  azure_iot_state_subscribed_to_pnp_cmds,
-  azure_iot_state_subscribing_to_pnp_props,
-  azure_iot_state_subscribed_to_pnp_props,
-  azure_iot_state_subscribing_to_pnp_writable_props,
+  azure_iot_state_subscribing_to_pnp_topics,
   azure_iot_state_ready,
   azure_iot_state_refreshing_sas,
+  azure_iot_state_reconnect_scheduled,
   azure_iot_state_error
 } azure_iot_client_state_t;
 
+#define AZURE_IOT_CLIENT_STATE_COUNT (azure_iot_state_error + 1)
+
+/*
+ * @brief    Time spent by the Azure IoT client in each of its states (connection phases).
+ * @remark   Arrays are indexed by azure_iot_client_state_t. `entry_count` counts the transitions
+ *           into each state. `total_time_in_ms` and `last_time_in_ms` are the time spent in each
+ *           state overall and on the last time it was left; the time in the current state is
+ *           only added once it is left. `last_time_to_ready_in_ms` is the time it took to get
+ *           ready, from the last `azure_iot_start` (or SAS token refresh).
+ */
+typedef struct connection_phase_statistics_t_struct
+{
+  uint32_t entry_count[AZURE_IOT_CLIENT_STATE_COUNT];
+  uint32_t total_time_in_ms[AZURE_IOT_CLIENT_STATE_COUNT];
+  uint32_t last_time_in_ms[AZURE_IOT_CLIENT_STATE_COUNT];
+  uint32_t last_time_to_ready_in_ms;
+} connection_phase_statistics_t;
+
+/*
+ * @brief    Defines how the Azure IoT client retries connecting after a failure.
+ * @remark   The delay before attempt N (starting at zero) is a random value between zero and
+ *           min(`max_delay_in_ms`, `min_delay_in_ms` * 2^N) ("full jitter"), so a fleet of devices
+ *           disconnected at once do not reconnect in lockstep. Once `max_attempts_per_window`
+ *           attempts are made within `window_in_secs`, the next attempt waits for the window to
+ *           end. Any member set to zero assumes its default value.
+ */
+typedef struct reconnect_policy_t_struct
+{
+  uint32_t min_delay_in_ms;
+  uint32_t max_delay_in_ms;
+  uint32_t max_attempts_per_window;
+  uint32_t window_in_secs;
+} reconnect_policy_t;
+
+/*
+ * @brief    Statistics of the automatic reconnections performed by the Azure IoT client.
+ */
+typedef struct reconnect_statistics_t_struct
+{
+  uint32_t attempts_count;
+  uint32_t dps_failures_count;
+  uint32_t iot_hub_failures_count;
+  uint32_t window_limit_reached_count;
+  uint32_t last_delay_in_ms;
+  uint64_t disconnected_time_in_ms;
+} reconnect_statistics_t;
+
+/*
+ * @brief    State of the backoff for one of the reconnect policies.
+ * @remark   Internal to the Azure IoT client.
+ */
+typedef struct reconnect_backoff_t_struct
+{
+  uint32_t consecutive_failures_count;
+  uint32_t window_attempts_count;
+  uint64_t window_start_time_in_ms;
+} reconnect_backoff_t;
+
+/*
+ * @brief        Function that returns a random number.
+ * @remark       Used for the jitter of the reconnection delays. It should produce different values
+ *               on different devices (e.g., a hardware random number generator), otherwise devices
+ *               still reconnect in lockstep.
+ *
+ * @return       uint32_t    A random number.
+ */
+typedef uint32_t (*random_number_function_t)();
+
+/*
+ * @brief    Modes for refreshing the SAS token used as MQTT password.
+ */
+typedef enum sas_token_refresh_mode_t_enum
+{
+  /*
+   * @brief     Once the SAS token is about to expire the MQTT client is disconnected, and only then
+   *            a new SAS token is generated and a new connection started.
+   */
+  sas_token_refresh_mode_break_before_make = 0,
+  /*
+   * @brief     The next SAS token is generated ahead of time (SAS_TOKEN_PREPARE_THRESHOLD_IN_SECS
+   *            before expiration) while the client is still connected, so once the current token
+   *            is about to expire the MQTT client is re-initialized right away with it.
+   * @remark    This mode expects `azure_iot_mqtt_client_disconnected` to be invoked from within
+   *            `mqtt_client_deinit`, as done in the sample.
+   */
+  sas_token_refresh_mode_make_before_break
+} sas_token_refresh_mode_t;
+
+/*
+ * @brief    Statistics of the SAS token refreshes performed by the Azure IoT client.
+ * @remark   The blackout is the time, in milliseconds, between the MQTT client being disconnected
+ *           for a refresh and the Azure IoT client being ready for messaging again.
+ */
+typedef struct sas_token_refresh_statistics_t_struct
+{
+  uint32_t refresh_count;
+  uint32_t last_blackout_in_ms;
+  uint32_t max_blackout_in_ms;
+  uint32_t held_messages_count;
+  uint32_t dropped_messages_count;
+} sas_token_refresh_statistics_t;
+
+/*
+ * @brief         Function to append a telemetry record to the offline telemetry storage.
+ * @remark        Invoked when the in-memory offline telemetry buffer is full, with its oldest
+ *                record, so that record is not dropped. Records must be returned by
+ *                `offline_telemetry_storage_peek_function_t` in the same order they were pushed.
+ *
+ * @param[in]     record    The telemetry payload to be stored.
+ *
+ * @return        int       0 on success, or non-zero if any failure occurs (e.g., storage full).
+ */
+typedef int (*offline_telemetry_storage_push_function_t)(az_span record);
+
+/*
+ * @brief         Function to read the oldest telemetry record in the offline telemetry storage,
+ *                without removing it.
+ *
+ * @param[in]     buffer           Buffer where to copy the record.
+ * @param[out]    record_length    Length of the record copied into `buffer`.
+ *
+ * @return        int              0 on success, or non-zero if the storage is empty or any
+ * failure occurs.
+ */
+typedef int (*offline_telemetry_storage_peek_function_t)(az_span buffer, int32_t* record_length);
+
+/*
+ * @brief         Function to remove the oldest telemetry record from the offline telemetry storage.
+ * @remark        Invoked once the record last returned by
+ *                `offline_telemetry_storage_peek_function_t` is published.
+ *
+ * @return        int       0 on success, or non-zero if any failure occurs.
+ */
+typedef int (*offline_telemetry_storage_pop_function_t)();
+
+/*
+ * @brief    Structure that consolidates the functions for spilling offline telemetry into
+ *           non-volatile storage (e.g., flash on the ESP32).
+ * @remark   This is optional. If `push` is NULL, the oldest records are dropped once the in-memory
+ *           offline telemetry buffer is full.
+ */
+typedef struct offline_telemetry_storage_interface_t_struct
+{
+  offline_telemetry_storage_push_function_t push;
+  offline_telemetry_storage_peek_function_t peek;
+  offline_telemetry_storage_pop_function_t pop;
+} offline_telemetry_storage_interface_t;
+
+/*
+ * @brief    Statistics of the telemetry stored while the Azure IoT client was not connected.
+ * @remark   `buffered_count` is the number of records currently in the in-memory buffer.
+ *           `dropped_count` counts the records lost because neither the in-memory buffer nor the
+ *           offline telemetry storage had space for them.
+ */
+typedef struct offline_telemetry_statistics_t_struct
+{
+  uint32_t stored_count;
+  uint32_t spilled_count;
+  uint32_t replayed_count;
+  uint32_t dropped_count;
+  uint32_t buffered_count;
+} offline_telemetry_statistics_t;
+
+/*
+ * @brief    Statistics of the reported properties merged into patches.
+ * @remark   `coalesced_count` counts the values replaced by a newer value for the same property
+ *           before being sent. `overflow_count` counts the values not set for lack of space.
+ */
+typedef struct reported_properties_statistics_t_struct
+{
+  uint32_t set_count;
+  uint32_t coalesced_count;
+  uint32_t flush_count;
+  uint32_t overflow_count;
+} reported_properties_statistics_t;
+
+/*
+ * @brief    Statistics of the TLS sessions established with the Azure IoT Hub.
+ * @remark   `offered_count` counts the connections where a saved session was given to the MQTT
+ *           client, and `resumed_count` the ones where the server accepted it. `expired_count`
+ *           counts the saved sessions discarded for being older than
+ *           `tls_session_lifetime_in_secs`.
+ */
+typedef struct tls_session_statistics_t_struct
+{
+  uint32_t handshake_count;
+  uint32_t resumed_count;
+  uint32_t offered_count;
+  uint32_t expired_count;
+} tls_session_statistics_t;
+
+/*
+ * @brief    Classes of messages published by the Azure IoT client, each with its own rate limit
+ *           and outbound queue, from the highest priority to the lowest.
+ */
+typedef enum outbound_message_class_t_enum
+{
+  outbound_message_class_command_response = 0,
+  outbound_message_class_properties,
+  outbound_message_class_telemetry
+} outbound_message_class_t;
+
+#define OUTBOUND_MESSAGE_CLASS_COUNT 3
+
+/*
+ * @brief    Token bucket limiting the rate of one class of outbound messages.
+ * @remark   Up to `burst` messages can be published back-to-back, and then `rate_per_sec` per
+ *           second. If `rate_per_sec` is zero the class is not limited. If `burst` is zero,
+ *           `rate_per_sec` is used.
+ */
+typedef struct rate_limit_t_struct
+{
+  uint32_t rate_per_sec;
+  uint32_t burst;
+} rate_limit_t;
+
+/*
+ * @brief    State of the token bucket of one class of outbound messages.
+ * @remark   Internal to the Azure IoT client. `tokens` are in thousandths of a message.
+ */
+typedef struct rate_limiter_t_struct
+{
+  uint64_t tokens;
+  uint64_t last_refill_time_in_ms;
+  uint64_t last_throttled_time_in_ms;
+  uint8_t backoff_level;
+} rate_limiter_t;
+
+/*
+ * @brief    Statistics of the outbound rate limits.
+ * @remark   Arrays are indexed by outbound_message_class_t. `deferred_count` counts the messages
+ *           held back to be published later within the limit (telemetry stored in
+ *           `offline_telemetry_buffer`, reported properties patches postponed, command responses
+ *           and properties waiting in their outbound queues), and `dropped_count` the ones
+ *           refused (only telemetry is). `throttled_count` counts the throttling signals from the
+ *           Azure IoT Hub (status 429, connection refused as "server unavailable"), each halving
+ *           the rate of the class; `backoff_level` is the number of halvings in effect. One is
+ *           undone per RATE_LIMIT_RECOVERY_INTERVAL_IN_MS without throttling signals.
+ */
+typedef struct rate_limit_statistics_t_struct
+{
+  uint32_t deferred_count[OUTBOUND_MESSAGE_CLASS_COUNT];
+  uint32_t dropped_count[OUTBOUND_MESSAGE_CLASS_COUNT];
+  uint32_t throttled_count[OUTBOUND_MESSAGE_CLASS_COUNT];
+  uint8_t backoff_level[OUTBOUND_MESSAGE_CLASS_COUNT];
+} rate_limit_statistics_t;
+
+/*
+ * @brief    A message waiting in an outbound queue.
+ * @remark   Internal to the Azure IoT client. Topic (with its null-terminator, none for
+ *           telemetry) and payload follow the ones of the previous messages in the buffer of the
+ *           queue.
+ */
+typedef struct outbound_message_t_struct
+{
+  int32_t topic_size;
+  int32_t payload_size;
+  mqtt_qos_t qos;
+  uint64_t enqueued_time_in_ms;
+} outbound_message_t;
+
+/*
+ * @brief    Queue of the outbound messages of one class.
+ * @remark   Internal to the Azure IoT client. `used` is the number of bytes of its buffer taken.
+ */
+typedef struct outbound_queue_t_struct
+{
+  outbound_message_t messages[OUTBOUND_QUEUE_MAX_COUNT];
+  uint8_t count;
+  int32_t used;
+} outbound_queue_t;
+
+/*
+ * @brief    Statistics of the outbound queues.
+ * @remark   Arrays are indexed by outbound_message_class_t. `overflow_count` counts the messages
+ *           not queued for lack of space, and `failed_count` the ones dequeued but not published.
+ *           The queueing delay is the time between a message being queued and published; the
+ *           average is `total_delay_in_ms` / `published_count`.
+ */
+typedef struct outbound_queue_statistics_t_struct
+{
+  uint32_t queued_count[OUTBOUND_MESSAGE_CLASS_COUNT];
+  uint32_t published_count[OUTBOUND_MESSAGE_CLASS_COUNT];
+  uint32_t overflow_count[OUTBOUND_MESSAGE_CLASS_COUNT];
+  uint32_t failed_count[OUTBOUND_MESSAGE_CLASS_COUNT];
+  uint8_t max_count[OUTBOUND_MESSAGE_CLASS_COUNT];
+  uint64_t total_delay_in_ms[OUTBOUND_MESSAGE_CLASS_COUNT];
+  uint32_t max_delay_in_ms[OUTBOUND_MESSAGE_CLASS_COUNT];
+} outbound_queue_statistics_t;
+
+/*
+ * @brief    Location of a reported property within `reported_properties_buffer`.
+ * @remark   Internal to the Azure IoT client. Each property is stored as `,"<name>":<value>`.
+ */
+typedef struct reported_property_t_struct
+{
+  int32_t offset;
+  int32_t name_size;
+  int32_t size;
+} reported_property_t;
+
+/*
+ * @brief    Ring buffer of length-prefixed telemetry records.
+ * @remark   Internal to the Azure IoT client.
+ */
+typedef struct offline_telemetry_buffer_t_struct
+{
+  az_span buffer;
+  int32_t head;
+  int32_t used;
+  uint32_t count;
+} offline_telemetry_buffer_t;
+
+/*
+ * @brief    Events posted by the Azure IoT client when notified by the MQTT client.
+ */
+typedef enum azure_iot_event_t_enum
+{
+  azure_iot_event_mqtt_connected,
+  azure_iot_event_mqtt_disconnected,
+  azure_iot_event_mqtt_subscribe_completed,
+  azure_iot_event_mqtt_publish_completed,
+  azure_iot_event_mqtt_message_received
+} azure_iot_event_t;
+
+/*
+ * @brief        Function to post an event into the event queue of the user application.
+ * @remark       Invoked by the `azure_iot_mqtt_client_*` functions once they are done, usually
+ *               from the context of the MQTT client. It must not block.
+ *
+ * @param[in]    event    The event to be posted.
+ *
+ * @return       Nothing.
+ */
+typedef void (*event_post_function_t)(azure_iot_event_t event);
+
+/*
+ * @brief        Function to wait for an event in the event queue of the user application.
+ * @remark       It must return as soon as an event is posted (including if already queued before
+ *               this function is invoked), or once `timeout_in_ms` elapses.
+ *
+ * @param[in]    timeout_in_ms    Maximum time to wait, in milliseconds.
+ *
+ * @return       Nothing.
+ */
+typedef void (*event_wait_function_t)(uint32_t timeout_in_ms);
+
+/*
+ * @brief    Structure that consolidates the functions of the event queue used by
+ *           `azure_iot_wait_for_work`.
+ * @remark   This is optional. If `wait` is NULL, `azure_iot_wait_for_work` returns right away.
+ */
+typedef struct event_interface_t_struct
+{
+  event_post_function_t post;
+  event_wait_function_t wait;
+} event_interface_t;
+
+/*
+ * @brief        Function to get the time of a monotonic clock, which neither goes backwards nor
+ *               jumps when the wall clock is set (e.g., by SNTP).
+ *
+ * @return       uint64_t    Milliseconds since an arbitrary point in the past (e.g., boot).
+ */
+typedef uint64_t (*monotonic_time_function_t)();
+
+/*
+ * @brief        Function to get the wall-clock time.
+ *
+ * @return       uint32_t    Seconds since UNIX epoch, or zero if not known.
+ */
+typedef uint32_t (*unix_time_function_t)();
+
+/*
+ * @brief    Clocks used by the Azure IoT client.
+ * @remark   Deadlines and intervals (SAS token expiration, DPS retry-after, reconnections,
+ *           timeouts) are measured with the monotonic clock, so setting the wall clock does not
+ *           move them. The wall clock is only used for the expiration written into SAS tokens.
+ *           Either function can be NULL, for CLOCK_MONOTONIC and `time()` respectively.
+ */
+typedef struct clock_interface_t_struct
+{
+  monotonic_time_function_t get_monotonic_time_in_ms;
+  unix_time_function_t get_unix_time;
+} clock_interface_t;
+
+/*
+ * @brief    Time spent by the user application within `azure_iot_wait_for_work`.
+ * @remark   `total_time_in_ms` is the time since `azure_iot_wait_for_work` was first called, so
+ *           the idle percentage is `idle_time_in_ms` * 100 / `total_time_in_ms`.
+ */
+typedef struct idle_statistics_t_struct
+{
+  uint64_t idle_time_in_ms;
+  uint64_t total_time_in_ms;
+  uint32_t wait_count;
+  uint32_t events_count;
+} idle_statistics_t;
+
+/*
+ * @brief    A region of `data_buffer` whose allocations share the same lifetime.
+ * @remark   Internal to the Azure IoT client.
+ */
+typedef struct data_buffer_region_t_struct
+{
+  az_span buffer;
+  int32_t used;
+  int32_t high_water_mark;
+  uint32_t overflow_count;
+} data_buffer_region_t;
+
+/*
+ * @brief    Usage of one of the regions of `data_buffer`.
+ * @remark   `high_water_mark` is the largest number of bytes used in the region so far, and
+ *           `overflow_count` the number of allocations that did not fit in it.
+ */
+typedef struct data_buffer_region_statistics_t_struct
+{
+  int32_t size;
+  int32_t high_water_mark;
+  uint32_t overflow_count;
+} data_buffer_region_statistics_t;
+
+/*
+ * @brief    Usage of `data_buffer`, per region.
+ * @remark   See `data_buffer` in `azure_iot_config_t` for what each region holds.
+ *           The scratch region is reused from its start by each operation, so its
+ *           `overflow_count` is the number of operations that needed more than the whole region.
+ *           Its `high_water_mark` is the highest byte written into it, found by scanning for the
+ *           byte it was painted with at initialization. A written byte that happens to equal the
+ *           paint is taken as never written, so the mark can be under-reported by a few bytes.
+ */
+typedef struct data_buffer_statistics_t_struct
+{
+  data_buffer_region_statistics_t persistent;
+  data_buffer_region_statistics_t connection;
+  data_buffer_region_statistics_t scratch;
+} data_buffer_statistics_t;
+
+/*
+ * @brief    Statistics of the telemetry published with QoS 1 (AT LEAST ONCE).
+ * @remark   `expired_count` counts the messages given up after `telemetry_max_retransmit_count`
+ *           retransmits without a PUBACK. `window_full_count` counts the times telemetry could not
+ *           be published right away because all the in-flight slots were taken.
+ */
+typedef struct telemetry_delivery_statistics_t_struct
+{
+  uint32_t sent_count;
+  uint32_t acked_count;
+  uint32_t retransmit_count;
+  uint32_t expired_count;
+  uint32_t window_full_count;
+  uint32_t max_in_flight_count;
+} telemetry_delivery_statistics_t;
+
+/*
+ * @brief    A telemetry message published with QoS 1 and not yet acknowledged.
+ * @remark   Internal to the Azure IoT client.
+ */
+typedef struct telemetry_in_flight_t_struct
+{
+  bool is_used;
+  int packet_id;
+  az_span payload;
+  uint64_t sent_time_in_ms;
+  uint8_t retransmit_count;
+} telemetry_in_flight_t;
+
 /*
  * @brief    Structure that holds the configuration for the Azure IoT client.
  * @remark   Once `azure_iot_start` is called, this structure SHALL NOT be modified by the
@@ -553,9 +1196,31 @@ typedef struct azure_iot_config_t_struct
    *
    *              sizeof(data_buffer) >= 592 bytes (59 bytes + 2 bytes + 3 bytes + 190 bytes + 338
    * bytes, respectively)
+   *
+   *              The buffer is split into three regions:
+   *              - persistent: Azure IoT Hub FQDN and device ID from device-provisioning, kept
+   * until the client is started without them;
+   *              - connection: DPS operation ID and the SAS token prepared for the next
+   * connection, released whenever a new connection is set up;
+   *              - scratch: everything else (MQTT client id, username and password, topics,
+   * payloads, SAS token intermediates), valid only within the call that uses it.
+   *              Use `azure_iot_get_data_buffer_statistics` to size each of them.
    */
   az_span data_buffer;
 
+  /*
+   * @brief    Size of the persistent region of `data_buffer`.
+   * @remark   If zero, DEFAULT_DATA_BUFFER_PERSISTENT_REGION_SIZE is used.
+   */
+  int32_t data_buffer_persistent_region_size;
+
+  /*
+   * @brief    Size of the connection region of `data_buffer`.
+   * @remark   If zero, DEFAULT_DATA_BUFFER_CONNECTION_REGION_SIZE is used. The scratch region
+   *           takes the rest of `data_buffer`.
+   */
+  int32_t data_buffer_connection_region_size;
+
   /*
    * @brief    Set of functions to serve as interface between Azure IoT client and the
    * user-application MQTT client.
@@ -567,6 +1232,17 @@ typedef struct azure_iot_config_t_struct
    */
   data_manipulation_functions_t data_manipulation_functions;
 
+  /*
+   * @brief    Optional set of functions for persisting the device-provisioning result.
+   * @remark   If provided, the Azure IoT Hub FQDN and device ID assigned by Azure Device
+   *           Provisioning are saved once provisioning completes. On the next start (e.g., after
+   *           a reboot) Azure IoT client connects directly to the Azure IoT Hub saved, skipping
+   *           device-provisioning. If the Azure IoT Hub does not accept the connection, the saved
+   *           result is cleared and device-provisioning is performed on the following start.
+   *           Only used if `use_device_provisioning` is true.
+   */
+  provisioning_cache_interface_t provisioning_cache;
+
   /*
    * @brief    Amount of minutes for which the MQTT password should be valid.
    * @remark   If set to zero, Azure IoT client sets it to the default value of 60 minutes.
@@ -576,6 +1252,199 @@ typedef struct azure_iot_config_t_struct
    */
   uint32_t sas_token_lifetime_in_minutes;
 
+  /*
+   * @brief    How the SAS token is refreshed once it is about to expire.
+   * @remark   If not set, `sas_token_refresh_mode_break_before_make` is used.
+   *           See `sas_token_refresh_mode_t` for details.
+   */
+  sas_token_refresh_mode_t sas_token_refresh_mode;
+
+  /*
+   * @brief    Optional buffer for holding messages published while a SAS token refresh is in
+   *           progress.
+   * @remark   Up to SAS_REFRESH_HELD_MESSAGES_MAX_COUNT messages (topic and payload) are copied
+   *           into this buffer and published once the client is ready again. If set to
+   *           AZ_SPAN_EMPTY, publishing during a SAS token refresh fails.
+   */
+  az_span sas_refresh_held_messages_buffer;
+
+  /*
+   * @brief    Controls whether Azure IoT client reconnects by itself after failures.
+   * @remark   If true, whenever the client gets into error state or the MQTT client disconnects
+   *           unexpectedly, it disconnects the MQTT client and schedules a new connection
+   *           according to `dps_reconnect_policy` or `iot_hub_reconnect_policy` (depending on
+   *           which service it was connected to). The user application then does not need to call
+   *           `azure_iot_stop` and `azure_iot_start` in such cases.
+   */
+  bool automatic_reconnect;
+
+  /*
+   * @brief    Reconnect policy for failures while working with Azure Device Provisioning service.
+   */
+  reconnect_policy_t dps_reconnect_policy;
+
+  /*
+   * @brief    Reconnect policy for failures while working with Azure IoT Hub.
+   */
+  reconnect_policy_t iot_hub_reconnect_policy;
+
+  /*
+   * @brief    Function used to randomize the reconnection delays.
+   * @remark   Optional. If NULL, `rand()` is used.
+   */
+  random_number_function_t get_random_number;
+
+  /*
+   * @brief    Optional buffer for storing telemetry sent while the client is not connected.
+   * @remark   Its size is the memory budget for offline telemetry. Each record takes the size of
+   *           its payload plus two bytes. Once full, the oldest records are moved into
+   *           `offline_telemetry_storage` (if set) or dropped. Stored records are published in
+   *           order once the client is connected again, and new telemetry is stored behind
+   *           them until all are published. If set to AZ_SPAN_EMPTY, sending telemetry while
+   *           not connected fails.
+   */
+  az_span offline_telemetry_buffer;
+
+  /*
+   * @brief    Maximum number of stored telemetry records published per second once reconnected.
+   * @remark   If zero, DEFAULT_OFFLINE_TELEMETRY_DRAIN_RATE_PER_SEC is used.
+   */
+  uint32_t offline_telemetry_drain_rate_per_sec;
+
+  /*
+   * @brief    Functions for spilling offline telemetry into non-volatile storage.
+   */
+  offline_telemetry_storage_interface_t offline_telemetry_storage;
+
+  /*
+   * @brief    Optional content type of the telemetry payloads (e.g. "application%2Fcbor").
+   * @remark   Sent as the `$.ct` message property of all telemetry, url-encoded. Needed for
+   *           Azure IoT to decode payloads that are not JSON. If AZ_SPAN_EMPTY, not sent.
+   */
+  az_span telemetry_content_type;
+
+  /*
+   * @brief    Optional content encoding of the telemetry payloads (e.g. "utf-8").
+   * @remark   Sent as the `$.ce` message property of all telemetry, url-encoded. If
+   *           AZ_SPAN_EMPTY, not sent.
+   */
+  az_span telemetry_content_encoding;
+
+  /*
+   * @brief    QoS used for publishing telemetry.
+   * @remark   If not set, `mqtt_qos_at_most_once` is used. With `mqtt_qos_at_least_once` up to
+   *           `telemetry_in_flight_window_size` messages are published without waiting for their
+   *           PUBACKs. A copy of each is kept in `telemetry_in_flight_buffer` until its PUBACK
+   *           arrives, and it is retransmitted if that takes longer than
+   *           `telemetry_ack_timeout_in_ms`. `mqtt_qos_exactly_once` is not supported by Azure IoT
+   *           Hub.
+   */
+  mqtt_qos_t telemetry_qos;
+
+  /*
+   * @brief    Buffer for the copies of the telemetry messages waiting for a PUBACK.
+   * @remark   Required if `telemetry_qos` is `mqtt_qos_at_least_once`. It is split evenly among
+   *           the `telemetry_in_flight_window_size` slots, so that is the maximum telemetry
+   *           payload size per slot.
+   */
+  az_span telemetry_in_flight_buffer;
+
+  /*
+   * @brief    Maximum number of telemetry messages waiting for a PUBACK at the same time.
+   * @remark   From 1 to TELEMETRY_IN_FLIGHT_MAX_COUNT. If zero, TELEMETRY_IN_FLIGHT_MAX_COUNT is
+   *           used. When the window is full, telemetry is stored in `offline_telemetry_buffer`
+   *           (if set), otherwise `azure_iot_send_telemetry` fails.
+   */
+  uint8_t telemetry_in_flight_window_size;
+
+  /*
+   * @brief    Time to wait for a PUBACK before retransmitting a telemetry message.
+   * @remark   If zero, DEFAULT_TELEMETRY_ACK_TIMEOUT_IN_MS is used.
+   */
+  uint32_t telemetry_ack_timeout_in_ms;
+
+  /*
+   * @brief    Number of retransmits of a telemetry message before giving up on it.
+   * @remark   If zero, DEFAULT_TELEMETRY_MAX_RETRANSMIT_COUNT is used.
+   */
+  uint8_t telemetry_max_retransmit_count;
+
+  /*
+   * @brief    Event queue used for waiting for work instead of calling `azure_iot_do_work`
+   *           continuously. See `azure_iot_wait_for_work`.
+   */
+  event_interface_t event_interface;
+
+  /*
+   * @brief    Optional clocks, replacing the system ones (e.g., with a fake clock that simulates
+   *           hours of SAS token lifetimes in milliseconds).
+   */
+  clock_interface_t clock_interface;
+
+  /*
+   * @brief    Optional buffer for merging the reported properties set with
+   *           `azure_iot_set_reported_property(ies)` into a single patch.
+   * @remark   Holds up to REPORTED_PROPERTIES_MAX_COUNT properties, in JSON. If set to
+   *           AZ_SPAN_EMPTY, `azure_iot_set_reported_properties` sends each patch right away.
+   */
+  az_span reported_properties_buffer;
+
+  /*
+   * @brief    Maximum time a reported property waits for others to be merged with.
+   * @remark   If zero, DEFAULT_REPORTED_PROPERTIES_FLUSH_INTERVAL_IN_MS is used.
+   */
+  uint32_t reported_properties_flush_interval_in_ms;
+
+  /*
+   * @brief    Size of the merged reported properties that causes them to be sent right away.
+   * @remark   If zero, three quarters of the size of `reported_properties_buffer` is used.
+   */
+  uint32_t reported_properties_flush_threshold;
+
+  /*
+   * @brief    Optional buffer for saving the TLS session established with the Azure IoT Hub, so
+   *           reconnections (e.g., on SAS token refreshes) can resume it.
+   * @remark   Must be large enough for the serialized session of the TLS stack used by the
+   *           MQTT client. If set to AZ_SPAN_EMPTY, every connection performs a full handshake.
+   */
+  az_span tls_session_buffer;
+
+  /*
+   * @brief    Maximum age of a saved TLS session for it to be offered to the server.
+   * @remark   If zero, DEFAULT_TLS_SESSION_LIFETIME_IN_SECS is used. It should not be longer than
+   *           the session ticket lifetime of the Azure IoT Hub.
+   */
+  uint32_t tls_session_lifetime_in_secs;
+
+  /*
+   * @brief    Optional rate limits of the messages published, indexed by
+   *           outbound_message_class_t.
+   * @remark   Telemetry over its limit is stored in `offline_telemetry_buffer` (if set) and
+   *           published once the limit allows it, otherwise `azure_iot_send_telemetry` fails.
+   *           Merged reported properties are sent later. Command responses and properties
+   *           updates are never dropped for their limits: they wait in their outbound queues,
+   *           which are required (see `outbound_queue_buffers`) for limiting these classes. The
+   *           limits back off when the Azure IoT Hub signals throttling (see
+   *           `rate_limit_statistics_t`). Its quotas are shared by all the devices of the hub, so
+   *           these should be well below them.
+   */
+  rate_limit_t rate_limits[OUTBOUND_MESSAGE_CLASS_COUNT];
+
+  /*
+   * @brief    Optional buffers for queueing the messages published, indexed by
+   *           outbound_message_class_t.
+   * @remark   Messages of a class with a buffer are copied into it (topic and payload), up to
+   *           OUTBOUND_QUEUE_MAX_COUNT, and published by `azure_iot_do_work` in strict priority
+   *           order: command responses, then properties, then telemetry. At most
+   *           OUTBOUND_QUEUE_DRAIN_MAX_COUNT are published per call, so a command response queued
+   *           behind a telemetry burst goes ahead of what is left of it. Queued messages wait
+   *           while the client is not ready (e.g., during a SAS token refresh), and telemetry
+   *           waits for an in-flight slot. Sending fails once the queue of a class is full,
+   *           except for telemetry, which goes into `offline_telemetry_buffer` (if set).
+   *           Classes without a buffer are published right away.
+   */
+  az_span outbound_queue_buffers[OUTBOUND_MESSAGE_CLASS_COUNT];
+
   /*
    * @brief     Callback handler used by Azure IoT client to inform the user application of
    *            a completion of properties update.
@@ -611,16 +1480,71 @@ typedef struct azure_iot_config_t_struct
 typedef struct azure_iot_t_struct
 {
   azure_iot_config_t* config;
-  az_span data_buffer;
+  data_buffer_region_t persistent_region;
+  data_buffer_region_t connection_region;
+  az_span scratch_buffer;
+  uint32_t scratch_overflow_count;
   mqtt_client_handle_t mqtt_client_handle;
   az_iot_hub_client iot_hub_client;
   az_iot_hub_client_options iot_hub_client_options;
   az_iot_provisioning_client dps_client;
   azure_iot_client_state_t state;
-  uint32_t sas_token_expiration_time;
+  uint64_t sas_token_expiration_time_in_ms;
   uint32_t dps_retry_after_seconds;
-  uint32_t dps_last_query_time;
+  uint64_t dps_last_query_time_in_ms;
   az_span dps_operation_id;
+  bool is_provisioning_cached;
+  bool is_iot_hub_connection_rejected;
+  int pnp_subscriptions_packet_ids[PNP_SUBSCRIPTIONS_COUNT];
+  int pnp_subscription_in_flight_index;
+  bool pnp_subscriptions_completed[PNP_SUBSCRIPTIONS_COUNT];
+  bool is_properties_document_requested;
+  uint64_t properties_document_retry_time_in_ms;
+  uint32_t properties_document_failures_count;
+  uint8_t decoded_device_key_buffer[DECODED_SAS_KEY_BUFFER_SIZE];
+  az_span decoded_device_key;
+  az_span next_sas_token;
+  uint64_t next_sas_token_expiration_time_in_ms;
+  bool is_refreshing_sas;
+  uint64_t sas_refresh_start_time_in_ms;
+  mqtt_message_t held_messages[SAS_REFRESH_HELD_MESSAGES_MAX_COUNT];
+  uint8_t held_messages_count;
+  az_span held_messages_buffer;
+  sas_token_refresh_statistics_t sas_token_refresh_statistics;
+  bool is_connecting_to_dps;
+  uint64_t reconnect_time_in_ms;
+  uint64_t disconnected_since_in_ms;
+  reconnect_backoff_t dps_reconnect_backoff;
+  reconnect_backoff_t iot_hub_reconnect_backoff;
+  reconnect_statistics_t reconnect_statistics;
+  offline_telemetry_buffer_t offline_telemetry;
+  bool has_spilled_telemetry;
+  uint64_t offline_telemetry_next_drain_time_in_ms;
+  offline_telemetry_statistics_t offline_telemetry_statistics;
+  telemetry_in_flight_t telemetry_in_flight[TELEMETRY_IN_FLIGHT_MAX_COUNT];
+  telemetry_delivery_statistics_t telemetry_delivery_statistics;
+  uint8_t telemetry_topic_buffer[TELEMETRY_TOPIC_BUFFER_SIZE];
+  az_span telemetry_topic;
+  uint8_t reported_properties_topic_prefix_buffer[REPORTED_PROPERTIES_TOPIC_PREFIX_BUFFER_SIZE];
+  az_span reported_properties_topic_prefix;
+  uint64_t idle_statistics_start_time_in_ms;
+  idle_statistics_t idle_statistics;
+  reported_property_t reported_properties[REPORTED_PROPERTIES_MAX_COUNT];
+  uint8_t reported_properties_count;
+  int32_t reported_properties_used;
+  uint64_t reported_properties_flush_time_in_ms;
+  uint32_t reported_properties_request_id;
+  reported_properties_statistics_t reported_properties_statistics;
+  az_span tls_session;
+  uint64_t tls_session_saved_time_in_ms;
+  tls_session_statistics_t tls_session_statistics;
+  uint64_t state_entry_time_in_ms;
+  uint64_t connection_start_time_in_ms;
+  connection_phase_statistics_t connection_phase_statistics;
+  rate_limiter_t rate_limiters[OUTBOUND_MESSAGE_CLASS_COUNT];
+  rate_limit_statistics_t rate_limit_statistics;
+  outbound_queue_t outbound_queues[OUTBOUND_MESSAGE_CLASS_COUNT];
+  outbound_queue_statistics_t outbound_queue_statistics;
 } azure_iot_t;
 
 /*
@@ -649,7 +1573,8 @@ void azure_iot_init(azure_iot_t* azure_iot, azure_iot_config_t* azure_iot_config
  *               Note: if device-provisioning is used, the device is provisioned only the first
  *               time a given `azure_iot_t` instance is started. Subsequent calls to
  *               `azure_iot_start` will re-use the Azure IoT Hub FQDN and device ID previously
- *               provisioned.
+ *               provisioned. If `provisioning_cache` is set in `azure_iot_config_t`, that is also
+ *               true across reboots of the device.
  *
  * @param[in]    azure_iot           A pointer to the instance of `azure_iot_t` defined by the
  * caller.
@@ -702,8 +1627,41 @@ azure_iot_status_t azure_iot_get_status(azure_iot_t* azure_iot);
  */
 void azure_iot_do_work(azure_iot_t* azure_iot);
 
+/*
+ * @brief        Blocks until the Azure IoT client has work to do in `azure_iot_do_work`.
+ * @remark       Returns once an event is posted by any of the `azure_iot_mqtt_client_*` functions,
+ * the next deadline of the Azure IoT client is reached (e.g., SAS token refresh, DPS retry-after,
+ * reconnect backoff, telemetry retransmit or drain), or `max_wait_in_ms` elapses, whichever comes
+ * first. States waiting for the MQTT client without any deadline wait no longer than
+ * EVENT_WAIT_MAX_TIMEOUT_IN_MS. Requires `event_interface` to be set in `azure_iot_config_t`.
+ * A typical main loop calls `azure_iot_do_work` followed by this function.
+ *
+ * @param[in]    azure_iot         A pointer to the instance of `azure_iot_t` previously initialized
+ * by the caller.
+ * @param[in]    max_wait_in_ms    Maximum time to wait, given the user application's own
+ * deadlines.
+ *
+ * @return                         Nothing.
+ */
+void azure_iot_wait_for_work(azure_iot_t* azure_iot, uint32_t max_wait_in_ms);
+
+/*
+ * @brief        Gets the time spent waiting within `azure_iot_wait_for_work` so far.
+ *
+ * @param[in]    azure_iot     A pointer to the instance of `azure_iot_t` previously initialized by
+ * the caller.
+ * @param[out]   statistics    A pointer to where the statistics are copied to.
+ *
+ * @return                     Nothing.
+ */
+void azure_iot_get_idle_statistics(azure_iot_t* azure_iot, idle_statistics_t* statistics);
+
 /*
  * @brief        Sends a telemetry payload to the Azure IoT Hub.
+ * @remark       If `offline_telemetry_buffer` is set in `azure_iot_config_t`, this function can be
+ *               called while the client is not connected. The payload is then stored and published
+ *               later (see `offline_telemetry_buffer`). The same happens to telemetry over its
+ *               rate limit (see `rate_limits`).
  *
  * @param[in]    azure_iot    A pointer to the instance of `azure_iot_t` previously initialized by
  * the caller.
@@ -716,6 +1674,8 @@ int azure_iot_send_telemetry(azure_iot_t* azure_iot, az_span message);
 
 /**
  * @brief        Sends a property update message to Azure IoT Hub.
+ * @remark       Fails until the client has connected to the Azure IoT Hub once, as the topic is
+ *               not known before.
  *
  * @param[in]    azure_iot     The pointer to the azure_iot_t instance that holds the state of the
  * Azure IoT client.
@@ -731,6 +1691,42 @@ int azure_iot_send_telemetry(azure_iot_t* azure_iot, az_span message);
  */
 int azure_iot_send_properties_update(azure_iot_t* azure_iot, uint32_t request_id, az_span message);
 
+/**
+ * @brief        Sets the value of a reported property, to be sent to Azure IoT Hub merged with the
+ *               other reported properties set within the same flush interval.
+ * @remark       Requires `reported_properties_buffer` in azure_iot_config_t. The last value set
+ *               for a property before the patch is sent is the one sent. The patch is sent
+ *               once `reported_properties_flush_interval_in_ms` elapses since the first property
+ *               in it was set, or once it reaches `reported_properties_flush_threshold`, and only
+ *               while the client is ready. `on_properties_update_completed` is invoked with the
+ *               request id of the patch, counted from zero and independent of the request ids
+ *               given to `azure_iot_send_properties_update`.
+ *
+ * @param[in]    azure_iot     The pointer to the azure_iot_t instance that holds the state of the
+ * Azure IoT client.
+ * @param[in]    name          Name of the property, used as-is as a JSON string (not escaped).
+ * @param[in]    value         Value of the property, as a JSON value (e.g. `10`, `"text"` or
+ *                             an object for a component).
+ *
+ * @return       int           0 if the function succeeds, or non-zero if any failure occurs.
+ */
+int azure_iot_set_reported_property(azure_iot_t* azure_iot, az_span name, az_span value);
+
+/**
+ * @brief        Sets the values of all the reported properties in a JSON object.
+ * @remark       Same as calling `azure_iot_set_reported_property` for each member of
+ *               `properties`. If `reported_properties_buffer` is not set, `properties` is sent
+ *               right away as a reported properties update instead.
+ *
+ * @param[in]    azure_iot     The pointer to the azure_iot_t instance that holds the state of the
+ * Azure IoT client.
+ * @param[in]    properties    A JSON object with the reported properties, as generated with the
+ *                             `az_iot_hub_client_properties_writer_*` functions.
+ *
+ * @return       int           0 if the function succeeds, or non-zero if any failure occurs.
+ */
+int azure_iot_set_reported_properties(azure_iot_t* azure_iot, az_span properties);
+
 /**
  * @brief        Sends a property update message to Azure IoT Hub.
  *
@@ -766,6 +1762,46 @@ int azure_iot_send_command_response(
  */
 int azure_iot_mqtt_client_connected(azure_iot_t* azure_iot);
 
+/*
+ * @brief        Informs the Azure IoT client of the TLS session established by the MQTT client.
+ * @remark       Should be called when the MQTT client connects, before
+ *               `azure_iot_mqtt_client_connected`. Only sessions with the Azure IoT Hub are saved
+ * (into `tls_session_buffer`), to be offered in the `tls_session` of the next
+ * `mqtt_client_config_t` for the Azure IoT Hub.
+ *
+ * @param[in]    azure_iot      A pointer to the instance of `azure_iot_t` previously initialized by
+ * the caller.
+ * @param[in]    tls_session    The serialized TLS session, opaque to the Azure IoT client, or
+ *                              AZ_SPAN_EMPTY if the MQTT client cannot export it.
+ * @param[in]    is_resumed     True if the TLS session offered was resumed by the server, false if
+ *                              a full handshake was performed.
+ *
+ * @return       int            0 on success, or non-zero if any failure occurs.
+ */
+int azure_iot_mqtt_client_tls_session_established(
+    azure_iot_t* azure_iot,
+    az_span tls_session,
+    bool is_resumed);
+
+/*
+ * @brief        Informs the Azure IoT client that the server refused the MQTT connection.
+ * @remark       Should be called when the MQTT client receives a CONNACK with a non-zero return
+ * code, before `azure_iot_mqtt_client_disconnected`. If the Azure IoT Hub of a saved provisioning
+ * result rejects the device (identifier rejected, bad username or password, not authorized), the
+ * saved result is discarded so device-provisioning is performed again. Any other refusal is retried
+ * like any other disconnection; "server unavailable" from the Azure IoT Hub, its answer to
+ * connections over its throttling limits, also backs off the rate limits (see `rate_limits`).
+ *
+ * @param[in]    azure_iot      A pointer to the instance of `azure_iot_t` previously initialized by
+ * the caller.
+ * @param[in]    return_code    The return code of the CONNACK received.
+ *
+ * @return       int            0 on success, or non-zero if any failure occurs.
+ */
+int azure_iot_mqtt_client_connection_refused(
+    azure_iot_t* azure_iot,
+    mqtt_connect_return_code_t return_code);
+
 /*
  * @brief        Informs the Azure IoT client that the MQTT client is disconnected.
  * @remark       This must be called after Azure IoT client invokes the `mqtt_client_deinit`
@@ -823,6 +1859,141 @@ int azure_iot_mqtt_client_publish_completed(azure_iot_t* azure_iot, int packet_i
  */
 int azure_iot_mqtt_client_message_received(azure_iot_t* azure_iot, mqtt_message_t* mqtt_message);
 
+/*
+ * @brief        Gets the statistics of the SAS token refreshes performed so far.
+ *
+ * @param[in]    azure_iot     A pointer to the instance of `azure_iot_t` previously initialized by
+ * the caller.
+ * @param[out]   statistics    A pointer to where the statistics are copied to.
+ *
+ * @return                     Nothing.
+ */
+void azure_iot_get_sas_token_refresh_statistics(
+    azure_iot_t* azure_iot,
+    sas_token_refresh_statistics_t* statistics);
+
+/*
+ * @brief        Gets the statistics of the automatic reconnections performed so far.
+ * @remark       `disconnected_time_in_ms` accumulates the time between the client leaving the
+ *               ready state due to a failure and being ready again.
+ *
+ * @param[in]    azure_iot     A pointer to the instance of `azure_iot_t` previously initialized by
+ * the caller.
+ * @param[out]   statistics    A pointer to where the statistics are copied to.
+ *
+ * @return                     Nothing.
+ */
+void azure_iot_get_reconnect_statistics(azure_iot_t* azure_iot, reconnect_statistics_t* statistics);
+
+/*
+ * @brief        Gets the usage of each region of `data_buffer` so far.
+ *
+ * @param[in]    azure_iot     A pointer to the instance of `azure_iot_t` previously initialized by
+ * the caller.
+ * @param[out]   statistics    A pointer to where the statistics are copied to.
+ *
+ * @return                     Nothing.
+ */
+void azure_iot_get_data_buffer_statistics(
+    azure_iot_t* azure_iot,
+    data_buffer_statistics_t* statistics);
+
+/*
+ * @brief        Gets the statistics of the telemetry published with QoS 1 (AT LEAST ONCE).
+ *
+ * @param[in]    azure_iot     A pointer to the instance of `azure_iot_t` previously initialized by
+ * the caller.
+ * @param[out]   statistics    A pointer to where the statistics are copied to.
+ *
+ * @return                     Nothing.
+ */
+void azure_iot_get_telemetry_delivery_statistics(
+    azure_iot_t* azure_iot,
+    telemetry_delivery_statistics_t* statistics);
+
+/*
+ * @brief        Gets the statistics of the telemetry stored while not connected.
+ *
+ * @param[in]    azure_iot     A pointer to the instance of `azure_iot_t` previously initialized by
+ * the caller.
+ * @param[out]   statistics    A pointer to where the statistics are copied to.
+ *
+ * @return                     Nothing.
+ */
+void azure_iot_get_offline_telemetry_statistics(
+    azure_iot_t* azure_iot,
+    offline_telemetry_statistics_t* statistics);
+
+/*
+ * @brief        Gets the statistics of the reported properties merged into patches.
+ *
+ * @param[in]    azure_iot     A pointer to the instance of `azure_iot_t` previously initialized by
+ * the caller.
+ * @param[out]   statistics    A pointer to where the statistics are copied to.
+ *
+ * @return                     Nothing.
+ */
+void azure_iot_get_reported_properties_statistics(
+    azure_iot_t* azure_iot,
+    reported_properties_statistics_t* statistics);
+
+/*
+ * @brief        Gets the statistics of the TLS sessions established with the Azure IoT Hub.
+ * @remark       The resumption hit rate is `resumed_count` over the sum of `resumed_count` and
+ *               `handshake_count`.
+ *
+ * @param[in]    azure_iot     A pointer to the instance of `azure_iot_t` previously initialized by
+ * the caller.
+ * @param[out]   statistics    A pointer to where the statistics are copied to.
+ *
+ * @return                     Nothing.
+ */
+void azure_iot_get_tls_session_statistics(
+    azure_iot_t* azure_iot,
+    tls_session_statistics_t* statistics);
+
+/*
+ * @brief        Gets the time spent in each state of the Azure IoT client.
+ * @remark       Useful for finding out where the time to connect goes (e.g., DPS registration
+ *               polling or subscriptions).
+ *
+ * @param[in]    azure_iot     A pointer to the instance of `azure_iot_t` previously initialized by
+ * the caller.
+ * @param[out]   statistics    A pointer to where the statistics are copied to.
+ *
+ * @return                     Nothing.
+ */
+void azure_iot_get_connection_phase_statistics(
+    azure_iot_t* azure_iot,
+    connection_phase_statistics_t* statistics);
+
+/*
+ * @brief        Gets the statistics of the outbound rate limits.
+ *
+ * @param[in]    azure_iot     A pointer to the instance of `azure_iot_t` previously initialized by
+ * the caller.
+ * @param[out]   statistics    A pointer to where the statistics are copied to.
+ *
+ * @return                     Nothing.
+ */
+void azure_iot_get_rate_limit_statistics(
+    azure_iot_t* azure_iot,
+    rate_limit_statistics_t* statistics);
+
+/*
+ * @brief        Gets the statistics of the outbound queues, including the queueing delay of each
+ *               class of messages.
+ *
+ * @param[in]    azure_iot     A pointer to the instance of `azure_iot_t` previously initialized by
+ * the caller.
+ * @param[out]   statistics    A pointer to where the statistics are copied to.
+ *
+ * @return                     Nothing.
+ */
+void azure_iot_get_outbound_queue_statistics(
+    azure_iot_t* azure_iot,
+    outbound_queue_statistics_t* statistics);
+
 /* --- az_core extensions --- */
 /*
  * These functions are used internally by the Azure IoT client code and its extensions.
@@ -3,6 +3,7 @@
 
 #include <stdarg.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <az_core.h>
 #include <az_iot.h>
@@ -59,9 +60,42 @@ static az_span COMMAND_NAME_DISPLAY_TEXT = AZ_SPAN_FROM_STR("DisplayText");
 
 #define WRITABLE_PROPERTY_TELEMETRY_FREQ_SECS "telemetryFrequencySecs"
 #define WRITABLE_PROPERTY_RESPONSE_SUCCESS "success"
+#define WRITABLE_PROPERTIES_VERSION_NAME "$version"
+#define PROPERTIES_DOCUMENT_DESIRED_NAME "desired"
 
 #define DOUBLE_DECIMAL_PLACE_DIGITS 2
 
+/* --- CBOR (RFC 8949) --- */
+#define CBOR_MAJOR_TYPE_UNSIGNED_INTEGER 0
+#define CBOR_MAJOR_TYPE_NEGATIVE_INTEGER 1
+#define CBOR_MAJOR_TYPE_TEXT_STRING 3
+#define CBOR_MAJOR_TYPE_ARRAY 4
+#define CBOR_MAJOR_TYPE_MAP 5
+#define CBOR_MAJOR_TYPE_SHIFT 5
+#define CBOR_ARGUMENT_MAX_INLINE_VALUE 23
+#define CBOR_ARGUMENT_UINT8 24
+#define CBOR_ARGUMENT_UINT16 25
+#define CBOR_ARGUMENT_UINT32 26
+#define CBOR_HEAD_MAX_SIZE 5
+
+/* --- Telemetry Batching --- */
+#define TELEMETRY_PROP_NAME_LED_STATUS "led_status"
+#define TELEMETRY_PROP_NAME_TIMESTAMP "timestamp"
+#define TELEMETRY_TIMESTAMP_FORMAT "%Y-%m-%dT%H:%M:%SZ"
+#define TELEMETRY_TIMESTAMP_BUFFER_SIZE 21
+// Per-message framing: MQTT fixed header, topic length and packet id, plus the TLS record header,
+// explicit nonce and authentication tag (AES-GCM). Added to the topic size.
+#define TELEMETRY_MQTT_FRAMING_SIZE 6
+#define TELEMETRY_TLS_RECORD_OVERHEAD_SIZE 29
+
+/* --- Command Latency --- */
+#define COMMAND_LATENCY_OTHER_COMMAND_INDEX (COMMAND_LATENCY_COMMAND_COUNT - 1)
+#define TELEMETRY_PROP_NAME_COMMAND_LATENCY "commandLatency"
+#define TELEMETRY_PROP_NAME_COMMAND "command"
+#define TELEMETRY_PROP_NAME_RECEIVE_TO_HANDLER "receiveToHandler"
+#define TELEMETRY_PROP_NAME_HANDLER "handler"
+#define TELEMETRY_PROP_NAME_RESPONSE "response"
+
 /* --- Function Checks and Returns --- */
 #define RESULT_OK 0
 #define RESULT_ERROR __LINE__
@@ -89,9 +123,49 @@ static time_t last_telemetry_send_time = INDEFINITE_TIME;
 
 static bool led1_on = false;
 
+static azure_pnp_telemetry_encoding_t telemetry_encoding = azure_pnp_telemetry_encoding_json;
+static azure_pnp_telemetry_statistics_t telemetry_statistics;
+
+typedef struct telemetry_sample_t_struct
+{
+  time_t timestamp;
+  int32_t led_status;
+} telemetry_sample_t;
+
+static telemetry_sample_t telemetry_samples[TELEMETRY_BATCH_MAX_SIZE];
+static uint8_t telemetry_samples_count = 0;
+static uint8_t telemetry_batch_size = 1;
+static size_t telemetry_batch_max_payload_size = DATA_BUFFER_SIZE;
+
+// "$version" of the last writable properties applied, zero if none applied since boot.
+static int32_t writable_properties_version = 0;
+
+static const uint32_t command_latency_bucket_upper_bounds_in_us[COMMAND_LATENCY_BUCKET_COUNT - 1]
+    = { 250, 500, 1000, 2500, 5000, 10000, 25000, 100000, 500000 };
+static azure_pnp_command_latency_statistics_t
+    command_latency_statistics[COMMAND_LATENCY_COMMAND_COUNT];
+// Number of times each command was handled when its latencies were last sent as telemetry.
+static uint32_t command_latency_sent_count[COMMAND_LATENCY_COMMAND_COUNT];
+
 /* --- Function Prototypes --- */
 /* Please find the function implementations at the bottom of this file */
+static int32_t get_led_status();
+static int send_telemetry_batch(azure_iot_t* azure_iot);
 static int generate_telemetry_payload(
+    const telemetry_sample_t* samples,
+    uint8_t samples_count,
+    uint8_t* payload_buffer,
+    size_t payload_buffer_size,
+    size_t* payload_buffer_length);
+static int generate_json_telemetry_payload(
+    const telemetry_sample_t* samples,
+    uint8_t samples_count,
+    uint8_t* payload_buffer,
+    size_t payload_buffer_size,
+    size_t* payload_buffer_length);
+static int generate_cbor_telemetry_payload(
+    const telemetry_sample_t* samples,
+    uint8_t samples_count,
     uint8_t* payload_buffer,
     size_t payload_buffer_size,
     size_t* payload_buffer_length);
@@ -100,9 +174,16 @@ static int generate_device_info_payload(
     uint8_t* payload_buffer,
     size_t payload_buffer_size,
     size_t* payload_buffer_length);
+static void add_latency_sample(azure_pnp_latency_histogram_t* histogram, uint32_t latency_in_us);
+static int generate_command_latency_payload(
+    const azure_pnp_command_latency_statistics_t* statistics,
+    uint8_t* payload_buffer,
+    size_t payload_buffer_size,
+    size_t* payload_buffer_length);
 static int consume_properties_and_generate_response(
     azure_iot_t* azure_iot,
     az_span properties,
+    az_iot_hub_client_properties_message_type message_type,
     uint8_t* buffer,
     size_t buffer_size,
     size_t* response_length);
@@ -112,6 +193,13 @@ void azure_pnp_init() {
 
   pixels.begin(); // NeoPixel başlatma
   pixels.show(); 
+
+  command_latency_statistics[0].command_name = COMMAND_NAME_TOGGLE_LED;
+  command_latency_statistics[1].command_name = COMMAND_NAME_TOGGLE_LED_RED;
+  command_latency_statistics[2].command_name = COMMAND_NAME_TOGGLE_LED_GREEN;
+  command_latency_statistics[3].command_name = COMMAND_NAME_TOGGLE_LED_BLUE;
+  command_latency_statistics[4].command_name = COMMAND_NAME_DISPLAY_TEXT;
+  command_latency_statistics[COMMAND_LATENCY_OTHER_COMMAND_INDEX].command_name = AZ_SPAN_EMPTY;
 }
 
 const az_span azure_pnp_get_model_id() { return AZ_SPAN_FROM_STR(AZURE_PNP_MODEL_ID); }
@@ -122,6 +210,77 @@ void azure_pnp_set_telemetry_frequency(size_t frequency_in_seconds)
   LogInfo("Telemetry frequency set to once every %d seconds.", telemetry_frequency_in_seconds);
 }
 
+void azure_pnp_set_telemetry_encoding(azure_pnp_telemetry_encoding_t encoding)
+{
+  telemetry_encoding = encoding;
+}
+
+void azure_pnp_set_telemetry_batch_size(uint8_t batch_size, size_t max_payload_size)
+{
+  if (batch_size < 1)
+  {
+    batch_size = 1;
+  }
+  else if (batch_size > TELEMETRY_BATCH_MAX_SIZE)
+  {
+    batch_size = TELEMETRY_BATCH_MAX_SIZE;
+  }
+
+  if (batch_size != telemetry_batch_size)
+  {
+    LogInfo("Telemetry batch size set to %d samples.", batch_size);
+  }
+
+  telemetry_batch_size = batch_size;
+  telemetry_batch_max_payload_size
+      = (max_payload_size == 0 || max_payload_size > DATA_BUFFER_SIZE) ? DATA_BUFFER_SIZE
+                                                                        : max_payload_size;
+}
+
+void azure_pnp_get_telemetry_statistics(azure_pnp_telemetry_statistics_t* statistics)
+{
+  _az_PRECONDITION_NOT_NULL(statistics);
+
+  *statistics = telemetry_statistics;
+}
+
+void azure_pnp_get_command_latency_statistics(azure_pnp_command_latency_statistics_t* statistics)
+{
+  _az_PRECONDITION_NOT_NULL(statistics);
+
+  for (int i = 0; i < COMMAND_LATENCY_COMMAND_COUNT; i++)
+  {
+    statistics[i] = command_latency_statistics[i];
+  }
+}
+
+int azure_pnp_send_command_latency_telemetry(azure_iot_t* azure_iot)
+{
+  _az_PRECONDITION_NOT_NULL(azure_iot);
+
+  int result;
+  size_t payload_size;
+
+  for (int i = 0; i < COMMAND_LATENCY_COMMAND_COUNT; i++)
+  {
+    if (command_latency_statistics[i].handler.count == command_latency_sent_count[i])
+    {
+      continue;
+    }
+
+    result = generate_command_latency_payload(
+        &command_latency_statistics[i], data_buffer, DATA_BUFFER_SIZE, &payload_size);
+    EXIT_IF_TRUE(result != RESULT_OK, RESULT_ERROR, "Failed generating command latency payload.");
+
+    result = azure_iot_send_telemetry(azure_iot, az_span_create(data_buffer, payload_size));
+    EXIT_IF_TRUE(result != RESULT_OK, RESULT_ERROR, "Failed sending command latency telemetry.");
+
+    command_latency_sent_count[i] = command_latency_statistics[i].handler.count;
+  }
+
+  return RESULT_OK;
+}
+
 /* Application-specific data section */
 
 int azure_pnp_send_telemetry(azure_iot_t* azure_iot)
@@ -139,27 +298,24 @@ int azure_pnp_send_telemetry(azure_iot_t* azure_iot)
       last_telemetry_send_time == INDEFINITE_TIME
       || difftime(now, last_telemetry_send_time) >= telemetry_frequency_in_seconds)
   {
-    size_t payload_size;
-
     last_telemetry_send_time = now;
 
-    if (generate_telemetry_payload(data_buffer, DATA_BUFFER_SIZE, &payload_size) != RESULT_OK)
-    {
-      LogError("Failed generating telemetry payload.");
-      return RESULT_ERROR;
-    }
+    telemetry_samples[telemetry_samples_count].timestamp = now;
+    telemetry_samples[telemetry_samples_count].led_status = get_led_status();
+    telemetry_samples_count++;
+    telemetry_statistics.sample_count++;
 
-    if (azure_iot_send_telemetry(azure_iot, az_span_create(data_buffer, payload_size)) != 0)
+    // The batch window is `telemetry_batch_size` samples apart.
+    if (telemetry_samples_count >= telemetry_batch_size)
     {
-      LogError("Failed sending telemetry.");
-      return RESULT_ERROR;
+      return send_telemetry_batch(azure_iot);
     }
   }
 
   return RESULT_OK;
 }
 
-int azure_pnp_send_device_info(azure_iot_t* azure_iot, uint32_t request_id)
+int azure_pnp_send_device_info(azure_iot_t* azure_iot)
 {
   _az_PRECONDITION_NOT_NULL(azure_iot);
 
@@ -170,18 +326,34 @@ int azure_pnp_send_device_info(azure_iot_t* azure_iot, uint32_t request_id)
       &azure_iot->iot_hub_client, data_buffer, DATA_BUFFER_SIZE, &length);
   EXIT_IF_TRUE(result != RESULT_OK, RESULT_ERROR, "Failed generating telemetry payload.");
 
-  result = azure_iot_send_properties_update(
-      azure_iot, request_id, az_span_create(data_buffer, length));
-  EXIT_IF_TRUE(result != RESULT_OK, RESULT_ERROR, "Failed sending reported properties update.");
+  result = azure_iot_set_reported_properties(azure_iot, az_span_create(data_buffer, length));
+  EXIT_IF_TRUE(result != RESULT_OK, RESULT_ERROR, "Failed setting reported properties.");
 
   return RESULT_OK;
 }
 
-int azure_pnp_handle_command_request(azure_iot_t* azure_iot, command_request_t command)
+int azure_pnp_handle_command_request(
+    azure_iot_t* azure_iot,
+    command_request_t command,
+    unsigned long received_time_in_us)
 {
   _az_PRECONDITION_NOT_NULL(azure_iot);
 
   uint16_t response_code;
+  int result;
+  unsigned long handler_start_time_in_us = micros();
+  unsigned long handler_end_time_in_us;
+  azure_pnp_command_latency_statistics_t* latency_statistics
+      = &command_latency_statistics[COMMAND_LATENCY_OTHER_COMMAND_INDEX];
+
+  for (int i = 0; i < COMMAND_LATENCY_OTHER_COMMAND_INDEX; i++)
+  {
+    if (az_span_is_content_equal(command.command_name, command_latency_statistics[i].command_name))
+    {
+      latency_statistics = &command_latency_statistics[i];
+      break;
+    }
+  }
 
 
 
@@ -279,28 +451,45 @@ else {
     response_code = COMMAND_RESPONSE_CODE_REJECTED;
 }
 
-  return azure_iot_send_command_response(
+  handler_end_time_in_us = micros();
+
+  result = azure_iot_send_command_response(
       azure_iot, command.request_id, response_code, AZ_SPAN_EMPTY);
+
+  add_latency_sample(
+      &latency_statistics->receive_to_handler,
+      (uint32_t)(handler_start_time_in_us - received_time_in_us));
+  add_latency_sample(
+      &latency_statistics->handler, (uint32_t)(handler_end_time_in_us - handler_start_time_in_us));
+  add_latency_sample(
+      &latency_statistics->response, (uint32_t)(micros() - handler_end_time_in_us));
+
+  return result;
 }
 
 int azure_pnp_handle_properties_update(
     azure_iot_t* azure_iot,
     az_span properties,
-    uint32_t request_id)
+    az_iot_hub_client_properties_message_type message_type)
 {
   _az_PRECONDITION_NOT_NULL(azure_iot);
   _az_PRECONDITION_VALID_SPAN(properties, 1, false);
 
   int result;
-  size_t length;
+  size_t length = 0;
 
   result = consume_properties_and_generate_response(
-      azure_iot, properties, data_buffer, DATA_BUFFER_SIZE, &length);
+      azure_iot, properties, message_type, data_buffer, DATA_BUFFER_SIZE, &length);
   EXIT_IF_TRUE(result != RESULT_OK, RESULT_ERROR, "Failed generating properties ack payload.");
 
-  result = azure_iot_send_properties_update(
-      azure_iot, request_id, az_span_create(data_buffer, length));
-  EXIT_IF_TRUE(result != RESULT_OK, RESULT_ERROR, "Failed sending reported properties update.");
+  if (length == 0)
+  {
+    // Nothing changed, so nothing to acknowledge.
+    return RESULT_OK;
+  }
+
+  result = azure_iot_set_reported_properties(azure_iot, az_span_create(data_buffer, length));
+  EXIT_IF_TRUE(result != RESULT_OK, RESULT_ERROR, "Failed setting reported properties.");
 
   return RESULT_OK;
 }
@@ -309,14 +498,8 @@ int azure_pnp_handle_properties_update(
 
 
 
-static int generate_telemetry_payload(
-    uint8_t* payload_buffer,
-    size_t payload_buffer_size,
-    size_t* payload_buffer_length)
+static int32_t get_led_status()
 {
-    az_json_writer jw;
-    az_result rc;
-    az_span payload_buffer_span = az_span_create(payload_buffer, payload_buffer_size);
     int led_status = -1;
 
     // Determine LED status
@@ -361,34 +544,443 @@ static int generate_telemetry_payload(
             break;
     }
 
-    rc = az_json_writer_init(&jw, payload_buffer_span, NULL);
-    EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed initializing json writer for telemetry.");
+    return led_status;
+}
+
+/*
+ * @brief     Sends the telemetry samples taken so far as a single message.
+ * @remark    If the batch does not fit in `telemetry_batch_max_payload_size`, the newest sample is
+ *            left for the next batch.
+ */
+static int send_telemetry_batch(azure_iot_t* azure_iot)
+{
+  size_t payload_size;
+  uint8_t samples_count = telemetry_samples_count;
+  int result;
+
+  result = generate_telemetry_payload(
+      telemetry_samples, samples_count, data_buffer, DATA_BUFFER_SIZE, &payload_size);
+
+  if (samples_count > 1
+      && (result != RESULT_OK || payload_size > telemetry_batch_max_payload_size))
+  {
+    samples_count--;
+    result = generate_telemetry_payload(
+        telemetry_samples, samples_count, data_buffer, DATA_BUFFER_SIZE, &payload_size);
+  }
+
+  // Samples not sent are not kept, as before batching.
+  telemetry_samples_count -= samples_count;
+
+  if (telemetry_samples_count > 0)
+  {
+    telemetry_samples[0] = telemetry_samples[samples_count];
+  }
+
+  EXIT_IF_TRUE(result != RESULT_OK, RESULT_ERROR, "Failed generating telemetry payload.");
+
+  telemetry_statistics.message_count++;
+  telemetry_statistics.payload_bytes += payload_size;
+
+  result = azure_iot_send_telemetry(azure_iot, az_span_create(data_buffer, payload_size));
+  EXIT_IF_TRUE(result != RESULT_OK, RESULT_ERROR, "Failed sending telemetry.");
+
+  // Framing not sent for the samples batched into this message.
+  telemetry_statistics.framing_bytes_saved += (uint32_t)(samples_count - 1)
+      * (uint32_t)(az_span_size(azure_iot->telemetry_topic) + TELEMETRY_MQTT_FRAMING_SIZE
+                   + TELEMETRY_TLS_RECORD_OVERHEAD_SIZE);
+
+  return RESULT_OK;
+}
 
+static int generate_telemetry_payload(
+    const telemetry_sample_t* samples,
+    uint8_t samples_count,
+    uint8_t* payload_buffer,
+    size_t payload_buffer_size,
+    size_t* payload_buffer_length)
+{
+  int result;
+  unsigned long encode_start_time_in_us = micros();
+
+  if (telemetry_encoding == azure_pnp_telemetry_encoding_cbor)
+  {
+    result = generate_cbor_telemetry_payload(
+        samples, samples_count, payload_buffer, payload_buffer_size, payload_buffer_length);
+  }
+  else
+  {
+    result = generate_json_telemetry_payload(
+        samples, samples_count, payload_buffer, payload_buffer_size, payload_buffer_length);
+  }
+
+  telemetry_statistics.encode_time_in_us += micros() - encode_start_time_in_us;
+
+  return result;
+}
+
+/*
+ * @brief     Formats the timestamp of a telemetry sample as ISO 8601, in UTC.
+ */
+static az_span format_telemetry_timestamp(time_t timestamp, char* buffer, size_t buffer_size)
+{
+  struct tm timestamp_tm;
+
+  (void)gmtime_r(&timestamp, &timestamp_tm);
+
+  return az_span_create(
+      (uint8_t*)buffer,
+      (int32_t)strftime(buffer, buffer_size, TELEMETRY_TIMESTAMP_FORMAT, &timestamp_tm));
+}
+
+/*
+ * @brief     Generates `{"led_status":N}` for a single sample, or an array of
+ *            `{"led_status":N,"timestamp":"..."}` for a batch.
+ */
+static int generate_json_telemetry_payload(
+    const telemetry_sample_t* samples,
+    uint8_t samples_count,
+    uint8_t* payload_buffer,
+    size_t payload_buffer_size,
+    size_t* payload_buffer_length)
+{
+  az_json_writer jw;
+  az_result rc;
+  az_span payload_buffer_span = az_span_create(payload_buffer, payload_buffer_size);
+  char timestamp_buffer[TELEMETRY_TIMESTAMP_BUFFER_SIZE];
+
+  rc = az_json_writer_init(&jw, payload_buffer_span, NULL);
+  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed initializing json writer for telemetry.");
+
+  if (samples_count > 1)
+  {
+    rc = az_json_writer_append_begin_array(&jw);
+    EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed setting telemetry json batch root.");
+  }
+
+  for (uint8_t i = 0; i < samples_count; i++)
+  {
     rc = az_json_writer_append_begin_object(&jw);
     EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed setting telemetry json root.");
 
-    rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR("led_status"));
-    EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding led_status property name to telemetry payload.");
-    rc = az_json_writer_append_int32(&jw, led_status);
-    EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding led_status property value to telemetry payload.");
+    rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_LED_STATUS));
+    EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding led_status name to telemetry payload.");
+    rc = az_json_writer_append_int32(&jw, samples[i].led_status);
+    EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding led_status value to telemetry payload.");
+
+    if (samples_count > 1)
+    {
+      rc = az_json_writer_append_property_name(
+          &jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_TIMESTAMP));
+      EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding timestamp name to telemetry payload.");
+      rc = az_json_writer_append_string(
+          &jw,
+          format_telemetry_timestamp(
+              samples[i].timestamp, timestamp_buffer, sizeof(timestamp_buffer)));
+      EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding timestamp value to telemetry payload.");
+    }
 
     rc = az_json_writer_append_end_object(&jw);
     EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed closing telemetry json payload.");
+  }
+
+  if (samples_count > 1)
+  {
+    rc = az_json_writer_append_end_array(&jw);
+    EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed closing telemetry json batch.");
+  }
+
+  payload_buffer_span = az_json_writer_get_bytes_used_in_destination(&jw);
+
+  if ((payload_buffer_size - az_span_size(payload_buffer_span)) < 1)
+  {
+    LogError("Insufficient space for telemetry payload null terminator.");
+    return RESULT_ERROR;
+  }
+
+  payload_buffer[az_span_size(payload_buffer_span)] = '\0';
+  *payload_buffer_length = az_span_size(payload_buffer_span);
+
+  return RESULT_OK;
+}
+
+/*
+ * @brief     Appends the head of a CBOR data item (major type and argument).
+ */
+static az_result cbor_append_head(az_span* remainder, uint8_t major_type, uint32_t argument)
+{
+  uint8_t head[CBOR_HEAD_MAX_SIZE];
+  int32_t head_size;
+
+  head[0] = (uint8_t)(major_type << CBOR_MAJOR_TYPE_SHIFT);
+
+  if (argument <= CBOR_ARGUMENT_MAX_INLINE_VALUE)
+  {
+    head[0] |= (uint8_t)argument;
+    head_size = 1;
+  }
+  else if (argument <= UINT8_MAX)
+  {
+    head[0] |= CBOR_ARGUMENT_UINT8;
+    head[1] = (uint8_t)argument;
+    head_size = 2;
+  }
+  else if (argument <= UINT16_MAX)
+  {
+    head[0] |= CBOR_ARGUMENT_UINT16;
+    head[1] = (uint8_t)(argument >> 8);
+    head[2] = (uint8_t)argument;
+    head_size = 3;
+  }
+  else
+  {
+    head[0] |= CBOR_ARGUMENT_UINT32;
+    head[1] = (uint8_t)(argument >> 24);
+    head[2] = (uint8_t)(argument >> 16);
+    head[3] = (uint8_t)(argument >> 8);
+    head[4] = (uint8_t)argument;
+    head_size = 5;
+  }
+
+  if (az_span_size(*remainder) < head_size)
+  {
+    return AZ_ERROR_NOT_ENOUGH_SPACE;
+  }
+
+  *remainder = az_span_copy(*remainder, az_span_create(head, head_size));
 
-    payload_buffer_span = az_json_writer_get_bytes_used_in_destination(&jw);
+  return AZ_OK;
+}
+
+/*
+ * @brief     Appends a CBOR text string.
+ */
+static az_result cbor_append_text(az_span* remainder, az_span text)
+{
+  az_result rc = cbor_append_head(remainder, CBOR_MAJOR_TYPE_TEXT_STRING, az_span_size(text));
 
-    if ((payload_buffer_size - az_span_size(payload_buffer_span)) < 1)
+  if (az_result_succeeded(rc))
+  {
+    if (az_span_size(*remainder) < az_span_size(text))
     {
-        LogError("Insufficient space for telemetry payload null terminator.");
-        return RESULT_ERROR;
+      return AZ_ERROR_NOT_ENOUGH_SPACE;
     }
 
-    payload_buffer[az_span_size(payload_buffer_span)] = '\0';
-    *payload_buffer_length = az_span_size(payload_buffer_span);
+    *remainder = az_span_copy(*remainder, text);
+  }
 
-    return RESULT_OK;
+  return rc;
+}
+
+/*
+ * @brief     Appends a CBOR integer.
+ */
+static az_result cbor_append_int32(az_span* remainder, int32_t value)
+{
+  // Negative integers are encoded as -1 - value.
+  return value >= 0
+      ? cbor_append_head(remainder, CBOR_MAJOR_TYPE_UNSIGNED_INTEGER, (uint32_t)value)
+      : cbor_append_head(remainder, CBOR_MAJOR_TYPE_NEGATIVE_INTEGER, (uint32_t)(-1 - value));
+}
+
+/*
+ * @brief     Generates the same telemetry as the JSON payload, as a CBOR map (or an array of
+ *            maps for a batch).
+ */
+static int generate_cbor_telemetry_payload(
+    const telemetry_sample_t* samples,
+    uint8_t samples_count,
+    uint8_t* payload_buffer,
+    size_t payload_buffer_size,
+    size_t* payload_buffer_length)
+{
+  az_result rc;
+  az_span remainder = az_span_create(payload_buffer, (int32_t)payload_buffer_size);
+  char timestamp_buffer[TELEMETRY_TIMESTAMP_BUFFER_SIZE];
+
+  if (samples_count > 1)
+  {
+    rc = cbor_append_head(&remainder, CBOR_MAJOR_TYPE_ARRAY, samples_count);
+    EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed setting telemetry cbor batch root.");
+  }
+
+  for (uint8_t i = 0; i < samples_count; i++)
+  {
+    rc = cbor_append_head(&remainder, CBOR_MAJOR_TYPE_MAP, samples_count > 1 ? 2 : 1);
+    EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed setting telemetry cbor root.");
+
+    rc = cbor_append_text(&remainder, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_LED_STATUS));
+    EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding led_status name to telemetry payload.");
+    rc = cbor_append_int32(&remainder, samples[i].led_status);
+    EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding led_status value to telemetry payload.");
+
+    if (samples_count > 1)
+    {
+      rc = cbor_append_text(&remainder, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_TIMESTAMP));
+      EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding timestamp name to telemetry payload.");
+      rc = cbor_append_text(
+          &remainder,
+          format_telemetry_timestamp(
+              samples[i].timestamp, timestamp_buffer, sizeof(timestamp_buffer)));
+      EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding timestamp value to telemetry payload.");
+    }
+  }
+
+  *payload_buffer_length = payload_buffer_size - (size_t)az_span_size(remainder);
+
+  return RESULT_OK;
+}
+
+/*
+ * @brief     Adds a latency to the bucket it falls in.
+ */
+static void add_latency_sample(azure_pnp_latency_histogram_t* histogram, uint32_t latency_in_us)
+{
+  int bucket = 0;
+
+  while (bucket < (COMMAND_LATENCY_BUCKET_COUNT - 1)
+         && latency_in_us > command_latency_bucket_upper_bounds_in_us[bucket])
+  {
+    bucket++;
+  }
+
+  histogram->bucket_count[bucket]++;
+  histogram->count++;
+
+  if (latency_in_us > histogram->max_in_us)
+  {
+    histogram->max_in_us = latency_in_us;
+  }
+}
+
+/*
+ * @brief     Appends a latency histogram as an array of bucket counts to a JSON payload.
+ */
+static az_result json_append_latency_histogram(
+    az_json_writer* jw,
+    az_span name,
+    const azure_pnp_latency_histogram_t* histogram)
+{
+  az_result rc = az_json_writer_append_property_name(jw, name);
+
+  if (az_result_succeeded(rc))
+  {
+    rc = az_json_writer_append_begin_array(jw);
+  }
+
+  for (int i = 0; i < COMMAND_LATENCY_BUCKET_COUNT && az_result_succeeded(rc); i++)
+  {
+    rc = az_json_writer_append_int32(jw, (int32_t)histogram->bucket_count[i]);
+  }
+
+  if (az_result_succeeded(rc))
+  {
+    rc = az_json_writer_append_end_array(jw);
+  }
+
+  return rc;
+}
+
+/*
+ * @brief     Appends a latency histogram as an array of bucket counts to a CBOR payload.
+ */
+static az_result cbor_append_latency_histogram(
+    az_span* remainder,
+    az_span name,
+    const azure_pnp_latency_histogram_t* histogram)
+{
+  az_result rc = cbor_append_text(remainder, name);
+
+  if (az_result_succeeded(rc))
+  {
+    rc = cbor_append_head(remainder, CBOR_MAJOR_TYPE_ARRAY, COMMAND_LATENCY_BUCKET_COUNT);
+  }
+
+  for (int i = 0; i < COMMAND_LATENCY_BUCKET_COUNT && az_result_succeeded(rc); i++)
+  {
+    rc = cbor_append_head(remainder, CBOR_MAJOR_TYPE_UNSIGNED_INTEGER, histogram->bucket_count[i]);
+  }
+
+  return rc;
 }
 
+/*
+ * @brief     Generates `{"commandLatency":{"command":"...","receiveToHandler":[...],
+ *            "handler":[...],"response":[...]}}`, in the telemetry encoding set.
+ */
+static int generate_command_latency_payload(
+    const azure_pnp_command_latency_statistics_t* statistics,
+    uint8_t* payload_buffer,
+    size_t payload_buffer_size,
+    size_t* payload_buffer_length)
+{
+  az_json_writer jw;
+  az_result rc;
+  az_span remainder = az_span_create(payload_buffer, (int32_t)payload_buffer_size);
+
+  if (telemetry_encoding == azure_pnp_telemetry_encoding_cbor)
+  {
+    rc = cbor_append_head(&remainder, CBOR_MAJOR_TYPE_MAP, 1);
+    EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed setting command latency cbor root.");
+    rc = cbor_append_text(&remainder, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_COMMAND_LATENCY));
+    EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding command latency name.");
+    rc = cbor_append_head(&remainder, CBOR_MAJOR_TYPE_MAP, 4);
+    EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed setting command latency cbor object.");
+    rc = cbor_append_text(&remainder, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_COMMAND));
+    EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding command name to command latency.");
+    rc = cbor_append_text(&remainder, statistics->command_name);
+    EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding command value to command latency.");
+    rc = cbor_append_latency_histogram(
+        &remainder,
+        AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_RECEIVE_TO_HANDLER),
+        &statistics->receive_to_handler);
+    EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding receive to handler latency.");
+    rc = cbor_append_latency_histogram(
+        &remainder, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_HANDLER), &statistics->handler);
+    EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding handler latency.");
+    rc = cbor_append_latency_histogram(
+        &remainder, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_RESPONSE), &statistics->response);
+    EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding response latency.");
+
+    *payload_buffer_length = payload_buffer_size - (size_t)az_span_size(remainder);
+
+    return RESULT_OK;
+  }
+
+  rc = az_json_writer_init(&jw, remainder, NULL);
+  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed initializing json writer for command latency.");
+
+  rc = az_json_writer_append_begin_object(&jw);
+  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed setting command latency json root.");
+  rc = az_json_writer_append_property_name(
+      &jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_COMMAND_LATENCY));
+  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding command latency name.");
+  rc = az_json_writer_append_begin_object(&jw);
+  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed setting command latency json object.");
+  rc = az_json_writer_append_property_name(&jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_COMMAND));
+  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding command name to command latency.");
+  rc = az_json_writer_append_string(&jw, statistics->command_name);
+  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding command value to command latency.");
+  rc = json_append_latency_histogram(
+      &jw,
+      AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_RECEIVE_TO_HANDLER),
+      &statistics->receive_to_handler);
+  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding receive to handler latency.");
+  rc = json_append_latency_histogram(
+      &jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_HANDLER), &statistics->handler);
+  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding handler latency.");
+  rc = json_append_latency_histogram(
+      &jw, AZ_SPAN_FROM_STR(TELEMETRY_PROP_NAME_RESPONSE), &statistics->response);
+  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed adding response latency.");
+  rc = az_json_writer_append_end_object(&jw);
+  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed closing command latency json object.");
+  rc = az_json_writer_append_end_object(&jw);
+  EXIT_IF_AZ_FAILED(rc, RESULT_ERROR, "Failed closing command latency json payload.");
+
+  *payload_buffer_length = (size_t)az_span_size(az_json_writer_get_bytes_used_in_destination(&jw));
+
+  return RESULT_OK;
+}
 
 static int generate_device_info_payload(
     az_iot_hub_client const* hub_client,
@@ -542,56 +1134,88 @@ static int generate_properties_update_response(
   return RESULT_OK;
 }
 
+/*
+ * @brief     Reads the writable properties in a single pass, and generates the response for the
+ *            ones that changed since the last "$version" applied.
+ * @remark    For a full properties document only the "desired" section is read. Its properties
+ *            are all present, changed or not, so only values that differ from the ones in use
+ *            are applied (all of them if nothing was applied since boot). An update contains
+ *            just the properties written, which are all applied.
+ *            `response_length` is left untouched if there is nothing to respond.
+ */
 static int consume_properties_and_generate_response(
     azure_iot_t* azure_iot,
     az_span properties,
+    az_iot_hub_client_properties_message_type message_type,
     uint8_t* buffer,
     size_t buffer_size,
     size_t* response_length)
 {
   int result;
   az_json_reader jr;
-  az_span component_name;
   int32_t version = 0;
+  bool has_version = false;
+  int32_t frequency = 0;
+  bool has_frequency = false;
 
   az_result azrc = az_json_reader_init(&jr, properties, NULL);
   EXIT_IF_AZ_FAILED(azrc, RESULT_ERROR, "Failed initializing json reader for properties update.");
 
-  const az_iot_hub_client_properties_message_type message_type
-      = AZ_IOT_HUB_CLIENT_PROPERTIES_MESSAGE_TYPE_WRITABLE_UPDATED;
+  azrc = az_json_reader_next_token(&jr);
+  EXIT_IF_TRUE(
+      az_result_failed(azrc) || jr.token.kind != AZ_JSON_TOKEN_BEGIN_OBJECT,
+      RESULT_ERROR,
+      "Failed reading the beginning of writable properties.");
+
+  if (message_type == AZ_IOT_HUB_CLIENT_PROPERTIES_MESSAGE_TYPE_GET_RESPONSE)
+  {
+    // Moving into the "desired" section; the "reported" section is never read.
+    while (az_result_succeeded(azrc = az_json_reader_next_token(&jr))
+           && jr.token.kind == AZ_JSON_TOKEN_PROPERTY_NAME
+           && !az_json_token_is_text_equal(
+               &jr.token, AZ_SPAN_FROM_STR(PROPERTIES_DOCUMENT_DESIRED_NAME)))
+    {
+      azrc = az_json_reader_next_token(&jr);
+      EXIT_IF_AZ_FAILED(azrc, RESULT_ERROR, "Failed moving to next json token of properties.");
+
+      azrc = az_json_reader_skip_children(&jr);
+      EXIT_IF_AZ_FAILED(azrc, RESULT_ERROR, "Failed skipping children of properties.");
+    }
 
-  azrc = az_iot_hub_client_properties_get_properties_version(
-      &azure_iot->iot_hub_client, &jr, message_type, &version);
-  EXIT_IF_AZ_FAILED(azrc, RESULT_ERROR, "Failed writable properties version.");
+    EXIT_IF_TRUE(
+        az_result_failed(azrc) || jr.token.kind != AZ_JSON_TOKEN_PROPERTY_NAME,
+        RESULT_ERROR,
+        "No desired section in properties document.");
 
-  azrc = az_json_reader_init(&jr, properties, NULL);
-  EXIT_IF_AZ_FAILED(
-      azrc, RESULT_ERROR, "Failed re-initializing json reader for properties update.");
+    azrc = az_json_reader_next_token(&jr);
+    EXIT_IF_TRUE(
+        az_result_failed(azrc) || jr.token.kind != AZ_JSON_TOKEN_BEGIN_OBJECT,
+        RESULT_ERROR,
+        "Failed reading the desired section of properties document.");
+  }
 
-  while (az_result_succeeded(
-      azrc = az_iot_hub_client_properties_get_next_component_property(
-          &azure_iot->iot_hub_client,
-          &jr,
-          message_type,
-          AZ_IOT_HUB_CLIENT_PROPERTY_WRITABLE,
-          &component_name)))
+  while (az_result_succeeded(azrc = az_json_reader_next_token(&jr))
+         && jr.token.kind == AZ_JSON_TOKEN_PROPERTY_NAME)
   {
     if (az_json_token_is_text_equal(
-            &jr.token, AZ_SPAN_FROM_STR(WRITABLE_PROPERTY_TELEMETRY_FREQ_SECS)))
+            &jr.token, AZ_SPAN_FROM_STR(WRITABLE_PROPERTIES_VERSION_NAME)))
     {
-      int32_t value;
       azrc = az_json_reader_next_token(&jr);
       EXIT_IF_AZ_FAILED(azrc, RESULT_ERROR, "Failed getting writable properties next token.");
 
-      azrc = az_json_token_get_int32(&jr.token, &value);
-      EXIT_IF_AZ_FAILED(azrc, RESULT_ERROR, "Failed getting writable properties int32_t value.");
-
-      azure_pnp_set_telemetry_frequency((size_t)value);
+      azrc = az_json_token_get_int32(&jr.token, &version);
+      EXIT_IF_AZ_FAILED(azrc, RESULT_ERROR, "Failed writable properties version.");
+      has_version = true;
+    }
+    else if (az_json_token_is_text_equal(
+                 &jr.token, AZ_SPAN_FROM_STR(WRITABLE_PROPERTY_TELEMETRY_FREQ_SECS)))
+    {
+      azrc = az_json_reader_next_token(&jr);
+      EXIT_IF_AZ_FAILED(azrc, RESULT_ERROR, "Failed getting writable properties next token.");
 
-      result = generate_properties_update_response(
-          azure_iot, component_name, value, version, buffer, buffer_size, response_length);
-      EXIT_IF_TRUE(
-          result != RESULT_OK, RESULT_ERROR, "generate_properties_update_response failed.");
+      azrc = az_json_token_get_int32(&jr.token, &frequency);
+      EXIT_IF_AZ_FAILED(azrc, RESULT_ERROR, "Failed getting writable properties int32_t value.");
+      has_frequency = true;
     }
     else
     {
@@ -599,19 +1223,39 @@ static int consume_properties_and_generate_response(
           "Unexpected property received (%.*s).",
           az_span_size(jr.token.slice),
           az_span_ptr(jr.token.slice));
+
+      azrc = az_json_reader_next_token(&jr);
+      EXIT_IF_AZ_FAILED(
+          azrc, RESULT_ERROR, "Failed moving to next json token of writable properties.");
+
+      azrc = az_json_reader_skip_children(&jr);
+      EXIT_IF_AZ_FAILED(azrc, RESULT_ERROR, "Failed skipping children of writable properties.");
     }
+  }
 
-    azrc = az_json_reader_next_token(&jr);
-    EXIT_IF_AZ_FAILED(
-        azrc, RESULT_ERROR, "Failed moving to next json token of writable properties.");
+  EXIT_IF_AZ_FAILED(azrc, RESULT_ERROR, "Failed reading writable properties.");
+  EXIT_IF_TRUE(!has_version, RESULT_ERROR, "Failed writable properties version.");
+
+  if (version <= writable_properties_version)
+  {
+    LogInfo("Writable properties version %d already applied.", version);
+    return RESULT_OK;
+  }
 
-    azrc = az_json_reader_skip_children(&jr);
-    EXIT_IF_AZ_FAILED(azrc, RESULT_ERROR, "Failed skipping children of writable properties.");
+  if (has_frequency
+      && (message_type != AZ_IOT_HUB_CLIENT_PROPERTIES_MESSAGE_TYPE_GET_RESPONSE
+          || writable_properties_version == 0
+          || (size_t)frequency != telemetry_frequency_in_seconds))
+  {
+    azure_pnp_set_telemetry_frequency((size_t)frequency);
 
-    azrc = az_json_reader_next_token(&jr);
-    EXIT_IF_AZ_FAILED(
-        azrc, RESULT_ERROR, "Failed moving to next json token of writable properties (again).");
+    result = generate_properties_update_response(
+        azure_iot, AZ_SPAN_EMPTY, frequency, version, buffer, buffer_size, response_length);
+    EXIT_IF_TRUE(
+        result != RESULT_OK, RESULT_ERROR, "generate_properties_update_response failed.");
   }
 
+  writable_properties_version = version;
+
   return RESULT_OK;
 }
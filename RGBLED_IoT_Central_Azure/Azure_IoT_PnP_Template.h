@@ -11,6 +11,12 @@
 
 #include "AzureIoT.h"
 
+#define TELEMETRY_BATCH_MAX_SIZE 16
+
+// Commands implemented by this template, plus one entry for any other command received.
+#define COMMAND_LATENCY_COMMAND_COUNT 6
+#define COMMAND_LATENCY_BUCKET_COUNT 10
+
 /*
  * @brief     Initializes internal components of this module.
  * @remark    It must be called once by the application, before any other function
@@ -30,16 +36,14 @@ const az_span azure_pnp_get_model_id();
  * @brief     Sends the device description to Azure IoT Central.
  * @remark    Azure IoT Central expects the application to send a description of device and its
  * capabilities. This function generates a description of the Espressif ESP32 Azure IoT Kit and
- * sends it to Azure IoT Central.
+ * sets it as reported properties, sent to Azure IoT Central merged with any other reported
+ * properties set around the same time (see `azure_iot_set_reported_properties`).
  *
  * @param[in]    azure_iot     A pointer the azure_iot_t instance with the state of the Azure IoT
  * client.
- * @param[in]    request_id    An unique identification number to correlate the response with when
- *                             `on_properties_update_completed` (set in azure_iot_config_t) is
- * invoked.
  * @return       int           0 if the function succeeds, non-zero if any error occurs.
  */
-int azure_pnp_send_device_info(azure_iot_t* azure_iot, uint32_t request_id);
+int azure_pnp_send_device_info(azure_iot_t* azure_iot);
 
 /*
  * @brief     Sets with which minimum frequency this module should send telemetry to Azure IoT
@@ -54,6 +58,63 @@ int azure_pnp_send_device_info(azure_iot_t* azure_iot, uint32_t request_id);
  */
 void azure_pnp_set_telemetry_frequency(size_t frequency_in_seconds);
 
+/*
+ * @brief    Encodings of the telemetry payload.
+ */
+typedef enum azure_pnp_telemetry_encoding_t_enum
+{
+  azure_pnp_telemetry_encoding_json,
+  azure_pnp_telemetry_encoding_cbor
+} azure_pnp_telemetry_encoding_t;
+
+/*
+ * @brief    Size and encoding cost of the telemetry payloads generated so far.
+ * @remark   `encode_time_in_us` only counts the time spent encoding the payloads, so it can be
+ *           compared between encodings. `framing_bytes_saved` estimates the MQTT and TLS
+ *           framing (including the topic) not sent thanks to batching `sample_count` samples
+ *           into `message_count` messages.
+ */
+typedef struct azure_pnp_telemetry_statistics_t_struct
+{
+  uint32_t sample_count;
+  uint32_t message_count;
+  uint32_t payload_bytes;
+  uint32_t encode_time_in_us;
+  uint32_t framing_bytes_saved;
+} azure_pnp_telemetry_statistics_t;
+
+/*
+ * @brief     Sets how telemetry payloads are encoded.
+ * @remark    JSON is used by default. CBOR (RFC 8949) payloads are smaller and cheaper to generate,
+ *            but Azure IoT needs the content type for decoding them, so `telemetry_content_type`
+ *            must be set to "application%2Fcbor" in azure_iot_config_t.
+ *
+ * @param[in]    encoding    Encoding of the telemetry payloads sent after this call.
+ */
+void azure_pnp_set_telemetry_encoding(azure_pnp_telemetry_encoding_t encoding);
+
+/*
+ * @brief     Sets how many telemetry samples are sent together in a single message.
+ * @remark    A sample is taken each time telemetry is due (see
+ *            `azure_pnp_set_telemetry_frequency`), and the samples are sent once `batch_size`
+ *            of them are taken. A batch is an array of samples, each with its timestamp. With a
+ *            `batch_size` of 1 (the default) each sample is sent on its own, without timestamp.
+ *            A batch is sent early if its payload would exceed `max_payload_size`, which
+ *            should not be larger than a telemetry in-flight slot for QoS 1.
+ *
+ * @param[in]    batch_size          From 1 to TELEMETRY_BATCH_MAX_SIZE samples.
+ * @param[in]    max_payload_size    Maximum size of a batch payload, in bytes. If zero, the
+ *                                   internal payload buffer size is used.
+ */
+void azure_pnp_set_telemetry_batch_size(uint8_t batch_size, size_t max_payload_size);
+
+/*
+ * @brief     Gets the size and encoding cost of the telemetry payloads generated so far.
+ *
+ * @param[out]   statistics    A pointer to where the statistics are copied to.
+ */
+void azure_pnp_get_telemetry_statistics(azure_pnp_telemetry_statistics_t* statistics);
+
 /*
  * @brief     Sends telemetry implemented by this IoT Plug and Play application to Azure IoT
  * Central.
@@ -73,39 +134,93 @@ void azure_pnp_set_telemetry_frequency(size_t frequency_in_seconds);
  */
 int azure_pnp_send_telemetry(azure_iot_t* azure_iot);
 
+/*
+ * @brief    Histogram of latencies, in microseconds.
+ * @remark   The upper bounds of the buckets are 250, 500, 1000, 2500, 5000, 10000, 25000, 100000
+ *           and 500000 us. The last bucket counts anything longer.
+ */
+typedef struct azure_pnp_latency_histogram_t_struct
+{
+  uint32_t bucket_count[COMMAND_LATENCY_BUCKET_COUNT];
+  uint32_t count;
+  uint32_t max_in_us;
+} azure_pnp_latency_histogram_t;
+
+/*
+ * @brief    Latencies of the handling of a command, from its reception to its response.
+ * @remark   `receive_to_handler` is the time between the command being received and its handler
+ *           starting (e.g., waiting for the main loop). `handler` is the time taken for the command
+ *           to take effect (including updating the LEDs), and `response` the time taken for
+ *           publishing the response. The entry for unknown commands has an empty `command_name`.
+ */
+typedef struct azure_pnp_command_latency_statistics_t_struct
+{
+  az_span command_name;
+  azure_pnp_latency_histogram_t receive_to_handler;
+  azure_pnp_latency_histogram_t handler;
+  azure_pnp_latency_histogram_t response;
+} azure_pnp_command_latency_statistics_t;
+
+/*
+ * @brief     Gets the latency histograms of each command handled so far.
+ *
+ * @param[out]   statistics    Array of COMMAND_LATENCY_COMMAND_COUNT elements where the
+ *                             statistics are copied to.
+ */
+void azure_pnp_get_command_latency_statistics(azure_pnp_command_latency_statistics_t* statistics);
+
+/*
+ * @brief     Sends the latency histograms of the commands handled since the last call as
+ *            telemetry, one message per command.
+ * @remark    The histograms sent are cumulative (since boot), with the encoding set with
+ *            `azure_pnp_set_telemetry_encoding`. Commands not received since the last call are
+ *            not sent.
+ *
+ * @param[in]    azure_iot    A pointer to a azure_iot_t instance, previously initialized
+ *                            with `azure_iot_init`.
+ *
+ * return        int          0 on success, non-zero if any failure occurs.
+ */
+int azure_pnp_send_command_latency_telemetry(azure_iot_t* azure_iot);
+
 /*
  * @brief     Handles a command when it is received from Azure IoT Central.
  * @remark    This function will perform the task requested by the command received
  *            (if the command matches the expected name) and sends back a response to
- *            Azure IoT Central.
+ *            Azure IoT Central. The time taken is added to the command latency histograms (see
+ *            `azure_pnp_get_command_latency_statistics`).
  *
- * @param[in]    azure_iot          A pointer to a azure_iot_t instance, previously initialized
- *                                  with `azure_iot_init`.
- * @param[in]    command_request    The `command_request_t` instance containing the details of the
- *                                  device command.
+ * @param[in]    azure_iot            A pointer to a azure_iot_t instance, previously initialized
+ *                                    with `azure_iot_init`.
+ * @param[in]    command_request      The `command_request_t` instance containing the details of
+ *                                    the device command.
+ * @param[in]    received_time_in_us  Time (from `micros()`) at which the command was received.
  *
- * return        int                0 on success, non-zero if any failure occurs.
+ * return        int                  0 on success, non-zero if any failure occurs.
  */
-int azure_pnp_handle_command_request(azure_iot_t* azure_iot, command_request_t command_request);
+int azure_pnp_handle_command_request(
+    azure_iot_t* azure_iot,
+    command_request_t command_request,
+    unsigned long received_time_in_us);
 
 /*
  * @brief     Handles a payload with writable properties received from Azure IoT Central.
- * @remark    This function will consume the writable properties update received
- *            and send back a response to Azure IoT Central.
+ * @remark    This function will consume the writable properties received and set the response
+ *            as reported properties (see `azure_iot_set_reported_properties`). Properties with a
+ *            "$version" not newer than the last one applied are skipped, as are unchanged
+ *            properties in a full properties document, so the document received on every
+ *            reconnection is not re-applied and re-acked.
  *
  * @param[in]    azure_iot     A pointer to a azure_iot_t instance, previously initialized
  *                             with `azure_iot_init`.
  * @param[in]    properties    Raw properties writable-properties payload received from Azure.
- * @param[in]    request_id    The request ID of the response that is sent to the Azure IoT Central.
- *                             In Azure IoT Plug and Play, a response to a writable-property update
- * is itself a reported-property (device-side property) update, so it gets a a response from Azure
- * with the same request ID provided here as argument.
+ * @param[in]    message_type  Type of properties message, as given to `on_properties_received`.
  *
  * return        int           0 on success, non-zero if any failure occurs.
  */
 int azure_pnp_handle_properties_update(
     azure_iot_t* azure_iot,
     az_span properties,
-    uint32_t request_id);
+    az_iot_hub_client_properties_message_type message_type);
 
 #endif // AZURE_IOT_PNP_TEMPLATE_H
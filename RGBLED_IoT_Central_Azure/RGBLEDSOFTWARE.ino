@@ -37,6 +37,9 @@
 #include <string.h>
 #include <time.h>
 
+// For the queue of requests deferred from the MQTT task to the main loop
+#include <atomic>
+
 // For hmac SHA256 encryption
 #include <mbedtls/base64.h>
 #include <mbedtls/md.h>
@@ -46,6 +49,19 @@
 #include <WiFi.h>
 #include <mqtt_client.h>
 
+// For saving the device-provisioning result in non-volatile storage (NVS)
+#include <Preferences.h>
+
+// Hardware random number generator
+#include <esp_system.h>
+
+// For spilling telemetry stored while offline into flash
+#include <LittleFS.h>
+
+// Event queue for waking up the main loop only when the Azure IoT client has work to do
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+
 // Azure IoT SDK for C includes
 #include <az_core.h>
 #include <az_iot.h>
@@ -59,6 +75,63 @@
 /* --- Sample-specific Settings --- */
 #define SERIAL_LOGGER_BAUD_RATE 115200
 #define MQTT_DO_NOT_RETAIN_MSG 0
+// Url-encoded, as sent in the telemetry topic.
+#define TELEMETRY_CBOR_CONTENT_TYPE "application%2Fcbor"
+
+/* --- Provisioning Cache Settings --- */
+#define PROVISIONING_CACHE_NVS_NAMESPACE "azprov"
+#define PROVISIONING_CACHE_NVS_KEY_HUB "hub"
+#define PROVISIONING_CACHE_NVS_KEY_DEVICE_ID "devid"
+#define PROVISIONING_CACHE_NVS_READ_ONLY true
+#define PROVISIONING_CACHE_NVS_READ_WRITE false
+
+/* --- HMAC-SHA256 Settings --- */
+#define HMAC_SHA256_BLOCK_SIZE 64
+#define HMAC_SHA256_DIGEST_SIZE 32
+#define HMAC_INNER_PAD_BYTE 0x36
+#define HMAC_OUTER_PAD_BYTE 0x5c
+
+/* --- Offline Telemetry Settings --- */
+#define OFFLINE_TELEMETRY_FILE_PATH "/telemetry.bin"
+#define OFFLINE_TELEMETRY_FILE_MAX_SIZE (64 * 1024)
+#define OFFLINE_TELEMETRY_RECORD_HEADER_SIZE 2
+#define OFFLINE_TELEMETRY_DRAIN_RATE_PER_SEC 5
+#define LITTLEFS_FORMAT_ON_FAIL true
+
+/* --- Outbound Rate Limit Settings --- */
+// Per device. The Azure IoT Hub quotas (e.g., per S1 unit: 100 telemetry messages, 10 twin
+// updates and 20 direct methods per second) are shared by all the devices of the hub.
+#define TELEMETRY_RATE_LIMIT_PER_SEC 2
+#define TELEMETRY_RATE_LIMIT_BURST 8
+#define PROPERTIES_RATE_LIMIT_PER_SEC 1
+#define PROPERTIES_RATE_LIMIT_BURST 4
+#define COMMAND_RESPONSE_RATE_LIMIT_PER_SEC 5
+#define COMMAND_RESPONSE_RATE_LIMIT_BURST 5
+
+/* --- Event Queue Settings --- */
+#define AZ_IOT_EVENT_QUEUE_LENGTH 16
+#define LOOP_MAX_WAIT_IN_MS 1000 // For checking Wi-Fi and sampling telemetry.
+#define IDLE_STATISTICS_LOG_INTERVAL_IN_MS 60000
+
+/* --- Deferred Requests Settings --- */
+#define DEFERRED_REQUESTS_QUEUE_LENGTH 4
+// Large enough for the full properties document requested on every connection.
+#define DEFERRED_REQUEST_BUFFER_SIZE 1024
+
+/* --- Command Latency Settings --- */
+#define COMMAND_LATENCY_TELEMETRY_INTERVAL_IN_MS 300000
+
+/* --- Telemetry Batching Settings --- */
+// Samples are batched more as the Wi-Fi signal weakens or telemetry needs retransmitting,
+// trading latency for fewer messages over a poor link.
+#define TELEMETRY_BATCH_SIZE_UPDATE_INTERVAL_IN_MS 30000
+#define TELEMETRY_BATCH_RSSI_FAIR_IN_DBM -70
+#define TELEMETRY_BATCH_RSSI_POOR_IN_DBM -80
+#define TELEMETRY_BATCH_SIZE_GOOD_LINK 1
+#define TELEMETRY_BATCH_SIZE_FAIR_LINK 4
+#define TELEMETRY_BATCH_SIZE_POOR_LINK 8
+#define TELEMETRY_BATCH_MAX_PAYLOAD_SIZE \
+  (AZ_IOT_TELEMETRY_IN_FLIGHT_BUFFER_SIZE / AZ_IOT_TELEMETRY_IN_FLIGHT_WINDOW_SIZE)
 
 /* --- Time and NTP Settings --- */
 #define NTP_SERVERS "pool.ntp.org", "time.nist.gov"
@@ -83,6 +156,7 @@ static const char* wifi_password = IOT_CONFIG_WIFI_PASSWORD;
 /* --- Function Declarations --- */
 static void sync_device_clock_with_ntp_server();
 static void connect_to_wifi();
+static void report_connection_phases();
 static esp_err_t esp_mqtt_event_handler(esp_mqtt_event_handle_t event);
 
 // This is a logging function used by Azure IoT client.
@@ -95,12 +169,97 @@ static esp_mqtt_client_handle_t mqtt_client;
 
 static char mqtt_broker_uri[128];
 
-#define AZ_IOT_DATA_BUFFER_SIZE 1500
+// Persistent (256 bytes) and connection (384 bytes) regions use the defaults from AzureIoT.h,
+// the rest is scratch. See the data buffer usage logged once connected for resizing.
+#define AZ_IOT_DATA_BUFFER_SIZE 1800
 static uint8_t az_iot_data_buffer[AZ_IOT_DATA_BUFFER_SIZE];
 
+#define AZ_IOT_HELD_MESSAGES_BUFFER_SIZE 512
+static uint8_t az_iot_held_messages_buffer[AZ_IOT_HELD_MESSAGES_BUFFER_SIZE];
+
+// Each slot fits a batch of telemetry samples.
+#define AZ_IOT_TELEMETRY_IN_FLIGHT_BUFFER_SIZE 2048
+#define AZ_IOT_TELEMETRY_IN_FLIGHT_WINDOW_SIZE 4
+static uint8_t az_iot_telemetry_in_flight_buffer[AZ_IOT_TELEMETRY_IN_FLIGHT_BUFFER_SIZE];
+
+#define AZ_IOT_OFFLINE_TELEMETRY_BUFFER_SIZE 2048
+static uint8_t az_iot_offline_telemetry_buffer[AZ_IOT_OFFLINE_TELEMETRY_BUFFER_SIZE];
+
+#define AZ_IOT_REPORTED_PROPERTIES_BUFFER_SIZE 1024
+static uint8_t az_iot_reported_properties_buffer[AZ_IOT_REPORTED_PROPERTIES_BUFFER_SIZE];
+
+// Command responses go out ahead of properties, and these ahead of telemetry. The properties
+// queue fits a full reported properties patch with its topic.
+#define AZ_IOT_COMMAND_RESPONSE_QUEUE_BUFFER_SIZE 512
+#define AZ_IOT_PROPERTIES_QUEUE_BUFFER_SIZE (AZ_IOT_REPORTED_PROPERTIES_BUFFER_SIZE + 128)
+#define AZ_IOT_TELEMETRY_QUEUE_BUFFER_SIZE 1024
+static uint8_t az_iot_command_response_queue_buffer[AZ_IOT_COMMAND_RESPONSE_QUEUE_BUFFER_SIZE];
+static uint8_t az_iot_properties_queue_buffer[AZ_IOT_PROPERTIES_QUEUE_BUFFER_SIZE];
+static uint8_t az_iot_telemetry_queue_buffer[AZ_IOT_TELEMETRY_QUEUE_BUFFER_SIZE];
+
+// Records before this position in the offline telemetry file were already published.
+static size_t offline_telemetry_file_read_position = 0;
+static size_t offline_telemetry_file_peeked_record_size = 0;
+static bool is_offline_telemetry_file_available = false;
+
+static QueueHandle_t az_iot_event_queue;
+static unsigned long last_idle_statistics_log_time = 0;
+
+/*
+ * Commands and writable-properties updates are received in the context of the ESP MQTT task,
+ * and copied into this single-producer (MQTT task) single-consumer (main loop) queue so they are
+ * processed by the main loop, with no contention over the data buffers or the LED.
+ */
+typedef enum deferred_request_type_t_enum
+{
+  deferred_request_command,
+  deferred_request_properties
+} deferred_request_type_t;
+
+typedef struct deferred_request_t_struct
+{
+  deferred_request_type_t type;
+  command_request_t command;
+  az_span properties;
+  az_iot_hub_client_properties_message_type properties_message_type;
+  unsigned long enqueue_time_in_ms;
+  unsigned long received_time_in_us;
+  uint8_t buffer[DEFERRED_REQUEST_BUFFER_SIZE];
+} deferred_request_t;
+
+static deferred_request_t deferred_requests[DEFERRED_REQUESTS_QUEUE_LENGTH];
+// Free-running indexes, each only written by one side.
+static std::atomic<uint32_t> deferred_requests_write_index(0);
+static std::atomic<uint32_t> deferred_requests_read_index(0);
+// SHA-256 states after hashing the inner and outer pads of the last HMAC key used, so each SAS
+// token signature only hashes the payload and the inner digest.
+static mbedtls_md_context_t hmac_inner_pad_context;
+static mbedtls_md_context_t hmac_outer_pad_context;
+static mbedtls_md_context_t hmac_context;
+static uint8_t hmac_key[HMAC_SHA256_BLOCK_SIZE];
+static size_t hmac_key_length = 0;
+static bool are_hmac_contexts_set_up = false;
+static uint32_t hmac_pad_state_hit_count = 0;
+static uint32_t hmac_pad_state_miss_count = 0;
+
+static unsigned long last_telemetry_batch_size_update_time = 0;
+static unsigned long last_command_latency_telemetry_time = 0;
+static uint32_t last_telemetry_retransmit_count = 0;
+
+static uint32_t deferred_requests_overflow_count = 0;
+static uint32_t deferred_requests_processed_count = 0;
+static unsigned long deferred_requests_total_wait_in_ms = 0;
+static unsigned long deferred_requests_max_wait_in_ms = 0;
+
+// Connection phases outside of the Azure IoT client, and the Azure IoT client ones last reported,
+// so each report only covers the time since the previous one.
+static unsigned long wifi_connect_time_in_ms = 0;
+static unsigned long ntp_sync_time_in_ms = 0;
+static connection_phase_statistics_t reported_connection_phase_statistics;
+static char connection_phases_payload[160];
+
 #define MQTT_PROTOCOL_PREFIX "mqtts://"
 
-static uint32_t properties_request_id = 0;
 static bool send_device_info = true;
 static bool azure_initial_connect = false; //Turns true when ESP32 successfully connects to Azure IoT Central for the first time
 
@@ -146,6 +305,9 @@ static int mqtt_client_init_function(
   mqtt_config.event_handle = esp_mqtt_event_handler;
   mqtt_config.user_context = NULL;
   mqtt_config.cert_pem = (const char*)ca_pem;
+  // esp-mqtt does not take (nor export) TLS sessions of its transport, so
+  // `mqtt_client_config->tls_session` cannot be offered and every connection performs a full
+  // TLS handshake. No `tls_session_buffer` is given to azure_iot_config for that reason.
 
   LogInfo("MQTT client target uri set to '%s'", mqtt_broker_uri);
 
@@ -234,22 +396,81 @@ static int mqtt_client_publish_function(
   int mqtt_result = esp_mqtt_client_publish(
       (esp_mqtt_client_handle_t)mqtt_client_handle,
       (const char*)az_span_ptr(mqtt_message->topic), // topic is always null-terminated.
-      (const char*)az_span_ptr(mqtt_message->payload),
+      // An empty payload (e.g. properties document request) must not be NULL for esp-mqtt.
+      az_span_size(mqtt_message->payload) == 0 ? ""
+                                               : (const char*)az_span_ptr(mqtt_message->payload),
       az_span_size(mqtt_message->payload),
       (int)mqtt_message->qos,
       MQTT_DO_NOT_RETAIN_MSG);
 
-  if (mqtt_result == -1)
+  // The message id is the packet id later informed by MQTT_EVENT_PUBLISHED (zero for QoS 0).
+  return mqtt_result;
+}
+
+/* --- Other Interface functions required by Azure IoT --- */
+
+/*
+ * @brief           Hashes the inner and outer pads of an HMAC-SHA256 key, keeping the resulting
+ *                  SHA-256 states for signing with the same key later.
+ *
+ * @return          0 on success, non-zero if any failure occurs.
+ */
+static int set_hmac_sha256_key(const uint8_t* key, size_t key_length)
+{
+  const mbedtls_md_info_t* md_info = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
+  uint8_t pad[HMAC_SHA256_BLOCK_SIZE];
+  int result;
+
+  hmac_key_length = 0;
+
+  if (!are_hmac_contexts_set_up)
   {
-    return RESULT_ERROR;
+    mbedtls_md_init(&hmac_inner_pad_context);
+    mbedtls_md_init(&hmac_outer_pad_context);
+    mbedtls_md_init(&hmac_context);
+
+    result = mbedtls_md_setup(&hmac_inner_pad_context, md_info, 0);
+    result = (result != 0) ? result : mbedtls_md_setup(&hmac_outer_pad_context, md_info, 0);
+    result = (result != 0) ? result : mbedtls_md_setup(&hmac_context, md_info, 0);
+
+    if (result != 0)
+    {
+      LogError("Failed setting up HMAC-SHA256 contexts (%d).", result);
+      return result;
+    }
+
+    are_hmac_contexts_set_up = true;
   }
-  else
+
+  (void)memset(pad, HMAC_INNER_PAD_BYTE, sizeof(pad));
+  for (size_t i = 0; i < key_length; i++)
   {
-    return RESULT_OK;
+    pad[i] ^= key[i];
   }
-}
 
-/* --- Other Interface functions required by Azure IoT --- */
+  result = mbedtls_md_starts(&hmac_inner_pad_context);
+  result = (result != 0) ? result : mbedtls_md_update(&hmac_inner_pad_context, pad, sizeof(pad));
+
+  (void)memset(pad, HMAC_OUTER_PAD_BYTE, sizeof(pad));
+  for (size_t i = 0; i < key_length; i++)
+  {
+    pad[i] ^= key[i];
+  }
+
+  result = (result != 0) ? result : mbedtls_md_starts(&hmac_outer_pad_context);
+  result = (result != 0) ? result : mbedtls_md_update(&hmac_outer_pad_context, pad, sizeof(pad));
+
+  // Not leaving key material on the stack.
+  (void)memset(pad, 0, sizeof(pad));
+
+  if (result == 0)
+  {
+    (void)memcpy(hmac_key, key, key_length);
+    hmac_key_length = key_length;
+  }
+
+  return result;
+}
 
 /*
  * See the documentation of `hmac_sha256_encryption_function_t` in AzureIoT.h for details.
@@ -262,18 +483,55 @@ static int mbedtls_hmac_sha256(
     uint8_t* signed_payload,
     size_t signed_payload_size)
 {
-  (void)signed_payload_size;
-  mbedtls_md_context_t ctx;
-  mbedtls_md_type_t md_type = MBEDTLS_MD_SHA256;
+  uint8_t inner_digest[HMAC_SHA256_DIGEST_SIZE];
+  int result;
+
+  if (signed_payload_size < HMAC_SHA256_DIGEST_SIZE)
+  {
+    return -1;
+  }
+
+  if (key_length > HMAC_SHA256_BLOCK_SIZE)
+  {
+    // Keys longer than a block are hashed first; not the case of device keys, so not cached.
+    mbedtls_md_context_t ctx;
 
-  mbedtls_md_init(&ctx);
-  mbedtls_md_setup(&ctx, mbedtls_md_info_from_type(md_type), 1);
-  mbedtls_md_hmac_starts(&ctx, (const unsigned char*)key, key_length);
-  mbedtls_md_hmac_update(&ctx, (const unsigned char*)payload, payload_length);
-  mbedtls_md_hmac_finish(&ctx, (byte*)signed_payload);
-  mbedtls_md_free(&ctx);
+    mbedtls_md_init(&ctx);
+    result = mbedtls_md_setup(&ctx, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 1);
+    result = (result != 0) ? result : mbedtls_md_hmac_starts(&ctx, key, key_length);
+    result = (result != 0) ? result : mbedtls_md_hmac_update(&ctx, payload, payload_length);
+    result = (result != 0) ? result : mbedtls_md_hmac_finish(&ctx, signed_payload);
+    mbedtls_md_free(&ctx);
 
-  return 0;
+    return result;
+  }
+
+  if (hmac_key_length == 0 || key_length != hmac_key_length
+      || memcmp(key, hmac_key, key_length) != 0)
+  {
+    hmac_pad_state_miss_count++;
+
+    if (set_hmac_sha256_key(key, key_length) != 0)
+    {
+      return -1;
+    }
+  }
+  else
+  {
+    hmac_pad_state_hit_count++;
+  }
+
+  // H((K ^ opad) || H((K ^ ipad) || payload)), resuming from the cached pad states.
+  result = mbedtls_md_clone(&hmac_context, &hmac_inner_pad_context);
+  result = (result != 0) ? result : mbedtls_md_update(&hmac_context, payload, payload_length);
+  result = (result != 0) ? result : mbedtls_md_finish(&hmac_context, inner_digest);
+  result = (result != 0) ? result : mbedtls_md_clone(&hmac_context, &hmac_outer_pad_context);
+  result = (result != 0)
+      ? result
+      : mbedtls_md_update(&hmac_context, inner_digest, sizeof(inner_digest));
+  result = (result != 0) ? result : mbedtls_md_finish(&hmac_context, signed_payload);
+
+  return result;
 }
 
 /*
@@ -302,6 +560,258 @@ static int base64_encode(
   return mbedtls_base64_encode(encoded, encoded_size, encoded_length, data, data_length);
 }
 
+/*
+ * See the documentation of `random_number_function_t` in AzureIoT.h for details.
+ */
+static uint32_t get_random_number() { return esp_random(); }
+
+/*
+ * See the documentation of `provisioning_cache_load_function_t` in AzureIoT.h for details.
+ */
+static int provisioning_cache_load(
+    az_span iot_hub_fqdn,
+    int32_t* iot_hub_fqdn_length,
+    az_span device_id,
+    int32_t* device_id_length)
+{
+  Preferences preferences;
+
+  if (!preferences.begin(PROVISIONING_CACHE_NVS_NAMESPACE, PROVISIONING_CACHE_NVS_READ_ONLY))
+  {
+    return RESULT_ERROR;
+  }
+
+  *iot_hub_fqdn_length = (int32_t)preferences.getBytes(
+      PROVISIONING_CACHE_NVS_KEY_HUB, az_span_ptr(iot_hub_fqdn), az_span_size(iot_hub_fqdn));
+  *device_id_length = (int32_t)preferences.getBytes(
+      PROVISIONING_CACHE_NVS_KEY_DEVICE_ID, az_span_ptr(device_id), az_span_size(device_id));
+  preferences.end();
+
+  return (*iot_hub_fqdn_length > 0 && *device_id_length > 0) ? RESULT_OK : RESULT_ERROR;
+}
+
+/*
+ * See the documentation of `provisioning_cache_save_function_t` in AzureIoT.h for details.
+ */
+static int provisioning_cache_save(az_span iot_hub_fqdn, az_span device_id)
+{
+  int result;
+  Preferences preferences;
+
+  if (!preferences.begin(PROVISIONING_CACHE_NVS_NAMESPACE, PROVISIONING_CACHE_NVS_READ_WRITE))
+  {
+    return RESULT_ERROR;
+  }
+
+  if (preferences.putBytes(
+          PROVISIONING_CACHE_NVS_KEY_HUB, az_span_ptr(iot_hub_fqdn), az_span_size(iot_hub_fqdn))
+          != (size_t)az_span_size(iot_hub_fqdn)
+      || preferences.putBytes(
+             PROVISIONING_CACHE_NVS_KEY_DEVICE_ID, az_span_ptr(device_id), az_span_size(device_id))
+          != (size_t)az_span_size(device_id))
+  {
+    (void)preferences.clear();
+    result = RESULT_ERROR;
+  }
+  else
+  {
+    result = RESULT_OK;
+  }
+
+  preferences.end();
+
+  return result;
+}
+
+/*
+ * See the documentation of `provisioning_cache_clear_function_t` in AzureIoT.h for details.
+ */
+static int provisioning_cache_clear()
+{
+  int result;
+  Preferences preferences;
+
+  if (!preferences.begin(PROVISIONING_CACHE_NVS_NAMESPACE, PROVISIONING_CACHE_NVS_READ_WRITE))
+  {
+    return RESULT_ERROR;
+  }
+
+  result = preferences.clear() ? RESULT_OK : RESULT_ERROR;
+  preferences.end();
+
+  return result;
+}
+
+/*
+ * See the documentation of `offline_telemetry_storage_push_function_t` in AzureIoT.h for details.
+ */
+static int offline_telemetry_storage_push(az_span record)
+{
+  int result;
+  uint8_t header[OFFLINE_TELEMETRY_RECORD_HEADER_SIZE];
+  File file;
+
+  if (!is_offline_telemetry_file_available)
+  {
+    return RESULT_ERROR;
+  }
+
+  file = LittleFS.open(OFFLINE_TELEMETRY_FILE_PATH, FILE_APPEND);
+
+  if (!file)
+  {
+    return RESULT_ERROR;
+  }
+
+  if ((file.size() + sizeof(header) + az_span_size(record)) > OFFLINE_TELEMETRY_FILE_MAX_SIZE)
+  {
+    result = RESULT_ERROR;
+  }
+  else
+  {
+    header[0] = (uint8_t)(az_span_size(record) >> 8);
+    header[1] = (uint8_t)az_span_size(record);
+
+    result = (file.write(header, sizeof(header)) == sizeof(header)
+              && file.write(az_span_ptr(record), az_span_size(record)) == az_span_size(record))
+        ? RESULT_OK
+        : RESULT_ERROR;
+  }
+
+  file.close();
+
+  return result;
+}
+
+/*
+ * See the documentation of `offline_telemetry_storage_peek_function_t` in AzureIoT.h for details.
+ * Note: the read position is not persisted, so records not yet published when the device reboots
+ * are published again (at-least-once).
+ */
+static int offline_telemetry_storage_peek(az_span buffer, int32_t* record_length)
+{
+  int result = RESULT_ERROR;
+  uint8_t header[OFFLINE_TELEMETRY_RECORD_HEADER_SIZE];
+  File file;
+
+  if (!is_offline_telemetry_file_available)
+  {
+    return RESULT_ERROR;
+  }
+
+  file = LittleFS.open(OFFLINE_TELEMETRY_FILE_PATH, FILE_READ);
+
+  if (!file)
+  {
+    return RESULT_ERROR;
+  }
+
+  if (file.seek(offline_telemetry_file_read_position)
+      && file.read(header, sizeof(header)) == sizeof(header))
+  {
+    *record_length = (header[0] << 8) | header[1];
+
+    if (*record_length <= az_span_size(buffer)
+        && file.read(az_span_ptr(buffer), *record_length) == (size_t)*record_length)
+    {
+      offline_telemetry_file_peeked_record_size = sizeof(header) + *record_length;
+      result = RESULT_OK;
+    }
+  }
+
+  file.close();
+
+  return result;
+}
+
+/*
+ * See the documentation of `offline_telemetry_storage_pop_function_t` in AzureIoT.h for details.
+ */
+static int offline_telemetry_storage_pop()
+{
+  File file;
+  size_t file_size;
+
+  offline_telemetry_file_read_position += offline_telemetry_file_peeked_record_size;
+  offline_telemetry_file_peeked_record_size = 0;
+
+  file = LittleFS.open(OFFLINE_TELEMETRY_FILE_PATH, FILE_READ);
+
+  if (!file)
+  {
+    return RESULT_ERROR;
+  }
+
+  file_size = file.size();
+  file.close();
+
+  // Once everything is published the file is removed, so it does not keep growing.
+  if (offline_telemetry_file_read_position >= file_size)
+  {
+    offline_telemetry_file_read_position = 0;
+    return LittleFS.remove(OFFLINE_TELEMETRY_FILE_PATH) ? RESULT_OK : RESULT_ERROR;
+  }
+
+  return RESULT_OK;
+}
+
+/*
+ * @brief           Sets the telemetry batch size according to the quality of the link, given by
+ *                  the Wi-Fi signal strength and the telemetry retransmitted since last time.
+ */
+static void update_telemetry_batch_size()
+{
+  telemetry_delivery_statistics_t delivery_statistics;
+  uint32_t retransmit_count;
+  int32_t rssi = WiFi.RSSI();
+  uint8_t batch_size;
+
+  azure_iot_get_telemetry_delivery_statistics(&azure_iot, &delivery_statistics);
+  retransmit_count = delivery_statistics.retransmit_count + delivery_statistics.expired_count;
+
+  if (rssi < TELEMETRY_BATCH_RSSI_POOR_IN_DBM
+      || retransmit_count != last_telemetry_retransmit_count)
+  {
+    batch_size = TELEMETRY_BATCH_SIZE_POOR_LINK;
+  }
+  else if (rssi < TELEMETRY_BATCH_RSSI_FAIR_IN_DBM)
+  {
+    batch_size = TELEMETRY_BATCH_SIZE_FAIR_LINK;
+  }
+  else
+  {
+    batch_size = TELEMETRY_BATCH_SIZE_GOOD_LINK;
+  }
+
+  last_telemetry_retransmit_count = retransmit_count;
+  azure_pnp_set_telemetry_batch_size(batch_size, TELEMETRY_BATCH_MAX_PAYLOAD_SIZE);
+}
+
+/*
+ * See the documentation of `event_post_function_t` in AzureIoT.h for details.
+ */
+static void post_azure_iot_event(azure_iot_event_t event)
+{
+  // Not blocking; if the queue is full the main loop is awake anyway.
+  (void)xQueueSend(az_iot_event_queue, &event, 0);
+}
+
+/*
+ * See the documentation of `event_wait_function_t` in AzureIoT.h for details.
+ */
+static void wait_for_azure_iot_event(uint32_t timeout_in_ms)
+{
+  azure_iot_event_t event;
+
+  if (xQueueReceive(az_iot_event_queue, &event, pdMS_TO_TICKS(timeout_in_ms)) == pdTRUE)
+  {
+    // All the events queued are handled by the same call to `azure_iot_do_work`.
+    while (xQueueReceive(az_iot_event_queue, &event, 0) == pdTRUE)
+    {
+    }
+  }
+}
+
 /*
  * See the documentation of `properties_update_completed_t` in AzureIoT.h for details.
  */
@@ -310,19 +820,133 @@ static void on_properties_update_completed(uint32_t request_id, az_iot_status st
   LogInfo("Properties update request completed (id=%d, status=%d)", request_id, status_code);
 }
 
+/*
+ * @brief           Gets the next free slot of the deferred requests queue (producer side).
+ *
+ * @return          A pointer to the slot, or NULL if the queue is full.
+ */
+static deferred_request_t* get_free_deferred_request()
+{
+  uint32_t write_index = deferred_requests_write_index.load(std::memory_order_relaxed);
+
+  if ((write_index - deferred_requests_read_index.load(std::memory_order_acquire))
+      >= DEFERRED_REQUESTS_QUEUE_LENGTH)
+  {
+    deferred_requests_overflow_count++;
+    return NULL;
+  }
+
+  return &deferred_requests[write_index % DEFERRED_REQUESTS_QUEUE_LENGTH];
+}
+
+/*
+ * @brief           Makes the slot last returned by `get_free_deferred_request` visible to the
+ *                  main loop (producer side).
+ */
+static void enqueue_deferred_request()
+{
+  deferred_requests[deferred_requests_write_index.load(std::memory_order_relaxed)
+                    % DEFERRED_REQUESTS_QUEUE_LENGTH]
+      .enqueue_time_in_ms
+      = millis();
+  deferred_requests_write_index.fetch_add(1, std::memory_order_release);
+}
+
+/*
+ * @brief           Copies data into the remaining buffer space of a deferred request.
+ *
+ * @param[in]       source         The data to be copied.
+ * @param[in,out]   remainder      The remaining buffer space, updated after the copy.
+ *
+ * @return          az_span        The copy, or AZ_SPAN_EMPTY if `source` is empty or does not fit.
+ */
+static az_span copy_into_deferred_request(az_span source, az_span* remainder)
+{
+  az_span destination;
+
+  if (az_span_size(source) == 0 || az_span_size(source) > az_span_size(*remainder))
+  {
+    return AZ_SPAN_EMPTY;
+  }
+
+  destination = az_span_slice(*remainder, 0, az_span_size(source));
+  (void)az_span_copy(destination, source);
+  *remainder = az_span_slice_to_end(*remainder, az_span_size(source));
+
+  return destination;
+}
+
+/*
+ * @brief           Processes the deferred requests queued so far (consumer side, main loop).
+ */
+static void process_deferred_requests()
+{
+  uint32_t read_index = deferred_requests_read_index.load(std::memory_order_relaxed);
+
+  while (read_index != deferred_requests_write_index.load(std::memory_order_acquire))
+  {
+    deferred_request_t* request = &deferred_requests[read_index % DEFERRED_REQUESTS_QUEUE_LENGTH];
+    unsigned long wait_in_ms = millis() - request->enqueue_time_in_ms;
+
+    deferred_requests_processed_count++;
+    deferred_requests_total_wait_in_ms += wait_in_ms;
+
+    if (wait_in_ms > deferred_requests_max_wait_in_ms)
+    {
+      deferred_requests_max_wait_in_ms = wait_in_ms;
+    }
+
+    if (request->type == deferred_request_command)
+    {
+      (void)azure_pnp_handle_command_request(
+          &azure_iot, request->command, request->received_time_in_us);
+    }
+    else if (
+        azure_pnp_handle_properties_update(
+            &azure_iot, request->properties, request->properties_message_type)
+        != 0)
+    {
+      LogError("Failed handling properties update.");
+    }
+
+    read_index++;
+    deferred_requests_read_index.store(read_index, std::memory_order_release);
+  }
+}
+
 /*
  * See the documentation of `properties_received_t` in AzureIoT.h for details.
  */
-void on_properties_received(az_span properties)
+void on_properties_received(
+    az_span properties,
+    az_iot_hub_client_properties_message_type message_type)
 {
   LogInfo("Properties update received: %.*s", az_span_size(properties), az_span_ptr(properties));
 
   // It is recommended not to perform work within callbacks.
-  // The properties are being handled here to simplify the sample.
-  if (azure_pnp_handle_properties_update(&azure_iot, properties, properties_request_id++) != 0)
+  // The properties are copied and handled later by the main loop.
+  deferred_request_t* request = get_free_deferred_request();
+  az_span remainder;
+
+  if (request == NULL)
+  {
+    LogError("No space for deferring properties update, discarding it.");
+    return;
+  }
+
+  remainder = AZ_SPAN_FROM_BUFFER(request->buffer);
+  request->type = deferred_request_properties;
+  request->properties_message_type = message_type;
+  request->properties = copy_into_deferred_request(properties, &remainder);
+
+  if (az_span_size(request->properties) != az_span_size(properties))
   {
-    LogError("Failed handling properties update.");
+    deferred_requests_overflow_count++;
+    LogError("Properties update too large for deferring, discarding it.");
+    return;
   }
+
+  enqueue_deferred_request();
 }
 
 /*
@@ -330,6 +954,7 @@ void on_properties_received(az_span properties)
  */
 static void on_command_request_received(command_request_t command)
 {
+  unsigned long received_time_in_us = micros();
   az_span component_name
       = az_span_size(command.component_name) == 0 ? AZ_SPAN_FROM_STR("") : command.component_name;
 
@@ -342,10 +967,35 @@ static void on_command_request_received(command_request_t command)
       az_span_size(command.command_name),
       az_span_ptr(command.command_name));
 
-  // Here the request is being processed within the callback that delivers the command request.
-  // However, for production application the recommendation is to save `command` and process it
-  // outside this callback, usually inside the main thread/task/loop.
-  (void)azure_pnp_handle_command_request(&azure_iot, command);
+  // The command is copied and processed later by the main loop, outside this callback.
+  deferred_request_t* request = get_free_deferred_request();
+  az_span remainder;
+
+  if (request == NULL)
+  {
+    LogError("No space for deferring command request, discarding it.");
+    return;
+  }
+
+  remainder = AZ_SPAN_FROM_BUFFER(request->buffer);
+  request->type = deferred_request_command;
+  request->received_time_in_us = received_time_in_us;
+  request->command.request_id = copy_into_deferred_request(command.request_id, &remainder);
+  request->command.component_name = copy_into_deferred_request(command.component_name, &remainder);
+  request->command.command_name = copy_into_deferred_request(command.command_name, &remainder);
+  request->command.payload = copy_into_deferred_request(command.payload, &remainder);
+
+  if (az_span_size(request->command.request_id) != az_span_size(command.request_id)
+      || az_span_size(request->command.component_name) != az_span_size(command.component_name)
+      || az_span_size(request->command.command_name) != az_span_size(command.command_name)
+      || az_span_size(request->command.payload) != az_span_size(command.payload))
+  {
+    deferred_requests_overflow_count++;
+    LogError("Command request too large for deferring, discarding it.");
+    return;
+  }
+
+  enqueue_deferred_request();
 }
 
 static void configure_azure_iot() {
@@ -376,13 +1026,59 @@ static void configure_azure_iot() {
       = AZ_SPAN_FROM_STR(IOT_CONFIG_DEVICE_ID); // Use Device ID for Azure IoT Central.
   azure_iot_config.data_buffer = AZ_SPAN_FROM_BUFFER(az_iot_data_buffer);
   azure_iot_config.sas_token_lifetime_in_minutes = MQTT_PASSWORD_LIFETIME_IN_MINUTES;
+  azure_iot_config.sas_token_refresh_mode = sas_token_refresh_mode_make_before_break;
+  azure_iot_config.sas_refresh_held_messages_buffer
+      = AZ_SPAN_FROM_BUFFER(az_iot_held_messages_buffer);
+  azure_iot_config.automatic_reconnect = true;
+  // Zeroed reconnect policies use the defaults from AzureIoT.h.
+  azure_iot_config.get_random_number = get_random_number;
   azure_iot_config.mqtt_client_interface.mqtt_client_init = mqtt_client_init_function;
   azure_iot_config.mqtt_client_interface.mqtt_client_deinit = mqtt_client_deinit_function;
   azure_iot_config.mqtt_client_interface.mqtt_client_subscribe = mqtt_client_subscribe_function;
   azure_iot_config.mqtt_client_interface.mqtt_client_publish = mqtt_client_publish_function;
+  // esp_mqtt_client_publish takes a single topic string and payload buffer, so fragments are left
+  // for the Azure IoT client to join.
+  azure_iot_config.mqtt_client_interface.mqtt_client_publish_fragments = NULL;
   azure_iot_config.data_manipulation_functions.hmac_sha256_encrypt = mbedtls_hmac_sha256;
   azure_iot_config.data_manipulation_functions.base64_decode = base64_decode;
   azure_iot_config.data_manipulation_functions.base64_encode = base64_encode;
+  azure_iot_config.provisioning_cache.load = provisioning_cache_load;
+  azure_iot_config.provisioning_cache.save = provisioning_cache_save;
+  azure_iot_config.provisioning_cache.clear = provisioning_cache_clear;
+  azure_iot_config.offline_telemetry_buffer = AZ_SPAN_FROM_BUFFER(az_iot_offline_telemetry_buffer);
+  azure_iot_config.offline_telemetry_drain_rate_per_sec = OFFLINE_TELEMETRY_DRAIN_RATE_PER_SEC;
+  azure_iot_config.offline_telemetry_storage.push = offline_telemetry_storage_push;
+  azure_iot_config.offline_telemetry_storage.peek = offline_telemetry_storage_peek;
+  azure_iot_config.offline_telemetry_storage.pop = offline_telemetry_storage_pop;
+#ifdef IOT_CONFIG_USE_CBOR_TELEMETRY
+  azure_iot_config.telemetry_content_type = AZ_SPAN_FROM_STR(TELEMETRY_CBOR_CONTENT_TYPE);
+#endif // IOT_CONFIG_USE_CBOR_TELEMETRY
+  azure_iot_config.reported_properties_buffer
+      = AZ_SPAN_FROM_BUFFER(az_iot_reported_properties_buffer);
+  azure_iot_config.event_interface.post = post_azure_iot_event;
+  azure_iot_config.event_interface.wait = wait_for_azure_iot_event;
+  azure_iot_config.telemetry_qos = mqtt_qos_at_least_once;
+  azure_iot_config.telemetry_in_flight_buffer
+      = AZ_SPAN_FROM_BUFFER(az_iot_telemetry_in_flight_buffer);
+  azure_iot_config.telemetry_in_flight_window_size = AZ_IOT_TELEMETRY_IN_FLIGHT_WINDOW_SIZE;
+  // Zeroed telemetry_ack_timeout_in_ms and telemetry_max_retransmit_count use the defaults.
+  azure_iot_config.rate_limits[outbound_message_class_telemetry].rate_per_sec
+      = TELEMETRY_RATE_LIMIT_PER_SEC;
+  azure_iot_config.rate_limits[outbound_message_class_telemetry].burst = TELEMETRY_RATE_LIMIT_BURST;
+  azure_iot_config.rate_limits[outbound_message_class_properties].rate_per_sec
+      = PROPERTIES_RATE_LIMIT_PER_SEC;
+  azure_iot_config.rate_limits[outbound_message_class_properties].burst
+      = PROPERTIES_RATE_LIMIT_BURST;
+  azure_iot_config.rate_limits[outbound_message_class_command_response].rate_per_sec
+      = COMMAND_RESPONSE_RATE_LIMIT_PER_SEC;
+  azure_iot_config.rate_limits[outbound_message_class_command_response].burst
+      = COMMAND_RESPONSE_RATE_LIMIT_BURST;
+  azure_iot_config.outbound_queue_buffers[outbound_message_class_command_response]
+      = AZ_SPAN_FROM_BUFFER(az_iot_command_response_queue_buffer);
+  azure_iot_config.outbound_queue_buffers[outbound_message_class_properties]
+      = AZ_SPAN_FROM_BUFFER(az_iot_properties_queue_buffer);
+  azure_iot_config.outbound_queue_buffers[outbound_message_class_telemetry]
+      = AZ_SPAN_FROM_BUFFER(az_iot_telemetry_queue_buffer);
   azure_iot_config.on_properties_update_completed = on_properties_update_completed;
   azure_iot_config.on_properties_received = on_properties_received;
   azure_iot_config.on_command_request_received = on_command_request_received;
@@ -400,6 +1096,18 @@ void setup()
   sync_device_clock_with_ntp_server();
 
   azure_pnp_init();
+#ifdef IOT_CONFIG_USE_CBOR_TELEMETRY
+  azure_pnp_set_telemetry_encoding(azure_pnp_telemetry_encoding_cbor);
+#endif // IOT_CONFIG_USE_CBOR_TELEMETRY
+
+  is_offline_telemetry_file_available = LittleFS.begin(LITTLEFS_FORMAT_ON_FAIL);
+
+  if (!is_offline_telemetry_file_available)
+  {
+    LogError("Failed mounting LittleFS, offline telemetry is kept in memory only.");
+  }
+
+  az_iot_event_queue = xQueueCreate(AZ_IOT_EVENT_QUEUE_LENGTH, sizeof(azure_iot_event_t));
 
   configure_azure_iot();
   azure_iot_start(&azure_iot);
@@ -427,22 +1135,60 @@ void loop()
     switch (azure_iot_get_status(&azure_iot))
     {
       case azure_iot_connected:
+        if (!azure_initial_connect)
+        {
+          data_buffer_statistics_t data_buffer_statistics;
+          azure_iot_get_data_buffer_statistics(&azure_iot, &data_buffer_statistics);
+
+          LogInfo(
+              "Data buffer usage: persistent %d/%d, connection %d/%d, scratch %d/%d bytes "
+              "(overflows %u/%u/%u).",
+              data_buffer_statistics.persistent.high_water_mark,
+              data_buffer_statistics.persistent.size,
+              data_buffer_statistics.connection.high_water_mark,
+              data_buffer_statistics.connection.size,
+              data_buffer_statistics.scratch.high_water_mark,
+              data_buffer_statistics.scratch.size,
+              data_buffer_statistics.persistent.overflow_count,
+              data_buffer_statistics.connection.overflow_count,
+              data_buffer_statistics.scratch.overflow_count);
+        }
+
         azure_initial_connect = true;
+        report_connection_phases();
 
         if (send_device_info)
         {
-          (void)azure_pnp_send_device_info(&azure_iot, properties_request_id++);
+          (void)azure_pnp_send_device_info(&azure_iot);
           send_device_info = false; // Only need to send once.
         }
         else if (azure_pnp_send_telemetry(&azure_iot) != 0)
         {
           LogError("Failed sending telemetry.");
         }
+
+        if ((millis() - last_command_latency_telemetry_time)
+            >= COMMAND_LATENCY_TELEMETRY_INTERVAL_IN_MS)
+        {
+          if (azure_pnp_send_command_latency_telemetry(&azure_iot) != 0)
+          {
+            LogError("Failed sending command latency telemetry.");
+          }
+
+          last_command_latency_telemetry_time = millis();
+        }
         break;
         
       case azure_iot_error:
+        // With `automatic_reconnect` the Azure IoT client schedules its own reconnection
+        // (with backoff) on the next call to `azure_iot_do_work`.
         LogError("Azure IoT client is in error state.");
-        azure_iot_stop(&azure_iot);
+
+        // Telemetry is stored by the Azure IoT client until it is connected again.
+        if (azure_pnp_send_telemetry(&azure_iot) != 0)
+        {
+          LogError("Failed storing telemetry.");
+        }
         break;
         
       case azure_iot_disconnected:
@@ -450,10 +1196,169 @@ void loop()
         break;
         
       default:
+        if (azure_pnp_send_telemetry(&azure_iot) != 0)
+        {
+          LogError("Failed storing telemetry.");
+        }
         break;
     }
 
     azure_iot_do_work(&azure_iot);
+
+    process_deferred_requests();
+
+    if ((millis() - last_telemetry_batch_size_update_time)
+        >= TELEMETRY_BATCH_SIZE_UPDATE_INTERVAL_IN_MS)
+    {
+      update_telemetry_batch_size();
+      last_telemetry_batch_size_update_time = millis();
+    }
+
+    // Sleeps until the Azure IoT client has work to do, instead of spinning.
+    azure_iot_wait_for_work(&azure_iot, LOOP_MAX_WAIT_IN_MS);
+
+    if ((millis() - last_idle_statistics_log_time) >= IDLE_STATISTICS_LOG_INTERVAL_IN_MS)
+    {
+      idle_statistics_t idle_statistics;
+      azure_iot_get_idle_statistics(&azure_iot, &idle_statistics);
+
+      if (idle_statistics.total_time_in_ms > 0)
+      {
+        LogInfo(
+            "Idle %u%% of the time (%u waits, %u events).",
+            (uint32_t)(idle_statistics.idle_time_in_ms * 100 / idle_statistics.total_time_in_ms),
+            idle_statistics.wait_count,
+            idle_statistics.events_count);
+      }
+
+      if (deferred_requests_processed_count > 0 || deferred_requests_overflow_count > 0)
+      {
+        LogInfo(
+            "Deferred requests: %u processed (wait avg %lu ms, max %lu ms), %u discarded.",
+            deferred_requests_processed_count,
+            deferred_requests_processed_count == 0
+                ? 0
+                : deferred_requests_total_wait_in_ms / deferred_requests_processed_count,
+            deferred_requests_max_wait_in_ms,
+            deferred_requests_overflow_count);
+      }
+
+      azure_pnp_telemetry_statistics_t telemetry_statistics;
+      azure_pnp_get_telemetry_statistics(&telemetry_statistics);
+
+      if (telemetry_statistics.message_count > 0)
+      {
+        LogInfo(
+            "Telemetry payloads: %u generated, avg %u bytes and %u us to encode.",
+            telemetry_statistics.message_count,
+            telemetry_statistics.payload_bytes / telemetry_statistics.message_count,
+            telemetry_statistics.encode_time_in_us / telemetry_statistics.message_count);
+        LogInfo(
+            "Telemetry batching: %u samples in %u messages, ~%u framing bytes saved.",
+            telemetry_statistics.sample_count,
+            telemetry_statistics.message_count,
+            telemetry_statistics.framing_bytes_saved);
+      }
+
+      if (hmac_pad_state_hit_count > 0 || hmac_pad_state_miss_count > 0)
+      {
+        LogInfo(
+            "SAS token signing: %u with cached HMAC pad states, %u computing them.",
+            hmac_pad_state_hit_count,
+            hmac_pad_state_miss_count);
+      }
+
+      reported_properties_statistics_t reported_properties_statistics;
+      azure_iot_get_reported_properties_statistics(&azure_iot, &reported_properties_statistics);
+
+      if (reported_properties_statistics.set_count > 0)
+      {
+        LogInfo(
+            "Reported properties: %u set, %u coalesced, %u patches sent, %u discarded.",
+            reported_properties_statistics.set_count,
+            reported_properties_statistics.coalesced_count,
+            reported_properties_statistics.flush_count,
+            reported_properties_statistics.overflow_count);
+      }
+
+      azure_pnp_command_latency_statistics_t
+          command_latency_statistics[COMMAND_LATENCY_COMMAND_COUNT];
+      azure_pnp_get_command_latency_statistics(command_latency_statistics);
+
+      for (int i = 0; i < COMMAND_LATENCY_COMMAND_COUNT; i++)
+      {
+        azure_pnp_command_latency_statistics_t* statistics = &command_latency_statistics[i];
+
+        if (statistics->handler.count > 0)
+        {
+          LogInfo(
+              "Command %.*s: %u handled, max %u us to start, %u us to apply, %u us to respond.",
+              az_span_size(statistics->command_name),
+              az_span_ptr(statistics->command_name),
+              statistics->handler.count,
+              statistics->receive_to_handler.max_in_us,
+              statistics->handler.max_in_us,
+              statistics->response.max_in_us);
+        }
+      }
+
+      tls_session_statistics_t tls_session_statistics;
+      azure_iot_get_tls_session_statistics(&azure_iot, &tls_session_statistics);
+
+      if (tls_session_statistics.handshake_count > 0 || tls_session_statistics.resumed_count > 0)
+      {
+        LogInfo(
+            "TLS sessions: %u resumed (%u%% hit rate), %u full handshakes, %u expired.",
+            tls_session_statistics.resumed_count,
+            tls_session_statistics.resumed_count * 100
+                / (tls_session_statistics.resumed_count + tls_session_statistics.handshake_count),
+            tls_session_statistics.handshake_count,
+            tls_session_statistics.expired_count);
+      }
+
+      rate_limit_statistics_t rate_limit_statistics;
+      azure_iot_get_rate_limit_statistics(&azure_iot, &rate_limit_statistics);
+
+      for (int i = 0; i < OUTBOUND_MESSAGE_CLASS_COUNT; i++)
+      {
+        if (rate_limit_statistics.deferred_count[i] > 0
+            || rate_limit_statistics.dropped_count[i] > 0
+            || rate_limit_statistics.throttled_count[i] > 0)
+        {
+          LogInfo(
+              "Rate limit of outbound class %d: %u deferred, %u dropped, %u throttled "
+              "(backoff level %u).",
+              i,
+              rate_limit_statistics.deferred_count[i],
+              rate_limit_statistics.dropped_count[i],
+              rate_limit_statistics.throttled_count[i],
+              rate_limit_statistics.backoff_level[i]);
+        }
+      }
+
+      outbound_queue_statistics_t outbound_queue_statistics;
+      azure_iot_get_outbound_queue_statistics(&azure_iot, &outbound_queue_statistics);
+
+      for (int i = 0; i < OUTBOUND_MESSAGE_CLASS_COUNT; i++)
+      {
+        if (outbound_queue_statistics.published_count[i] > 0)
+        {
+          LogInfo(
+              "Outbound queue of class %d: %u published (delay avg %u ms, max %u ms), "
+              "%u overflowed, %u failed, max %u queued.",
+              i,
+              outbound_queue_statistics.published_count[i],
+              (uint32_t)(outbound_queue_statistics.total_delay_in_ms[i]
+                         / outbound_queue_statistics.published_count[i]),
+              outbound_queue_statistics.max_delay_in_ms[i],
+              outbound_queue_statistics.overflow_count[i],
+              outbound_queue_statistics.failed_count[i],
+              outbound_queue_statistics.max_count[i]);
+        }
+      }
+
+      last_idle_statistics_log_time = millis();
+    }
   }
 }
 
@@ -468,6 +1373,8 @@ void loop()
 /* --- System and Platform Functions --- */
 static void sync_device_clock_with_ntp_server()
 {
+  unsigned long start_time = millis();
+
   LogInfo("Setting time using SNTP");
 
   configTime(GMT_OFFSET_SECS, GMT_OFFSET_SECS_DST, NTP_SERVERS);
@@ -479,11 +1386,14 @@ static void sync_device_clock_with_ntp_server()
     now = time(NULL);
   }
   Serial.println("");
-  LogInfo("Time initialized!");
+  ntp_sync_time_in_ms = millis() - start_time;
+  LogInfo("Time initialized in %lu ms!", ntp_sync_time_in_ms);
 }
 
 static void connect_to_wifi()
 {
+  unsigned long start_time = millis();
+
   LogInfo("Connecting to WIFI wifi_ssid %s", wifi_ssid);
 
   WiFi.mode(WIFI_STA);
@@ -497,8 +1407,86 @@ static void connect_to_wifi()
   }
 
   Serial.println("");
+  wifi_connect_time_in_ms = millis() - start_time;
 
-  LogInfo("WiFi connected, IP address: %s", WiFi.localIP().toString().c_str());
+  LogInfo(
+      "WiFi connected in %lu ms, IP address: %s",
+      wifi_connect_time_in_ms,
+      WiFi.localIP().toString().c_str());
+}
+
+/*
+ * Gets the time spent in a range of states of the Azure IoT client since the last report.
+ */
+static uint32_t get_connection_phase_time_in_ms(
+    connection_phase_statistics_t* statistics,
+    azure_iot_client_state_t first_state,
+    azure_iot_client_state_t last_state)
+{
+  uint32_t time_in_ms = 0;
+
+  for (int state = first_state; state <= last_state; state++)
+  {
+    time_in_ms += statistics->total_time_in_ms[state]
+        - reported_connection_phase_statistics.total_time_in_ms[state];
+  }
+
+  return time_in_ms;
+}
+
+/*
+ * Logs (and optionally reports) where the time went each time the Azure IoT client gets ready.
+ */
+static void report_connection_phases()
+{
+  connection_phase_statistics_t statistics;
+  azure_iot_get_connection_phase_statistics(&azure_iot, &statistics);
+
+  if (statistics.entry_count[azure_iot_state_ready]
+      == reported_connection_phase_statistics.entry_count[azure_iot_state_ready])
+  {
+    return;
+  }
+
+  int length = snprintf(
+      connection_phases_payload,
+      sizeof(connection_phases_payload),
+      "{\"wifiMs\":%lu,\"ntpMs\":%lu,\"dpsConnectMs\":%u,\"dpsPollingMs\":%u,"
+      "\"hubConnectMs\":%u,\"subscribeMs\":%u,\"readyMs\":%u}",
+      wifi_connect_time_in_ms,
+      ntp_sync_time_in_ms,
+      get_connection_phase_time_in_ms(
+          &statistics, azure_iot_state_connecting_to_dps, azure_iot_state_connected_to_dps),
+      get_connection_phase_time_in_ms(
+          &statistics, azure_iot_state_subscribing_to_dps, azure_iot_state_provisioning_waiting),
+      get_connection_phase_time_in_ms(
+          &statistics, azure_iot_state_provisioned, azure_iot_state_connected_to_hub),
+      get_connection_phase_time_in_ms(
+          &statistics,
+          azure_iot_state_subscribing_to_pnp_topics,
+          azure_iot_state_subscribing_to_pnp_topics),
+      statistics.last_time_to_ready_in_ms);
+
+  reported_connection_phase_statistics = statistics;
+
+  if (length < 0 || length >= (int)sizeof(connection_phases_payload))
+  {
+    LogError("Failed generating connection phases payload.");
+    return;
+  }
+
+  LogInfo("Connection phases: %s", connection_phases_payload);
+
+#ifdef IOT_CONFIG_REPORT_CONNECTION_PHASES
+  if (azure_iot_set_reported_property(
+          &azure_iot,
+          AZ_SPAN_FROM_STR("connectionPhases"),
+          az_span_create((uint8_t*)connection_phases_payload, length))
+      != 0)
+  {
+    LogError("Failed reporting connection phases.");
+  }
+#endif // IOT_CONFIG_REPORT_CONNECTION_PHASES
 }
 
 static esp_err_t esp_mqtt_event_handler(esp_mqtt_event_handle_t event)
@@ -544,10 +1532,25 @@ static esp_err_t esp_mqtt_event_handler(esp_mqtt_event_handle_t event)
           break;
       };
 
+      // esp-mqtt raises MQTT_EVENT_DISCONNECTED right after a refused connection.
+      if (event->error_handle->connect_return_code != MQTT_CONNECTION_ACCEPTED
+          && azure_iot_mqtt_client_connection_refused(
+                 &azure_iot,
+                 (mqtt_connect_return_code_t)event->error_handle->connect_return_code)
+              != 0)
+      {
+        LogError("azure_iot_mqtt_client_connection_refused failed.");
+      }
+
       break;
     case MQTT_EVENT_CONNECTED:
       LogInfo("MQTT client connected (session_present=%d).", event->session_present);
 
+      if (azure_iot_mqtt_client_tls_session_established(&azure_iot, AZ_SPAN_EMPTY, false) != 0)
+      {
+        LogError("azure_iot_mqtt_client_tls_session_established failed.");
+      }
+
       if (azure_iot_mqtt_client_connected(&azure_iot) != 0)
       {
         LogError("azure_iot_mqtt_client_connected failed.");
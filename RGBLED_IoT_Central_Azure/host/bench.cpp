@@ -0,0 +1,1153 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * bench.cpp runs the Azure IoT client of the ESP32 sample on the host, against the fake broker,
+ * measuring:
+ * - state machine transitions per second (stop/start cycles, provisioning result kept);
+ * - end-to-end connect latency, through DPS and with the provisioning result cached in a file;
+ * - telemetry throughput (QoS 1, in-flight window of the sample);
+ * - telemetry payload size and encoding time, JSON vs CBOR;
+ * - SAS token signing, with and without cached HMAC-SHA256 pad states;
+ * - provisioning cache and offline telemetry file operations;
+ * - command round trip, as seen by the broker, alone and behind telemetry bursts (outbound
+ *   queues);
+ * - dispatch of received messages by topic, over a recorded topic mix;
+ * - SAS token refreshes over simulated token lifetimes (fake clock), the TLS sessions resumed by
+ *   their reconnections, and wall clock steps;
+ * - telemetry flooding a rate limit (fake clock);
+ * - per-publish topic work, rebuilt with the azure-sdk-for-c getters vs cached per connection (up
+ *   to the PUBLISH encoded, not sent);
+ * - properties updates published from a joined topic vs from topic fragments.
+ *
+ * Usage: bench [iterations] [response_delay_in_ms]
+ * Set AZURE_IOT_BENCH_VERBOSE in the environment to see the logs of the Azure IoT client.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "AzureIoT.h"
+#include "Azure_IoT_PnP_Template.h"
+#include "fake_broker.h"
+#include "fake_clock.h"
+#include "host_device.h"
+#include "mqtt_packet.h"
+#include "posix_platform.h"
+
+#define DEFAULT_ITERATIONS 100
+#define BROKER_HOST "127.0.0.1"
+#define BROKER_IOT_HUB_FQDN "bench-hub.azure-devices.net"
+#define CONNECT_TIMEOUT_IN_MS 10000
+#define WORK_WAIT_IN_MS 10
+#define TELEMETRY_PAYLOAD "{\"ledStatus\":\"White\"}"
+#define TELEMETRY_MESSAGES_PER_ITERATION 100
+#define SAS_SIGNATURES_PER_ITERATION 100
+#define SAS_STRING_TO_SIGN \
+  "bench-hub.azure-devices.net%2Fdevices%2Fbench-device\n1700000000"
+#define OFFLINE_TELEMETRY_RECORD "{\"ledStatus\":\"White\",\"timestamp\":1700000000}"
+#define COMMAND_NAME "ToggleLed1"
+#define COMMAND_PAYLOAD "{}"
+#define TELEMETRY_BURST_SIZE OUTBOUND_QUEUE_MAX_COUNT
+#define OUTBOUND_QUEUE_BUFFER_SIZE 512
+#define DISPATCHES_PER_ITERATION 1000
+#define DISPATCH_PAYLOAD "{}"
+#define FAKE_CLOCK_START_TIME_IN_MS 1000
+#define FAKE_CLOCK_START_UNIX_TIME 1700000000
+#define WALL_CLOCK_STEP_IN_SECS 3600
+#define WALL_CLOCK_STEP_WORK_ROUNDS 10
+#define RATE_LIMIT_TELEMETRY_PER_SEC 4
+#define RATE_LIMIT_TELEMETRY_BURST 8
+#define RATE_LIMIT_FLOOD_DURATION_IN_SECS 10
+#define RATE_LIMIT_FLOOD_STEP_IN_MS 20
+#define TOPICS_PER_ITERATION 1000
+#define PROPERTIES_UPDATES_PER_ITERATION 100
+#define PROPERTIES_UPDATE_PAYLOAD_SIZE 512
+// Digits of the largest request id.
+#define PROPERTIES_UPDATE_REQUEST_ID_MAX_SIZE 10
+#define STORAGE_DIRECTORY_TEMPLATE "/tmp/azure-iot-bench-XXXXXX"
+#define SAS_KEY_MAX_SIZE 64
+#define SAS_SIGNATURE_SIZE 32
+#define REGISTRATION_ID_SIZE 64
+#define PATH_SIZE 256
+
+/*
+ * Topics received by a device of the sample connected to IoT Central, in the order recorded:
+ * mostly commands, with the acknowledgements of the properties they report and a few writable
+ * properties updates.
+ */
+static const char* const recorded_topics[] = {
+  "$iothub/methods/POST/toggleLed1/?$rid=1",
+  "$iothub/twin/res/204/?$rid=2&$version=3",
+  "$iothub/methods/POST/toggleRed/?$rid=3",
+  "$iothub/methods/POST/DisplayText/?$rid=4",
+  "$iothub/twin/res/204/?$rid=5&$version=4",
+  "$iothub/methods/POST/toggleGreen/?$rid=6",
+  "$iothub/twin/PATCH/properties/desired/?$version=5",
+  "$iothub/methods/POST/toggleBlue/?$rid=7",
+  "$iothub/methods/POST/toggleLed1/?$rid=8",
+  "$iothub/twin/res/204/?$rid=9&$version=6",
+};
+
+#define RECORDED_TOPICS_COUNT (sizeof(recorded_topics) / sizeof(recorded_topics[0]))
+
+static fake_broker_t* broker;
+static int broker_port;
+static host_device_t device;
+
+static uint64_t get_time_in_us()
+{
+  struct timespec now;
+  (void)clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+static void print_latencies(const char* name, std::vector<uint32_t>& latencies_in_us)
+{
+  uint64_t total = 0;
+
+  if (latencies_in_us.empty())
+  {
+    printf("%-40s no samples\n", name);
+    return;
+  }
+
+  std::sort(latencies_in_us.begin(), latencies_in_us.end());
+
+  for (uint32_t latency : latencies_in_us)
+  {
+    total += latency;
+  }
+
+  printf(
+      "%-40s n=%zu avg=%llu us p50=%u us p90=%u us p99=%u us max=%u us\n",
+      name,
+      latencies_in_us.size(),
+      (unsigned long long)(total / latencies_in_us.size()),
+      latencies_in_us[latencies_in_us.size() * 50 / 100],
+      latencies_in_us[latencies_in_us.size() * 90 / 100],
+      latencies_in_us[latencies_in_us.size() * 99 / 100],
+      latencies_in_us.back());
+}
+
+static uint32_t get_state_entries_count(host_device_t* host_device)
+{
+  connection_phase_statistics_t statistics;
+  uint32_t count = 0;
+
+  azure_iot_get_connection_phase_statistics(&host_device->azure_iot, &statistics);
+
+  for (int i = 0; i < AZURE_IOT_CLIENT_STATE_COUNT; i++)
+  {
+    count += statistics.entry_count[i];
+  }
+
+  return count;
+}
+
+/*
+ * @brief    Starts the Azure IoT client of the device and works until it is connected.
+ * @return   Time taken, in microseconds, or zero if it did not connect in time.
+ */
+static uint32_t connect_device(host_device_t* host_device)
+{
+  uint64_t start_time = get_time_in_us();
+  uint64_t deadline = start_time + (uint64_t)CONNECT_TIMEOUT_IN_MS * 1000;
+
+  host_device_select(host_device);
+
+  if (azure_iot_start(&host_device->azure_iot) != 0)
+  {
+    return 0;
+  }
+
+  while (azure_iot_get_status(&host_device->azure_iot) != azure_iot_connected)
+  {
+    if (get_time_in_us() > deadline)
+    {
+      (void)fprintf(stderr, "Device did not connect in time.\n");
+      return 0;
+    }
+
+    host_device_do_work(host_device, WORK_WAIT_IN_MS);
+  }
+
+  return (uint32_t)(get_time_in_us() - start_time);
+}
+
+static void disconnect_device(host_device_t* host_device)
+{
+  host_device_select(host_device);
+  (void)azure_iot_stop(&host_device->azure_iot);
+}
+
+/*
+ * @brief    Works until the telemetry sent so far is acknowledged.
+ */
+static void wait_for_telemetry_acks(host_device_t* host_device)
+{
+  telemetry_delivery_statistics_t statistics;
+
+  do
+  {
+    host_device_do_work(host_device, WORK_WAIT_IN_MS);
+    azure_iot_get_telemetry_delivery_statistics(&host_device->azure_iot, &statistics);
+  } while (statistics.acked_count + statistics.expired_count < statistics.sent_count);
+}
+
+/*
+ * @brief    Works until there is an in-flight slot for telemetry.
+ */
+static void wait_for_telemetry_slot(host_device_t* host_device)
+{
+  telemetry_delivery_statistics_t statistics;
+
+  azure_iot_get_telemetry_delivery_statistics(&host_device->azure_iot, &statistics);
+
+  while ((statistics.sent_count - statistics.acked_count - statistics.expired_count)
+         >= HOST_DEVICE_TELEMETRY_IN_FLIGHT_WINDOW_SIZE)
+  {
+    host_device_do_work(host_device, WORK_WAIT_IN_MS);
+    azure_iot_get_telemetry_delivery_statistics(&host_device->azure_iot, &statistics);
+  }
+}
+
+static void bench_connect_latency_via_dps(int iterations)
+{
+  char registration_id[REGISTRATION_ID_SIZE];
+  std::vector<uint32_t> latencies;
+
+  for (int i = 0; i < iterations; i++)
+  {
+    (void)snprintf(registration_id, sizeof(registration_id), "bench-dps-%d", i);
+    host_device_init(&device, registration_id, BROKER_HOST, broker_port, NULL);
+
+    uint32_t latency = connect_device(&device);
+
+    if (latency > 0)
+    {
+      latencies.push_back(latency);
+    }
+
+    disconnect_device(&device);
+  }
+
+  print_latencies("connect latency (DPS + IoT Hub)", latencies);
+}
+
+static void bench_connect_latency_with_cached_provisioning(int iterations)
+{
+  char storage_directory[] = STORAGE_DIRECTORY_TEMPLATE;
+  std::vector<uint32_t> latencies;
+
+  if (mkdtemp(storage_directory) == NULL)
+  {
+    (void)fprintf(stderr, "Failed creating %s.\n", storage_directory);
+    return;
+  }
+
+  // The first connection goes through DPS and saves the result, reused by the next ones.
+  for (int i = 0; i <= iterations; i++)
+  {
+    host_device_init(&device, "bench-cached", BROKER_HOST, broker_port, storage_directory);
+
+    uint32_t latency = connect_device(&device);
+
+    if (latency > 0 && i > 0)
+    {
+      latencies.push_back(latency);
+    }
+
+    disconnect_device(&device);
+  }
+
+  print_latencies("connect latency (cached provisioning)", latencies);
+
+  (void)remove(device.provisioning_cache_path);
+  (void)rmdir(storage_directory);
+}
+
+static void bench_state_transitions(int iterations)
+{
+  uint32_t entries_count;
+  uint64_t start_time;
+  uint64_t elapsed_time;
+
+  host_device_init(&device, "bench-transitions", BROKER_HOST, broker_port, NULL);
+
+  if (connect_device(&device) == 0)
+  {
+    return;
+  }
+
+  entries_count = get_state_entries_count(&device);
+  start_time = get_time_in_us();
+
+  for (int i = 0; i < iterations; i++)
+  {
+    disconnect_device(&device);
+
+    if (connect_device(&device) == 0)
+    {
+      return;
+    }
+  }
+
+  elapsed_time = get_time_in_us() - start_time;
+  entries_count = get_state_entries_count(&device) - entries_count;
+
+  printf(
+      "%-40s %u transitions in %llu us: %.0f transitions/s, %.0f reconnections/s\n",
+      "state machine",
+      entries_count,
+      (unsigned long long)elapsed_time,
+      entries_count * 1e6 / elapsed_time,
+      iterations * 1e6 / elapsed_time);
+
+  disconnect_device(&device);
+}
+
+static void bench_telemetry_throughput(int iterations)
+{
+  int messages_count = iterations * TELEMETRY_MESSAGES_PER_ITERATION;
+  uint64_t start_time;
+  uint64_t elapsed_time;
+
+  host_device_init(&device, "bench-telemetry", BROKER_HOST, broker_port, NULL);
+
+  if (connect_device(&device) == 0)
+  {
+    return;
+  }
+
+  start_time = get_time_in_us();
+
+  for (int i = 0; i < messages_count; i++)
+  {
+    wait_for_telemetry_slot(&device);
+    (void)azure_iot_send_telemetry(&device.azure_iot, AZ_SPAN_FROM_STR(TELEMETRY_PAYLOAD));
+  }
+
+  wait_for_telemetry_acks(&device);
+  elapsed_time = get_time_in_us() - start_time;
+
+  printf(
+      "%-40s %d messages in %llu us: %.0f messages/s\n",
+      "telemetry throughput (QoS 1)",
+      messages_count,
+      (unsigned long long)elapsed_time,
+      messages_count * 1e6 / elapsed_time);
+
+  disconnect_device(&device);
+}
+
+static void bench_telemetry_encoding(int iterations)
+{
+  const char* names[] = { "telemetry encoding (JSON)", "telemetry encoding (CBOR)" };
+  azure_pnp_telemetry_encoding_t encodings[]
+      = { azure_pnp_telemetry_encoding_json, azure_pnp_telemetry_encoding_cbor };
+  azure_pnp_telemetry_statistics_t before;
+  azure_pnp_telemetry_statistics_t after;
+  int messages_count = iterations * TELEMETRY_MESSAGES_PER_ITERATION;
+
+  host_device_init(&device, "bench-encoding", BROKER_HOST, broker_port, NULL);
+
+  if (connect_device(&device) == 0)
+  {
+    return;
+  }
+
+  // Every call to azure_pnp_send_telemetry sends a message.
+  azure_pnp_set_telemetry_frequency(0);
+  azure_pnp_set_telemetry_batch_size(1, 0);
+
+  for (int e = 0; e < 2; e++)
+  {
+    azure_pnp_set_telemetry_encoding(encodings[e]);
+    azure_pnp_get_telemetry_statistics(&before);
+
+    for (int i = 0; i < messages_count; i++)
+    {
+      wait_for_telemetry_slot(&device);
+      (void)azure_pnp_send_telemetry(&device.azure_iot);
+    }
+
+    wait_for_telemetry_acks(&device);
+    azure_pnp_get_telemetry_statistics(&after);
+
+    uint32_t count = after.message_count - before.message_count;
+
+    printf(
+        "%-40s %u messages: %.1f bytes/message, %.2f us/message to encode\n",
+        names[e],
+        count,
+        count == 0 ? 0.0 : (double)(after.payload_bytes - before.payload_bytes) / count,
+        count == 0 ? 0.0 : (double)(after.encode_time_in_us - before.encode_time_in_us) / count);
+  }
+
+  azure_pnp_set_telemetry_encoding(azure_pnp_telemetry_encoding_json);
+  disconnect_device(&device);
+}
+
+static void bench_sas_token_signing(int iterations)
+{
+  const char* names[] = { "SAS token signing (uncached pads)", "SAS token signing (cached pads)" };
+  uint8_t key[SAS_KEY_MAX_SIZE];
+  uint8_t encoded_key[] = HOST_DEVICE_KEY;
+  uint8_t signature[SAS_SIGNATURE_SIZE];
+  size_t key_length;
+  int signatures_count = iterations * SAS_SIGNATURES_PER_ITERATION;
+
+  if (posix_base64_decode(encoded_key, sizeof(encoded_key) - 1, key, sizeof(key), &key_length)
+      != 0)
+  {
+    return;
+  }
+
+  for (int caching = 0; caching < 2; caching++)
+  {
+    uint64_t start_time;
+    uint64_t elapsed_time;
+
+    posix_hmac_sha256_set_caching(caching != 0);
+    start_time = get_time_in_us();
+
+    for (int i = 0; i < signatures_count; i++)
+    {
+      (void)posix_hmac_sha256(
+          key,
+          key_length,
+          (const uint8_t*)SAS_STRING_TO_SIGN,
+          sizeof(SAS_STRING_TO_SIGN) - 1,
+          signature,
+          sizeof(signature));
+    }
+
+    elapsed_time = get_time_in_us() - start_time;
+
+    printf(
+        "%-40s %d signatures: %.0f ns/signature\n",
+        names[caching],
+        signatures_count,
+        elapsed_time * 1e3 / signatures_count);
+  }
+
+  posix_hmac_sha256_set_caching(true);
+}
+
+static void bench_storage(int iterations)
+{
+  char storage_directory[] = STORAGE_DIRECTORY_TEMPLATE;
+  char path[PATH_SIZE];
+  uint8_t iot_hub_fqdn[128];
+  uint8_t device_id[64];
+  uint8_t record[256];
+  int32_t iot_hub_fqdn_length;
+  int32_t device_id_length;
+  int32_t record_length;
+  posix_offline_telemetry_file_t file;
+  uint64_t start_time;
+  uint64_t elapsed_time;
+
+  if (mkdtemp(storage_directory) == NULL)
+  {
+    (void)fprintf(stderr, "Failed creating %s.\n", storage_directory);
+    return;
+  }
+
+  (void)snprintf(path, sizeof(path), "%s/provisioning", storage_directory);
+  start_time = get_time_in_us();
+
+  for (int i = 0; i < iterations; i++)
+  {
+    (void)posix_provisioning_cache_save(
+        path, AZ_SPAN_FROM_STR(BROKER_IOT_HUB_FQDN), AZ_SPAN_FROM_STR("bench-storage"));
+    (void)posix_provisioning_cache_load(
+        path,
+        AZ_SPAN_FROM_BUFFER(iot_hub_fqdn),
+        &iot_hub_fqdn_length,
+        AZ_SPAN_FROM_BUFFER(device_id),
+        &device_id_length);
+  }
+
+  elapsed_time = get_time_in_us() - start_time;
+  (void)posix_provisioning_cache_clear(path);
+
+  printf(
+      "%-40s %d save+load: %.1f us each\n",
+      "provisioning cache file",
+      iterations,
+      (double)elapsed_time / iterations);
+
+  (void)snprintf(path, sizeof(path), "%s/telemetry", storage_directory);
+  (void)memset(&file, 0, sizeof(file));
+  file.path = path;
+  start_time = get_time_in_us();
+
+  for (int i = 0; i < iterations; i++)
+  {
+    (void)posix_offline_telemetry_storage_push(&file, AZ_SPAN_FROM_STR(OFFLINE_TELEMETRY_RECORD));
+  }
+
+  for (int i = 0; i < iterations; i++)
+  {
+    (void)posix_offline_telemetry_storage_peek(&file, AZ_SPAN_FROM_BUFFER(record), &record_length);
+    (void)posix_offline_telemetry_storage_pop(&file);
+  }
+
+  elapsed_time = get_time_in_us() - start_time;
+
+  printf(
+      "%-40s %d push+peek+pop: %.1f us each\n",
+      "offline telemetry file",
+      iterations,
+      (double)elapsed_time / iterations);
+
+  (void)remove(path);
+  (void)rmdir(storage_directory);
+}
+
+static void bench_command_round_trip(int iterations)
+{
+  fake_broker_statistics_t statistics;
+  std::vector<uint32_t> latencies((size_t)iterations);
+  uint32_t responses_count;
+
+  host_device_init(&device, "bench-commands", BROKER_HOST, broker_port, NULL);
+
+  if (connect_device(&device) == 0)
+  {
+    return;
+  }
+
+  // Dropping latencies of earlier runs, if any.
+  (void)fake_broker_get_command_latencies(broker, latencies.data(), (uint32_t)latencies.size());
+
+  for (int i = 0; i < iterations; i++)
+  {
+    fake_broker_get_statistics(broker, &statistics);
+    responses_count = statistics.command_responses_count;
+
+    (void)fake_broker_send_command(
+        broker, device.registration_id, COMMAND_NAME, AZ_SPAN_FROM_STR(COMMAND_PAYLOAD));
+
+    do
+    {
+      host_device_do_work(&device, WORK_WAIT_IN_MS);
+      fake_broker_get_statistics(broker, &statistics);
+    } while (statistics.command_responses_count == responses_count);
+  }
+
+  latencies.resize(
+      fake_broker_get_command_latencies(broker, latencies.data(), (uint32_t)latencies.size()));
+  print_latencies("command round trip", latencies);
+
+  disconnect_device(&device);
+}
+
+static uint8_t outbound_queue_buffers[OUTBOUND_MESSAGE_CLASS_COUNT][OUTBOUND_QUEUE_BUFFER_SIZE];
+
+static void bench_command_round_trip_behind_telemetry(int iterations)
+{
+  static const char* const class_names[OUTBOUND_MESSAGE_CLASS_COUNT]
+      = { "command responses", "properties", "telemetry" };
+  fake_broker_statistics_t statistics;
+  outbound_queue_statistics_t queue_statistics;
+  std::vector<uint32_t> latencies((size_t)iterations);
+  uint32_t responses_count;
+
+  host_device_init(&device, "bench-queues", BROKER_HOST, broker_port, NULL);
+
+  for (int i = 0; i < OUTBOUND_MESSAGE_CLASS_COUNT; i++)
+  {
+    device.config.outbound_queue_buffers[i] = AZ_SPAN_FROM_BUFFER(outbound_queue_buffers[i]);
+  }
+
+  if (connect_device(&device) == 0)
+  {
+    return;
+  }
+
+  (void)fake_broker_get_command_latencies(broker, latencies.data(), (uint32_t)latencies.size());
+
+  for (int i = 0; i < iterations; i++)
+  {
+    fake_broker_get_statistics(broker, &statistics);
+    responses_count = statistics.command_responses_count;
+
+    // More telemetry than the in-flight window takes, so some is still queued when the command
+    // response is.
+    for (int j = 0; j < TELEMETRY_BURST_SIZE; j++)
+    {
+      (void)azure_iot_send_telemetry(&device.azure_iot, AZ_SPAN_FROM_STR(TELEMETRY_PAYLOAD));
+    }
+
+    (void)fake_broker_send_command(
+        broker, device.registration_id, COMMAND_NAME, AZ_SPAN_FROM_STR(COMMAND_PAYLOAD));
+
+    do
+    {
+      host_device_do_work(&device, WORK_WAIT_IN_MS);
+      fake_broker_get_statistics(broker, &statistics);
+    } while (statistics.command_responses_count == responses_count);
+
+    // Draining the rest of the burst before the next one.
+    azure_iot_get_outbound_queue_statistics(&device.azure_iot, &queue_statistics);
+
+    while (queue_statistics.published_count[outbound_message_class_telemetry]
+               + queue_statistics.failed_count[outbound_message_class_telemetry]
+           < queue_statistics.queued_count[outbound_message_class_telemetry])
+    {
+      host_device_do_work(&device, WORK_WAIT_IN_MS);
+      azure_iot_get_outbound_queue_statistics(&device.azure_iot, &queue_statistics);
+    }
+
+    wait_for_telemetry_acks(&device);
+  }
+
+  latencies.resize(
+      fake_broker_get_command_latencies(broker, latencies.data(), (uint32_t)latencies.size()));
+  print_latencies("command round trip behind telemetry", latencies);
+
+  azure_iot_get_outbound_queue_statistics(&device.azure_iot, &queue_statistics);
+
+  for (int i = 0; i < OUTBOUND_MESSAGE_CLASS_COUNT; i++)
+  {
+    if (queue_statistics.published_count[i] > 0)
+    {
+      printf(
+          "%-40s %u published, delay avg %llu ms, max %u ms, %u overflowed\n",
+          class_names[i],
+          queue_statistics.published_count[i],
+          (unsigned long long)(queue_statistics.total_delay_in_ms[i]
+                               / queue_statistics.published_count[i]),
+          queue_statistics.max_delay_in_ms[i],
+          queue_statistics.overflow_count[i]);
+    }
+  }
+
+  disconnect_device(&device);
+}
+
+static uint32_t dispatched_commands_count;
+
+static void on_dispatched_command_received(command_request_t command)
+{
+  (void)command;
+  dispatched_commands_count++;
+}
+
+static void bench_topic_dispatch(int iterations)
+{
+  az_span topics[RECORDED_TOPICS_COUNT];
+  mqtt_message_t mqtt_message;
+  int messages_count = iterations * DISPATCHES_PER_ITERATION;
+  int failures_count = 0;
+  uint64_t start_time;
+  uint64_t elapsed_time;
+
+  for (size_t i = 0; i < RECORDED_TOPICS_COUNT; i++)
+  {
+    topics[i] = az_span_create((uint8_t*)recorded_topics[i], (int32_t)strlen(recorded_topics[i]));
+  }
+
+  host_device_init(&device, "bench-dispatch", BROKER_HOST, broker_port, NULL);
+
+  if (connect_device(&device) == 0)
+  {
+    return;
+  }
+
+  // Commands are only counted, so that responding to them is not measured.
+  device.config.on_command_request_received = on_dispatched_command_received;
+  dispatched_commands_count = 0;
+  mqtt_message.payload = AZ_SPAN_FROM_STR(DISPATCH_PAYLOAD);
+  mqtt_message.qos = mqtt_qos_at_most_once;
+  start_time = get_time_in_us();
+
+  for (int i = 0; i < messages_count; i++)
+  {
+    mqtt_message.topic = topics[i % RECORDED_TOPICS_COUNT];
+
+    if (azure_iot_mqtt_client_message_received(&device.azure_iot, &mqtt_message) != 0)
+    {
+      failures_count++;
+    }
+  }
+
+  elapsed_time = get_time_in_us() - start_time;
+
+  printf(
+      "%-40s %d messages (%u commands, %d failed) in %llu us: %.0f messages/s\n",
+      "topic dispatch (recorded mix)",
+      messages_count,
+      dispatched_commands_count,
+      failures_count,
+      (unsigned long long)elapsed_time,
+      messages_count * 1e6 / elapsed_time);
+
+  // What dispatching costs when properties parsing is tried first on every message.
+  start_time = get_time_in_us();
+
+  for (int i = 0; i < messages_count; i++)
+  {
+    az_iot_hub_client_properties_message properties_message;
+    az_iot_hub_client_command_request command_request;
+    az_span topic = topics[i % RECORDED_TOPICS_COUNT];
+
+    if (az_result_failed(az_iot_hub_client_properties_parse_received_topic(
+            &device.azure_iot.iot_hub_client, topic, &properties_message)))
+    {
+      (void)az_iot_hub_client_commands_parse_received_topic(
+          &device.azure_iot.iot_hub_client, topic, &command_request);
+    }
+  }
+
+  elapsed_time = get_time_in_us() - start_time;
+
+  printf(
+      "%-40s %d messages in %llu us: %.0f messages/s\n",
+      "topic parsing, properties first",
+      messages_count,
+      (unsigned long long)elapsed_time,
+      messages_count * 1e6 / elapsed_time);
+
+  disconnect_device(&device);
+}
+
+static uint32_t get_sas_token_refresh_count(host_device_t* host_device)
+{
+  sas_token_refresh_statistics_t statistics;
+
+  azure_iot_get_sas_token_refresh_statistics(&host_device->azure_iot, &statistics);
+
+  return statistics.refresh_count;
+}
+
+static void bench_simulated_sas_token_lifetimes(int iterations)
+{
+  uint32_t lifetime_in_ms;
+  uint32_t refresh_count;
+  tls_session_statistics_t tls_session_statistics_at_start;
+  tls_session_statistics_t tls_session_statistics;
+  uint64_t start_time;
+  uint64_t elapsed_time;
+
+  fake_clock_init(FAKE_CLOCK_START_TIME_IN_MS, FAKE_CLOCK_START_UNIX_TIME);
+  host_device_init(&device, "bench-clock", BROKER_HOST, broker_port, NULL);
+  device.config.clock_interface = fake_clock_get_interface();
+  lifetime_in_ms = device.config.sas_token_lifetime_in_minutes * 60 * 1000;
+
+  if (connect_device(&device) == 0)
+  {
+    return;
+  }
+
+  refresh_count = get_sas_token_refresh_count(&device);
+  azure_iot_get_tls_session_statistics(&device.azure_iot, &tls_session_statistics_at_start);
+  start_time = get_time_in_us();
+
+  for (int i = 0; i < iterations; i++)
+  {
+    // Into the window where the next token is prepared, then into the one where it is used.
+    fake_clock_advance(lifetime_in_ms - SAS_TOKEN_PREPARE_THRESHOLD_IN_SECS * 1000 + 1000);
+    host_device_do_work(&device, 0);
+    fake_clock_advance(
+        (SAS_TOKEN_PREPARE_THRESHOLD_IN_SECS - SAS_TOKEN_REFRESH_THRESHOLD_IN_SECS) * 1000);
+
+    while (get_sas_token_refresh_count(&device) - refresh_count <= (uint32_t)i
+           || azure_iot_get_status(&device.azure_iot) != azure_iot_connected)
+    {
+      host_device_do_work(&device, WORK_WAIT_IN_MS);
+    }
+  }
+
+  elapsed_time = get_time_in_us() - start_time;
+  azure_iot_get_tls_session_statistics(&device.azure_iot, &tls_session_statistics);
+
+  printf(
+      "%-40s %d refreshes, %.1f simulated hours in %llu us\n",
+      "SAS token lifetimes (fake clock)",
+      iterations,
+      (double)iterations * lifetime_in_ms / 3600000,
+      (unsigned long long)elapsed_time);
+  // Resumed sessions keep their age, so they expire every other refresh or so.
+  printf(
+      "%-40s %u resumed, %u full handshakes, %u saved sessions expired (lifetime %u s)\n",
+      "TLS sessions over SAS token refreshes",
+      tls_session_statistics.resumed_count - tls_session_statistics_at_start.resumed_count,
+      tls_session_statistics.handshake_count - tls_session_statistics_at_start.handshake_count,
+      tls_session_statistics.expired_count - tls_session_statistics_at_start.expired_count,
+      device.config.tls_session_lifetime_in_secs);
+
+  // Stepping the wall clock back and forth must not cause any refresh.
+  refresh_count = get_sas_token_refresh_count(&device);
+
+  for (int i = 0; i < iterations; i++)
+  {
+    if (i % 2 == 0)
+    {
+      fake_clock_set_unix_time(fake_clock_get_unix_time() + WALL_CLOCK_STEP_IN_SECS);
+    }
+    else
+    {
+      fake_clock_set_unix_time(fake_clock_get_unix_time() - WALL_CLOCK_STEP_IN_SECS);
+    }
+
+    for (int j = 0; j < WALL_CLOCK_STEP_WORK_ROUNDS; j++)
+    {
+      host_device_do_work(&device, 0);
+    }
+  }
+
+  printf(
+      "%-40s %d steps of %d s: %u refreshes\n",
+      "wall clock steps (fake clock)",
+      iterations,
+      WALL_CLOCK_STEP_IN_SECS,
+      get_sas_token_refresh_count(&device) - refresh_count);
+
+  disconnect_device(&device);
+}
+
+static void bench_rate_limited_telemetry()
+{
+  int steps_count = RATE_LIMIT_FLOOD_DURATION_IN_SECS * 1000 / RATE_LIMIT_FLOOD_STEP_IN_MS;
+  telemetry_delivery_statistics_t delivery_statistics;
+  offline_telemetry_statistics_t offline_statistics;
+  rate_limit_statistics_t rate_limit_statistics;
+  uint32_t sent_count;
+
+  fake_clock_init(FAKE_CLOCK_START_TIME_IN_MS, FAKE_CLOCK_START_UNIX_TIME);
+  host_device_init(&device, "bench-rate-limit", BROKER_HOST, broker_port, NULL);
+  device.config.clock_interface = fake_clock_get_interface();
+  device.config.rate_limits[outbound_message_class_telemetry].rate_per_sec
+      = RATE_LIMIT_TELEMETRY_PER_SEC;
+  device.config.rate_limits[outbound_message_class_telemetry].burst = RATE_LIMIT_TELEMETRY_BURST;
+
+  if (connect_device(&device) == 0)
+  {
+    return;
+  }
+
+  azure_iot_get_telemetry_delivery_statistics(&device.azure_iot, &delivery_statistics);
+  sent_count = delivery_statistics.sent_count;
+
+  // One message per step, far over the limit; what goes over it is deferred into the offline
+  // telemetry buffer (evicting the oldest records once full).
+  for (int i = 0; i < steps_count; i++)
+  {
+    fake_clock_advance(RATE_LIMIT_FLOOD_STEP_IN_MS);
+    wait_for_telemetry_slot(&device);
+    (void)azure_iot_send_telemetry(&device.azure_iot, AZ_SPAN_FROM_STR(TELEMETRY_PAYLOAD));
+    host_device_do_work(&device, 0);
+  }
+
+  azure_iot_get_telemetry_delivery_statistics(&device.azure_iot, &delivery_statistics);
+  azure_iot_get_offline_telemetry_statistics(&device.azure_iot, &offline_statistics);
+  azure_iot_get_rate_limit_statistics(&device.azure_iot, &rate_limit_statistics);
+  sent_count = delivery_statistics.sent_count - sent_count;
+
+  printf(
+      "%-40s %d offered, %u published (%.1f/s, limit %d/s burst %d), %u deferred, %u evicted\n",
+      "telemetry rate limit (fake clock)",
+      steps_count,
+      sent_count,
+      (double)sent_count / RATE_LIMIT_FLOOD_DURATION_IN_SECS,
+      RATE_LIMIT_TELEMETRY_PER_SEC,
+      RATE_LIMIT_TELEMETRY_BURST,
+      rate_limit_statistics.deferred_count[outbound_message_class_telemetry],
+      offline_statistics.dropped_count);
+
+  disconnect_device(&device);
+}
+
+static uint8_t encoded_publish_buffer[MQTT_PACKET_MAX_SIZE];
+static volatile int32_t encoded_publish_size;
+
+/*
+ * @brief    Stands in for the MQTT client publish: encodes the PUBLISH like the POSIX MQTT client,
+ *           without writing it to the socket, so only the per-publish work is measured.
+ */
+static int encode_publish(mqtt_client_handle_t mqtt_client_handle, mqtt_message_t* mqtt_message)
+{
+  (void)mqtt_client_handle;
+  encoded_publish_size = mqtt_packet_encode_publish(
+      AZ_SPAN_FROM_BUFFER(encoded_publish_buffer),
+      mqtt_message->topic,
+      mqtt_message->payload,
+      (uint8_t)mqtt_message->qos,
+      0);
+
+  return 0;
+}
+
+/*
+ * @brief    Same as `encode_publish`, for `mqtt_client_publish_fragments`.
+ */
+static int encode_publish_fragments(
+    mqtt_client_handle_t mqtt_client_handle,
+    mqtt_message_fragments_t* mqtt_message)
+{
+  (void)mqtt_client_handle;
+  encoded_publish_size = mqtt_packet_encode_publish_fragments(
+      AZ_SPAN_FROM_BUFFER(encoded_publish_buffer),
+      mqtt_message->topic,
+      mqtt_message->topic_count,
+      mqtt_message->payload,
+      mqtt_message->payload_count,
+      (uint8_t)mqtt_message->qos,
+      0);
+
+  return 0;
+}
+
+static void bench_topic_building(int iterations)
+{
+  uint8_t topic[TELEMETRY_TOPIC_BUFFER_SIZE];
+  uint8_t properties_buffer[TELEMETRY_PROPERTIES_BUFFER_SIZE];
+  uint8_t request_id_buffer[PROPERTIES_UPDATE_REQUEST_ID_MAX_SIZE];
+  az_iot_message_properties properties;
+  az_iot_hub_client* client = &device.azure_iot.iot_hub_client;
+  azure_iot_config_t* config = &device.config;
+  mqtt_client_interface_t mqtt_client_interface;
+  mqtt_message_t mqtt_message;
+  int topics_count = iterations * TOPICS_PER_ITERATION;
+  uint64_t start_in_us;
+  uint64_t telemetry_rebuilt_in_us;
+  uint64_t telemetry_cached_in_us;
+  uint64_t properties_rebuilt_in_us;
+  uint64_t properties_joined_in_us;
+  uint64_t properties_fragments_in_us;
+  size_t topic_length;
+  az_span request_id;
+  bool has_properties;
+
+  host_device_init(&device, "bench-topics", BROKER_HOST, broker_port, NULL);
+  // QoS 0, so telemetry is published right away instead of going through the in-flight window.
+  config->telemetry_qos = mqtt_qos_at_most_once;
+
+  // The Azure IoT Hub client and the cached topics are only set once connected.
+  if (connect_device(&device) == 0)
+  {
+    return;
+  }
+
+  has_properties = az_span_size(config->telemetry_content_type) > 0
+      || az_span_size(config->telemetry_content_encoding) > 0;
+
+  // Both sides end with the PUBLISH encoded, not sent.
+  mqtt_client_interface = config->mqtt_client_interface;
+  config->mqtt_client_interface.mqtt_client_publish = encode_publish;
+  config->mqtt_client_interface.mqtt_client_publish_fragments = encode_publish_fragments;
+  mqtt_message.payload = AZ_SPAN_FROM_STR(TELEMETRY_PAYLOAD);
+  mqtt_message.qos = mqtt_qos_at_most_once;
+
+  // Before the topics were cached: each topic built with the SDK getters for every publish, as
+  // build_iot_hub_topics now does once per connection.
+  start_in_us = get_time_in_us();
+
+  for (int i = 0; i < topics_count; i++)
+  {
+    (void)az_iot_message_properties_init(&properties, AZ_SPAN_FROM_BUFFER(properties_buffer), 0);
+
+    if (az_span_size(config->telemetry_content_type) > 0)
+    {
+      (void)az_iot_message_properties_append(
+          &properties,
+          AZ_SPAN_FROM_STR(AZ_IOT_MESSAGE_PROPERTIES_CONTENT_TYPE),
+          config->telemetry_content_type);
+    }
+
+    if (az_span_size(config->telemetry_content_encoding) > 0)
+    {
+      (void)az_iot_message_properties_append(
+          &properties,
+          AZ_SPAN_FROM_STR(AZ_IOT_MESSAGE_PROPERTIES_CONTENT_ENCODING),
+          config->telemetry_content_encoding);
+    }
+
+    (void)az_iot_hub_client_telemetry_get_publish_topic(
+        client, has_properties ? &properties : NULL, (char*)topic, sizeof(topic), &topic_length);
+    mqtt_message.topic = az_span_create(topic, (int32_t)topic_length + 1);
+    (void)encode_publish(NULL, &mqtt_message);
+  }
+
+  telemetry_rebuilt_in_us = get_time_in_us() - start_in_us;
+  start_in_us = get_time_in_us();
+
+  for (int i = 0; i < topics_count; i++)
+  {
+    (void)az_span_u32toa(AZ_SPAN_FROM_BUFFER(request_id_buffer), (uint32_t)i, &request_id);
+    request_id = az_span_slice(
+        AZ_SPAN_FROM_BUFFER(request_id_buffer),
+        0,
+        (int32_t)sizeof(request_id_buffer) - az_span_size(request_id));
+    (void)az_iot_hub_client_properties_get_reported_publish_topic(
+        client, request_id, (char*)topic, sizeof(topic), &topic_length);
+    mqtt_message.topic = az_span_create(topic, (int32_t)topic_length + 1);
+    (void)encode_publish(NULL, &mqtt_message);
+  }
+
+  properties_rebuilt_in_us = get_time_in_us() - start_in_us;
+
+  // Cached, through the client: publish_telemetry with the cached telemetry topic, and the
+  // properties update topic joined from its cached prefix and the request id by
+  // join_mqtt_message_fragments, or given in fragments to the MQTT client.
+  start_in_us = get_time_in_us();
+
+  for (int i = 0; i < topics_count; i++)
+  {
+    (void)azure_iot_send_telemetry(&device.azure_iot, AZ_SPAN_FROM_STR(TELEMETRY_PAYLOAD));
+  }
+
+  telemetry_cached_in_us = get_time_in_us() - start_in_us;
+  config->mqtt_client_interface.mqtt_client_publish_fragments = NULL;
+  start_in_us = get_time_in_us();
+
+  for (int i = 0; i < topics_count; i++)
+  {
+    (void)azure_iot_send_properties_update(
+        &device.azure_iot, (uint32_t)i, AZ_SPAN_FROM_STR(TELEMETRY_PAYLOAD));
+  }
+
+  properties_joined_in_us = get_time_in_us() - start_in_us;
+  config->mqtt_client_interface.mqtt_client_publish_fragments = encode_publish_fragments;
+  start_in_us = get_time_in_us();
+
+  for (int i = 0; i < topics_count; i++)
+  {
+    (void)azure_iot_send_properties_update(
+        &device.azure_iot, (uint32_t)i, AZ_SPAN_FROM_STR(TELEMETRY_PAYLOAD));
+  }
+
+  properties_fragments_in_us = get_time_in_us() - start_in_us;
+
+  printf(
+      "%-40s %.0f ns/publish rebuilt, %.0f ns/publish cached\n",
+      "telemetry publish topic",
+      telemetry_rebuilt_in_us * 1e3 / topics_count,
+      telemetry_cached_in_us * 1e3 / topics_count);
+  printf(
+      "%-40s %.0f ns/publish rebuilt, %.0f ns/publish cached joined, %.0f ns/publish cached "
+      "fragments\n",
+      "reported properties publish topic",
+      properties_rebuilt_in_us * 1e3 / topics_count,
+      properties_joined_in_us * 1e3 / topics_count,
+      properties_fragments_in_us * 1e3 / topics_count);
+
+  config->mqtt_client_interface = mqtt_client_interface;
+  disconnect_device(&device);
+}
+
+static void bench_properties_update_publish(int iterations, bool use_fragments)
+{
+  static uint8_t payload[PROPERTIES_UPDATE_PAYLOAD_SIZE];
+  int updates_count = iterations * PROPERTIES_UPDATES_PER_ITERATION;
+  uint64_t elapsed_in_us = 0;
+  uint64_t start_in_us;
+  int32_t joined_size;
+
+  // A JSON document of the intended size: {"p":"aaa...a"}
+  (void)memset(payload, 'a', sizeof(payload));
+  (void)memcpy(payload, "{\"p\":\"", 6);
+  (void)memcpy(payload + sizeof(payload) - 2, "\"}", 2);
+
+  host_device_init(&device, "bench-properties", BROKER_HOST, broker_port, NULL);
+
+  if (!use_fragments)
+  {
+    device.config.mqtt_client_interface.mqtt_client_publish_fragments = NULL;
+  }
+
+  if (connect_device(&device) == 0)
+  {
+    return;
+  }
+
+  for (int i = 0; i < updates_count; i++)
+  {
+    start_in_us = get_time_in_us();
+    (void)azure_iot_send_properties_update(
+        &device.azure_iot, (uint32_t)i + 1, AZ_SPAN_FROM_BUFFER(payload));
+    elapsed_in_us += get_time_in_us() - start_in_us;
+
+    // Consuming the acknowledgements of the broker.
+    host_device_do_work(&device, 0);
+  }
+
+  // Prefix, request id and null-terminator, copied into the data buffer before the MQTT client
+  // copies the topic again into its transmit buffer.
+  joined_size = az_span_size(device.azure_iot.reported_properties_topic_prefix)
+      + PROPERTIES_UPDATE_REQUEST_ID_MAX_SIZE + 1;
+
+  printf(
+      "%-40s %.2f us/update (%d-byte payload), up to %d topic bytes joined per update\n",
+      use_fragments ? "properties update, topic fragments" : "properties update, joined topic",
+      (double)elapsed_in_us / updates_count,
+      PROPERTIES_UPDATE_PAYLOAD_SIZE,
+      use_fragments ? 0 : (int)joined_size);
+
+  disconnect_device(&device);
+}
+
+int main(int argc, char** argv)
+{
+  fake_broker_config_t broker_config;
+  bool is_verbose = getenv("AZURE_IOT_BENCH_VERBOSE") != NULL;
+  int iterations = (argc > 1) ? atoi(argv[1]) : DEFAULT_ITERATIONS;
+
+  if (iterations <= 0)
+  {
+    (void)fprintf(stderr, "Usage: %s [iterations] [response_delay_in_ms]\n", argv[0]);
+    return 1;
+  }
+
+  set_logging_function(posix_logging_function);
+  posix_set_logging(is_verbose, true);
+  azure_pnp_init();
+
+  (void)memset(&broker_config, 0, sizeof(broker_config));
+  broker_config.iot_hub_fqdn = BROKER_IOT_HUB_FQDN;
+  broker_config.dps_assigning_queries_count = 1;
+  broker_config.dps_retry_after_in_secs = 0;
+  broker_config.response_delay_in_ms = (argc > 2) ? (uint32_t)atoi(argv[2]) : 0;
+  broker = fake_broker_start(&broker_config);
+
+  if (broker == NULL)
+  {
+    return 1;
+  }
+
+  broker_port = fake_broker_get_port(broker);
+
+  printf(
+      "Azure IoT host benchmark: %d iterations, %u ms response delay.\n",
+      iterations,
+      (unsigned)broker_config.response_delay_in_ms);
+
+  bench_state_transitions(iterations);
+  bench_connect_latency_via_dps(iterations);
+  bench_connect_latency_with_cached_provisioning(iterations);
+  bench_telemetry_throughput(iterations);
+  bench_telemetry_encoding(iterations);
+  bench_sas_token_signing(iterations);
+  bench_storage(iterations);
+  bench_command_round_trip(iterations);
+  bench_command_round_trip_behind_telemetry(iterations);
+  bench_topic_dispatch(iterations);
+  bench_simulated_sas_token_lifetimes(iterations);
+  bench_rate_limited_telemetry();
+  bench_topic_building(iterations);
+  bench_properties_update_publish(iterations, false);
+  bench_properties_update_publish(iterations, true);
+
+  fake_broker_stop(broker);
+
+  return 0;
+}
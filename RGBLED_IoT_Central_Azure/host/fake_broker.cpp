@@ -0,0 +1,890 @@
+// SPDX-License-Identifier: MIT
+
+#include "fake_broker.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <deque>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "mqtt_packet.h"
+
+#define RESULT_OK 0
+#define RESULT_ERROR __LINE__
+
+#define LISTEN_BACKLOG 1024
+#define WAKE_PIPE_READ 0
+#define WAKE_PIPE_WRITE 1
+#define WAKE_BUFFER_SIZE 64
+#define TOPIC_BUFFER_SIZE 256
+#define PAYLOAD_BUFFER_SIZE 1024
+#define TLS_SESSION_PREFIX "tls-session-"
+
+#define DPS_USERNAME_MARKER "/registrations/"
+#define DPS_REGISTER_TOPIC_PREFIX "$dps/registrations/PUT/iotdps-register/"
+#define DPS_QUERY_TOPIC_PREFIX "$dps/registrations/GET/iotdps-get-operationstate/"
+#define TWIN_GET_TOPIC_PREFIX "$iothub/twin/GET/"
+#define TWIN_REPORTED_TOPIC_PREFIX "$iothub/twin/PATCH/properties/reported/"
+#define COMMAND_RESPONSE_TOPIC_PREFIX "$iothub/methods/res/"
+#define TELEMETRY_TOPIC_PREFIX "devices/"
+#define REQUEST_ID_PROPERTY "$rid="
+
+#define HTTP_STATUS_OK 200
+#define HTTP_STATUS_ACCEPTED 202
+#define HTTP_STATUS_NO_CONTENT 204
+
+/*
+ * @brief    A device connected to the broker, either to the DPS or the Azure IoT Hub emulation.
+ */
+typedef struct fake_broker_connection_t_struct
+{
+  uint64_t id;
+  int socket_fd;
+  std::string client_id;
+  bool is_tls_established;
+  bool is_dps;
+  uint32_t dps_queries_count;
+  uint32_t reported_version;
+  uint32_t desired_version;
+  uint32_t last_request_id;
+  std::map<std::string, uint64_t> command_send_times_in_us;
+} fake_broker_connection_t;
+
+/*
+ * @brief    A packet held back by `response_delay_in_ms`.
+ */
+typedef struct fake_broker_delayed_packet_t_struct
+{
+  uint64_t due_time_in_us;
+  uint64_t connection_id;
+  std::vector<uint8_t> packet;
+} fake_broker_delayed_packet_t;
+
+/*
+ * @brief    A command or desired properties update requested by another thread.
+ */
+typedef struct fake_broker_injected_message_t_struct
+{
+  std::string device_id;
+  std::string command_name;
+  std::string payload;
+  bool is_command;
+} fake_broker_injected_message_t;
+
+struct fake_broker_t_struct
+{
+  fake_broker_config_t config;
+  std::string iot_hub_fqdn;
+  int listen_fd;
+  int wake_pipe[2];
+  int port;
+  std::thread thread;
+  std::atomic<bool> is_stopping;
+  uint64_t next_connection_id;
+  std::list<fake_broker_connection_t> connections;
+  // Open connections, for finding those of delayed packets without scanning the whole fleet.
+  std::unordered_map<uint64_t, fake_broker_connection_t*> open_connections;
+  std::unordered_map<std::string, fake_broker_connection_t*> iot_hub_connections;
+  // Delays are all the same, so due times are in order.
+  std::deque<fake_broker_delayed_packet_t> delayed_packets;
+  std::mutex mutex; // Guards everything below.
+  std::deque<fake_broker_injected_message_t> injected_messages;
+  std::unordered_set<std::string> tls_sessions;
+  uint64_t last_tls_session_id;
+  uint32_t iot_hub_connections_to_refuse_count;
+  fake_broker_statistics_t statistics;
+  std::vector<uint32_t> command_latencies_in_us;
+  uint8_t rx_buffer[MQTT_PACKET_MAX_SIZE];
+  uint8_t tx_buffer[MQTT_PACKET_MAX_SIZE];
+};
+
+static uint64_t get_time_in_us()
+{
+  struct timespec now;
+  (void)clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+static bool starts_with(az_span span, const char* prefix)
+{
+  az_span prefix_span = az_span_create((uint8_t*)prefix, (int32_t)strlen(prefix));
+
+  return az_span_size(span) >= az_span_size(prefix_span)
+      && az_span_is_content_equal(
+             az_span_slice(span, 0, az_span_size(prefix_span)), prefix_span);
+}
+
+/*
+ * @brief    Gets the value of the "$rid" property of a topic, or an empty string if none.
+ */
+static std::string get_request_id(az_span topic)
+{
+  std::string topic_string((const char*)az_span_ptr(topic), (size_t)az_span_size(topic));
+  size_t start = topic_string.find(REQUEST_ID_PROPERTY);
+
+  if (start == std::string::npos)
+  {
+    return std::string();
+  }
+
+  start += strlen(REQUEST_ID_PROPERTY);
+
+  return topic_string.substr(start, topic_string.find('&', start) - start);
+}
+
+static void close_connection(fake_broker_t* broker, fake_broker_connection_t* connection)
+{
+  std::unordered_map<std::string, fake_broker_connection_t*>::iterator iot_hub_connection
+      = broker->iot_hub_connections.find(connection->client_id);
+
+  if (iot_hub_connection != broker->iot_hub_connections.end()
+      && iot_hub_connection->second == connection)
+  {
+    broker->iot_hub_connections.erase(iot_hub_connection);
+  }
+
+  broker->open_connections.erase(connection->id);
+
+  if (connection->socket_fd >= 0)
+  {
+    (void)close(connection->socket_fd);
+    connection->socket_fd = -1;
+  }
+}
+
+static int send_packet(fake_broker_t* broker, fake_broker_connection_t* connection, int32_t size)
+{
+  fake_broker_delayed_packet_t delayed_packet;
+
+  if (size == 0)
+  {
+    return RESULT_ERROR;
+  }
+
+  if (broker->config.response_delay_in_ms == 0)
+  {
+    return mqtt_packet_write(connection->socket_fd, az_span_create(broker->tx_buffer, size));
+  }
+
+  delayed_packet.due_time_in_us
+      = get_time_in_us() + (uint64_t)broker->config.response_delay_in_ms * 1000;
+  delayed_packet.connection_id = connection->id;
+  delayed_packet.packet.assign(broker->tx_buffer, broker->tx_buffer + size);
+  broker->delayed_packets.push_back(delayed_packet);
+
+  return RESULT_OK;
+}
+
+static int send_publish(
+    fake_broker_t* broker,
+    fake_broker_connection_t* connection,
+    const char* topic,
+    const char* payload)
+{
+  return send_packet(
+      broker,
+      connection,
+      mqtt_packet_encode_publish(
+          AZ_SPAN_FROM_BUFFER(broker->tx_buffer),
+          az_span_create((uint8_t*)topic, (int32_t)strlen(topic)),
+          az_span_create((uint8_t*)payload, (int32_t)strlen(payload)),
+          0,
+          0));
+}
+
+/*
+ * @brief    Sends the packets held back whose time has come.
+ * @return   Time until the next packet is due, in milliseconds, or -1 if there are none.
+ */
+static int send_delayed_packets(fake_broker_t* broker)
+{
+  uint64_t now = get_time_in_us();
+
+  while (!broker->delayed_packets.empty())
+  {
+    fake_broker_delayed_packet_t& delayed_packet = broker->delayed_packets.front();
+
+    if (delayed_packet.due_time_in_us > now)
+    {
+      return (int)((delayed_packet.due_time_in_us - now + 999) / 1000);
+    }
+
+    std::unordered_map<uint64_t, fake_broker_connection_t*>::iterator connection
+        = broker->open_connections.find(delayed_packet.connection_id);
+
+    if (connection != broker->open_connections.end())
+    {
+      az_span packet
+          = az_span_create(delayed_packet.packet.data(), (int32_t)delayed_packet.packet.size());
+
+      if (mqtt_packet_write(connection->second->socket_fd, packet) != 0)
+      {
+        close_connection(broker, connection->second);
+      }
+    }
+
+    broker->delayed_packets.pop_front();
+  }
+
+  return -1;
+}
+
+static int send_dps_response(
+    fake_broker_t* broker,
+    fake_broker_connection_t* connection,
+    const std::string& request_id)
+{
+  char topic[TOPIC_BUFFER_SIZE];
+  char payload[PAYLOAD_BUFFER_SIZE];
+  bool is_assigned = connection->dps_queries_count >= broker->config.dps_assigning_queries_count;
+
+  if (is_assigned)
+  {
+    (void)snprintf(
+        topic,
+        sizeof(topic),
+        "$dps/registrations/res/%d/?$rid=%s",
+        HTTP_STATUS_OK,
+        request_id.c_str());
+    (void)snprintf(
+        payload,
+        sizeof(payload),
+        "{\"operationId\":\"op-%llu\",\"status\":\"assigned\",\"registrationState\":{"
+        "\"registrationId\":\"%s\",\"assignedHub\":\"%s\",\"deviceId\":\"%s\","
+        "\"status\":\"assigned\",\"substatus\":\"initialAssignment\"}}",
+        (unsigned long long)connection->id,
+        connection->client_id.c_str(),
+        broker->iot_hub_fqdn.c_str(),
+        connection->client_id.c_str());
+
+    std::lock_guard<std::mutex> lock(broker->mutex);
+    broker->statistics.dps_assignments_count++;
+  }
+  else
+  {
+    (void)snprintf(
+        topic,
+        sizeof(topic),
+        "$dps/registrations/res/%d/?$rid=%s&retry-after=%u",
+        HTTP_STATUS_ACCEPTED,
+        request_id.c_str(),
+        (unsigned)broker->config.dps_retry_after_in_secs);
+    (void)snprintf(
+        payload,
+        sizeof(payload),
+        "{\"operationId\":\"op-%llu\",\"status\":\"assigning\"}",
+        (unsigned long long)connection->id);
+  }
+
+  return send_publish(broker, connection, topic, payload);
+}
+
+static int handle_publish(
+    fake_broker_t* broker,
+    fake_broker_connection_t* connection,
+    mqtt_packet_t* packet)
+{
+  mqtt_publish_t publish;
+  char topic[TOPIC_BUFFER_SIZE];
+  char payload[PAYLOAD_BUFFER_SIZE];
+  std::string request_id;
+
+  if (mqtt_packet_decode_publish(packet, &publish) != 0)
+  {
+    return RESULT_ERROR;
+  }
+
+  if (publish.qos > 0
+      && send_packet(
+             broker,
+             connection,
+             mqtt_packet_encode_puback(AZ_SPAN_FROM_BUFFER(broker->tx_buffer), publish.packet_id))
+          != RESULT_OK)
+  {
+    return RESULT_ERROR;
+  }
+
+  request_id = get_request_id(publish.topic);
+
+  if (connection->is_dps)
+  {
+    if (starts_with(publish.topic, DPS_REGISTER_TOPIC_PREFIX))
+    {
+      std::lock_guard<std::mutex> lock(broker->mutex);
+      broker->statistics.dps_registrations_count++;
+    }
+    else if (starts_with(publish.topic, DPS_QUERY_TOPIC_PREFIX))
+    {
+      connection->dps_queries_count++;
+    }
+    else
+    {
+      return RESULT_OK;
+    }
+
+    return send_dps_response(broker, connection, request_id);
+  }
+
+  if (starts_with(publish.topic, TWIN_GET_TOPIC_PREFIX))
+  {
+    (void)snprintf(
+        topic,
+        sizeof(topic),
+        "$iothub/twin/res/%d/?$rid=%s",
+        HTTP_STATUS_OK,
+        request_id.c_str());
+    (void)snprintf(
+        payload,
+        sizeof(payload),
+        "{\"desired\":{\"$version\":%u},\"reported\":{\"$version\":%u}}",
+        (unsigned)connection->desired_version,
+        (unsigned)connection->reported_version);
+
+    return send_publish(broker, connection, topic, payload);
+  }
+  else if (starts_with(publish.topic, TWIN_REPORTED_TOPIC_PREFIX))
+  {
+    connection->reported_version++;
+
+    {
+      std::lock_guard<std::mutex> lock(broker->mutex);
+      broker->statistics.reported_properties_count++;
+    }
+
+    (void)snprintf(
+        topic,
+        sizeof(topic),
+        "$iothub/twin/res/%d/?$rid=%s&$version=%u",
+        HTTP_STATUS_NO_CONTENT,
+        request_id.c_str(),
+        (unsigned)connection->reported_version);
+
+    return send_publish(broker, connection, topic, "");
+  }
+  else if (starts_with(publish.topic, COMMAND_RESPONSE_TOPIC_PREFIX))
+  {
+    std::map<std::string, uint64_t>::iterator send_time
+        = connection->command_send_times_in_us.find(request_id);
+
+    if (send_time != connection->command_send_times_in_us.end())
+    {
+      std::lock_guard<std::mutex> lock(broker->mutex);
+      broker->statistics.command_responses_count++;
+      broker->command_latencies_in_us.push_back(
+          (uint32_t)(get_time_in_us() - send_time->second));
+      connection->command_send_times_in_us.erase(send_time);
+    }
+  }
+  else if (starts_with(publish.topic, TELEMETRY_TOPIC_PREFIX))
+  {
+    std::lock_guard<std::mutex> lock(broker->mutex);
+    broker->statistics.telemetry_count++;
+  }
+
+  return RESULT_OK;
+}
+
+static int handle_tls_session(
+    fake_broker_t* broker,
+    fake_broker_connection_t* connection,
+    mqtt_packet_t* packet)
+{
+  bool is_resumed;
+  az_span session;
+  std::string offered_session;
+  std::string issued_session;
+
+  if (connection->is_tls_established
+      || mqtt_packet_decode_tls_session(packet, &is_resumed, &session) != 0)
+  {
+    return RESULT_ERROR;
+  }
+
+  connection->is_tls_established = true;
+  offered_session.assign((const char*)az_span_ptr(session), (size_t)az_span_size(session));
+
+  {
+    std::lock_guard<std::mutex> lock(broker->mutex);
+    is_resumed = broker->tls_sessions.count(offered_session) > 0;
+
+    if (is_resumed)
+    {
+      broker->statistics.tls_resumptions_count++;
+    }
+    else
+    {
+      issued_session = TLS_SESSION_PREFIX + std::to_string(++broker->last_tls_session_id);
+      broker->tls_sessions.insert(issued_session);
+      broker->statistics.tls_handshakes_count++;
+    }
+  }
+
+  return send_packet(
+      broker,
+      connection,
+      mqtt_packet_encode_tls_session(
+          AZ_SPAN_FROM_BUFFER(broker->tx_buffer),
+          is_resumed,
+          az_span_create((uint8_t*)issued_session.data(), (int32_t)issued_session.size())));
+}
+
+static int handle_connect(
+    fake_broker_t* broker,
+    fake_broker_connection_t* connection,
+    mqtt_packet_t* packet)
+{
+  az_span client_id;
+  az_span username;
+  az_span password;
+  bool is_refused = false;
+  std::unordered_map<std::string, fake_broker_connection_t*>::iterator previous_connection;
+
+  if (mqtt_packet_decode_connect(packet, &client_id, &username, &password) != 0)
+  {
+    return RESULT_ERROR;
+  }
+
+  connection->client_id.assign(
+      (const char*)az_span_ptr(client_id), (size_t)az_span_size(client_id));
+  connection->is_dps
+      = std::string((const char*)az_span_ptr(username), (size_t)az_span_size(username))
+            .find(DPS_USERNAME_MARKER)
+      != std::string::npos;
+
+  if (!connection->is_dps)
+  {
+    std::lock_guard<std::mutex> lock(broker->mutex);
+
+    if (broker->iot_hub_connections_to_refuse_count > 0)
+    {
+      broker->iot_hub_connections_to_refuse_count--;
+      broker->statistics.refused_connections_count++;
+      is_refused = true;
+    }
+  }
+
+  if (is_refused)
+  {
+    // The client closes the connection on the refusal; closing it here would drop the CONNACK if
+    // it is delayed.
+    return send_packet(
+        broker,
+        connection,
+        mqtt_packet_encode_connack(
+            AZ_SPAN_FROM_BUFFER(broker->tx_buffer), MQTT_CONNACK_REFUSED_NOT_AUTHORIZED));
+  }
+  else if (!connection->is_dps)
+  {
+    // Like the Azure IoT Hub, a new connection of the same device closes the previous one.
+    previous_connection = broker->iot_hub_connections.find(connection->client_id);
+
+    if (previous_connection != broker->iot_hub_connections.end())
+    {
+      close_connection(broker, previous_connection->second);
+    }
+
+    broker->iot_hub_connections[connection->client_id] = connection;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(broker->mutex);
+    broker->statistics.connections_count++;
+  }
+
+  return send_packet(
+      broker,
+      connection,
+      mqtt_packet_encode_connack(AZ_SPAN_FROM_BUFFER(broker->tx_buffer), MQTT_CONNACK_ACCEPTED));
+}
+
+static int handle_packet(
+    fake_broker_t* broker,
+    fake_broker_connection_t* connection,
+    mqtt_packet_t* packet)
+{
+  uint16_t packet_id;
+  az_span topic;
+
+  {
+    std::lock_guard<std::mutex> lock(broker->mutex);
+    broker->statistics.bytes_received += (uint64_t)az_span_size(packet->body);
+  }
+
+  // As with TLS, the handshake comes before any MQTT packet.
+  if (!connection->is_tls_established && packet->type != MQTT_PACKET_TYPE_TLS_SESSION)
+  {
+    return RESULT_ERROR;
+  }
+
+  switch (packet->type)
+  {
+    case MQTT_PACKET_TYPE_TLS_SESSION:
+      return handle_tls_session(broker, connection, packet);
+    case MQTT_PACKET_TYPE_CONNECT:
+      return handle_connect(broker, connection, packet);
+    case MQTT_PACKET_TYPE_SUBSCRIBE:
+      if (mqtt_packet_decode_subscribe(packet, &packet_id, &topic) != 0)
+      {
+        return RESULT_ERROR;
+      }
+
+      // Messages are all sent with QoS 0, whatever requested.
+      return send_packet(
+          broker,
+          connection,
+          mqtt_packet_encode_suback(AZ_SPAN_FROM_BUFFER(broker->tx_buffer), packet_id, 0));
+    case MQTT_PACKET_TYPE_PUBLISH:
+      return handle_publish(broker, connection, packet);
+    case MQTT_PACKET_TYPE_PUBACK:
+      return RESULT_OK;
+    case MQTT_PACKET_TYPE_PINGREQ:
+      return send_packet(
+          broker,
+          connection,
+          mqtt_packet_encode_empty(
+              AZ_SPAN_FROM_BUFFER(broker->tx_buffer), MQTT_PACKET_TYPE_PINGRESP));
+    case MQTT_PACKET_TYPE_DISCONNECT:
+    default:
+      return RESULT_ERROR;
+  }
+}
+
+static void send_injected_message(fake_broker_t* broker, fake_broker_injected_message_t& message)
+{
+  char topic[TOPIC_BUFFER_SIZE];
+  std::string payload;
+  std::unordered_map<std::string, fake_broker_connection_t*>::iterator iterator
+      = broker->iot_hub_connections.find(message.device_id);
+  fake_broker_connection_t* connection
+      = (iterator == broker->iot_hub_connections.end()) ? NULL : iterator->second;
+
+  if (connection == NULL)
+  {
+    std::lock_guard<std::mutex> lock(broker->mutex);
+    broker->statistics.commands_dropped_count += message.is_command ? 1 : 0;
+    return;
+  }
+
+  if (message.is_command)
+  {
+    std::string request_id = std::to_string(++connection->last_request_id);
+
+    (void)snprintf(
+        topic,
+        sizeof(topic),
+        "$iothub/methods/POST/%s/?$rid=%s",
+        message.command_name.c_str(),
+        request_id.c_str());
+    connection->command_send_times_in_us[request_id] = get_time_in_us();
+    payload = message.payload;
+
+    std::lock_guard<std::mutex> lock(broker->mutex);
+    broker->statistics.commands_sent_count++;
+  }
+  else
+  {
+    connection->desired_version++;
+
+    (void)snprintf(
+        topic,
+        sizeof(topic),
+        "$iothub/twin/PATCH/properties/desired/?$version=%u",
+        (unsigned)connection->desired_version);
+
+    // "$version" goes into the document as the first property.
+    payload = "{\"$version\":" + std::to_string(connection->desired_version);
+    payload += (message.payload.size() > 2) ? "," + message.payload.substr(1) : "}";
+
+    std::lock_guard<std::mutex> lock(broker->mutex);
+    broker->statistics.desired_properties_sent_count++;
+  }
+
+  if (send_publish(broker, connection, topic, payload.c_str()) != RESULT_OK)
+  {
+    close_connection(broker, connection);
+  }
+}
+
+static void accept_connection(fake_broker_t* broker)
+{
+  int no_delay = 1;
+  int socket_fd = accept(broker->listen_fd, NULL, NULL);
+
+  if (socket_fd < 0)
+  {
+    return;
+  }
+
+  (void)setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+
+  broker->connections.push_back(fake_broker_connection_t());
+  broker->connections.back().id = ++broker->next_connection_id;
+  broker->connections.back().socket_fd = socket_fd;
+  broker->connections.back().is_tls_established = false;
+  broker->connections.back().is_dps = false;
+  broker->connections.back().dps_queries_count = 0;
+  broker->connections.back().reported_version = 1;
+  broker->connections.back().desired_version = 1;
+  broker->connections.back().last_request_id = 0;
+  broker->open_connections[broker->connections.back().id] = &broker->connections.back();
+}
+
+static void run_broker(fake_broker_t* broker)
+{
+  std::vector<struct pollfd> poll_fds;
+  std::vector<fake_broker_connection_t*> polled_connections;
+  std::deque<fake_broker_injected_message_t> injected_messages;
+  uint8_t wake_buffer[WAKE_BUFFER_SIZE];
+  mqtt_packet_t packet;
+  int timeout;
+
+  while (!broker->is_stopping)
+  {
+    timeout = send_delayed_packets(broker);
+
+    poll_fds.clear();
+    polled_connections.clear();
+    poll_fds.push_back({ broker->wake_pipe[WAKE_PIPE_READ], POLLIN, 0 });
+    poll_fds.push_back({ broker->listen_fd, POLLIN, 0 });
+
+    for (std::list<fake_broker_connection_t>::iterator connection = broker->connections.begin();
+         connection != broker->connections.end();)
+    {
+      if (connection->socket_fd < 0)
+      {
+        connection = broker->connections.erase(connection);
+        continue;
+      }
+
+      poll_fds.push_back({ connection->socket_fd, POLLIN, 0 });
+      polled_connections.push_back(&*connection);
+      connection++;
+    }
+
+    if (poll(poll_fds.data(), (nfds_t)poll_fds.size(), timeout) <= 0)
+    {
+      continue;
+    }
+
+    if (poll_fds[0].revents & POLLIN)
+    {
+      (void)read(broker->wake_pipe[WAKE_PIPE_READ], wake_buffer, sizeof(wake_buffer));
+
+      {
+        std::lock_guard<std::mutex> lock(broker->mutex);
+        injected_messages.swap(broker->injected_messages);
+      }
+
+      while (!injected_messages.empty())
+      {
+        send_injected_message(broker, injected_messages.front());
+        injected_messages.pop_front();
+      }
+    }
+
+    if (poll_fds[1].revents & POLLIN)
+    {
+      accept_connection(broker);
+    }
+
+    for (size_t i = 0; i < polled_connections.size(); i++)
+    {
+      fake_broker_connection_t* connection = polled_connections[i];
+
+      if ((poll_fds[i + 2].revents & (POLLIN | POLLHUP | POLLERR)) == 0
+          || connection->socket_fd < 0)
+      {
+        continue;
+      }
+
+      if (mqtt_packet_read(connection->socket_fd, AZ_SPAN_FROM_BUFFER(broker->rx_buffer), &packet)
+              != 0
+          || handle_packet(broker, connection, &packet) != RESULT_OK)
+      {
+        close_connection(broker, connection);
+      }
+    }
+  }
+}
+
+static void wake_broker(fake_broker_t* broker)
+{
+  uint8_t wake = 1;
+  (void)write(broker->wake_pipe[WAKE_PIPE_WRITE], &wake, sizeof(wake));
+}
+
+fake_broker_t* fake_broker_start(const fake_broker_config_t* config)
+{
+  struct sockaddr_in address;
+  socklen_t address_length = sizeof(address);
+  int reuse_address = 1;
+  fake_broker_t* broker = new fake_broker_t();
+
+  broker->config = *config;
+  broker->iot_hub_fqdn = (config->iot_hub_fqdn != NULL) ? config->iot_hub_fqdn : "localhost";
+  broker->is_stopping = false;
+  broker->next_connection_id = 0;
+  broker->last_tls_session_id = 0;
+  broker->iot_hub_connections_to_refuse_count = 0;
+  (void)memset(&broker->statistics, 0, sizeof(broker->statistics));
+  broker->wake_pipe[WAKE_PIPE_READ] = -1;
+  broker->wake_pipe[WAKE_PIPE_WRITE] = -1;
+  broker->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+
+  (void)memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons((uint16_t)config->port);
+
+  if (broker->listen_fd < 0
+      || setsockopt(
+             broker->listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse_address, sizeof(reuse_address))
+          != 0
+      || bind(broker->listen_fd, (struct sockaddr*)&address, sizeof(address)) != 0
+      || listen(broker->listen_fd, LISTEN_BACKLOG) != 0
+      || getsockname(broker->listen_fd, (struct sockaddr*)&address, &address_length) != 0
+      || pipe(broker->wake_pipe) != 0
+      || fcntl(broker->wake_pipe[WAKE_PIPE_READ], F_SETFL, O_NONBLOCK) != 0
+      || fcntl(broker->wake_pipe[WAKE_PIPE_WRITE], F_SETFL, O_NONBLOCK) != 0)
+  {
+    (void)fprintf(stderr, "Failed starting fake broker (errno=%d).\n", errno);
+    fake_broker_stop(broker);
+    return NULL;
+  }
+
+  broker->port = ntohs(address.sin_port);
+  broker->thread = std::thread(run_broker, broker);
+
+  return broker;
+}
+
+void fake_broker_stop(fake_broker_t* broker)
+{
+  if (broker->thread.joinable())
+  {
+    broker->is_stopping = true;
+    wake_broker(broker);
+    broker->thread.join();
+  }
+
+  for (std::list<fake_broker_connection_t>::iterator connection = broker->connections.begin();
+       connection != broker->connections.end();
+       connection++)
+  {
+    close_connection(broker, &*connection);
+  }
+
+  for (int fd : { broker->listen_fd,
+                  broker->wake_pipe[WAKE_PIPE_READ],
+                  broker->wake_pipe[WAKE_PIPE_WRITE] })
+  {
+    if (fd >= 0)
+    {
+      (void)close(fd);
+    }
+  }
+
+  delete broker;
+}
+
+int fake_broker_get_port(fake_broker_t* broker) { return broker->port; }
+
+int fake_broker_send_command(
+    fake_broker_t* broker,
+    const char* device_id,
+    const char* command_name,
+    az_span payload)
+{
+  fake_broker_injected_message_t message;
+
+  message.device_id = device_id;
+  message.command_name = command_name;
+  message.payload.assign((const char*)az_span_ptr(payload), (size_t)az_span_size(payload));
+  message.is_command = true;
+
+  {
+    std::lock_guard<std::mutex> lock(broker->mutex);
+    broker->injected_messages.push_back(message);
+  }
+
+  wake_broker(broker);
+
+  return RESULT_OK;
+}
+
+int fake_broker_send_desired_properties(
+    fake_broker_t* broker,
+    const char* device_id,
+    az_span properties)
+{
+  fake_broker_injected_message_t message;
+
+  if (az_span_size(properties) < 2 || az_span_ptr(properties)[0] != '{')
+  {
+    return RESULT_ERROR;
+  }
+
+  message.device_id = device_id;
+  message.payload.assign((const char*)az_span_ptr(properties), (size_t)az_span_size(properties));
+  message.is_command = false;
+
+  {
+    std::lock_guard<std::mutex> lock(broker->mutex);
+    broker->injected_messages.push_back(message);
+  }
+
+  wake_broker(broker);
+
+  return RESULT_OK;
+}
+
+void fake_broker_forget_tls_sessions(fake_broker_t* broker)
+{
+  std::lock_guard<std::mutex> lock(broker->mutex);
+  broker->tls_sessions.clear();
+}
+
+void fake_broker_refuse_iot_hub_connections(fake_broker_t* broker, uint32_t count)
+{
+  std::lock_guard<std::mutex> lock(broker->mutex);
+  broker->iot_hub_connections_to_refuse_count = count;
+}
+
+void fake_broker_get_statistics(fake_broker_t* broker, fake_broker_statistics_t* statistics)
+{
+  std::lock_guard<std::mutex> lock(broker->mutex);
+  *statistics = broker->statistics;
+}
+
+uint32_t fake_broker_get_command_latencies(
+    fake_broker_t* broker,
+    uint32_t* latencies_in_us,
+    uint32_t max_count)
+{
+  std::lock_guard<std::mutex> lock(broker->mutex);
+  uint32_t count = (uint32_t)broker->command_latencies_in_us.size();
+
+  count = (count < max_count) ? count : max_count;
+  (void)memcpy(latencies_in_us, broker->command_latencies_in_us.data(), count * sizeof(uint32_t));
+  broker->command_latencies_in_us.clear();
+
+  return count;
+}
@@ -0,0 +1,160 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * fake_broker.h defines an in-process MQTT broker for the host build that emulates what Azure
+ * Device Provisioning and the Azure IoT Hub do over MQTT for this device:
+ * - DPS: register, "assigning" responses with retry-after, status queries and the assignment to
+ *   `iot_hub_fqdn` (the device id being the registration id);
+ * - Azure IoT Hub: SUBACKs, properties document (twin GET), reported properties (twin PATCH),
+ *   PUBACKs of telemetry, commands (direct methods) and desired properties updates sent on
+ *   request, and the responses to commands.
+ * It serves plain TCP on the loopback interface from a thread of its own. Authentication is not
+ * checked. In place of TLS, each connection starts with the simulated handshake of
+ * `mqtt_packet_encode_tls_session`: a session the broker issued is resumed, otherwise a new one is
+ * issued.
+ */
+
+#ifndef FAKE_BROKER_H
+#define FAKE_BROKER_H
+
+#include <stdint.h>
+
+#include <az_core.h>
+
+typedef struct fake_broker_t_struct fake_broker_t;
+
+/*
+ * @brief    Configuration of the fake broker.
+ */
+typedef struct fake_broker_config_t_struct
+{
+  /*
+   * @brief    TCP port to listen on, or zero for any free port (see `fake_broker_get_port`).
+   */
+  int port;
+
+  /*
+   * @brief    Azure IoT Hub FQDN assigned to the devices by the DPS emulation.
+   */
+  const char* iot_hub_fqdn;
+
+  /*
+   * @brief    Number of status queries answered with "assigning" before the device is assigned.
+   * @remark   Zero assigns the device already in the response to its registration.
+   */
+  uint32_t dps_assigning_queries_count;
+
+  /*
+   * @brief    Retry-after informed to the device in the "assigning" responses.
+   */
+  uint32_t dps_retry_after_in_secs;
+
+  /*
+   * @brief    Delay added to every packet sent by the broker, emulating the round-trip time to
+   *           the Azure IoT services.
+   */
+  uint32_t response_delay_in_ms;
+} fake_broker_config_t;
+
+/*
+ * @brief    Counts of what the fake broker has done since started.
+ */
+typedef struct fake_broker_statistics_t_struct
+{
+  uint32_t connections_count;
+  uint32_t dps_registrations_count;
+  uint32_t dps_assignments_count;
+  uint32_t telemetry_count;
+  uint32_t reported_properties_count;
+  uint32_t commands_sent_count;
+  uint32_t commands_dropped_count;
+  uint32_t command_responses_count;
+  uint32_t desired_properties_sent_count;
+  uint32_t tls_handshakes_count;
+  uint32_t tls_resumptions_count;
+  uint32_t refused_connections_count;
+  uint64_t bytes_received;
+} fake_broker_statistics_t;
+
+/*
+ * @brief        Starts a fake broker listening on 127.0.0.1.
+ *
+ * @return       fake_broker_t*    The broker, or NULL if it could not be started.
+ */
+fake_broker_t* fake_broker_start(const fake_broker_config_t* config);
+
+/*
+ * @brief        Closes all connections and stops the broker, releasing it.
+ */
+void fake_broker_stop(fake_broker_t* broker);
+
+/*
+ * @brief        Gets the TCP port the broker listens on.
+ */
+int fake_broker_get_port(fake_broker_t* broker);
+
+/*
+ * @brief        Sends a command to a device connected to the Azure IoT Hub emulation.
+ * @remark       Can be called from any thread. The command is dropped (and counted as such) if
+ *               the device is not connected by the time the broker sends it. The time until the
+ *               device responds is kept (see `fake_broker_get_command_latencies`).
+ *
+ * @param[in]    broker          The broker.
+ * @param[in]    device_id       MQTT client id of the device.
+ * @param[in]    command_name    Name of the command, prefixed by "<component>*" if any.
+ * @param[in]    payload         Payload of the command (JSON).
+ *
+ * @return       int             0 on success, non-zero if any failure occurs.
+ */
+int fake_broker_send_command(
+    fake_broker_t* broker,
+    const char* device_id,
+    const char* command_name,
+    az_span payload);
+
+/*
+ * @brief        Sends a desired properties update to a device connected to the Azure IoT Hub
+ *               emulation.
+ * @remark       Can be called from any thread. `properties` is the JSON document without
+ *               "$version", which the broker adds.
+ *
+ * @return       int             0 on success, non-zero if any failure occurs.
+ */
+int fake_broker_send_desired_properties(
+    fake_broker_t* broker,
+    const char* device_id,
+    az_span properties);
+
+/*
+ * @brief        Forgets all the TLS sessions issued, as a server rotating its session ticket keys
+ *               does, so the next sessions offered are refused (a full handshake is performed).
+ * @remark       Can be called from any thread.
+ */
+void fake_broker_forget_tls_sessions(fake_broker_t* broker);
+
+/*
+ * @brief        Refuses the next `count` connections to the Azure IoT Hub emulation as "not
+ *               authorized", as the Azure IoT Hub does with a device no longer registered to it
+ *               (e.g., re-assigned by DPS to another hub).
+ * @remark       Can be called from any thread. DPS connections are not refused.
+ */
+void fake_broker_refuse_iot_hub_connections(fake_broker_t* broker, uint32_t count);
+
+/*
+ * @brief        Gets the fake broker statistics.
+ */
+void fake_broker_get_statistics(fake_broker_t* broker, fake_broker_statistics_t* statistics);
+
+/*
+ * @brief        Moves the latencies of the commands responded since last call into `latencies`.
+ * @remark       Each latency is the time between the broker sending a command and receiving its
+ *               response, in microseconds. Latencies that do not fit in `latencies` are dropped.
+ *
+ * @return       uint32_t    Number of latencies written into `latencies`.
+ */
+uint32_t fake_broker_get_command_latencies(
+    fake_broker_t* broker,
+    uint32_t* latencies_in_us,
+    uint32_t max_count);
+
+#endif // FAKE_BROKER_H
@@ -0,0 +1,45 @@
+// SPDX-License-Identifier: MIT
+
+#include "fake_clock.h"
+
+#include <atomic>
+
+#define NUMBER_OF_MILLISECONDS_IN_A_SECOND 1000
+
+static std::atomic<uint64_t> current_monotonic_time_in_ms(0);
+// Kept in milliseconds too, so advancing by less than a second is not lost.
+static std::atomic<uint64_t> current_unix_time_in_ms(0);
+
+void fake_clock_init(uint64_t monotonic_time_in_ms, uint32_t unix_time)
+{
+  current_monotonic_time_in_ms = monotonic_time_in_ms;
+  current_unix_time_in_ms = (uint64_t)unix_time * NUMBER_OF_MILLISECONDS_IN_A_SECOND;
+}
+
+void fake_clock_advance(uint32_t time_in_ms)
+{
+  current_monotonic_time_in_ms += time_in_ms;
+  current_unix_time_in_ms += time_in_ms;
+}
+
+void fake_clock_set_unix_time(uint32_t unix_time)
+{
+  current_unix_time_in_ms = (uint64_t)unix_time * NUMBER_OF_MILLISECONDS_IN_A_SECOND;
+}
+
+uint64_t fake_clock_get_monotonic_time_in_ms() { return current_monotonic_time_in_ms; }
+
+uint32_t fake_clock_get_unix_time()
+{
+  return (uint32_t)(current_unix_time_in_ms / NUMBER_OF_MILLISECONDS_IN_A_SECOND);
+}
+
+clock_interface_t fake_clock_get_interface()
+{
+  clock_interface_t clock_interface;
+
+  clock_interface.get_monotonic_time_in_ms = fake_clock_get_monotonic_time_in_ms;
+  clock_interface.get_unix_time = fake_clock_get_unix_time;
+
+  return clock_interface;
+}
@@ -0,0 +1,48 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * fake_clock.h provides a clock for `clock_interface_t` that only moves when told to, so the host
+ * build can go through hours of SAS token lifetimes in milliseconds, or step the wall clock (as
+ * SNTP does) without moving the monotonic one. It is shared by all the devices of the process.
+ */
+
+#ifndef FAKE_CLOCK_H
+#define FAKE_CLOCK_H
+
+#include <stdint.h>
+
+#include "AzureIoT.h"
+
+/*
+ * @brief        Sets both clocks of the fake clock.
+ * @remark       `monotonic_time_in_ms` should not be zero, which the Azure IoT client uses for
+ *               "not set" in some of its timestamps.
+ */
+void fake_clock_init(uint64_t monotonic_time_in_ms, uint32_t unix_time);
+
+/*
+ * @brief        Moves both clocks forward, as time passing.
+ */
+void fake_clock_advance(uint32_t time_in_ms);
+
+/*
+ * @brief        Sets the wall clock only, as SNTP stepping it.
+ */
+void fake_clock_set_unix_time(uint32_t unix_time);
+
+/*
+ * See the documentation of `monotonic_time_function_t` in AzureIoT.h for details.
+ */
+uint64_t fake_clock_get_monotonic_time_in_ms();
+
+/*
+ * See the documentation of `unix_time_function_t` in AzureIoT.h for details.
+ */
+uint32_t fake_clock_get_unix_time();
+
+/*
+ * @brief        Gets a clock interface for `azure_iot_config_t` made of the fake clock.
+ */
+clock_interface_t fake_clock_get_interface();
+
+#endif // FAKE_CLOCK_H
@@ -0,0 +1,458 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * fleet.cpp load tests the fake broker (standing for the Azure IoT services) with a fleet of
+ * independent devices of the sample, each with its own Azure IoT client and buffers, worked by a
+ * small pool of threads. It reports:
+ * - connects per second (DPS registration and Azure IoT Hub connection) and connect latency;
+ * - telemetry messages per second;
+ * - command round trip latency percentiles, as seen by the broker;
+ * - memory per device.
+ *
+ * Usage: fleet [devices] [threads] [duration_in_secs] [telemetry_interval_in_ms]
+ *              [commands_per_sec] [response_delay_in_ms]
+ * Set AZURE_IOT_FLEET_VERBOSE in the environment to see the logs of the Azure IoT clients.
+ */
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "AzureIoT.h"
+#include "fake_broker.h"
+#include "host_device.h"
+#include "posix_platform.h"
+
+#define DEFAULT_DEVICES_COUNT 1000
+#define DEFAULT_THREADS_COUNT 4
+#define DEFAULT_DURATION_IN_SECS 10
+#define DEFAULT_TELEMETRY_INTERVAL_IN_MS 1000
+#define DEFAULT_COMMANDS_PER_SEC 100
+#define BROKER_HOST "127.0.0.1"
+#define BROKER_IOT_HUB_FQDN "fleet-hub.azure-devices.net"
+#define REGISTRATION_ID_FORMAT "fleet-%06d"
+#define CONNECT_TIMEOUT_IN_SECS 120
+#define WORK_WAIT_IN_MS 10
+#define DRAIN_TIME_IN_MS 500
+#define TELEMETRY_PAYLOAD "{\"ledStatus\":\"White\"}"
+#define COMMAND_NAME "toggleLed1"
+#define COMMAND_PAYLOAD "{}"
+// A device takes a socket to the broker, and the broker one more for it.
+#define FILE_DESCRIPTORS_PER_DEVICE 2
+#define FILE_DESCRIPTORS_SPARE 64
+
+/*
+ * @brief    A thread of the pool and the devices it works, none shared with other threads.
+ */
+typedef struct fleet_worker_t_struct
+{
+  std::thread thread;
+  std::vector<host_device_t*> devices;
+  std::vector<uint64_t> start_times_in_us;
+  std::vector<uint64_t> next_telemetry_times_in_us;
+  std::vector<bool> is_connected;
+  std::vector<uint32_t> connect_latencies_in_us;
+  uint32_t telemetry_failures_count;
+} fleet_worker_t;
+
+static std::atomic<uint32_t> connected_devices_count;
+static std::atomic<bool> is_sending_telemetry;
+static std::atomic<bool> is_stopping;
+static uint32_t telemetry_interval_in_ms;
+
+static uint64_t get_time_in_us()
+{
+  struct timespec now;
+  (void)clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+/*
+ * @brief    Gets the resident memory of the process, in bytes.
+ */
+static uint64_t get_resident_memory()
+{
+  unsigned long total_pages = 0;
+  unsigned long resident_pages = 0;
+  FILE* statm = fopen("/proc/self/statm", "r");
+
+  if (statm != NULL)
+  {
+    if (fscanf(statm, "%lu %lu", &total_pages, &resident_pages) != 2)
+    {
+      resident_pages = 0;
+    }
+
+    (void)fclose(statm);
+  }
+
+  return (uint64_t)resident_pages * (uint64_t)sysconf(_SC_PAGESIZE);
+}
+
+/*
+ * @brief    Raises the limit of open files as needed for the fleet, if allowed.
+ * @return   true if the fleet fits in the limit.
+ */
+static bool raise_file_descriptors_limit(int devices_count)
+{
+  struct rlimit limit;
+  rlim_t needed
+      = (rlim_t)devices_count * FILE_DESCRIPTORS_PER_DEVICE + FILE_DESCRIPTORS_SPARE;
+
+  if (getrlimit(RLIMIT_NOFILE, &limit) != 0)
+  {
+    return false;
+  }
+
+  if (limit.rlim_cur < needed)
+  {
+    limit.rlim_cur = std::min(needed, limit.rlim_max);
+    (void)setrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  return limit.rlim_cur >= needed;
+}
+
+static void print_latencies(const char* name, std::vector<uint32_t>& latencies_in_us)
+{
+  uint64_t total = 0;
+
+  if (latencies_in_us.empty())
+  {
+    printf("%-28s no samples\n", name);
+    return;
+  }
+
+  std::sort(latencies_in_us.begin(), latencies_in_us.end());
+
+  for (uint32_t latency : latencies_in_us)
+  {
+    total += latency;
+  }
+
+  printf(
+      "%-28s n=%zu avg=%llu us p50=%u us p90=%u us p99=%u us max=%u us\n",
+      name,
+      latencies_in_us.size(),
+      (unsigned long long)(total / latencies_in_us.size()),
+      latencies_in_us[latencies_in_us.size() * 50 / 100],
+      latencies_in_us[latencies_in_us.size() * 90 / 100],
+      latencies_in_us[latencies_in_us.size() * 99 / 100],
+      latencies_in_us.back());
+}
+
+/*
+ * @brief    Waits until any socket of the worker's devices is readable, or for WORK_WAIT_IN_MS.
+ */
+static void wait_for_devices(fleet_worker_t* worker, std::vector<struct pollfd>& poll_fds)
+{
+  poll_fds.clear();
+
+  for (host_device_t* device : worker->devices)
+  {
+    if (posix_mqtt_client_is_open(&device->mqtt_client))
+    {
+      poll_fds.push_back({ device->mqtt_client.socket_fd, POLLIN, 0 });
+    }
+  }
+
+  if (poll_fds.empty())
+  {
+    (void)usleep(WORK_WAIT_IN_MS * 1000);
+  }
+  else
+  {
+    (void)poll(poll_fds.data(), (nfds_t)poll_fds.size(), WORK_WAIT_IN_MS);
+  }
+}
+
+/*
+ * @brief    Sends the telemetry of a connected device when it is due.
+ */
+static void send_telemetry_if_due(fleet_worker_t* worker, size_t index, uint64_t now)
+{
+  host_device_t* device = worker->devices[index];
+
+  if (now < worker->next_telemetry_times_in_us[index])
+  {
+    return;
+  }
+
+  worker->next_telemetry_times_in_us[index] = now + (uint64_t)telemetry_interval_in_ms * 1000;
+
+  if (azure_iot_send_telemetry(&device->azure_iot, AZ_SPAN_FROM_STR(TELEMETRY_PAYLOAD)) != 0)
+  {
+    worker->telemetry_failures_count++;
+  }
+}
+
+static void run_worker(fleet_worker_t* worker)
+{
+  std::vector<struct pollfd> poll_fds;
+
+  for (size_t i = 0; i < worker->devices.size(); i++)
+  {
+    host_device_select(worker->devices[i]);
+    worker->start_times_in_us[i] = get_time_in_us();
+
+    if (azure_iot_start(&worker->devices[i]->azure_iot) != 0)
+    {
+      (void)fprintf(stderr, "Failed starting %s.\n", worker->devices[i]->registration_id);
+    }
+  }
+
+  while (!is_stopping)
+  {
+    wait_for_devices(worker, poll_fds);
+
+    for (size_t i = 0; i < worker->devices.size(); i++)
+    {
+      host_device_t* device = worker->devices[i];
+      uint64_t now;
+
+      host_device_do_work(device, 0);
+
+      if (azure_iot_get_status(&device->azure_iot) != azure_iot_connected)
+      {
+        continue;
+      }
+
+      now = get_time_in_us();
+
+      if (!worker->is_connected[i])
+      {
+        worker->is_connected[i] = true;
+        worker->connect_latencies_in_us.push_back(
+            (uint32_t)(now - worker->start_times_in_us[i]));
+        // Spreading the telemetry of the fleet over the interval.
+        worker->next_telemetry_times_in_us[i]
+            = now + (uint64_t)posix_get_random_number() % (telemetry_interval_in_ms * 1000 + 1);
+        connected_devices_count++;
+      }
+
+      if (is_sending_telemetry)
+      {
+        send_telemetry_if_due(worker, i, now);
+      }
+    }
+  }
+
+  for (host_device_t* device : worker->devices)
+  {
+    host_device_select(device);
+    (void)azure_iot_stop(&device->azure_iot);
+  }
+}
+
+int main(int argc, char** argv)
+{
+  int devices_count = (argc > 1) ? atoi(argv[1]) : DEFAULT_DEVICES_COUNT;
+  int threads_count = (argc > 2) ? atoi(argv[2]) : DEFAULT_THREADS_COUNT;
+  int duration_in_secs = (argc > 3) ? atoi(argv[3]) : DEFAULT_DURATION_IN_SECS;
+  int telemetry_interval = (argc > 4) ? atoi(argv[4]) : DEFAULT_TELEMETRY_INTERVAL_IN_MS;
+  int commands_per_sec = (argc > 5) ? atoi(argv[5]) : DEFAULT_COMMANDS_PER_SEC;
+  bool is_verbose = getenv("AZURE_IOT_FLEET_VERBOSE") != NULL;
+  fake_broker_config_t broker_config;
+  fake_broker_t* broker;
+  fake_broker_statistics_t statistics_before;
+  fake_broker_statistics_t statistics_after;
+  std::vector<fleet_worker_t> workers;
+  std::vector<host_device_t*> devices;
+  std::vector<uint32_t> latencies;
+  telemetry_delivery_statistics_t telemetry_statistics;
+  char registration_id[HOST_DEVICE_REGISTRATION_ID_SIZE];
+  uint64_t telemetry_acked_count = 0;
+  uint32_t telemetry_failures_count = 0;
+  uint64_t resident_memory_before;
+  uint64_t resident_memory_after;
+  uint64_t start_time;
+  uint64_t elapsed_time;
+
+  if (devices_count <= 0 || threads_count <= 0 || duration_in_secs <= 0 || telemetry_interval <= 0
+      || commands_per_sec < 0)
+  {
+    (void)fprintf(
+        stderr,
+        "Usage: %s [devices] [threads] [duration_in_secs] [telemetry_interval_in_ms] "
+        "[commands_per_sec] [response_delay_in_ms]\n",
+        argv[0]);
+    return 1;
+  }
+
+  if (!raise_file_descriptors_limit(devices_count))
+  {
+    (void)fprintf(stderr, "Too many devices for the limit of open files (see ulimit -n).\n");
+    return 1;
+  }
+
+  telemetry_interval_in_ms = (uint32_t)telemetry_interval;
+  set_logging_function(posix_logging_function);
+  posix_set_logging(is_verbose, is_verbose);
+
+  (void)memset(&broker_config, 0, sizeof(broker_config));
+  broker_config.iot_hub_fqdn = BROKER_IOT_HUB_FQDN;
+  broker_config.dps_assigning_queries_count = 1;
+  broker_config.dps_retry_after_in_secs = 0;
+  broker_config.response_delay_in_ms = (argc > 6) ? (uint32_t)atoi(argv[6]) : 0;
+  broker = fake_broker_start(&broker_config);
+
+  if (broker == NULL)
+  {
+    return 1;
+  }
+
+  printf(
+      "Azure IoT fleet: %d devices, %d threads, %d s, telemetry every %d ms, %d commands/s, "
+      "%u ms response delay.\n",
+      devices_count,
+      threads_count,
+      duration_in_secs,
+      telemetry_interval,
+      commands_per_sec,
+      (unsigned)broker_config.response_delay_in_ms);
+
+  // Devices are initialized in this thread; each is then only touched by the thread working it.
+  resident_memory_before = get_resident_memory();
+  workers = std::vector<fleet_worker_t>((size_t)threads_count);
+
+  for (int i = 0; i < devices_count; i++)
+  {
+    fleet_worker_t* worker = &workers[(size_t)(i % threads_count)];
+    host_device_t* device = new host_device_t();
+
+    (void)snprintf(registration_id, sizeof(registration_id), REGISTRATION_ID_FORMAT, i);
+    host_device_init(
+        device, registration_id, BROKER_HOST, fake_broker_get_port(broker), NULL);
+    devices.push_back(device);
+    worker->devices.push_back(device);
+  }
+
+  for (fleet_worker_t& worker : workers)
+  {
+    worker.start_times_in_us.assign(worker.devices.size(), 0);
+    worker.next_telemetry_times_in_us.assign(worker.devices.size(), 0);
+    worker.is_connected.assign(worker.devices.size(), false);
+    worker.telemetry_failures_count = 0;
+  }
+
+  // Connecting the whole fleet at once, as after an outage of the services.
+  start_time = get_time_in_us();
+
+  for (fleet_worker_t& worker : workers)
+  {
+    worker.thread = std::thread(run_worker, &worker);
+  }
+
+  while (connected_devices_count < (uint32_t)devices_count
+         && get_time_in_us() - start_time < (uint64_t)CONNECT_TIMEOUT_IN_SECS * 1000000)
+  {
+    (void)usleep(WORK_WAIT_IN_MS * 1000);
+  }
+
+  elapsed_time = get_time_in_us() - start_time;
+  resident_memory_after = get_resident_memory();
+
+  printf(
+      "%-28s %u of %d devices in %llu us: %.0f connects/s\n",
+      "connects",
+      connected_devices_count.load(),
+      devices_count,
+      (unsigned long long)elapsed_time,
+      connected_devices_count * 1e6 / elapsed_time);
+
+  // Steady state: telemetry from every device and commands to random ones.
+  fake_broker_get_statistics(broker, &statistics_before);
+  is_sending_telemetry = true;
+  start_time = get_time_in_us();
+
+  for (uint64_t commands_count = 0;
+       get_time_in_us() - start_time < (uint64_t)duration_in_secs * 1000000;)
+  {
+    uint64_t commands_due = (get_time_in_us() - start_time) * (uint64_t)commands_per_sec / 1000000;
+
+    for (; commands_count < commands_due; commands_count++)
+    {
+      (void)snprintf(
+          registration_id,
+          sizeof(registration_id),
+          REGISTRATION_ID_FORMAT,
+          (int)(posix_get_random_number() % (uint32_t)devices_count));
+      (void)fake_broker_send_command(
+          broker, registration_id, COMMAND_NAME, AZ_SPAN_FROM_STR(COMMAND_PAYLOAD));
+    }
+
+    (void)usleep(1000);
+  }
+
+  is_sending_telemetry = false;
+  elapsed_time = get_time_in_us() - start_time;
+  // Letting the responses and acknowledgements in flight arrive.
+  (void)usleep(DRAIN_TIME_IN_MS * 1000);
+  fake_broker_get_statistics(broker, &statistics_after);
+
+  is_stopping = true;
+
+  for (fleet_worker_t& worker : workers)
+  {
+    worker.thread.join();
+    telemetry_failures_count += worker.telemetry_failures_count;
+    latencies.insert(
+        latencies.end(),
+        worker.connect_latencies_in_us.begin(),
+        worker.connect_latencies_in_us.end());
+  }
+
+  for (host_device_t* device : devices)
+  {
+    azure_iot_get_telemetry_delivery_statistics(&device->azure_iot, &telemetry_statistics);
+    telemetry_acked_count += telemetry_statistics.acked_count;
+  }
+
+  print_latencies("connect latency", latencies);
+
+  printf(
+      "%-28s %u messages in %llu us: %.0f messages/s (%llu acked, %u not sent)\n",
+      "telemetry",
+      statistics_after.telemetry_count - statistics_before.telemetry_count,
+      (unsigned long long)elapsed_time,
+      (statistics_after.telemetry_count - statistics_before.telemetry_count) * 1e6
+          / elapsed_time,
+      (unsigned long long)telemetry_acked_count,
+      telemetry_failures_count);
+
+  printf(
+      "%-28s %u sent, %u responded, %u dropped\n",
+      "commands",
+      statistics_after.commands_sent_count - statistics_before.commands_sent_count,
+      statistics_after.command_responses_count - statistics_before.command_responses_count,
+      statistics_after.commands_dropped_count - statistics_before.commands_dropped_count);
+
+  latencies.resize(statistics_after.command_responses_count);
+  latencies.resize(
+      fake_broker_get_command_latencies(broker, latencies.data(), (uint32_t)latencies.size()));
+  print_latencies("command round trip", latencies);
+
+  printf(
+      "%-28s %zu bytes per device structure, %llu bytes per device resident (broker included)\n",
+      "memory",
+      sizeof(host_device_t),
+      (unsigned long long)((resident_memory_after - resident_memory_before) / devices_count));
+
+  fake_broker_stop(broker);
+
+  for (host_device_t* device : devices)
+  {
+    delete device;
+  }
+
+  return 0;
+}
@@ -0,0 +1,272 @@
+// SPDX-License-Identifier: MIT
+
+#include "host_device.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "Azure_IoT_PnP_Template.h"
+
+#define RESULT_OK 0
+#define RESULT_ERROR __LINE__
+
+#define HOST_DEVICE_USER_AGENT "c%2F" AZ_SDK_VERSION_STRING "(host)"
+#define HOST_DEVICE_SAS_TOKEN_LIFETIME_IN_MINUTES 60
+#define HOST_DEVICE_OFFLINE_TELEMETRY_DRAIN_RATE_PER_SEC 5
+
+#define COMMAND_RESPONSE_STATUS_OK 200
+#define COMMAND_RESPONSE_EMPTY_PAYLOAD "{}"
+
+static thread_local host_device_t* selected_device = NULL;
+
+/* --- Trampolines from the context-less callbacks to the selected device --- */
+
+static int mqtt_client_init_function(
+    mqtt_client_config_t* mqtt_client_config,
+    mqtt_client_handle_t* mqtt_client_handle)
+{
+  if (posix_mqtt_client_connect(&selected_device->mqtt_client, mqtt_client_config) != 0)
+  {
+    return RESULT_ERROR;
+  }
+
+  *mqtt_client_handle = &selected_device->mqtt_client;
+
+  return RESULT_OK;
+}
+
+static int mqtt_client_deinit_function(mqtt_client_handle_t mqtt_client_handle)
+{
+  return posix_mqtt_client_disconnect((posix_mqtt_client_t*)mqtt_client_handle);
+}
+
+static int mqtt_client_subscribe_function(
+    mqtt_client_handle_t mqtt_client_handle,
+    az_span topic,
+    mqtt_qos_t qos)
+{
+  return posix_mqtt_client_subscribe((posix_mqtt_client_t*)mqtt_client_handle, topic, qos);
+}
+
+static int mqtt_client_publish_function(
+    mqtt_client_handle_t mqtt_client_handle,
+    mqtt_message_t* mqtt_message)
+{
+  return posix_mqtt_client_publish((posix_mqtt_client_t*)mqtt_client_handle, mqtt_message);
+}
+
+static int mqtt_client_publish_fragments_function(
+    mqtt_client_handle_t mqtt_client_handle,
+    mqtt_message_fragments_t* mqtt_message)
+{
+  return posix_mqtt_client_publish_fragments(
+      (posix_mqtt_client_t*)mqtt_client_handle, mqtt_message);
+}
+
+static int provisioning_cache_load(
+    az_span iot_hub_fqdn,
+    int32_t* iot_hub_fqdn_length,
+    az_span device_id,
+    int32_t* device_id_length)
+{
+  return posix_provisioning_cache_load(
+      selected_device->provisioning_cache_path,
+      iot_hub_fqdn,
+      iot_hub_fqdn_length,
+      device_id,
+      device_id_length);
+}
+
+static int provisioning_cache_save(az_span iot_hub_fqdn, az_span device_id)
+{
+  return posix_provisioning_cache_save(
+      selected_device->provisioning_cache_path, iot_hub_fqdn, device_id);
+}
+
+static int provisioning_cache_clear()
+{
+  return posix_provisioning_cache_clear(selected_device->provisioning_cache_path);
+}
+
+static int offline_telemetry_storage_push(az_span record)
+{
+  return posix_offline_telemetry_storage_push(&selected_device->offline_telemetry_file, record);
+}
+
+static int offline_telemetry_storage_peek(az_span buffer, int32_t* record_length)
+{
+  return posix_offline_telemetry_storage_peek(
+      &selected_device->offline_telemetry_file, buffer, record_length);
+}
+
+static int offline_telemetry_storage_pop()
+{
+  return posix_offline_telemetry_storage_pop(&selected_device->offline_telemetry_file);
+}
+
+/*
+ * See the documentation of `event_post_function_t` in AzureIoT.h for details.
+ * Events are posted from within `posix_mqtt_client_poll`, in the thread of the device.
+ */
+static void post_azure_iot_event(azure_iot_event_t event)
+{
+  (void)event;
+  selected_device->has_event = true;
+}
+
+/*
+ * See the documentation of `event_wait_function_t` in AzureIoT.h for details.
+ */
+static void wait_for_azure_iot_event(uint32_t timeout_in_ms)
+{
+  host_device_t* device = selected_device;
+
+  if (!device->has_event)
+  {
+    if (posix_mqtt_client_is_open(&device->mqtt_client))
+    {
+      (void)posix_mqtt_client_poll(&device->mqtt_client, timeout_in_ms);
+    }
+    else if (timeout_in_ms > 0)
+    {
+      (void)usleep(timeout_in_ms * 1000);
+    }
+  }
+
+  // All the events posted are handled by the same call to `azure_iot_do_work`.
+  device->has_event = false;
+}
+
+/*
+ * @brief    Responds to every command right away; there is nothing to defer it to on the host.
+ */
+static void on_command_request_received(command_request_t command)
+{
+  if (azure_iot_send_command_response(
+          &selected_device->azure_iot,
+          command.request_id,
+          COMMAND_RESPONSE_STATUS_OK,
+          AZ_SPAN_FROM_STR(COMMAND_RESPONSE_EMPTY_PAYLOAD))
+      != 0)
+  {
+    LogError("Failed sending command response.");
+  }
+}
+
+static void on_properties_received(
+    az_span properties,
+    az_iot_hub_client_properties_message_type message_type)
+{
+  (void)properties;
+  (void)message_type;
+}
+
+static void on_properties_update_completed(uint32_t request_id, az_iot_status status_code)
+{
+  (void)request_id;
+  (void)status_code;
+}
+
+/* --- Public functions --- */
+
+void host_device_init(
+    host_device_t* device,
+    const char* registration_id,
+    const char* broker_host,
+    int broker_port,
+    const char* storage_directory)
+{
+  azure_iot_config_t* config = &device->config;
+
+  (void)memset(device, 0, sizeof(host_device_t));
+  (void)snprintf(device->registration_id, sizeof(device->registration_id), "%s", registration_id);
+  posix_mqtt_client_init(&device->mqtt_client, &device->azure_iot, broker_host, broker_port);
+
+  config->user_agent = AZ_SPAN_FROM_STR(HOST_DEVICE_USER_AGENT);
+  config->model_id = azure_pnp_get_model_id();
+  config->use_device_provisioning = true;
+  config->iot_hub_fqdn = AZ_SPAN_EMPTY;
+  config->device_id = AZ_SPAN_EMPTY;
+  config->device_certificate = AZ_SPAN_EMPTY;
+  config->device_certificate_private_key = AZ_SPAN_EMPTY;
+  config->device_key = AZ_SPAN_FROM_STR(HOST_DEVICE_KEY);
+  config->dps_id_scope = AZ_SPAN_FROM_STR(HOST_DEVICE_ID_SCOPE);
+  config->dps_registration_id = az_span_create(
+      (uint8_t*)device->registration_id, (int32_t)strlen(device->registration_id));
+  config->data_buffer = AZ_SPAN_FROM_BUFFER(device->data_buffer);
+  config->sas_token_lifetime_in_minutes = HOST_DEVICE_SAS_TOKEN_LIFETIME_IN_MINUTES;
+  config->sas_token_refresh_mode = sas_token_refresh_mode_make_before_break;
+  config->sas_refresh_held_messages_buffer = AZ_SPAN_FROM_BUFFER(device->held_messages_buffer);
+  config->automatic_reconnect = true;
+  config->get_random_number = posix_get_random_number;
+  config->mqtt_client_interface.mqtt_client_init = mqtt_client_init_function;
+  config->mqtt_client_interface.mqtt_client_deinit = mqtt_client_deinit_function;
+  config->mqtt_client_interface.mqtt_client_subscribe = mqtt_client_subscribe_function;
+  config->mqtt_client_interface.mqtt_client_publish = mqtt_client_publish_function;
+  config->mqtt_client_interface.mqtt_client_publish_fragments
+      = mqtt_client_publish_fragments_function;
+  config->data_manipulation_functions.hmac_sha256_encrypt = posix_hmac_sha256;
+  config->data_manipulation_functions.base64_decode = posix_base64_decode;
+  config->data_manipulation_functions.base64_encode = posix_base64_encode;
+  config->offline_telemetry_buffer = AZ_SPAN_FROM_BUFFER(device->offline_telemetry_buffer);
+  config->offline_telemetry_drain_rate_per_sec = HOST_DEVICE_OFFLINE_TELEMETRY_DRAIN_RATE_PER_SEC;
+  config->reported_properties_buffer = AZ_SPAN_FROM_BUFFER(device->reported_properties_buffer);
+  config->tls_session_buffer = AZ_SPAN_FROM_BUFFER(device->tls_session_buffer);
+  config->event_interface.post = post_azure_iot_event;
+  config->event_interface.wait = wait_for_azure_iot_event;
+  config->telemetry_qos = mqtt_qos_at_least_once;
+  config->telemetry_in_flight_buffer = AZ_SPAN_FROM_BUFFER(device->telemetry_in_flight_buffer);
+  config->telemetry_in_flight_window_size = HOST_DEVICE_TELEMETRY_IN_FLIGHT_WINDOW_SIZE;
+  config->on_properties_update_completed = on_properties_update_completed;
+  config->on_properties_received = on_properties_received;
+  config->on_command_request_received = on_command_request_received;
+
+  if (storage_directory != NULL)
+  {
+    (void)snprintf(
+        device->provisioning_cache_path,
+        sizeof(device->provisioning_cache_path),
+        "%s/%s.provisioning",
+        storage_directory,
+        registration_id);
+    (void)snprintf(
+        device->offline_telemetry_path,
+        sizeof(device->offline_telemetry_path),
+        "%s/%s.telemetry",
+        storage_directory,
+        registration_id);
+    device->offline_telemetry_file.path = device->offline_telemetry_path;
+
+    config->provisioning_cache.load = provisioning_cache_load;
+    config->provisioning_cache.save = provisioning_cache_save;
+    config->provisioning_cache.clear = provisioning_cache_clear;
+    config->offline_telemetry_storage.push = offline_telemetry_storage_push;
+    config->offline_telemetry_storage.peek = offline_telemetry_storage_peek;
+    config->offline_telemetry_storage.pop = offline_telemetry_storage_pop;
+  }
+
+  host_device_select(device);
+  azure_iot_init(&device->azure_iot, config);
+}
+
+void host_device_select(host_device_t* device) { selected_device = device; }
+
+host_device_t* host_device_get_selected() { return selected_device; }
+
+void host_device_do_work(host_device_t* device, uint32_t max_wait_in_ms)
+{
+  host_device_select(device);
+  azure_iot_do_work(&device->azure_iot);
+
+  // azure_iot_wait_for_work does not wait when there is work pending or nothing to wait for, but
+  // on the host the wait is what reads the packets received, unlike esp-mqtt and its own task.
+  if (max_wait_in_ms == 0)
+  {
+    wait_for_azure_iot_event(0);
+  }
+  else
+  {
+    azure_iot_wait_for_work(&device->azure_iot, max_wait_in_ms);
+  }
+}
@@ -0,0 +1,107 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * host_device.h bundles everything a device of the host build needs (Azure IoT client, its
+ * configuration and buffers, POSIX MQTT client and files) into a `host_device_t`, configured like
+ * RGBLEDSOFTWARE.ino configures the ESP32. Several devices can live in the same process.
+ *
+ * The callbacks of `azure_iot_config_t` do not take a context, so the functions of this module act
+ * on the device last selected in the calling thread (see `host_device_select`).
+ */
+
+#ifndef HOST_DEVICE_H
+#define HOST_DEVICE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "AzureIoT.h"
+#include "posix_mqtt_client.h"
+#include "posix_platform.h"
+
+// Same sizes as the buffers of RGBLEDSOFTWARE.ino.
+#define HOST_DEVICE_DATA_BUFFER_SIZE 1800
+#define HOST_DEVICE_HELD_MESSAGES_BUFFER_SIZE 512
+#define HOST_DEVICE_TELEMETRY_IN_FLIGHT_BUFFER_SIZE 2048
+#define HOST_DEVICE_TELEMETRY_IN_FLIGHT_WINDOW_SIZE 4
+#define HOST_DEVICE_OFFLINE_TELEMETRY_BUFFER_SIZE 2048
+#define HOST_DEVICE_REPORTED_PROPERTIES_BUFFER_SIZE 1024
+// RGBLEDSOFTWARE.ino has none, esp-mqtt not exporting TLS sessions; the host saves those of the
+// simulated TLS handshake.
+#define HOST_DEVICE_TLS_SESSION_BUFFER_SIZE MQTT_PACKET_TLS_SESSION_MAX_SIZE
+
+#define HOST_DEVICE_ID_SCOPE "0ne00000000"
+// Not checked by the fake broker, but must be valid Base64 for generating SAS tokens.
+#define HOST_DEVICE_KEY "aG9zdC1kZXZpY2Uta2V5LTAxMjM0NTY3ODlhYmNkZWY="
+#define HOST_DEVICE_REGISTRATION_ID_SIZE 64
+#define HOST_DEVICE_PATH_SIZE 256
+
+/*
+ * @brief    A device of the host build.
+ * @remark   Large (tens of KB), so better not kept on the stack.
+ */
+typedef struct host_device_t_struct
+{
+  azure_iot_config_t config;
+  azure_iot_t azure_iot;
+  posix_mqtt_client_t mqtt_client;
+  bool has_event;
+  char registration_id[HOST_DEVICE_REGISTRATION_ID_SIZE];
+  char provisioning_cache_path[HOST_DEVICE_PATH_SIZE];
+  char offline_telemetry_path[HOST_DEVICE_PATH_SIZE];
+  posix_offline_telemetry_file_t offline_telemetry_file;
+  uint8_t data_buffer[HOST_DEVICE_DATA_BUFFER_SIZE];
+  uint8_t held_messages_buffer[HOST_DEVICE_HELD_MESSAGES_BUFFER_SIZE];
+  uint8_t telemetry_in_flight_buffer[HOST_DEVICE_TELEMETRY_IN_FLIGHT_BUFFER_SIZE];
+  uint8_t offline_telemetry_buffer[HOST_DEVICE_OFFLINE_TELEMETRY_BUFFER_SIZE];
+  uint8_t reported_properties_buffer[HOST_DEVICE_REPORTED_PROPERTIES_BUFFER_SIZE];
+  uint8_t tls_session_buffer[HOST_DEVICE_TLS_SESSION_BUFFER_SIZE];
+} host_device_t;
+
+/*
+ * @brief        Initializes a device and its Azure IoT client (not started), and selects it.
+ * @remark       The configuration is that of RGBLEDSOFTWARE.ino, with device-provisioning and SAS
+ *               token authentication, plus a buffer for resuming TLS sessions; it can be changed in
+ *               `device->config` before starting the Azure IoT client. Commands are responded right
+ *               away with an empty payload, and properties updates are ignored, unless other
+ *               callbacks are set in the config.
+ *
+ * @param[in]    device               The device to initialize.
+ * @param[in]    registration_id      DPS registration id, also the device id assigned by the fake
+ *                                    broker.
+ * @param[in]    broker_host          Host of the (fake) broker serving both DPS and the Azure IoT
+ *                                    Hub.
+ * @param[in]    broker_port          Port of the (fake) broker.
+ * @param[in]    storage_directory    Directory for the provisioning cache and offline telemetry
+ *                                    files of the device, or NULL for none.
+ */
+void host_device_init(
+    host_device_t* device,
+    const char* registration_id,
+    const char* broker_host,
+    int broker_port,
+    const char* storage_directory);
+
+/*
+ * @brief        Makes `device` the one the callbacks of its Azure IoT client act on, in the calling
+ *               thread.
+ * @remark       Must be called before calling any `azure_iot_*` function with a different device
+ *               than last time in the same thread. `host_device_do_work` does it.
+ */
+void host_device_select(host_device_t* device);
+
+/*
+ * @brief        Gets the device last selected in the calling thread.
+ */
+host_device_t* host_device_get_selected();
+
+/*
+ * @brief        Selects the device, then calls `azure_iot_do_work` and `azure_iot_wait_for_work`.
+ *
+ * @param[in]    device            The device.
+ * @param[in]    max_wait_in_ms    Maximum time to wait for work; zero handles whatever is pending
+ *                                 without blocking.
+ */
+void host_device_do_work(host_device_t* device, uint32_t max_wait_in_ms);
+
+#endif // HOST_DEVICE_H
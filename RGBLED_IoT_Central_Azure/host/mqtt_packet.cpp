@@ -0,0 +1,557 @@
+// SPDX-License-Identifier: MIT
+
+#include "mqtt_packet.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#define MQTT_PROTOCOL_NAME "MQTT"
+#define MQTT_PROTOCOL_LEVEL 4
+#define MQTT_CONNECT_FLAG_USERNAME 0x80
+#define MQTT_CONNECT_FLAG_PASSWORD 0x40
+#define MQTT_CONNECT_FLAG_CLEAN_SESSION 0x02
+#define MQTT_SUBSCRIBE_FLAGS 0x02
+#define MQTT_PUBLISH_QOS_SHIFT 1
+#define MQTT_PUBLISH_QOS_MASK 0x03
+#define MQTT_REMAINING_LENGTH_MAX_SIZE 4
+#define MQTT_STRING_LENGTH_SIZE 2
+#define MQTT_PACKET_ID_SIZE 2
+// Protocol level, connect flags and keep alive, after the protocol name.
+#define MQTT_CONNECT_FLAGS_AND_KEEP_ALIVE_SIZE 4
+
+/*
+ * @brief    Cursor over a buffer being encoded into or decoded from.
+ * @remark   Once `is_failed` is set (out of space or malformed input) all further operations are
+ *           no-ops, so callers only check it at the end.
+ */
+typedef struct mqtt_cursor_t_struct
+{
+  uint8_t* ptr;
+  int32_t size;
+  int32_t position;
+  bool is_failed;
+} mqtt_cursor_t;
+
+static mqtt_cursor_t cursor_create(az_span span)
+{
+  mqtt_cursor_t cursor = { az_span_ptr(span), az_span_size(span), 0, false };
+  return cursor;
+}
+
+static void put_u8(mqtt_cursor_t* cursor, uint8_t value)
+{
+  if (cursor->is_failed || cursor->position >= cursor->size)
+  {
+    cursor->is_failed = true;
+    return;
+  }
+
+  cursor->ptr[cursor->position++] = value;
+}
+
+static void put_u16(mqtt_cursor_t* cursor, uint16_t value)
+{
+  put_u8(cursor, (uint8_t)(value >> 8));
+  put_u8(cursor, (uint8_t)value);
+}
+
+static void put_bytes(mqtt_cursor_t* cursor, az_span bytes)
+{
+  if (cursor->is_failed || (cursor->size - cursor->position) < az_span_size(bytes))
+  {
+    cursor->is_failed = true;
+    return;
+  }
+
+  if (az_span_size(bytes) > 0)
+  {
+    (void)memcpy(cursor->ptr + cursor->position, az_span_ptr(bytes), az_span_size(bytes));
+  }
+
+  cursor->position += az_span_size(bytes);
+}
+
+static void put_string(mqtt_cursor_t* cursor, az_span string)
+{
+  put_u16(cursor, (uint16_t)az_span_size(string));
+  put_bytes(cursor, string);
+}
+
+static void put_fixed_header(mqtt_cursor_t* cursor, uint8_t type, uint8_t flags, int32_t length)
+{
+  put_u8(cursor, (uint8_t)((type << 4) | flags));
+
+  do
+  {
+    uint8_t digit = (uint8_t)(length % 128);
+    length /= 128;
+    put_u8(cursor, length > 0 ? (uint8_t)(digit | 0x80) : digit);
+  } while (length > 0);
+}
+
+static uint8_t get_u8(mqtt_cursor_t* cursor)
+{
+  if (cursor->is_failed || cursor->position >= cursor->size)
+  {
+    cursor->is_failed = true;
+    return 0;
+  }
+
+  return cursor->ptr[cursor->position++];
+}
+
+static uint16_t get_u16(mqtt_cursor_t* cursor)
+{
+  uint16_t value = (uint16_t)(get_u8(cursor) << 8);
+  return (uint16_t)(value | get_u8(cursor));
+}
+
+static az_span get_bytes(mqtt_cursor_t* cursor, int32_t size)
+{
+  az_span bytes;
+
+  if (cursor->is_failed || size < 0 || (cursor->size - cursor->position) < size)
+  {
+    cursor->is_failed = true;
+    return AZ_SPAN_EMPTY;
+  }
+
+  bytes = size == 0 ? AZ_SPAN_EMPTY : az_span_create(cursor->ptr + cursor->position, size);
+  cursor->position += size;
+
+  return bytes;
+}
+
+static az_span get_string(mqtt_cursor_t* cursor) { return get_bytes(cursor, get_u16(cursor)); }
+
+static int32_t get_encoded_size(mqtt_cursor_t* cursor)
+{
+  return cursor->is_failed ? 0 : cursor->position;
+}
+
+static int read_fully(int socket_fd, uint8_t* buffer, size_t size)
+{
+  while (size > 0)
+  {
+    ssize_t received = recv(socket_fd, buffer, size, 0);
+
+    if (received < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    else if (received <= 0)
+    {
+      return 1;
+    }
+
+    buffer += received;
+    size -= (size_t)received;
+  }
+
+  return 0;
+}
+
+az_span mqtt_packet_string(az_span string)
+{
+  if (az_span_size(string) == 0)
+  {
+    return AZ_SPAN_EMPTY;
+  }
+
+  return az_span_create(
+      az_span_ptr(string),
+      (int32_t)strnlen((const char*)az_span_ptr(string), (size_t)az_span_size(string)));
+}
+
+int mqtt_packet_read(int socket_fd, az_span buffer, mqtt_packet_t* packet)
+{
+  uint8_t header;
+  uint8_t digit;
+  int32_t length = 0;
+  int32_t multiplier = 1;
+
+  if (read_fully(socket_fd, &header, 1) != 0)
+  {
+    return 1;
+  }
+
+  for (int i = 0; i < MQTT_REMAINING_LENGTH_MAX_SIZE; i++)
+  {
+    if (read_fully(socket_fd, &digit, 1) != 0)
+    {
+      return 1;
+    }
+
+    length += (digit & 0x7F) * multiplier;
+    multiplier *= 128;
+
+    if ((digit & 0x80) == 0)
+    {
+      break;
+    }
+    else if (i == (MQTT_REMAINING_LENGTH_MAX_SIZE - 1))
+    {
+      return 1;
+    }
+  }
+
+  if (length > az_span_size(buffer)
+      || (length > 0 && read_fully(socket_fd, az_span_ptr(buffer), (size_t)length) != 0))
+  {
+    return 1;
+  }
+
+  packet->type = (uint8_t)(header >> 4);
+  packet->flags = (uint8_t)(header & 0x0F);
+  packet->body = az_span_slice(buffer, 0, length);
+
+  return 0;
+}
+
+int mqtt_packet_write(int socket_fd, az_span packet)
+{
+  uint8_t* ptr = az_span_ptr(packet);
+  size_t size = (size_t)az_span_size(packet);
+
+  while (size > 0)
+  {
+    ssize_t sent = send(socket_fd, ptr, size, MSG_NOSIGNAL);
+
+    if (sent < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    else if (sent <= 0)
+    {
+      return 1;
+    }
+
+    ptr += sent;
+    size -= (size_t)sent;
+  }
+
+  return 0;
+}
+
+int32_t mqtt_packet_encode_connect(
+    az_span buffer,
+    az_span client_id,
+    az_span username,
+    az_span password,
+    uint16_t keep_alive_in_secs)
+{
+  mqtt_cursor_t cursor = cursor_create(buffer);
+  uint8_t flags = MQTT_CONNECT_FLAG_CLEAN_SESSION;
+  int32_t length;
+
+  client_id = mqtt_packet_string(client_id);
+  username = mqtt_packet_string(username);
+  password = mqtt_packet_string(password);
+
+  length = MQTT_STRING_LENGTH_SIZE + (int32_t)(sizeof(MQTT_PROTOCOL_NAME) - 1)
+      + MQTT_CONNECT_FLAGS_AND_KEEP_ALIVE_SIZE + MQTT_STRING_LENGTH_SIZE + az_span_size(client_id);
+
+  if (az_span_size(username) > 0)
+  {
+    flags |= MQTT_CONNECT_FLAG_USERNAME;
+    length += MQTT_STRING_LENGTH_SIZE + az_span_size(username);
+  }
+
+  if (az_span_size(password) > 0)
+  {
+    flags |= MQTT_CONNECT_FLAG_PASSWORD;
+    length += MQTT_STRING_LENGTH_SIZE + az_span_size(password);
+  }
+
+  put_fixed_header(&cursor, MQTT_PACKET_TYPE_CONNECT, 0, length);
+  put_string(&cursor, AZ_SPAN_FROM_STR(MQTT_PROTOCOL_NAME));
+  put_u8(&cursor, MQTT_PROTOCOL_LEVEL);
+  put_u8(&cursor, flags);
+  put_u16(&cursor, keep_alive_in_secs);
+  put_string(&cursor, client_id);
+
+  if (az_span_size(username) > 0)
+  {
+    put_string(&cursor, username);
+  }
+
+  if (az_span_size(password) > 0)
+  {
+    put_string(&cursor, password);
+  }
+
+  return get_encoded_size(&cursor);
+}
+
+int32_t mqtt_packet_encode_connack(az_span buffer, uint8_t return_code)
+{
+  mqtt_cursor_t cursor = cursor_create(buffer);
+
+  put_fixed_header(&cursor, MQTT_PACKET_TYPE_CONNACK, 0, 2);
+  put_u8(&cursor, 0); // No session present, sessions are always clean.
+  put_u8(&cursor, return_code);
+
+  return get_encoded_size(&cursor);
+}
+
+int32_t mqtt_packet_encode_publish(
+    az_span buffer,
+    az_span topic,
+    az_span payload,
+    uint8_t qos,
+    uint16_t packet_id)
+{
+  mqtt_cursor_t cursor = cursor_create(buffer);
+
+  topic = mqtt_packet_string(topic);
+
+  put_fixed_header(
+      &cursor,
+      MQTT_PACKET_TYPE_PUBLISH,
+      (uint8_t)(qos << MQTT_PUBLISH_QOS_SHIFT),
+      MQTT_STRING_LENGTH_SIZE + az_span_size(topic) + (qos > 0 ? MQTT_PACKET_ID_SIZE : 0)
+          + az_span_size(payload));
+  put_string(&cursor, topic);
+
+  if (qos > 0)
+  {
+    put_u16(&cursor, packet_id);
+  }
+
+  put_bytes(&cursor, payload);
+
+  return get_encoded_size(&cursor);
+}
+
+int32_t mqtt_packet_encode_publish_fragments(
+    az_span buffer,
+    const az_span* topic_fragments,
+    int32_t topic_fragments_count,
+    const az_span* payload_fragments,
+    int32_t payload_fragments_count,
+    uint8_t qos,
+    uint16_t packet_id)
+{
+  mqtt_cursor_t cursor = cursor_create(buffer);
+  int32_t topic_size = 0;
+  int32_t payload_size = 0;
+  int32_t i;
+
+  for (i = 0; i < topic_fragments_count; i++)
+  {
+    topic_size += az_span_size(topic_fragments[i]);
+  }
+
+  for (i = 0; i < payload_fragments_count; i++)
+  {
+    payload_size += az_span_size(payload_fragments[i]);
+  }
+
+  if (topic_size > UINT16_MAX)
+  {
+    return 0;
+  }
+
+  put_fixed_header(
+      &cursor,
+      MQTT_PACKET_TYPE_PUBLISH,
+      (uint8_t)(qos << MQTT_PUBLISH_QOS_SHIFT),
+      MQTT_STRING_LENGTH_SIZE + topic_size + (qos > 0 ? MQTT_PACKET_ID_SIZE : 0) + payload_size);
+  put_u16(&cursor, (uint16_t)topic_size);
+
+  for (i = 0; i < topic_fragments_count; i++)
+  {
+    put_bytes(&cursor, topic_fragments[i]);
+  }
+
+  if (qos > 0)
+  {
+    put_u16(&cursor, packet_id);
+  }
+
+  for (i = 0; i < payload_fragments_count; i++)
+  {
+    put_bytes(&cursor, payload_fragments[i]);
+  }
+
+  return get_encoded_size(&cursor);
+}
+
+int32_t mqtt_packet_encode_puback(az_span buffer, uint16_t packet_id)
+{
+  mqtt_cursor_t cursor = cursor_create(buffer);
+
+  put_fixed_header(&cursor, MQTT_PACKET_TYPE_PUBACK, 0, MQTT_PACKET_ID_SIZE);
+  put_u16(&cursor, packet_id);
+
+  return get_encoded_size(&cursor);
+}
+
+int32_t mqtt_packet_encode_subscribe(
+    az_span buffer,
+    uint16_t packet_id,
+    az_span topic,
+    uint8_t qos)
+{
+  mqtt_cursor_t cursor = cursor_create(buffer);
+
+  topic = mqtt_packet_string(topic);
+
+  put_fixed_header(
+      &cursor,
+      MQTT_PACKET_TYPE_SUBSCRIBE,
+      MQTT_SUBSCRIBE_FLAGS,
+      MQTT_PACKET_ID_SIZE + MQTT_STRING_LENGTH_SIZE + az_span_size(topic) + 1);
+  put_u16(&cursor, packet_id);
+  put_string(&cursor, topic);
+  put_u8(&cursor, qos);
+
+  return get_encoded_size(&cursor);
+}
+
+int32_t mqtt_packet_encode_suback(az_span buffer, uint16_t packet_id, uint8_t return_code)
+{
+  mqtt_cursor_t cursor = cursor_create(buffer);
+
+  put_fixed_header(&cursor, MQTT_PACKET_TYPE_SUBACK, 0, MQTT_PACKET_ID_SIZE + 1);
+  put_u16(&cursor, packet_id);
+  put_u8(&cursor, return_code);
+
+  return get_encoded_size(&cursor);
+}
+
+int32_t mqtt_packet_encode_empty(az_span buffer, uint8_t type)
+{
+  mqtt_cursor_t cursor = cursor_create(buffer);
+
+  put_fixed_header(&cursor, type, 0, 0);
+
+  return get_encoded_size(&cursor);
+}
+
+int32_t mqtt_packet_encode_tls_session(az_span buffer, bool is_resumed, az_span session)
+{
+  mqtt_cursor_t cursor = cursor_create(buffer);
+
+  if (az_span_size(session) > MQTT_PACKET_TLS_SESSION_MAX_SIZE)
+  {
+    return 0;
+  }
+
+  put_fixed_header(
+      &cursor,
+      MQTT_PACKET_TYPE_TLS_SESSION,
+      0,
+      1 + MQTT_STRING_LENGTH_SIZE + az_span_size(session));
+  put_u8(&cursor, is_resumed ? 1 : 0);
+  put_string(&cursor, session);
+
+  return get_encoded_size(&cursor);
+}
+
+int mqtt_packet_decode_connect(
+    const mqtt_packet_t* packet,
+    az_span* client_id,
+    az_span* username,
+    az_span* password)
+{
+  mqtt_cursor_t cursor = cursor_create(packet->body);
+  uint8_t flags;
+
+  if (packet->type != MQTT_PACKET_TYPE_CONNECT
+      || !az_span_is_content_equal(get_string(&cursor), AZ_SPAN_FROM_STR(MQTT_PROTOCOL_NAME))
+      || get_u8(&cursor) != MQTT_PROTOCOL_LEVEL)
+  {
+    return 1;
+  }
+
+  flags = get_u8(&cursor);
+  (void)get_u16(&cursor); // Keep alive, not enforced by the fake broker.
+  *client_id = get_string(&cursor);
+  *username = (flags & MQTT_CONNECT_FLAG_USERNAME) ? get_string(&cursor) : AZ_SPAN_EMPTY;
+  *password = (flags & MQTT_CONNECT_FLAG_PASSWORD) ? get_string(&cursor) : AZ_SPAN_EMPTY;
+
+  return cursor.is_failed ? 1 : 0;
+}
+
+int mqtt_packet_decode_publish(const mqtt_packet_t* packet, mqtt_publish_t* publish)
+{
+  mqtt_cursor_t cursor = cursor_create(packet->body);
+
+  if (packet->type != MQTT_PACKET_TYPE_PUBLISH)
+  {
+    return 1;
+  }
+
+  publish->qos = (uint8_t)((packet->flags >> MQTT_PUBLISH_QOS_SHIFT) & MQTT_PUBLISH_QOS_MASK);
+  publish->topic = get_string(&cursor);
+  publish->packet_id = publish->qos > 0 ? get_u16(&cursor) : 0;
+  publish->payload = get_bytes(&cursor, cursor.size - cursor.position);
+
+  return cursor.is_failed ? 1 : 0;
+}
+
+int mqtt_packet_decode_subscribe(const mqtt_packet_t* packet, uint16_t* packet_id, az_span* topic)
+{
+  mqtt_cursor_t cursor = cursor_create(packet->body);
+
+  if (packet->type != MQTT_PACKET_TYPE_SUBSCRIBE)
+  {
+    return 1;
+  }
+
+  *packet_id = get_u16(&cursor);
+  *topic = get_string(&cursor);
+  (void)get_u8(&cursor); // Requested QoS, always granted.
+
+  return cursor.is_failed ? 1 : 0;
+}
+
+int mqtt_packet_decode_tls_session(const mqtt_packet_t* packet, bool* is_resumed, az_span* session)
+{
+  mqtt_cursor_t cursor = cursor_create(packet->body);
+
+  if (packet->type != MQTT_PACKET_TYPE_TLS_SESSION)
+  {
+    return 1;
+  }
+
+  *is_resumed = get_u8(&cursor) != 0;
+  *session = get_string(&cursor);
+
+  return (cursor.is_failed || az_span_size(*session) > MQTT_PACKET_TLS_SESSION_MAX_SIZE) ? 1 : 0;
+}
+
+int mqtt_packet_decode_return_code(const mqtt_packet_t* packet, uint8_t* return_code)
+{
+  mqtt_cursor_t cursor = cursor_create(packet->body);
+
+  // CONNACK: session present flag, then the return code. SUBACK: packet id, then the return code.
+  if (packet->type == MQTT_PACKET_TYPE_CONNACK)
+  {
+    (void)get_u8(&cursor);
+  }
+  else if (packet->type == MQTT_PACKET_TYPE_SUBACK)
+  {
+    (void)get_u16(&cursor);
+  }
+  else
+  {
+    return 1;
+  }
+
+  *return_code = get_u8(&cursor);
+
+  return cursor.is_failed ? 1 : 0;
+}
+
+int mqtt_packet_decode_packet_id(const mqtt_packet_t* packet, uint16_t* packet_id)
+{
+  mqtt_cursor_t cursor = cursor_create(packet->body);
+
+  *packet_id = get_u16(&cursor);
+
+  return cursor.is_failed ? 1 : 0;
+}
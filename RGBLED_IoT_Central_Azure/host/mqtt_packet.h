@@ -0,0 +1,186 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * mqtt_packet.h defines the minimal MQTT 3.1.1 encoding and decoding shared by the POSIX MQTT
+ * client and the fake broker of the host build. Only what Azure IoT uses is supported: a single
+ * topic per SUBSCRIBE, QoS 0 and 1, no retained messages, no wills.
+ */
+
+#ifndef MQTT_PACKET_H
+#define MQTT_PACKET_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <az_core.h>
+
+#define MQTT_PACKET_TYPE_CONNECT 1
+#define MQTT_PACKET_TYPE_CONNACK 2
+#define MQTT_PACKET_TYPE_PUBLISH 3
+#define MQTT_PACKET_TYPE_PUBACK 4
+#define MQTT_PACKET_TYPE_SUBSCRIBE 8
+#define MQTT_PACKET_TYPE_SUBACK 9
+#define MQTT_PACKET_TYPE_PINGREQ 12
+#define MQTT_PACKET_TYPE_PINGRESP 13
+#define MQTT_PACKET_TYPE_DISCONNECT 14
+// Not MQTT (type 15 is reserved in 3.1.1): stands in for the TLS handshake, see
+// `mqtt_packet_encode_tls_session`.
+#define MQTT_PACKET_TYPE_TLS_SESSION 15
+
+#define MQTT_CONNACK_ACCEPTED 0
+#define MQTT_CONNACK_REFUSED_NOT_AUTHORIZED 5
+
+#define MQTT_SUBACK_FAILURE 0x80
+
+// Large enough for the biggest DPS response or properties document exchanged.
+#define MQTT_PACKET_MAX_SIZE 8192
+
+// Largest TLS session (ticket) exchanged by `mqtt_packet_encode_tls_session`.
+#define MQTT_PACKET_TLS_SESSION_MAX_SIZE 64
+
+/*
+ * @brief    A packet read from a socket.
+ * @remark   `body` is everything after the fixed header (variable header and payload), pointing
+ *           into the buffer given to `mqtt_packet_read`.
+ */
+typedef struct mqtt_packet_t_struct
+{
+  uint8_t type;
+  uint8_t flags;
+  az_span body;
+} mqtt_packet_t;
+
+/*
+ * @brief    Contents of a PUBLISH packet.
+ * @remark   `packet_id` is zero for QoS 0.
+ */
+typedef struct mqtt_publish_t_struct
+{
+  az_span topic;
+  az_span payload;
+  uint8_t qos;
+  uint16_t packet_id;
+} mqtt_publish_t;
+
+/*
+ * @brief        Reads one full packet from a socket, blocking until it is complete.
+ *
+ * @param[in]    socket_fd    The connected socket.
+ * @param[in]    buffer       Buffer where to read the packet body into.
+ * @param[out]   packet       The packet read.
+ *
+ * @return       int          0 on success, non-zero if the connection is closed, the packet is
+ *                            malformed or does not fit in `buffer`.
+ */
+int mqtt_packet_read(int socket_fd, az_span buffer, mqtt_packet_t* packet);
+
+/*
+ * @brief        Writes an encoded packet to a socket, blocking until it is fully sent.
+ *
+ * @return       int          0 on success, non-zero if any failure occurs.
+ */
+int mqtt_packet_write(int socket_fd, az_span packet);
+
+/*
+ * @brief        Encoders of each packet type.
+ * @remark       Strings are taken up to their first null-terminator (if any), as the Azure IoT
+ *               client hands them over.
+ *
+ * @return       int32_t      Size of the packet encoded into `buffer`, or zero if it does not fit.
+ */
+int32_t mqtt_packet_encode_connect(
+    az_span buffer,
+    az_span client_id,
+    az_span username,
+    az_span password,
+    uint16_t keep_alive_in_secs);
+
+int32_t mqtt_packet_encode_connack(az_span buffer, uint8_t return_code);
+
+int32_t mqtt_packet_encode_publish(
+    az_span buffer,
+    az_span topic,
+    az_span payload,
+    uint8_t qos,
+    uint16_t packet_id);
+
+/*
+ * @brief        Encodes a PUBLISH whose topic and payload are the concatenation of fragments,
+ *               copying each fragment straight into `buffer`.
+ * @remark       The topic fragments must not include a null-terminator.
+ *
+ * @return       int32_t      Size of the packet encoded into `buffer`, or zero if it does not fit.
+ */
+int32_t mqtt_packet_encode_publish_fragments(
+    az_span buffer,
+    const az_span* topic_fragments,
+    int32_t topic_fragments_count,
+    const az_span* payload_fragments,
+    int32_t payload_fragments_count,
+    uint8_t qos,
+    uint16_t packet_id);
+
+int32_t mqtt_packet_encode_puback(az_span buffer, uint16_t packet_id);
+
+int32_t mqtt_packet_encode_subscribe(
+    az_span buffer,
+    uint16_t packet_id,
+    az_span topic,
+    uint8_t qos);
+
+int32_t mqtt_packet_encode_suback(az_span buffer, uint16_t packet_id, uint8_t return_code);
+
+/*
+ * @brief        Encodes a packet with no variable header nor payload (PINGREQ, PINGRESP,
+ *               DISCONNECT).
+ */
+int32_t mqtt_packet_encode_empty(az_span buffer, uint8_t type);
+
+/*
+ * @brief        Encodes the simulated TLS handshake the host build performs over plain TCP, before
+ *               the CONNECT.
+ * @remark       The client sends the TLS session (ticket) it offers, empty for none; the broker
+ *               answers whether it resumed that session and, if not, the new session to save.
+ *
+ * @param[in]    buffer        Buffer to encode into.
+ * @param[in]    is_resumed    From the broker, true if the session offered was resumed; false from
+ *                             the client.
+ * @param[in]    session       The TLS session offered or issued, or AZ_SPAN_EMPTY.
+ *
+ * @return       int32_t       Size of the packet encoded into `buffer`, or zero if it does not fit.
+ */
+int32_t mqtt_packet_encode_tls_session(az_span buffer, bool is_resumed, az_span session);
+
+/*
+ * @brief        Decoders of the packets with contents needed by the client or the broker.
+ *
+ * @return       int          0 on success, non-zero if the packet is malformed.
+ */
+int mqtt_packet_decode_connect(
+    const mqtt_packet_t* packet,
+    az_span* client_id,
+    az_span* username,
+    az_span* password);
+
+int mqtt_packet_decode_publish(const mqtt_packet_t* packet, mqtt_publish_t* publish);
+
+int mqtt_packet_decode_subscribe(const mqtt_packet_t* packet, uint16_t* packet_id, az_span* topic);
+
+int mqtt_packet_decode_tls_session(const mqtt_packet_t* packet, bool* is_resumed, az_span* session);
+
+/*
+ * @brief        Decodes the return code of a CONNACK or SUBACK.
+ */
+int mqtt_packet_decode_return_code(const mqtt_packet_t* packet, uint8_t* return_code);
+
+/*
+ * @brief        Decodes the packet id of a PUBACK, SUBACK or SUBSCRIBE.
+ */
+int mqtt_packet_decode_packet_id(const mqtt_packet_t* packet, uint16_t* packet_id);
+
+/*
+ * @brief        Gets a string handed over by the Azure IoT client without its null-terminator.
+ */
+az_span mqtt_packet_string(az_span string);
+
+#endif // MQTT_PACKET_H
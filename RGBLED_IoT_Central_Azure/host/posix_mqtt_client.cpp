@@ -0,0 +1,477 @@
+// SPDX-License-Identifier: MIT
+
+#include "posix_mqtt_client.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define RESULT_OK 0
+#define RESULT_ERROR __LINE__
+
+// Keep-alive is disabled; the fake broker does not expect PINGREQs.
+#define MQTT_KEEP_ALIVE_IN_SECS 0
+#define MQTT_PORT_STRING_SIZE 8
+#define MQTT_HOST_MAX_SIZE 256
+
+static uint16_t get_next_packet_id(posix_mqtt_client_t* client)
+{
+  client->last_packet_id++;
+
+  // Zero is not a valid packet id.
+  if (client->last_packet_id == 0)
+  {
+    client->last_packet_id = 1;
+  }
+
+  return client->last_packet_id;
+}
+
+static void close_socket(posix_mqtt_client_t* client)
+{
+  if (client->socket_fd != POSIX_MQTT_CLIENT_NO_SOCKET)
+  {
+    (void)close(client->socket_fd);
+    client->socket_fd = POSIX_MQTT_CLIENT_NO_SOCKET;
+  }
+}
+
+static int open_socket(posix_mqtt_client_t* client, const char* host, int port)
+{
+  struct addrinfo hints;
+  struct addrinfo* addresses;
+  char port_string[MQTT_PORT_STRING_SIZE];
+  int no_delay = 1;
+
+  (void)memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  (void)snprintf(port_string, sizeof(port_string), "%d", port);
+
+  if (getaddrinfo(host, port_string, &hints, &addresses) != 0)
+  {
+    LogError("Failed resolving '%s'.", host);
+    return RESULT_ERROR;
+  }
+
+  for (struct addrinfo* address = addresses; address != NULL; address = address->ai_next)
+  {
+    client->socket_fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+
+    if (client->socket_fd == POSIX_MQTT_CLIENT_NO_SOCKET)
+    {
+      continue;
+    }
+
+    if (connect(client->socket_fd, address->ai_addr, address->ai_addrlen) == 0)
+    {
+      break;
+    }
+
+    close_socket(client);
+  }
+
+  freeaddrinfo(addresses);
+
+  if (client->socket_fd == POSIX_MQTT_CLIENT_NO_SOCKET)
+  {
+    LogError("Failed connecting to %s:%d (errno=%d).", host, port, errno);
+    return RESULT_ERROR;
+  }
+
+  // Packets are small and latency is measured, so they are not held back by Nagle's algorithm.
+  (void)setsockopt(client->socket_fd, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+
+  return RESULT_OK;
+}
+
+/*
+ * @brief    Closes the connection after the broker closed it or sent something unexpected.
+ */
+static void handle_connection_lost(posix_mqtt_client_t* client)
+{
+  LogInfo("MQTT client disconnected.");
+
+  close_socket(client);
+
+  if (azure_iot_mqtt_client_disconnected(client->azure_iot) != 0)
+  {
+    LogError("azure_iot_mqtt_client_disconnected failed.");
+  }
+}
+
+static int handle_packet(posix_mqtt_client_t* client, mqtt_packet_t* packet)
+{
+  uint8_t return_code = 0;
+  uint16_t packet_id;
+  mqtt_publish_t publish;
+  mqtt_message_t mqtt_message;
+  az_span session;
+  int32_t size;
+
+  switch (packet->type)
+  {
+    case MQTT_PACKET_TYPE_CONNACK:
+      if (mqtt_packet_decode_return_code(packet, &return_code) != 0
+          || return_code != MQTT_CONNACK_ACCEPTED)
+      {
+        LogError("MQTT connection refused (connect_return_code=%d).", return_code);
+
+        if (return_code != MQTT_CONNACK_ACCEPTED
+            && azure_iot_mqtt_client_connection_refused(
+                   client->azure_iot, (mqtt_connect_return_code_t)return_code)
+                != 0)
+        {
+          LogError("azure_iot_mqtt_client_connection_refused failed.");
+        }
+
+        return RESULT_ERROR;
+      }
+
+      if (!client->is_tls_established)
+      {
+        LogError("MQTT CONNACK received before the TLS handshake completed.");
+        return RESULT_ERROR;
+      }
+
+      LogInfo("MQTT client connected (TLS session resumed=%d).", client->is_tls_session_resumed);
+
+      if (azure_iot_mqtt_client_tls_session_established(
+              client->azure_iot, client->tls_session, client->is_tls_session_resumed)
+          != 0)
+      {
+        LogError("azure_iot_mqtt_client_tls_session_established failed.");
+      }
+
+      if (azure_iot_mqtt_client_connected(client->azure_iot) != 0)
+      {
+        LogError("azure_iot_mqtt_client_connected failed.");
+      }
+
+      break;
+    case MQTT_PACKET_TYPE_TLS_SESSION:
+      if (client->is_tls_established
+          || mqtt_packet_decode_tls_session(packet, &client->is_tls_session_resumed, &session) != 0)
+      {
+        return RESULT_ERROR;
+      }
+
+      // A resumed session stays the one saved by the Azure IoT client; a new one is saved.
+      (void)az_span_copy(AZ_SPAN_FROM_BUFFER(client->tls_session_buffer), session);
+      client->tls_session = az_span_slice(
+          AZ_SPAN_FROM_BUFFER(client->tls_session_buffer), 0, az_span_size(session));
+      client->is_tls_established = true;
+
+      break;
+    case MQTT_PACKET_TYPE_SUBACK:
+      if (mqtt_packet_decode_packet_id(packet, &packet_id) != 0
+          || mqtt_packet_decode_return_code(packet, &return_code) != 0)
+      {
+        return RESULT_ERROR;
+      }
+
+      if (return_code == MQTT_SUBACK_FAILURE)
+      {
+        LogError("MQTT topic subscription refused (message id=%d).", packet_id);
+      }
+      else if (azure_iot_mqtt_client_subscribe_completed(client->azure_iot, packet_id) != 0)
+      {
+        LogError("azure_iot_mqtt_client_subscribe_completed failed.");
+      }
+
+      break;
+    case MQTT_PACKET_TYPE_PUBACK:
+      if (mqtt_packet_decode_packet_id(packet, &packet_id) != 0)
+      {
+        return RESULT_ERROR;
+      }
+
+      if (azure_iot_mqtt_client_publish_completed(client->azure_iot, packet_id) != 0)
+      {
+        LogError("azure_iot_mqtt_client_publish_completed failed (message id=%d).", packet_id);
+      }
+
+      break;
+    case MQTT_PACKET_TYPE_PUBLISH:
+      if (mqtt_packet_decode_publish(packet, &publish) != 0)
+      {
+        return RESULT_ERROR;
+      }
+
+      // Acknowledged first, as esp-mqtt does before raising MQTT_EVENT_DATA.
+      if (publish.qos > 0)
+      {
+        size = mqtt_packet_encode_puback(
+            AZ_SPAN_FROM_BUFFER(client->tx_buffer), publish.packet_id);
+
+        if (mqtt_packet_write(
+                client->socket_fd, az_span_slice(AZ_SPAN_FROM_BUFFER(client->tx_buffer), 0, size))
+            != 0)
+        {
+          return RESULT_ERROR;
+        }
+      }
+
+      mqtt_message.topic = publish.topic;
+      mqtt_message.payload = publish.payload;
+      mqtt_message.qos = mqtt_qos_at_most_once; // Unused by azure_iot_mqtt_client_message_received.
+
+      if (azure_iot_mqtt_client_message_received(client->azure_iot, &mqtt_message) != 0)
+      {
+        LogError(
+            "azure_iot_mqtt_client_message_received failed (topic=%.*s).",
+            az_span_size(publish.topic),
+            az_span_ptr(publish.topic));
+      }
+
+      break;
+    case MQTT_PACKET_TYPE_PINGRESP:
+      break;
+    default:
+      LogError("MQTT packet type %d unexpected.", packet->type);
+      return RESULT_ERROR;
+  }
+
+  return RESULT_OK;
+}
+
+void posix_mqtt_client_init(
+    posix_mqtt_client_t* client,
+    azure_iot_t* azure_iot,
+    const char* broker_host,
+    int broker_port)
+{
+  (void)memset(client, 0, sizeof(posix_mqtt_client_t));
+  client->azure_iot = azure_iot;
+  client->broker_host = broker_host;
+  client->broker_port = broker_port;
+  client->socket_fd = POSIX_MQTT_CLIENT_NO_SOCKET;
+}
+
+int posix_mqtt_client_connect(posix_mqtt_client_t* client, mqtt_client_config_t* config)
+{
+  char host[MQTT_HOST_MAX_SIZE];
+  az_span address = mqtt_packet_string(config->address);
+  int32_t size;
+
+  if (client->broker_host != NULL)
+  {
+    (void)snprintf(host, sizeof(host), "%s", client->broker_host);
+  }
+  else
+  {
+    (void)snprintf(host, sizeof(host), "%.*s", az_span_size(address), az_span_ptr(address));
+  }
+
+  close_socket(client);
+
+  LogInfo(
+      "MQTT client target set to '%s' (for '%.*s').",
+      host,
+      az_span_size(address),
+      az_span_ptr(address));
+
+  if (open_socket(client, host, client->broker_port > 0 ? client->broker_port : config->port)
+      != RESULT_OK)
+  {
+    return RESULT_ERROR;
+  }
+
+  client->is_tls_established = false;
+  client->is_tls_session_resumed = false;
+  client->tls_session = AZ_SPAN_EMPTY;
+
+  // The CONNECT follows without waiting for the handshake response, which comes before the
+  // CONNACK.
+  size = mqtt_packet_encode_tls_session(
+      AZ_SPAN_FROM_BUFFER(client->tx_buffer), false, config->tls_session);
+
+  if (size == 0
+      || mqtt_packet_write(
+             client->socket_fd, az_span_slice(AZ_SPAN_FROM_BUFFER(client->tx_buffer), 0, size))
+          != 0)
+  {
+    LogError("Failed sending the TLS session offered.");
+    close_socket(client);
+    return RESULT_ERROR;
+  }
+
+  size = mqtt_packet_encode_connect(
+      AZ_SPAN_FROM_BUFFER(client->tx_buffer),
+      config->client_id,
+      config->username,
+      config->password,
+      MQTT_KEEP_ALIVE_IN_SECS);
+
+  if (size == 0
+      || mqtt_packet_write(
+             client->socket_fd, az_span_slice(AZ_SPAN_FROM_BUFFER(client->tx_buffer), 0, size))
+          != 0)
+  {
+    LogError("Failed sending MQTT CONNECT.");
+    close_socket(client);
+    return RESULT_ERROR;
+  }
+
+  return RESULT_OK;
+}
+
+int posix_mqtt_client_disconnect(posix_mqtt_client_t* client)
+{
+  int32_t size;
+
+  LogInfo("MQTT client being disconnected.");
+
+  if (client->socket_fd != POSIX_MQTT_CLIENT_NO_SOCKET)
+  {
+    size = mqtt_packet_encode_empty(
+        AZ_SPAN_FROM_BUFFER(client->tx_buffer), MQTT_PACKET_TYPE_DISCONNECT);
+    (void)mqtt_packet_write(
+        client->socket_fd, az_span_slice(AZ_SPAN_FROM_BUFFER(client->tx_buffer), 0, size));
+    close_socket(client);
+  }
+
+  if (azure_iot_mqtt_client_disconnected(client->azure_iot) != 0)
+  {
+    LogError("Failed updating azure iot client of MQTT disconnection.");
+  }
+
+  return RESULT_OK;
+}
+
+int posix_mqtt_client_publish(posix_mqtt_client_t* client, mqtt_message_t* mqtt_message)
+{
+  uint16_t packet_id
+      = (mqtt_message->qos == mqtt_qos_at_most_once) ? 0 : get_next_packet_id(client);
+  int32_t size;
+
+  if (client->socket_fd == POSIX_MQTT_CLIENT_NO_SOCKET)
+  {
+    return -1;
+  }
+
+  size = mqtt_packet_encode_publish(
+      AZ_SPAN_FROM_BUFFER(client->tx_buffer),
+      mqtt_message->topic,
+      mqtt_message->payload,
+      (uint8_t)mqtt_message->qos,
+      packet_id);
+
+  if (size == 0
+      || mqtt_packet_write(
+             client->socket_fd, az_span_slice(AZ_SPAN_FROM_BUFFER(client->tx_buffer), 0, size))
+          != 0)
+  {
+    LogError("Failed sending MQTT PUBLISH.");
+    return -1;
+  }
+
+  // The packet id is later informed through azure_iot_mqtt_client_publish_completed (zero for
+  // QoS 0).
+  return packet_id;
+}
+
+int posix_mqtt_client_publish_fragments(
+    posix_mqtt_client_t* client,
+    mqtt_message_fragments_t* mqtt_message)
+{
+  uint16_t packet_id
+      = (mqtt_message->qos == mqtt_qos_at_most_once) ? 0 : get_next_packet_id(client);
+  int32_t size;
+
+  if (client->socket_fd == POSIX_MQTT_CLIENT_NO_SOCKET)
+  {
+    return -1;
+  }
+
+  size = mqtt_packet_encode_publish_fragments(
+      AZ_SPAN_FROM_BUFFER(client->tx_buffer),
+      mqtt_message->topic,
+      mqtt_message->topic_count,
+      mqtt_message->payload,
+      mqtt_message->payload_count,
+      (uint8_t)mqtt_message->qos,
+      packet_id);
+
+  if (size == 0
+      || mqtt_packet_write(
+             client->socket_fd, az_span_slice(AZ_SPAN_FROM_BUFFER(client->tx_buffer), 0, size))
+          != 0)
+  {
+    LogError("Failed sending MQTT PUBLISH.");
+    return -1;
+  }
+
+  return packet_id;
+}
+
+int posix_mqtt_client_subscribe(posix_mqtt_client_t* client, az_span topic, mqtt_qos_t qos)
+{
+  uint16_t packet_id = get_next_packet_id(client);
+  int32_t size;
+
+  if (client->socket_fd == POSIX_MQTT_CLIENT_NO_SOCKET)
+  {
+    return -1;
+  }
+
+  size = mqtt_packet_encode_subscribe(
+      AZ_SPAN_FROM_BUFFER(client->tx_buffer), packet_id, topic, (uint8_t)qos);
+
+  if (size == 0
+      || mqtt_packet_write(
+             client->socket_fd, az_span_slice(AZ_SPAN_FROM_BUFFER(client->tx_buffer), 0, size))
+          != 0)
+  {
+    LogError("Failed sending MQTT SUBSCRIBE.");
+    return -1;
+  }
+
+  return packet_id;
+}
+
+int posix_mqtt_client_poll(posix_mqtt_client_t* client, uint32_t timeout_in_ms)
+{
+  struct pollfd poll_fd;
+  mqtt_packet_t packet;
+  int packets_count = 0;
+  int timeout = (int)timeout_in_ms;
+
+  while (client->socket_fd != POSIX_MQTT_CLIENT_NO_SOCKET)
+  {
+    poll_fd.fd = client->socket_fd;
+    poll_fd.events = POLLIN;
+    poll_fd.revents = 0;
+
+    if (poll(&poll_fd, 1, timeout) <= 0)
+    {
+      break;
+    }
+
+    if (mqtt_packet_read(client->socket_fd, AZ_SPAN_FROM_BUFFER(client->rx_buffer), &packet) != 0
+        || handle_packet(client, &packet) != RESULT_OK)
+    {
+      handle_connection_lost(client);
+      packets_count++;
+      break;
+    }
+
+    packets_count++;
+
+    // Whatever else already arrived is handled too, without waiting.
+    timeout = 0;
+  }
+
+  return packets_count;
+}
+
+bool posix_mqtt_client_is_open(posix_mqtt_client_t* client)
+{
+  return client->socket_fd != POSIX_MQTT_CLIENT_NO_SOCKET;
+}
@@ -0,0 +1,111 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * posix_mqtt_client.h defines an MQTT client over plain TCP sockets, used by the host build to
+ * implement `mqtt_client_interface_t` against the fake broker. It has no thread of its own: the
+ * application calls `posix_mqtt_client_poll` (through `event_interface_t.wait`), which informs the
+ * Azure IoT client of each packet received the way the esp-mqtt event handler does on the ESP32.
+ */
+
+#ifndef POSIX_MQTT_CLIENT_H
+#define POSIX_MQTT_CLIENT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "AzureIoT.h"
+#include "mqtt_packet.h"
+
+#define POSIX_MQTT_CLIENT_NO_SOCKET -1
+
+/*
+ * @brief    State of one POSIX MQTT client.
+ * @remark   `broker_host` and `broker_port`, if set, replace the address and port given by the
+ *           Azure IoT client, so DPS and the Azure IoT Hub are both served by the fake broker.
+ *           `tls_session` is the one received in the simulated TLS handshake of the current
+ *           connection (see `mqtt_packet_encode_tls_session`), informed to the Azure IoT client on
+ *           the CONNACK.
+ */
+typedef struct posix_mqtt_client_t_struct
+{
+  azure_iot_t* azure_iot;
+  const char* broker_host;
+  int broker_port;
+  int socket_fd;
+  uint16_t last_packet_id;
+  bool is_tls_established;
+  bool is_tls_session_resumed;
+  az_span tls_session;
+  uint8_t tls_session_buffer[MQTT_PACKET_TLS_SESSION_MAX_SIZE];
+  uint8_t rx_buffer[MQTT_PACKET_MAX_SIZE];
+  uint8_t tx_buffer[MQTT_PACKET_MAX_SIZE];
+} posix_mqtt_client_t;
+
+/*
+ * @brief        Initializes a POSIX MQTT client, not connected.
+ *
+ * @param[in]    client         The client to initialize.
+ * @param[in]    azure_iot      The Azure IoT client to inform of the MQTT events.
+ * @param[in]    broker_host    Host to connect to instead of the Azure IoT services, or NULL.
+ * @param[in]    broker_port    Port to connect to instead of the Azure IoT services, or zero.
+ */
+void posix_mqtt_client_init(
+    posix_mqtt_client_t* client,
+    azure_iot_t* azure_iot,
+    const char* broker_host,
+    int broker_port);
+
+/*
+ * @brief        Opens the TCP connection, offers `config->tls_session` in the simulated TLS
+ *               handshake and sends the CONNECT packet.
+ * @remark       Meant to be called from `mqtt_client_init_function_t`. The handshake response and
+ *               the CONNACK are handled by `posix_mqtt_client_poll`.
+ *
+ * @return       int    0 on success, non-zero if any failure occurs.
+ */
+int posix_mqtt_client_connect(posix_mqtt_client_t* client, mqtt_client_config_t* config);
+
+/*
+ * @brief        Sends a DISCONNECT, closes the connection and calls
+ *               `azure_iot_mqtt_client_disconnected`.
+ * @remark       Meant to be called from `mqtt_client_deinit_function_t`.
+ *
+ * @return       int    0 on success, non-zero if any failure occurs.
+ */
+int posix_mqtt_client_disconnect(posix_mqtt_client_t* client);
+
+/*
+ * See the documentation of `mqtt_client_publish_function_t` in AzureIoT.h for details.
+ */
+int posix_mqtt_client_publish(posix_mqtt_client_t* client, mqtt_message_t* mqtt_message);
+
+/*
+ * See the documentation of `mqtt_client_publish_fragments_function_t` in AzureIoT.h for details.
+ */
+int posix_mqtt_client_publish_fragments(
+    posix_mqtt_client_t* client,
+    mqtt_message_fragments_t* mqtt_message);
+
+/*
+ * See the documentation of `mqtt_client_subscribe_function_t` in AzureIoT.h for details.
+ */
+int posix_mqtt_client_subscribe(posix_mqtt_client_t* client, az_span topic, mqtt_qos_t qos);
+
+/*
+ * @brief        Waits for packets from the broker and handles all of them that arrived.
+ * @remark       A closed connection is handled like an MQTT_EVENT_DISCONNECTED of esp-mqtt.
+ *
+ * @param[in]    client           The client to poll.
+ * @param[in]    timeout_in_ms    Maximum time to wait for the first packet.
+ *
+ * @return       int              Number of packets handled; zero if none arrived in time or the
+ *                                client is not connected.
+ */
+int posix_mqtt_client_poll(posix_mqtt_client_t* client, uint32_t timeout_in_ms);
+
+/*
+ * @brief        Tells if the client has a TCP connection open (not necessarily accepted yet).
+ */
+bool posix_mqtt_client_is_open(posix_mqtt_client_t* client);
+
+#endif // POSIX_MQTT_CLIENT_H
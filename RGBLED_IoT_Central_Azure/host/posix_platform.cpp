@@ -0,0 +1,520 @@
+// SPDX-License-Identifier: MIT
+
+#include "posix_platform.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#define RESULT_OK 0
+#define RESULT_ERROR __LINE__
+
+#define BASE64_PADDING_CHAR '='
+#define BASE64_INVALID_VALUE 0xff
+
+#define HMAC_SHA256_BLOCK_SIZE 64
+#define HMAC_SHA256_DIGEST_SIZE 32
+#define HMAC_INNER_PAD_BYTE 0x36
+#define HMAC_OUTER_PAD_BYTE 0x5c
+
+#define PROVISIONING_CACHE_FILE_MAX_LINE_SIZE 256
+
+#define OFFLINE_TELEMETRY_FILE_MAX_SIZE (64 * 1024)
+#define OFFLINE_TELEMETRY_RECORD_HEADER_SIZE 2
+
+#define UNIX_EPOCH_START_YEAR 1900
+
+static const char base64_alphabet[]
+    = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/*
+ * @brief    HMAC-SHA256 pad states of the last key used.
+ * @remark   Thread-local, so each thread of the fleet simulator keeps its own like each ESP32 does.
+ */
+typedef struct hmac_sha256_cache_t_struct
+{
+  EVP_MD_CTX* inner_pad_context;
+  EVP_MD_CTX* outer_pad_context;
+  EVP_MD_CTX* context;
+  uint8_t key[HMAC_SHA256_BLOCK_SIZE];
+  size_t key_length;
+  posix_hmac_statistics_t statistics;
+} hmac_sha256_cache_t;
+
+static thread_local hmac_sha256_cache_t hmac_cache;
+static bool is_hmac_caching_enabled = true;
+
+static bool is_info_logging_enabled = true;
+static bool is_error_logging_enabled = true;
+
+/* --- Base64 --- */
+
+static uint8_t get_base64_value(uint8_t c)
+{
+  const char* position = (c == '\0') ? NULL : strchr(base64_alphabet, c);
+  return (position == NULL) ? BASE64_INVALID_VALUE : (uint8_t)(position - base64_alphabet);
+}
+
+int posix_base64_decode(
+    uint8_t* data,
+    size_t data_length,
+    uint8_t* decoded,
+    size_t decoded_size,
+    size_t* decoded_length)
+{
+  size_t padding_length = 0;
+  size_t length;
+  uint32_t bits = 0;
+  int bits_count = 0;
+
+  if ((data_length % 4) != 0)
+  {
+    return RESULT_ERROR;
+  }
+
+  while (padding_length < 2 && padding_length < data_length
+         && data[data_length - 1 - padding_length] == BASE64_PADDING_CHAR)
+  {
+    padding_length++;
+  }
+
+  length = (data_length / 4) * 3 - padding_length;
+
+  if (length > decoded_size)
+  {
+    return RESULT_ERROR;
+  }
+
+  *decoded_length = 0;
+
+  for (size_t i = 0; i < data_length - padding_length; i++)
+  {
+    uint8_t value = get_base64_value(data[i]);
+
+    if (value == BASE64_INVALID_VALUE)
+    {
+      return RESULT_ERROR;
+    }
+
+    bits = (bits << 6) | value;
+    bits_count += 6;
+
+    if (bits_count >= 8)
+    {
+      bits_count -= 8;
+      decoded[(*decoded_length)++] = (uint8_t)(bits >> bits_count);
+    }
+  }
+
+  return RESULT_OK;
+}
+
+int posix_base64_encode(
+    uint8_t* data,
+    size_t data_length,
+    uint8_t* encoded,
+    size_t encoded_size,
+    size_t* encoded_length)
+{
+  size_t length = ((data_length + 2) / 3) * 4;
+
+  if (length > encoded_size)
+  {
+    return RESULT_ERROR;
+  }
+
+  *encoded_length = 0;
+
+  for (size_t i = 0; i < data_length; i += 3)
+  {
+    size_t remaining = data_length - i;
+    uint32_t bits = ((uint32_t)data[i] << 16) | (remaining > 1 ? (uint32_t)data[i + 1] << 8 : 0)
+        | (remaining > 2 ? data[i + 2] : 0);
+
+    encoded[(*encoded_length)++] = base64_alphabet[(bits >> 18) & 0x3f];
+    encoded[(*encoded_length)++] = base64_alphabet[(bits >> 12) & 0x3f];
+    encoded[(*encoded_length)++]
+        = remaining > 1 ? base64_alphabet[(bits >> 6) & 0x3f] : BASE64_PADDING_CHAR;
+    encoded[(*encoded_length)++]
+        = remaining > 2 ? base64_alphabet[bits & 0x3f] : BASE64_PADDING_CHAR;
+  }
+
+  return RESULT_OK;
+}
+
+/* --- HMAC-SHA256 --- */
+
+/*
+ * @brief           Hashes the inner and outer pads of an HMAC-SHA256 key, keeping the resulting
+ *                  SHA-256 states for signing with the same key later.
+ *
+ * @return          0 on success, non-zero if any failure occurs.
+ */
+static int set_hmac_sha256_key(const uint8_t* key, size_t key_length)
+{
+  uint8_t pad[HMAC_SHA256_BLOCK_SIZE];
+  int result;
+
+  hmac_cache.key_length = 0;
+
+  if (hmac_cache.context == NULL)
+  {
+    hmac_cache.inner_pad_context = EVP_MD_CTX_new();
+    hmac_cache.outer_pad_context = EVP_MD_CTX_new();
+    hmac_cache.context = EVP_MD_CTX_new();
+
+    if (hmac_cache.inner_pad_context == NULL || hmac_cache.outer_pad_context == NULL
+        || hmac_cache.context == NULL)
+    {
+      return RESULT_ERROR;
+    }
+  }
+
+  (void)memset(pad, HMAC_INNER_PAD_BYTE, sizeof(pad));
+  for (size_t i = 0; i < key_length; i++)
+  {
+    pad[i] ^= key[i];
+  }
+
+  result = (EVP_DigestInit_ex(hmac_cache.inner_pad_context, EVP_sha256(), NULL) == 1
+            && EVP_DigestUpdate(hmac_cache.inner_pad_context, pad, sizeof(pad)) == 1)
+      ? RESULT_OK
+      : RESULT_ERROR;
+
+  (void)memset(pad, HMAC_OUTER_PAD_BYTE, sizeof(pad));
+  for (size_t i = 0; i < key_length; i++)
+  {
+    pad[i] ^= key[i];
+  }
+
+  if (result == RESULT_OK
+      && (EVP_DigestInit_ex(hmac_cache.outer_pad_context, EVP_sha256(), NULL) != 1
+          || EVP_DigestUpdate(hmac_cache.outer_pad_context, pad, sizeof(pad)) != 1))
+  {
+    result = RESULT_ERROR;
+  }
+
+  // Not leaving key material on the stack.
+  (void)memset(pad, 0, sizeof(pad));
+
+  if (result == RESULT_OK)
+  {
+    (void)memcpy(hmac_cache.key, key, key_length);
+    hmac_cache.key_length = key_length;
+  }
+
+  return result;
+}
+
+int posix_hmac_sha256(
+    const uint8_t* key,
+    size_t key_length,
+    const uint8_t* payload,
+    size_t payload_length,
+    uint8_t* signed_payload,
+    size_t signed_payload_size)
+{
+  uint8_t inner_digest[HMAC_SHA256_DIGEST_SIZE];
+  unsigned int digest_length;
+
+  if (signed_payload_size < HMAC_SHA256_DIGEST_SIZE)
+  {
+    return RESULT_ERROR;
+  }
+
+  if (!is_hmac_caching_enabled || key_length > HMAC_SHA256_BLOCK_SIZE)
+  {
+    return HMAC(EVP_sha256(),
+                key,
+                (int)key_length,
+                payload,
+                payload_length,
+                signed_payload,
+                &digest_length)
+            == NULL
+        ? RESULT_ERROR
+        : RESULT_OK;
+  }
+
+  if (hmac_cache.key_length == 0 || key_length != hmac_cache.key_length
+      || memcmp(key, hmac_cache.key, key_length) != 0)
+  {
+    hmac_cache.statistics.miss_count++;
+
+    if (set_hmac_sha256_key(key, key_length) != RESULT_OK)
+    {
+      return RESULT_ERROR;
+    }
+  }
+  else
+  {
+    hmac_cache.statistics.hit_count++;
+  }
+
+  // H((K ^ opad) || H((K ^ ipad) || payload)), resuming from the cached pad states.
+  return (EVP_MD_CTX_copy_ex(hmac_cache.context, hmac_cache.inner_pad_context) == 1
+          && EVP_DigestUpdate(hmac_cache.context, payload, payload_length) == 1
+          && EVP_DigestFinal_ex(hmac_cache.context, inner_digest, &digest_length) == 1
+          && EVP_MD_CTX_copy_ex(hmac_cache.context, hmac_cache.outer_pad_context) == 1
+          && EVP_DigestUpdate(hmac_cache.context, inner_digest, sizeof(inner_digest)) == 1
+          && EVP_DigestFinal_ex(hmac_cache.context, signed_payload, &digest_length) == 1)
+      ? RESULT_OK
+      : RESULT_ERROR;
+}
+
+void posix_hmac_sha256_set_caching(bool is_enabled) { is_hmac_caching_enabled = is_enabled; }
+
+void posix_get_hmac_statistics(posix_hmac_statistics_t* statistics)
+{
+  *statistics = hmac_cache.statistics;
+}
+
+/* --- Random numbers and logging --- */
+
+uint32_t posix_get_random_number() { return (uint32_t)random(); }
+
+void posix_set_logging(bool is_info_enabled, bool is_error_enabled)
+{
+  is_info_logging_enabled = is_info_enabled;
+  is_error_logging_enabled = is_error_enabled;
+}
+
+void posix_logging_function(log_level_t log_level, char const* const format, ...)
+{
+  struct timeval now;
+  struct tm now_utc;
+  va_list ap;
+
+  if ((log_level == log_level_info && !is_info_logging_enabled)
+      || (log_level == log_level_error && !is_error_logging_enabled))
+  {
+    return;
+  }
+
+  (void)gettimeofday(&now, NULL);
+  (void)gmtime_r(&now.tv_sec, &now_utc);
+
+  (void)fprintf(
+      stderr,
+      "%04d/%02d/%02d %02d:%02d:%02d.%03ld %s ",
+      now_utc.tm_year + UNIX_EPOCH_START_YEAR,
+      now_utc.tm_mon + 1,
+      now_utc.tm_mday,
+      now_utc.tm_hour,
+      now_utc.tm_min,
+      now_utc.tm_sec,
+      (long)(now.tv_usec / 1000),
+      log_level == log_level_info ? "[INFO]" : "[ERROR]");
+
+  va_start(ap, format);
+  (void)vfprintf(stderr, format, ap);
+  va_end(ap);
+
+  (void)fputc('\n', stderr);
+}
+
+/* --- Provisioning cache --- */
+
+/*
+ * @brief           Reads one line of the provisioning cache file, without its line break.
+ *
+ * @return          0 on success, non-zero if the line is missing, empty or does not fit.
+ */
+static int read_provisioning_cache_line(FILE* file, az_span buffer, int32_t* length)
+{
+  char line[PROVISIONING_CACHE_FILE_MAX_LINE_SIZE];
+
+  if (fgets(line, sizeof(line), file) == NULL)
+  {
+    return RESULT_ERROR;
+  }
+
+  *length = (int32_t)strcspn(line, "\n");
+
+  if (*length == 0 || *length > az_span_size(buffer))
+  {
+    return RESULT_ERROR;
+  }
+
+  (void)memcpy(az_span_ptr(buffer), line, (size_t)*length);
+
+  return RESULT_OK;
+}
+
+int posix_provisioning_cache_load(
+    const char* path,
+    az_span iot_hub_fqdn,
+    int32_t* iot_hub_fqdn_length,
+    az_span device_id,
+    int32_t* device_id_length)
+{
+  int result;
+  FILE* file = fopen(path, "r");
+
+  if (file == NULL)
+  {
+    return RESULT_ERROR;
+  }
+
+  result = read_provisioning_cache_line(file, iot_hub_fqdn, iot_hub_fqdn_length);
+  result = (result != RESULT_OK)
+      ? result
+      : read_provisioning_cache_line(file, device_id, device_id_length);
+
+  (void)fclose(file);
+
+  return result;
+}
+
+int posix_provisioning_cache_save(const char* path, az_span iot_hub_fqdn, az_span device_id)
+{
+  int result;
+  FILE* file = fopen(path, "w");
+
+  if (file == NULL)
+  {
+    return RESULT_ERROR;
+  }
+
+  result = (fprintf(
+                file,
+                "%.*s\n%.*s\n",
+                az_span_size(iot_hub_fqdn),
+                az_span_ptr(iot_hub_fqdn),
+                az_span_size(device_id),
+                az_span_ptr(device_id))
+            > 0)
+      ? RESULT_OK
+      : RESULT_ERROR;
+
+  if (fclose(file) != 0 || result != RESULT_OK)
+  {
+    (void)remove(path);
+    result = RESULT_ERROR;
+  }
+
+  return result;
+}
+
+int posix_provisioning_cache_clear(const char* path)
+{
+  return (remove(path) == 0 || errno == ENOENT) ? RESULT_OK : RESULT_ERROR;
+}
+
+/* --- Offline telemetry storage --- */
+
+int posix_offline_telemetry_storage_push(posix_offline_telemetry_file_t* file, az_span record)
+{
+  int result;
+  uint8_t header[OFFLINE_TELEMETRY_RECORD_HEADER_SIZE];
+  long file_size;
+  FILE* stream = fopen(file->path, "ab");
+
+  if (stream == NULL)
+  {
+    return RESULT_ERROR;
+  }
+
+  file_size = (fseek(stream, 0, SEEK_END) == 0) ? ftell(stream) : -1;
+
+  if (file_size < 0
+      || ((size_t)file_size + sizeof(header) + az_span_size(record))
+          > OFFLINE_TELEMETRY_FILE_MAX_SIZE)
+  {
+    result = RESULT_ERROR;
+  }
+  else
+  {
+    header[0] = (uint8_t)(az_span_size(record) >> 8);
+    header[1] = (uint8_t)az_span_size(record);
+
+    result = (fwrite(header, 1, sizeof(header), stream) == sizeof(header)
+              && fwrite(az_span_ptr(record), 1, (size_t)az_span_size(record), stream)
+                  == (size_t)az_span_size(record))
+        ? RESULT_OK
+        : RESULT_ERROR;
+  }
+
+  if (fclose(stream) != 0)
+  {
+    result = RESULT_ERROR;
+  }
+
+  return result;
+}
+
+/*
+ * Note: like on the ESP32, the read position is not persisted, so records not yet published when
+ * the process exits are published again (at-least-once).
+ */
+int posix_offline_telemetry_storage_peek(
+    posix_offline_telemetry_file_t* file,
+    az_span buffer,
+    int32_t* record_length)
+{
+  int result = RESULT_ERROR;
+  uint8_t header[OFFLINE_TELEMETRY_RECORD_HEADER_SIZE];
+  FILE* stream = fopen(file->path, "rb");
+
+  if (stream == NULL)
+  {
+    return RESULT_ERROR;
+  }
+
+  if (fseek(stream, (long)file->read_position, SEEK_SET) == 0
+      && fread(header, 1, sizeof(header), stream) == sizeof(header))
+  {
+    *record_length = (header[0] << 8) | header[1];
+
+    if (*record_length <= az_span_size(buffer)
+        && fread(az_span_ptr(buffer), 1, (size_t)*record_length, stream)
+            == (size_t)*record_length)
+    {
+      file->peeked_record_size = sizeof(header) + (size_t)*record_length;
+      result = RESULT_OK;
+    }
+  }
+
+  (void)fclose(stream);
+
+  return result;
+}
+
+int posix_offline_telemetry_storage_pop(posix_offline_telemetry_file_t* file)
+{
+  long file_size;
+  FILE* stream;
+
+  file->read_position += file->peeked_record_size;
+  file->peeked_record_size = 0;
+
+  stream = fopen(file->path, "rb");
+
+  if (stream == NULL)
+  {
+    return RESULT_ERROR;
+  }
+
+  file_size = (fseek(stream, 0, SEEK_END) == 0) ? ftell(stream) : -1;
+  (void)fclose(stream);
+
+  if (file_size < 0)
+  {
+    return RESULT_ERROR;
+  }
+
+  // Once everything is published the file is removed, so it does not keep growing.
+  if (file->read_position >= (size_t)file_size)
+  {
+    file->read_position = 0;
+    return (remove(file->path) == 0) ? RESULT_OK : RESULT_ERROR;
+  }
+
+  return RESULT_OK;
+}
@@ -0,0 +1,128 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * posix_platform.h provides the host build with POSIX (and OpenSSL) implementations of the
+ * functions the Azure IoT client needs from the platform, mirroring the ones RGBLEDSOFTWARE.ino
+ * provides on the ESP32: Base64, HMAC-SHA256 (with cached pad states), random numbers, logging,
+ * and file-backed provisioning cache and offline telemetry storage.
+ */
+
+#ifndef POSIX_PLATFORM_H
+#define POSIX_PLATFORM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "AzureIoT.h"
+
+/*
+ * @brief    Counts of `posix_hmac_sha256` calls that reused the cached pad states of the key
+ *           (hits) or had to hash them first (misses), in the calling thread.
+ */
+typedef struct posix_hmac_statistics_t_struct
+{
+  uint32_t hit_count;
+  uint32_t miss_count;
+} posix_hmac_statistics_t;
+
+/*
+ * See the documentation of `base64_decode_function_t` in AzureIoT.h for details.
+ */
+int posix_base64_decode(
+    uint8_t* data,
+    size_t data_length,
+    uint8_t* decoded,
+    size_t decoded_size,
+    size_t* decoded_length);
+
+/*
+ * See the documentation of `base64_encode_function_t` in AzureIoT.h for details.
+ */
+int posix_base64_encode(
+    uint8_t* data,
+    size_t data_length,
+    uint8_t* encoded,
+    size_t encoded_size,
+    size_t* encoded_length);
+
+/*
+ * See the documentation of `hmac_sha256_encryption_function_t` in AzureIoT.h for details.
+ * The pad states of the last key are cached per thread, as the sketch does on the ESP32.
+ */
+int posix_hmac_sha256(
+    const uint8_t* key,
+    size_t key_length,
+    const uint8_t* payload,
+    size_t payload_length,
+    uint8_t* signed_payload,
+    size_t signed_payload_size);
+
+/*
+ * @brief        Enables or disables the caching of the HMAC-SHA256 pad states (enabled by
+ *               default), so both can be measured.
+ */
+void posix_hmac_sha256_set_caching(bool is_enabled);
+
+/*
+ * @brief        Gets the HMAC-SHA256 pad states statistics of the calling thread.
+ */
+void posix_get_hmac_statistics(posix_hmac_statistics_t* statistics);
+
+/*
+ * See the documentation of `random_number_function_t` in AzureIoT.h for details.
+ */
+uint32_t posix_get_random_number();
+
+/*
+ * @brief        Logging function printing to stderr, to be set with `set_logging_function`.
+ */
+void posix_logging_function(log_level_t log_level, char const* const format, ...);
+
+/*
+ * @brief        Enables or disables each log level of `posix_logging_function` (both enabled by
+ *               default). Benchmarks disable them so printing is not measured.
+ */
+void posix_set_logging(bool is_info_enabled, bool is_error_enabled);
+
+/*
+ * @brief        File-backed implementations of `provisioning_cache_interface_t`.
+ * @remark       The file is given by `path`, so each device of a process can have its own;
+ *               the host device adapts them to the context-less interface.
+ */
+int posix_provisioning_cache_load(
+    const char* path,
+    az_span iot_hub_fqdn,
+    int32_t* iot_hub_fqdn_length,
+    az_span device_id,
+    int32_t* device_id_length);
+
+int posix_provisioning_cache_save(const char* path, az_span iot_hub_fqdn, az_span device_id);
+
+int posix_provisioning_cache_clear(const char* path);
+
+/*
+ * @brief    State of a file-backed offline telemetry storage.
+ * @remark   Same format as the LittleFS file of the sketch: records prefixed by their 2-byte
+ *           big-endian length, the file removed once all records are read.
+ */
+typedef struct posix_offline_telemetry_file_t_struct
+{
+  const char* path;
+  size_t read_position;
+  size_t peeked_record_size;
+} posix_offline_telemetry_file_t;
+
+/*
+ * @brief        File-backed implementations of `offline_telemetry_storage_interface_t`.
+ */
+int posix_offline_telemetry_storage_push(posix_offline_telemetry_file_t* file, az_span record);
+
+int posix_offline_telemetry_storage_peek(
+    posix_offline_telemetry_file_t* file,
+    az_span buffer,
+    int32_t* record_length);
+
+int posix_offline_telemetry_storage_pop(posix_offline_telemetry_file_t* file);
+
+#endif // POSIX_PLATFORM_H
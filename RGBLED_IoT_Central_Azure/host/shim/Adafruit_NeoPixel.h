@@ -0,0 +1,54 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * Adafruit_NeoPixel.h of the host build: a strip without LEDs, keeping the last colors set so
+ * the PnP template can report them back.
+ */
+
+#ifndef ADAFRUIT_NEOPIXEL_H
+#define ADAFRUIT_NEOPIXEL_H
+
+#include <stdint.h>
+
+#include <Arduino.h>
+
+#define NEO_GRB 0
+#define NEO_KHZ800 0
+
+#define NEOPIXEL_MAX_COUNT 64
+
+class Adafruit_NeoPixel
+{
+public:
+  Adafruit_NeoPixel(uint16_t count, int16_t pin, uint16_t type)
+      : count(count < NEOPIXEL_MAX_COUNT ? count : NEOPIXEL_MAX_COUNT), colors()
+  {
+    (void)pin;
+    (void)type;
+  }
+
+  void begin() {}
+
+  void show() {}
+
+  void setPixelColor(uint16_t index, uint32_t color)
+  {
+    if (index < count)
+    {
+      colors[index] = color;
+    }
+  }
+
+  uint32_t getPixelColor(uint16_t index) const { return index < count ? colors[index] : 0; }
+
+  static uint32_t Color(uint8_t red, uint8_t green, uint8_t blue)
+  {
+    return ((uint32_t)red << 16) | ((uint32_t)green << 8) | blue;
+  }
+
+private:
+  uint16_t count;
+  uint32_t colors[NEOPIXEL_MAX_COUNT];
+};
+
+#endif // ADAFRUIT_NEOPIXEL_H
@@ -0,0 +1,27 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * Arduino.h of the host build: only the timing functions used by the Azure IoT PnP template.
+ */
+
+#ifndef ARDUINO_H
+#define ARDUINO_H
+
+#include <stdint.h>
+#include <time.h>
+
+static inline unsigned long micros()
+{
+  struct timespec now;
+  (void)clock_gettime(CLOCK_MONOTONIC, &now);
+  return (unsigned long)((uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000);
+}
+
+static inline unsigned long millis()
+{
+  struct timespec now;
+  (void)clock_gettime(CLOCK_MONOTONIC, &now);
+  return (unsigned long)((uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000);
+}
+
+#endif // ARDUINO_H
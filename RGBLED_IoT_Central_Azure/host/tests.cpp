@@ -0,0 +1,457 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * tests.cpp runs the Azure IoT client of the ESP32 sample on the host against the fake broker,
+ * asserting what the broker sees:
+ * - dps_to_ready: registration through DPS, then connection to the Azure IoT Hub assigned;
+ * - command_round_trip: a command sent by the broker is responded by the device;
+ * - sas_token_refresh: a make-before-break SAS token refresh under the fake clock, without
+ *   provisioning again nor dropping telemetry;
+ * - cached_provisioning: a warm boot connects straight to the Azure IoT Hub saved by the first;
+ * - connection_refused_fallback: a warm boot refused by the Azure IoT Hub discards the saved
+ *   provisioning result and goes through DPS again;
+ * - tls_session_resumption: reconnections resume the TLS session saved, unless it expired under the
+ *   fake clock or the broker forgot it.
+ *
+ * Usage: tests [test_name]
+ * Runs all the tests if no name is given (CTest runs each on its own). Set
+ * AZURE_IOT_TESTS_VERBOSE in the environment to see the logs of the Azure IoT client.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "AzureIoT.h"
+#include "Azure_IoT_PnP_Template.h"
+#include "fake_broker.h"
+#include "fake_clock.h"
+#include "host_device.h"
+#include "posix_platform.h"
+
+#define BROKER_HOST "127.0.0.1"
+#define BROKER_IOT_HUB_FQDN "tests-hub.azure-devices.net"
+#define TIMEOUT_IN_MS 10000
+#define WORK_WAIT_IN_MS 10
+#define COMMAND_NAME "ToggleLed1"
+#define COMMAND_PAYLOAD "{}"
+#define TELEMETRY_PAYLOAD "{\"ledStatus\":\"White\"}"
+#define FAKE_CLOCK_START_TIME_IN_MS 1000
+#define FAKE_CLOCK_START_UNIX_TIME 1700000000
+#define STORAGE_DIRECTORY_TEMPLATE "/tmp/azure-iot-tests-XXXXXX"
+
+#define TEST_ASSERT(condition)                                                                 \
+  do                                                                                           \
+  {                                                                                            \
+    if (!(condition))                                                                          \
+    {                                                                                          \
+      (void)fprintf(stderr, "%s:%d: assertion failed: %s\n", __FILE__, __LINE__, #condition); \
+      return 1;                                                                                \
+    }                                                                                          \
+  } while (0)
+
+typedef int (*test_function_t)(fake_broker_t* broker);
+
+typedef struct test_t_struct
+{
+  const char* name;
+  test_function_t function;
+} test_t;
+
+static host_device_t device;
+
+static uint64_t get_time_in_us()
+{
+  struct timespec now;
+  (void)clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+static uint64_t get_deadline() { return get_time_in_us() + (uint64_t)TIMEOUT_IN_MS * 1000; }
+
+static fake_broker_statistics_t get_broker_statistics(fake_broker_t* broker)
+{
+  fake_broker_statistics_t statistics;
+  fake_broker_get_statistics(broker, &statistics);
+  return statistics;
+}
+
+static bool is_connected(host_device_t* host_device)
+{
+  return azure_iot_get_status(&host_device->azure_iot) == azure_iot_connected;
+}
+
+/*
+ * @brief    Works until the device is connected, advancing the fake clock by the time waited if
+ *           the device uses it (so reconnection delays elapse).
+ * @return   true if connected in time, false otherwise.
+ */
+static bool work_until_connected(host_device_t* host_device, bool is_fake_clock)
+{
+  uint64_t deadline = get_deadline();
+
+  while (!is_connected(host_device))
+  {
+    if (get_time_in_us() > deadline)
+    {
+      return false;
+    }
+
+    host_device_do_work(host_device, WORK_WAIT_IN_MS);
+
+    if (is_fake_clock)
+    {
+      fake_clock_advance(WORK_WAIT_IN_MS);
+    }
+  }
+
+  return true;
+}
+
+static bool start_device(host_device_t* host_device)
+{
+  host_device_select(host_device);
+
+  return azure_iot_start(&host_device->azure_iot) == 0
+      && work_until_connected(
+          host_device, host_device->config.clock_interface.get_monotonic_time_in_ms != NULL);
+}
+
+static void stop_device(host_device_t* host_device)
+{
+  host_device_select(host_device);
+  (void)azure_iot_stop(&host_device->azure_iot);
+}
+
+static uint32_t get_sas_token_refresh_count(host_device_t* host_device)
+{
+  sas_token_refresh_statistics_t statistics;
+
+  azure_iot_get_sas_token_refresh_statistics(&host_device->azure_iot, &statistics);
+
+  return statistics.refresh_count;
+}
+
+/*
+ * @brief    Removes the files of the device from its storage directory, then the directory.
+ */
+static void remove_storage_directory(host_device_t* host_device, const char* storage_directory)
+{
+  (void)unlink(host_device->provisioning_cache_path);
+  (void)unlink(host_device->offline_telemetry_path);
+  (void)rmdir(storage_directory);
+}
+
+static int test_dps_to_ready(fake_broker_t* broker)
+{
+  host_device_init(&device, "tests-dps", BROKER_HOST, fake_broker_get_port(broker), NULL);
+
+  TEST_ASSERT(start_device(&device));
+
+  fake_broker_statistics_t statistics = get_broker_statistics(broker);
+  TEST_ASSERT(statistics.dps_registrations_count == 1);
+  TEST_ASSERT(statistics.dps_assignments_count == 1);
+  // One connection to DPS, then one to the Azure IoT Hub.
+  TEST_ASSERT(statistics.connections_count == 2);
+  TEST_ASSERT(statistics.refused_connections_count == 0);
+
+  stop_device(&device);
+
+  return 0;
+}
+
+static int test_command_round_trip(fake_broker_t* broker)
+{
+  uint64_t deadline;
+
+  host_device_init(&device, "tests-command", BROKER_HOST, fake_broker_get_port(broker), NULL);
+
+  TEST_ASSERT(start_device(&device));
+  TEST_ASSERT(
+      fake_broker_send_command(
+          broker, "tests-command", COMMAND_NAME, AZ_SPAN_FROM_STR(COMMAND_PAYLOAD))
+      == 0);
+
+  deadline = get_deadline();
+
+  while (get_broker_statistics(broker).command_responses_count == 0)
+  {
+    TEST_ASSERT(get_time_in_us() < deadline);
+    host_device_do_work(&device, WORK_WAIT_IN_MS);
+  }
+
+  fake_broker_statistics_t statistics = get_broker_statistics(broker);
+  TEST_ASSERT(statistics.commands_sent_count == 1);
+  TEST_ASSERT(statistics.commands_dropped_count == 0);
+  TEST_ASSERT(statistics.command_responses_count == 1);
+
+  stop_device(&device);
+
+  return 0;
+}
+
+static int test_sas_token_refresh(fake_broker_t* broker)
+{
+  uint32_t lifetime_in_ms;
+  uint64_t deadline;
+  fake_broker_statistics_t statistics_before_refresh;
+  sas_token_refresh_statistics_t refresh_statistics;
+
+  fake_clock_init(FAKE_CLOCK_START_TIME_IN_MS, FAKE_CLOCK_START_UNIX_TIME);
+  host_device_init(&device, "tests-sas", BROKER_HOST, fake_broker_get_port(broker), NULL);
+  device.config.clock_interface = fake_clock_get_interface();
+  lifetime_in_ms = device.config.sas_token_lifetime_in_minutes * 60 * 1000;
+
+  TEST_ASSERT(start_device(&device));
+  TEST_ASSERT(get_sas_token_refresh_count(&device) == 0);
+
+  statistics_before_refresh = get_broker_statistics(broker);
+
+  // Into the window where the next token is prepared, still connected with the current one.
+  fake_clock_advance(lifetime_in_ms - SAS_TOKEN_PREPARE_THRESHOLD_IN_SECS * 1000 + 1000);
+  host_device_do_work(&device, 0);
+  TEST_ASSERT(is_connected(&device));
+  TEST_ASSERT(get_sas_token_refresh_count(&device) == 0);
+
+  // Into the window where it is used: the refresh starts, and telemetry sent meanwhile is held.
+  fake_clock_advance(
+      (SAS_TOKEN_PREPARE_THRESHOLD_IN_SECS - SAS_TOKEN_REFRESH_THRESHOLD_IN_SECS) * 1000);
+  host_device_do_work(&device, 0);
+  TEST_ASSERT(
+      azure_iot_send_telemetry(&device.azure_iot, AZ_SPAN_FROM_STR(TELEMETRY_PAYLOAD)) == 0);
+
+  deadline = get_deadline();
+
+  while (get_sas_token_refresh_count(&device) == 0 || !is_connected(&device)
+         || get_broker_statistics(broker).telemetry_count
+             == statistics_before_refresh.telemetry_count)
+  {
+    TEST_ASSERT(get_time_in_us() < deadline);
+    host_device_do_work(&device, WORK_WAIT_IN_MS);
+  }
+
+  fake_broker_statistics_t statistics = get_broker_statistics(broker);
+  azure_iot_get_sas_token_refresh_statistics(&device.azure_iot, &refresh_statistics);
+  TEST_ASSERT(refresh_statistics.refresh_count == 1);
+  TEST_ASSERT(refresh_statistics.dropped_messages_count == 0);
+  // Reconnected to the Azure IoT Hub alone, with the provisioning result kept.
+  TEST_ASSERT(statistics.connections_count == statistics_before_refresh.connections_count + 1);
+  TEST_ASSERT(
+      statistics.dps_registrations_count == statistics_before_refresh.dps_registrations_count);
+  TEST_ASSERT(statistics.telemetry_count == statistics_before_refresh.telemetry_count + 1);
+
+  stop_device(&device);
+
+  return 0;
+}
+
+static int test_cached_provisioning(fake_broker_t* broker)
+{
+  char storage_directory[] = STORAGE_DIRECTORY_TEMPLATE;
+  fake_broker_statistics_t statistics;
+
+  TEST_ASSERT(mkdtemp(storage_directory) != NULL);
+
+  // Cold boot: through DPS, saving the result.
+  host_device_init(
+      &device, "tests-cached", BROKER_HOST, fake_broker_get_port(broker), storage_directory);
+  TEST_ASSERT(start_device(&device));
+  stop_device(&device);
+
+  statistics = get_broker_statistics(broker);
+  TEST_ASSERT(statistics.dps_registrations_count == 1);
+  TEST_ASSERT(statistics.connections_count == 2);
+
+  // Warm boot: a device initialized anew connects to the saved Azure IoT Hub alone.
+  host_device_init(
+      &device, "tests-cached", BROKER_HOST, fake_broker_get_port(broker), storage_directory);
+  TEST_ASSERT(start_device(&device));
+  stop_device(&device);
+
+  statistics = get_broker_statistics(broker);
+  TEST_ASSERT(statistics.dps_registrations_count == 1);
+  TEST_ASSERT(statistics.connections_count == 3);
+
+  remove_storage_directory(&device, storage_directory);
+
+  return 0;
+}
+
+static int test_connection_refused_fallback(fake_broker_t* broker)
+{
+  char storage_directory[] = STORAGE_DIRECTORY_TEMPLATE;
+  fake_broker_statistics_t statistics;
+
+  TEST_ASSERT(mkdtemp(storage_directory) != NULL);
+
+  // Cold boot, saving the provisioning result.
+  fake_clock_init(FAKE_CLOCK_START_TIME_IN_MS, FAKE_CLOCK_START_UNIX_TIME);
+  host_device_init(
+      &device, "tests-refused", BROKER_HOST, fake_broker_get_port(broker), storage_directory);
+  device.config.clock_interface = fake_clock_get_interface();
+  TEST_ASSERT(start_device(&device));
+  stop_device(&device);
+
+  // Warm boot, the saved Azure IoT Hub no longer taking the device: refused once, the client
+  // falls back to DPS and connects to the Azure IoT Hub assigned.
+  fake_broker_refuse_iot_hub_connections(broker, 1);
+  host_device_init(
+      &device, "tests-refused", BROKER_HOST, fake_broker_get_port(broker), storage_directory);
+  device.config.clock_interface = fake_clock_get_interface();
+  TEST_ASSERT(start_device(&device));
+  stop_device(&device);
+
+  statistics = get_broker_statistics(broker);
+  TEST_ASSERT(statistics.refused_connections_count == 1);
+  TEST_ASSERT(statistics.dps_registrations_count == 2);
+  TEST_ASSERT(statistics.dps_assignments_count == 2);
+  // DPS and hub on the cold boot; then the refused hub connection, DPS and hub again.
+  TEST_ASSERT(statistics.connections_count == 4);
+
+  // The new result is saved: the next warm boot goes to the Azure IoT Hub alone.
+  host_device_init(
+      &device, "tests-refused", BROKER_HOST, fake_broker_get_port(broker), storage_directory);
+  device.config.clock_interface = fake_clock_get_interface();
+  TEST_ASSERT(start_device(&device));
+  stop_device(&device);
+
+  statistics = get_broker_statistics(broker);
+  TEST_ASSERT(statistics.dps_registrations_count == 2);
+  TEST_ASSERT(statistics.connections_count == 5);
+
+  remove_storage_directory(&device, storage_directory);
+
+  return 0;
+}
+
+static int test_tls_session_resumption(fake_broker_t* broker)
+{
+  fake_broker_statistics_t statistics;
+  tls_session_statistics_t tls_session_statistics;
+
+  fake_clock_init(FAKE_CLOCK_START_TIME_IN_MS, FAKE_CLOCK_START_UNIX_TIME);
+  host_device_init(&device, "tests-tls", BROKER_HOST, fake_broker_get_port(broker), NULL);
+  device.config.clock_interface = fake_clock_get_interface();
+
+  // Full handshakes with DPS and the Azure IoT Hub; only the session of the latter is saved.
+  TEST_ASSERT(start_device(&device));
+  stop_device(&device);
+
+  statistics = get_broker_statistics(broker);
+  TEST_ASSERT(statistics.tls_handshakes_count == 2);
+  TEST_ASSERT(statistics.tls_resumptions_count == 0);
+
+  // A reconnection within the session lifetime resumes it.
+  TEST_ASSERT(start_device(&device));
+  stop_device(&device);
+
+  statistics = get_broker_statistics(broker);
+  azure_iot_get_tls_session_statistics(&device.azure_iot, &tls_session_statistics);
+  TEST_ASSERT(statistics.tls_handshakes_count == 2);
+  TEST_ASSERT(statistics.tls_resumptions_count == 1);
+  TEST_ASSERT(tls_session_statistics.resumed_count == 1);
+  TEST_ASSERT(tls_session_statistics.expired_count == 0);
+
+  // A session the broker forgot is offered, refused, and replaced by a full handshake.
+  fake_broker_forget_tls_sessions(broker);
+  TEST_ASSERT(start_device(&device));
+  stop_device(&device);
+
+  statistics = get_broker_statistics(broker);
+  azure_iot_get_tls_session_statistics(&device.azure_iot, &tls_session_statistics);
+  TEST_ASSERT(statistics.tls_handshakes_count == 3);
+  TEST_ASSERT(statistics.tls_resumptions_count == 1);
+  TEST_ASSERT(tls_session_statistics.resumed_count == 1);
+  TEST_ASSERT(tls_session_statistics.offered_count == 2);
+
+  // A session past its lifetime is not offered at all.
+  fake_clock_advance(device.config.tls_session_lifetime_in_secs * 1000 + 1000);
+  TEST_ASSERT(start_device(&device));
+  stop_device(&device);
+
+  statistics = get_broker_statistics(broker);
+  azure_iot_get_tls_session_statistics(&device.azure_iot, &tls_session_statistics);
+  TEST_ASSERT(statistics.tls_handshakes_count == 4);
+  TEST_ASSERT(statistics.tls_resumptions_count == 1);
+  TEST_ASSERT(tls_session_statistics.expired_count == 1);
+  TEST_ASSERT(tls_session_statistics.offered_count == 2);
+
+  return 0;
+}
+
+static const test_t tests[] = {
+  { "dps_to_ready", test_dps_to_ready },
+  { "command_round_trip", test_command_round_trip },
+  { "sas_token_refresh", test_sas_token_refresh },
+  { "cached_provisioning", test_cached_provisioning },
+  { "connection_refused_fallback", test_connection_refused_fallback },
+  { "tls_session_resumption", test_tls_session_resumption },
+};
+
+#define TESTS_COUNT (sizeof(tests) / sizeof(tests[0]))
+
+/*
+ * @brief    Runs a test against a broker of its own, so its statistics start from zero.
+ * @return   0 if the test passed, non-zero otherwise.
+ */
+static int run_test(const test_t* test)
+{
+  fake_broker_config_t broker_config;
+  fake_broker_t* broker;
+  int result;
+
+  (void)memset(&broker_config, 0, sizeof(broker_config));
+  broker_config.iot_hub_fqdn = BROKER_IOT_HUB_FQDN;
+  broker_config.dps_assigning_queries_count = 1;
+  broker_config.dps_retry_after_in_secs = 0;
+  broker = fake_broker_start(&broker_config);
+
+  if (broker == NULL)
+  {
+    (void)fprintf(stderr, "Failed starting the fake broker.\n");
+    return 1;
+  }
+
+  result = test->function(broker);
+  fake_broker_stop(broker);
+
+  printf("%s %s\n", (result == 0) ? "PASS" : "FAIL", test->name);
+
+  return result;
+}
+
+int main(int argc, char** argv)
+{
+  bool is_verbose = getenv("AZURE_IOT_TESTS_VERBOSE") != NULL;
+  int failures_count = 0;
+  bool is_found = false;
+
+  set_logging_function(posix_logging_function);
+  posix_set_logging(is_verbose, is_verbose);
+  azure_pnp_init();
+
+  for (size_t i = 0; i < TESTS_COUNT; i++)
+  {
+    if (argc > 1 && strcmp(argv[1], tests[i].name) != 0)
+    {
+      continue;
+    }
+
+    is_found = true;
+
+    if (run_test(&tests[i]) != 0)
+    {
+      failures_count++;
+    }
+  }
+
+  if (!is_found)
+  {
+    (void)fprintf(stderr, "Usage: %s [test_name]\n", argv[0]);
+    return 1;
+  }
+
+  return (failures_count == 0) ? 0 : 1;
+}
@@ -65,6 +65,16 @@
 // please update the suffix with the format '(ard;<platform>)' as an url-encoded string.
 #define AZURE_SDK_CLIENT_USER_AGENT "c%2F" AZ_SDK_VERSION_STRING "(ard%3Besp32)"
 
+// Enable macro IOT_CONFIG_USE_CBOR_TELEMETRY to encode telemetry as CBOR instead of JSON.
+// CBOR payloads are smaller and cheaper to generate; they are sent with the content type set.
+
+// #define IOT_CONFIG_USE_CBOR_TELEMETRY
+
+// Enable macro IOT_CONFIG_REPORT_CONNECTION_PHASES to send the time spent in each connection phase
+// (Wi-Fi, NTP, DPS, IoT Hub, subscriptions) as the "connectionPhases" reported property.
+
+// #define IOT_CONFIG_REPORT_CONNECTION_PHASES
+
 // Publish 1 message every 2 seconds.
 #define TELEMETRY_FREQUENCY_IN_SECONDS 2
 